@@ -0,0 +1,586 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+
+#include "async_io.h"
+#include "metrics.h"
+
+bool parse_async_io_backend(const std::string& name, AsyncIoBackend& backend) {
+    const char *names[] = { "auto", "uring", "threads", "sync" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (name == names[i]) {
+            backend = (AsyncIoBackend) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parse_fsync_policy(const std::string& name, FsyncPolicy& policy) {
+    const char *names[] = { "none", "file", "flush" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (name == names[i]) {
+            policy = (FsyncPolicy) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+////////////////
+/// io_uring ///
+////////////////
+
+// The rings of an io_uring through the raw system calls, liburing isn't
+// a dependency. Used by a single thread.
+class UringQueue {
+ public:
+    UringQueue()
+        : fd(-1), sq_ring(NULL), cq_ring(NULL), sqes(NULL),
+          sq_ring_size(0), cq_ring_size(0), sqes_size(0), queued(0)
+    {};
+
+    ~UringQueue() {
+#ifdef __NR_io_uring_setup
+        if (sqes) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_ring && cq_ring != sq_ring) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        if (sq_ring) {
+            munmap(sq_ring, sq_ring_size);
+        }
+#endif
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // false when the kernel (or a seccomp filter) doesn't allow it
+    bool open(unsigned entries) {
+#ifdef __NR_io_uring_setup
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0) {
+            return false;
+        }
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+
+        sq_ring = map(sq_ring_size, IORING_OFF_SQ_RING);
+        cq_ring = single ? sq_ring : map(cq_ring_size, IORING_OFF_CQ_RING);
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe*) map(sqes_size, IORING_OFF_SQES);
+        if (!sq_ring || !cq_ring || !sqes) {
+            return false;
+        }
+
+        sq_tail = (uint32_t*) (sq_ring + params.sq_off.tail);
+        sq_mask = *(uint32_t*) (sq_ring + params.sq_off.ring_mask);
+        sq_array = (uint32_t*) (sq_ring + params.sq_off.array);
+        cq_head = (uint32_t*) (cq_ring + params.cq_off.head);
+        cq_tail = (uint32_t*) (cq_ring + params.cq_off.tail);
+        cq_mask = *(uint32_t*) (cq_ring + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe*) (cq_ring + params.cq_off.cqes);
+        capacity = params.sq_entries;
+        return true;
+#else
+        (void) entries;
+        return false;
+#endif
+    }
+
+    inline unsigned get_capacity() const {
+        return capacity;
+    }
+
+#ifdef __NR_io_uring_setup
+    void prep_write(int file, const void *buf, unsigned len, uint64_t offset, uint64_t user) {
+        struct io_uring_sqe *sqe = next_sqe();
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = file;
+        sqe->addr = (uint64_t) (uintptr_t) buf;
+        sqe->len = len;
+        sqe->off = offset;
+        sqe->user_data = user;
+    }
+
+    void prep_fsync(int file, uint64_t user) {
+        struct io_uring_sqe *sqe = next_sqe();
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = file;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = user;
+    }
+
+    // submit the queued entries, wait for min_complete completions
+    bool enter(unsigned min_complete) {
+        unsigned to_submit = queued;
+        while (true) {
+            int rc = syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                             min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+            if (rc >= 0) {
+                to_submit -= std::min<unsigned>(rc, to_submit);
+                if (to_submit == 0) {
+                    break;
+                }
+            } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                LOG(ERROR) << "io_uring_enter: " << strerror(errno);
+                queued = to_submit;
+                return false;
+            }
+        }
+        queued = 0;
+        return true;
+    }
+
+    // entries prepared but not taken by the kernel, the last ones
+    inline unsigned get_queued() const {
+        return queued;
+    }
+
+    // fn(user, res) on each completion
+    void reap(const std::function<void(uint64_t, int)>& fn) {
+        uint32_t head = *cq_head;
+        uint32_t tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe& cqe = cqes[head & cq_mask];
+            fn(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+#endif
+
+ private:
+#ifdef __NR_io_uring_setup
+    char* map(size_t size, off_t offset) {
+        void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, offset);
+        return addr == MAP_FAILED ? NULL : (char*) addr;
+    }
+
+    struct io_uring_sqe* next_sqe() {
+        uint32_t tail = *sq_tail;
+        uint32_t index = tail & sq_mask;
+        struct io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        queued++;
+        return sqe;
+    }
+#endif
+
+    int             fd;
+    char           *sq_ring;
+    char           *cq_ring;
+    struct io_uring_sqe *sqes;
+    size_t          sq_ring_size;
+    size_t          cq_ring_size;
+    size_t          sqes_size;
+
+    uint32_t       *sq_tail;
+    uint32_t        sq_mask;
+    uint32_t       *sq_array;
+    uint32_t       *cq_head;
+    uint32_t       *cq_tail;
+    uint32_t        cq_mask;
+    struct io_uring_cqe *cqes;
+
+    unsigned        capacity;
+    unsigned        queued;
+};
+
+///////////////
+/// writer  ///
+///////////////
+
+AsyncWriter::AsyncWriter(const AsyncIoOptions& options)
+    : options(options), backend(options.backend), outstanding(0), stopping(false),
+      errors(0) {
+    if (backend == ASYNC_IO_AUTO || backend == ASYNC_IO_URING) {
+        uring.reset(new UringQueue());
+        if (uring->open(std::max(options.queue_depth, 1))) {
+            backend = ASYNC_IO_URING;
+        } else {
+            if (backend == ASYNC_IO_URING) {
+                LOG(WARNING) << "io_uring not available, writing from threads";
+            }
+            uring.reset();
+            backend = ASYNC_IO_THREADS;
+        }
+    }
+
+    if (backend == ASYNC_IO_URING) {
+        workers.push_back(std::thread(&AsyncWriter::uring_loop, this));
+    } else if (backend == ASYNC_IO_THREADS) {
+        for (int i = 0; i < std::max(options.threads, 1); i++) {
+            workers.push_back(std::thread(&AsyncWriter::thread_loop, this));
+        }
+    }
+
+    const char *names[] = { "auto", "uring", "threads", "sync" };
+    Metrics::instance().set("io.async.backend", names[backend]);
+}
+
+AsyncWriter::~AsyncWriter() {
+    flush();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    for (auto& stream : streams) {
+        if (stream.second.fd >= 0) {
+            close(stream.second.fd);
+        }
+    }
+}
+
+int AsyncWriter::open_file(const std::string& path) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG(ERROR) << "Can't open " << path << ": " << strerror(errno);
+        errors++;
+    }
+    return fd;
+}
+
+void AsyncWriter::write_file(const std::string& path, std::string data) {
+    int fd = open_file(path);
+    if (fd < 0) {
+        return;
+    }
+
+    Request *request = new Request();
+    request->fd = fd;
+    request->offset = 0;
+    request->data.swap(data);
+    request->done = 0;
+    request->whole = true;
+    request->syncing = false;
+    submit(request);
+}
+
+void AsyncWriter::append(const std::string& path, const void *data, size_t size) {
+    Request *request = NULL;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = streams.find(path);
+        if (it == streams.end()) {
+            Stream stream;
+            stream.fd = open_file(path);
+            stream.offset = 0;
+            it = streams.insert(std::make_pair(path, stream)).first;
+        }
+
+        Stream& stream = it->second;
+        if (stream.fd < 0) {
+            return;
+        }
+
+        stream.buffer.append((const char*) data, size);
+        if (stream.buffer.size() < options.coalesce_bytes) {
+            return;
+        }
+
+        request = new Request();
+        request->fd = stream.fd;
+        request->offset = stream.offset;
+        request->data.swap(stream.buffer);
+        request->done = 0;
+        request->whole = false;
+        request->syncing = false;
+        stream.offset += request->data.size();
+    }
+    submit(request);
+}
+
+void AsyncWriter::submit(Request *request) {
+    Metrics::instance().add("io.async.bytes", request->data.size());
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        outstanding++;
+        if (backend != ASYNC_IO_SYNC) {
+            pending.push_back(request);
+        }
+    }
+
+    if (backend == ASYNC_IO_SYNC) {
+        run_sync(request);
+    } else {
+        work.notify_one();
+    }
+}
+
+void AsyncWriter::run_sync(Request *request) {
+    bool ok = true;
+    while (request->done < request->data.size()) {
+        ssize_t rc = pwrite(request->fd, request->data.data() + request->done,
+                            request->data.size() - request->done,
+                            request->offset + request->done);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc <= 0) {
+            LOG(ERROR) << "Write failed: " << strerror(rc < 0 ? errno : EIO);
+            ok = false;
+            break;
+        }
+        request->done += rc;
+    }
+    Metrics::instance().add("io.async.writes");
+
+    if (ok && request->whole && options.fsync == FSYNC_FILE && fdatasync(request->fd) != 0) {
+        LOG(ERROR) << "fdatasync failed: " << strerror(errno);
+        ok = false;
+    }
+    complete(request, ok);
+}
+
+void AsyncWriter::complete(Request *request, bool ok) {
+    if (!ok) {
+        errors++;
+    }
+
+    if (request->whole) {
+        if (ok && options.fsync == FSYNC_FLUSH) {
+            bool full;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                deferred.push_back(request->fd);
+                full = deferred.size() >= AIO_MAX_DEFERRED;
+            }
+            if (full) {
+                sync_deferred();
+            }
+        } else {
+            close(request->fd);
+        }
+    }
+    delete request;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--outstanding == 0) {
+        idle.notify_all();
+    }
+}
+
+void AsyncWriter::sync_deferred() {
+    std::vector<int> files;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        files.swap(deferred);
+    }
+
+    for (int fd : files) {
+        if (fdatasync(fd) != 0) {
+            LOG(ERROR) << "fdatasync failed: " << strerror(errno);
+            errors++;
+        }
+        close(fd);
+    }
+    Metrics::instance().add("io.async.fsyncs", files.size());
+}
+
+bool AsyncWriter::flush() {
+    // the partial buffers of the appended files
+    std::vector<Request*> tails;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& it : streams) {
+            Stream& stream = it.second;
+            if (stream.fd < 0 || stream.buffer.empty()) {
+                continue;
+            }
+            Request *request = new Request();
+            request->fd = stream.fd;
+            request->offset = stream.offset;
+            request->data.swap(stream.buffer);
+            request->done = 0;
+            request->whole = false;
+            request->syncing = false;
+            stream.offset += request->data.size();
+            tails.push_back(request);
+        }
+    }
+    for (Request *request : tails) {
+        submit(request);
+    }
+
+    std::vector<int> stream_files;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this]() { return outstanding == 0; });
+        for (auto& it : streams) {
+            if (it.second.fd >= 0) {
+                stream_files.push_back(it.second.fd);
+            }
+        }
+    }
+
+    if (options.fsync != FSYNC_NONE) {
+        for (int fd : stream_files) {
+            if (fdatasync(fd) != 0) {
+                LOG(ERROR) << "fdatasync failed: " << strerror(errno);
+                errors++;
+            }
+        }
+    }
+    sync_deferred();
+
+    return errors.exchange(0) == 0;
+}
+
+void AsyncWriter::thread_loop() {
+    while (true) {
+        Request *request;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            work.wait(lock, [this]() { return stopping || !pending.empty(); });
+            if (pending.empty()) {
+                return;
+            }
+            request = pending.front();
+            pending.pop_front();
+        }
+        run_sync(request);
+    }
+}
+
+void AsyncWriter::uring_fallback(const std::vector<Request*>& left, size_t in_flight) {
+#ifdef __NR_io_uring_setup
+    LOG(WARNING) << "io_uring failed, writing from threads";
+    Metrics::instance().set("io.async.backend", "threads");
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        backend = ASYNC_IO_THREADS;
+        pending.insert(pending.begin(), left.begin(), left.end());
+    }
+
+    // the kernel reads the buffers of the requests it took until they
+    // complete, their rest and fsync are written from here
+    while (in_flight > 0) {
+        uring->reap([&](uint64_t user, int res) {
+                Request *request = (Request*) (uintptr_t) user;
+                in_flight--;
+
+                if ((res < 0 && res != -EINTR && res != -EAGAIN) ||
+                    (res == 0 && !request->syncing)) {
+                    LOG(ERROR) << "Write failed: " << strerror(res < 0 ? -res : EIO);
+                    complete(request, false);
+                } else if (request->syncing && res >= 0) {
+                    complete(request, true);
+                } else {
+                    request->done += std::max(res, 0);
+                    run_sync(request);
+                }
+            });
+        if (in_flight > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    thread_loop();
+#endif
+}
+
+void AsyncWriter::uring_loop() {
+#ifdef __NR_io_uring_setup
+    size_t in_flight = 0;
+    std::vector<Request*> ready;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (in_flight == 0 && ready.empty()) {
+                work.wait(lock, [this]() { return stopping || !pending.empty(); });
+                if (pending.empty()) {
+                    return;
+                }
+            }
+            while (!pending.empty() && in_flight + ready.size() < uring->get_capacity()) {
+                ready.push_back(pending.front());
+                pending.pop_front();
+            }
+        }
+
+        // the whole batch in one system call
+        std::vector<Request*> batch(ready);
+        for (Request *request : ready) {
+            if (request->syncing) {
+                uring->prep_fsync(request->fd, (uint64_t) (uintptr_t) request);
+            } else {
+                uring->prep_write(request->fd, request->data.data() + request->done,
+                                  request->data.size() - request->done,
+                                  request->offset + request->done,
+                                  (uint64_t) (uintptr_t) request);
+            }
+        }
+        Metrics::instance().add("io.async.writes", ready.size());
+        Metrics::instance().add("io.async.batches");
+        in_flight += ready.size();
+        ready.clear();
+
+        if (!uring->enter(1)) {
+            // requests the kernel didn't take go back in the queue
+            size_t left = uring->get_queued();
+            in_flight -= left;
+            uring_fallback(std::vector<Request*>(batch.end() - left, batch.end()), in_flight);
+            return;
+        }
+
+        uring->reap([&](uint64_t user, int res) {
+                Request *request = (Request*) (uintptr_t) user;
+                in_flight--;
+
+                if (res == -EINTR || res == -EAGAIN) {
+                    ready.push_back(request);
+                } else if (res < 0 || (res == 0 && !request->syncing)) {
+                    LOG(ERROR) << "Write failed: " << strerror(res < 0 ? -res : EIO);
+                    complete(request, false);
+                } else if (request->syncing) {
+                    complete(request, true);
+                } else {
+                    request->done += res;
+                    if (request->done < request->data.size()) {
+                        // short write, the rest goes with the next batch
+                        ready.push_back(request);
+                    } else if (request->whole && options.fsync == FSYNC_FILE) {
+                        request->syncing = true;
+                        ready.push_back(request);
+                    } else {
+                        complete(request, true);
+                    }
+                }
+            });
+    }
+#endif
+}
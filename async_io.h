@@ -0,0 +1,170 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Asynchronous batched file writes.
+//
+// Workers hand buffers to an AsyncWriter and go on, the writes happen
+// on I/O threads:
+//  - io_uring when the kernel has it: one thread fills the submission
+//    queue with every pending write and submits them with a single
+//    io_uring_enter(), short writes are resubmitted, if io_uring_enter()
+//    fails for good that thread goes on with pwrite(),
+//  - otherwise a few threads doing pwrite(),
+//  - ASYNC_IO_SYNC writes in the calling thread, as before.
+//
+// append() coalesces the small records of a file in memory, and writes
+// them coalesce_bytes at a time. Files are opened in the calling thread,
+// an error is logged and reported by the next flush().
+//
+// fsync policy: FSYNC_NONE leaves it to the kernel, FSYNC_FILE syncs each
+// file once written, FSYNC_FLUSH keeps the written files open and syncs
+// them all at flush() (or every AIO_MAX_DEFERRED files), so the file
+// system gets them together.
+//
+// Usage :
+//  AsyncWriter writer(options);
+//  writer.write_file("features/a.yml", data);     // whole file
+//  writer.append("pairs.bin", record, size);       // coalesced
+//  if (!writer.flush()) ...                        // everything on disk
+
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "photogram.h"
+
+// files kept open by FSYNC_FLUSH before syncing them early
+#define AIO_MAX_DEFERRED 256
+
+enum AsyncIoBackend {
+    ASYNC_IO_AUTO = 0,  // io_uring, threads when not available
+    ASYNC_IO_URING,
+    ASYNC_IO_THREADS,
+    ASYNC_IO_SYNC       // in the calling thread
+};
+
+enum FsyncPolicy {
+    FSYNC_NONE = 0,
+    FSYNC_FILE,
+    FSYNC_FLUSH
+};
+
+struct AsyncIoOptions {
+    AsyncIoOptions()
+        : backend(ASYNC_IO_AUTO), queue_depth(64), threads(4),
+          coalesce_bytes(1 << 20), fsync(FSYNC_NONE)
+    {};
+
+    AsyncIoBackend  backend;
+
+    // writes in flight with io_uring
+    int             queue_depth;
+
+    // I/O threads of the fallback
+    int             threads;
+
+    // append() buffer per file
+    size_t          coalesce_bytes;
+
+    FsyncPolicy     fsync;
+};
+
+// "uring", "threads", "sync" or "auto", false for anything else
+bool parse_async_io_backend(const std::string& name, AsyncIoBackend& backend);
+
+// "none", "file" or "flush"
+bool parse_fsync_policy(const std::string& name, FsyncPolicy& policy);
+
+class UringQueue;
+
+class AsyncWriter {
+ public:
+    AsyncWriter(const AsyncIoOptions& options = AsyncIoOptions());
+
+    // flushes, closes the appended files
+    ~AsyncWriter();
+
+    // create or replace path with data
+    void write_file(const std::string& path, std::string data);
+
+    // add to path, truncated by the first append of this writer
+    void append(const std::string& path, const void *data, size_t size);
+
+    // wait for everything written so far, sync per policy. False if a
+    // write failed since the last flush().
+    bool flush();
+
+    // the one running, never ASYNC_IO_AUTO
+    inline AsyncIoBackend get_backend() const {
+        return backend;
+    }
+
+ private:
+    struct Request {
+        int             fd;
+        uint64_t        offset;
+        std::string     data;
+        size_t          done;
+
+        // file written whole: sync per policy and close once done
+        bool            whole;
+        bool            syncing;
+    };
+
+    struct Stream {
+        int             fd;
+        uint64_t        offset;
+        std::string     buffer;
+    };
+
+    int open_file(const std::string& path);
+
+    void submit(Request *request);
+
+    // after the last byte of a request, or its fsync
+    void complete(Request *request, bool ok);
+
+    // write or sync a request in this thread
+    void run_sync(Request *request);
+
+    void sync_deferred();
+
+    void thread_loop();
+    void uring_loop();
+
+    // io_uring_enter failed: left go back to the queue, wait for the
+    // requests in flight, then run as a writer thread
+    void uring_fallback(const std::vector<Request*>& left, size_t in_flight);
+
+    AsyncIoOptions              options;
+    std::atomic<AsyncIoBackend> backend;
+
+    std::mutex                  mutex;
+    std::condition_variable     work;
+    std::condition_variable     idle;
+    std::deque<Request*>        pending;
+    size_t                      outstanding;
+    bool                        stopping;
+
+    std::map<std::string, Stream>   streams;
+
+    // FSYNC_FLUSH files, synced and closed at flush()
+    std::vector<int>            deferred;
+
+    std::atomic<size_t>         errors;
+
+    std::unique_ptr<UringQueue> uring;
+    std::vector<std::thread>    workers;
+};
+
+#endif // !ASYNC_IO_H
@@ -0,0 +1,126 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "attitude.h"
+
+// earth's mean radius in meters, same as haversine_dist.h
+#define EARTH_RADIUS_M 6371000.0
+
+// footprints closer to the horizon than this are unbounded
+#define MIN_FOOTPRINT_PITCH 10.0
+
+static const char XMP_NAMESPACE[] = "http://ns.adobe.com/xap/1.0/";
+
+// value of a tag by local name, as an attribute (:name="1.0") or an
+// element (:name>1.0<)
+static bool xmp_value(const std::string& xmp, const char *name, double& value) {
+    std::string key = std::string(":") + name;
+    size_t at = 0;
+    while ((at = xmp.find(key, at)) != std::string::npos) {
+        at += key.size();
+        if (at < xmp.size() && xmp[at] == '=') {
+            at++;
+            if (at < xmp.size() && (xmp[at] == '"' || xmp[at] == '\'')) {
+                at++;
+            }
+        } else if (at < xmp.size() && xmp[at] == '>') {
+            at++;
+        } else {
+            // a longer name
+            continue;
+        }
+
+        const char *start = xmp.c_str() + at;
+        char *end;
+        value = strtod(start, &end);
+        if (end != start) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parse_xmp_packet(const std::string& xmp, Attitude& attitude) {
+    Attitude parsed;
+    if (!xmp_value(xmp, "GimbalPitchDegree", parsed.pitch)) {
+        return false;
+    }
+    xmp_value(xmp, "GimbalRollDegree", parsed.roll);
+    if (!xmp_value(xmp, "GimbalYawDegree", parsed.yaw)) {
+        xmp_value(xmp, "FlightYawDegree", parsed.yaw);
+    }
+    parsed.has_height = xmp_value(xmp, "RelativeAltitude", parsed.height);
+
+    attitude = parsed;
+    return true;
+}
+
+bool parse_xmp_attitude(const unsigned char *jpeg, size_t size, Attitude& attitude) {
+    if (size < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) {
+        return false;
+    }
+
+    // markers up to the start of scan, the XMP packet is an APP1 segment
+    size_t at = 2;
+    while (at + 4 <= size && jpeg[at] == 0xFF) {
+        unsigned char marker = jpeg[at + 1];
+        if (marker == 0xDA || marker == 0xD9) {
+            break;
+        }
+        size_t length = (jpeg[at + 2] << 8) | jpeg[at + 3];
+        if (length < 2 || at + 2 + length > size) {
+            break;
+        }
+
+        const unsigned char *payload = jpeg + at + 4;
+        size_t payload_size = length - 2;
+        if (marker == 0xE1 && payload_size > sizeof(XMP_NAMESPACE) &&
+            memcmp(payload, XMP_NAMESPACE, sizeof(XMP_NAMESPACE)) == 0) {
+            std::string xmp((const char*) payload + sizeof(XMP_NAMESPACE),
+                            payload_size - sizeof(XMP_NAMESPACE));
+            return parse_xmp_packet(xmp, attitude);
+        }
+        at += 2 + length;
+    }
+    return false;
+}
+
+Matx31d gravity_in_camera(const Attitude& attitude) {
+    // the camera pitched down by tilt, then rolled
+    double tilt = -attitude.pitch * M_PI / 180;
+    double roll = attitude.roll * M_PI / 180;
+
+    Matx31d g;
+    g(0) = sin(roll) * cos(tilt);
+    g(1) = cos(roll) * cos(tilt);
+    g(2) = sin(tilt);
+    return g;
+}
+
+bool camera_footprint(double lat, double lon, const Attitude& attitude,
+                      const Matx33d& K, Footprint& footprint) {
+    double tilt = -attitude.pitch;
+    if (!attitude.has_height || attitude.height <= 0 || tilt < MIN_FOOTPRINT_PITCH) {
+        return false;
+    }
+    tilt *= M_PI / 180;
+
+    // optical axis on the ground, ahead of the point below the camera
+    double ahead = attitude.height / tan(tilt);
+    double range = attitude.height / sin(tilt);
+
+    // circle through the corners, seen from the center of the image
+    double half_diagonal = atan(hypot(K(0, 2) / K(0, 0), K(1, 2) / K(1, 1)));
+    double radius = range * tan(half_diagonal);
+
+    double yaw = attitude.yaw * M_PI / 180;
+    double north = ahead * cos(yaw), east = ahead * sin(yaw);
+
+    footprint.lat = lat + north / EARTH_RADIUS_M * 180 / M_PI;
+    footprint.lon = lon + east / (EARTH_RADIUS_M * cos(lat * M_PI / 180)) * 180 / M_PI;
+    footprint.radius_km = radius / 1000;
+    return true;
+}
@@ -0,0 +1,72 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Camera attitude from drone metadata.
+//
+// DJI drones (and others writing the same tags) store the gimbal angles
+// in the XMP packet of the JPEG, which easyexif doesn't read:
+//   drone-dji:GimbalPitchDegree="-90.0"  0 horizontal, -90 straight down
+//   drone-dji:GimbalRollDegree="+0.00"   clockwise seen from behind
+//   drone-dji:GimbalYawDegree="+37.4"    heading, clockwise from north
+//   drone-dji:RelativeAltitude="+80.20"  meters above the take off point
+// Tags are matched on their local name, attributes or elements.
+//
+// Pitch and roll come from the gimbal IMU and give the direction of
+// gravity in the camera, see gravity_in_camera() and gravity_ransac.h.
+// The yaw is compass based, a few degrees off: good enough to place the
+// ground footprint of the image for pair planning, not for poses.
+//
+// Usage :
+//  Attitude attitude;
+//  if (parse_xmp_attitude(jpeg, size, attitude)) {
+//      Matx31d g = gravity_in_camera(attitude);
+//  }
+
+#ifndef ATTITUDE_H
+#define ATTITUDE_H
+
+#include <string>
+
+#include "photogram.h"
+
+struct Attitude {
+    Attitude()
+        : pitch(0), roll(0), yaw(0), has_height(false), height(0)
+    {};
+
+    // degrees, see above
+    double      pitch;
+    double      roll;
+    double      yaw;
+
+    // meters above the ground, from the relative altitude
+    bool        has_height;
+    double      height;
+};
+
+// gimbal angles of a JPEG (up to the image data), false without them
+bool parse_xmp_attitude(const unsigned char *jpeg, size_t size, Attitude& attitude);
+
+// same from the XMP packet alone
+bool parse_xmp_packet(const std::string& xmp, Attitude& attitude);
+
+// unit vector down, in the camera frame (x right, y down, z forward)
+Matx31d gravity_in_camera(const Attitude& attitude);
+
+// ground circle seen by a camera
+struct Footprint {
+    Footprint()
+        : lat(0), lon(0), radius_km(0)
+    {};
+
+    double      lat;
+    double      lon;
+    double      radius_km;
+};
+
+// footprint of a camera at lat, lon with a known height, along its
+// heading. false without the height, or looking too close to the
+// horizon for the footprint to be bounded
+bool camera_footprint(double lat, double lon, const Attitude& attitude,
+                      const Matx33d& K, Footprint& footprint);
+
+#endif // !ATTITUDE_H
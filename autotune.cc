@@ -0,0 +1,326 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+#include "autotune.h"
+#include "metrics.h"
+#include "simd_kernels.h"
+#include "util.h"
+
+string describe_matcher(const MatcherOptions& options) {
+    std::ostringstream s;
+    switch (options.type) {
+    case MATCHER_HNSW:
+        s << "hnsw ef " << options.hnsw_ef;
+        break;
+    case MATCHER_CASCADE:
+        s << "cascade candidates " << options.cascade_candidates;
+        break;
+    default:
+#ifdef USE_SIFT_GPU
+        s << "siftgpu";
+#else
+        s << "flann trees " << options.flann_trees
+          << " checks " << options.flann_checks;
+#endif
+        break;
+    }
+    return s.str();
+}
+
+static uint64_t fnv1a(const void *data, size_t size, uint64_t h = 14695981039346656037ULL) {
+    const uint8_t *p = (const uint8_t*) data;
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// dataset, host and the settings out of the grid
+static string cache_key(const vector<ImageFeaturesPtr>& features,
+                        const AutotuneOptions& autotune,
+                        const MatcherOptions& options) {
+    uint64_t dataset = fnv1a(NULL, 0);
+    for (size_t i = 0; i < features.size(); i++) {
+        uint64_t count = features[i] ? features[i]->keypoints.size() : 0;
+        dataset = fnv1a(&count, sizeof(count), dataset);
+    }
+
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+
+    int threads = options.threads > 0 ? options.threads : default_thread_count();
+
+    std::ostringstream key;
+    key << "images " << features.size() << " dataset " << std::hex << dataset << std::dec
+        << " host " << host << " simd " << simd_kernels().name
+        << " threads " << threads << " recall " << autotune.target_recall
+        << " f16 " << options.descriptors_f16 << " u8 " << options.hnsw_u8
+        << " hnsw_m " << options.hnsw_m
+        << " hnsw_ef_construction " << options.hnsw_ef_construction;
+    return key.str();
+}
+
+static string cache_filename(const AutotuneOptions& autotune, const string& key) {
+    std::ostringstream filename;
+    filename << autotune.cache_dir << "/autotune-" << std::hex
+             << fnv1a(key.data(), key.size()) << ".yml";
+    return filename.str();
+}
+
+// mkdir -p
+static bool make_dirs(const string& path) {
+    for (size_t pos = 1; pos <= path.size(); pos++) {
+        if (pos == path.size() || path[pos] == '/') {
+            string dir = path.substr(0, pos);
+            if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool load_cache(const string& filename, const string& key,
+                       MatcherOptions& options) {
+    FileStorage fs(filename, FileStorage::READ);
+    if (!fs.isOpened() || (string) fs["key"] != key) {
+        return false;
+    }
+
+    options.type = (MatcherType) (int) fs["type"];
+    options.flann_trees = (int) fs["flann_trees"];
+    options.flann_checks = (int) fs["flann_checks"];
+    options.hnsw_ef = (int) fs["hnsw_ef"];
+    options.cascade_candidates = (int) fs["cascade_candidates"];
+
+    LOG(INFO) << "Autotune: " << describe_matcher(options) << " from "
+              << filename << ", recall " << (double) fs["recall"];
+    return true;
+}
+
+static void save_cache(const string& filename, const string& key,
+                       const AutotuneTrial& trial) {
+    FileStorage fs(filename, FileStorage::WRITE);
+    if (!fs.isOpened()) {
+        LOG(ERROR) << "Can't write autotune cache " << filename;
+        return;
+    }
+
+    fs << "key" << key
+       << "type" << (int) trial.options.type
+       << "flann_trees" << trial.options.flann_trees
+       << "flann_checks" << trial.options.flann_checks
+       << "hnsw_ef" << trial.options.hnsw_ef
+       << "cascade_candidates" << trial.options.cascade_candidates
+       << "recall" << trial.recall
+       << "queries_per_sec" << trial.queries_per_sec;
+}
+
+// every step-th descriptor of an image, without its indexes
+static void sample_features(const ImageFeatures& src, size_t step,
+                            ImageFeatures& dst) {
+    size_t count;
+    vector<float> storage;
+    const float *desc = get_descriptors(src, count, storage);
+    size_t n = (count + step - 1) / step;
+
+    vector<float> sample(n * SIFT_DIM);
+    for (size_t i = 0; i < n; i++) {
+        std::copy(desc + i * step * SIFT_DIM, desc + (i * step + 1) * SIFT_DIM,
+                  &sample[i * SIFT_DIM]);
+        if (src.keypoints.size() == count) {
+            const KeypointSet& k = src.keypoints;
+            size_t j = i * step;
+            dst.keypoints.push_back(k.x[j], k.y[j], k.scale[j], k.orientation[j]);
+        }
+    }
+
+    if (!src.descriptors_f16.empty()) {
+        dst.descriptors_f16.resize(sample.size());
+        simd_kernels().f32_to_f16(&sample[0], &dst.descriptors_f16[0], sample.size());
+        return;
+    }
+#ifdef USE_SIFT_GPU
+    dst.descriptors.swap(sample);
+#else
+    Mat(n, SIFT_DIM, CV_32F, &sample[0]).copyTo(dst.descriptors);
+#endif
+}
+
+// a sampled pair and the exact nearest neighbor of each query
+struct AutotunePair {
+    ImageFeatures   query;
+    ImageFeatures   train;
+    vector<int>     nearest;
+};
+
+static void exact_nearest(AutotunePair& pair, int threads) {
+    const SimdKernels& kernels = simd_kernels();
+    size_t count1, count2;
+    vector<float> storage1, storage2;
+    const float *query = get_descriptors(pair.query, count1, storage1);
+    const float *train = get_descriptors(pair.train, count2, storage2);
+
+    pair.nearest.assign(count1, -1);
+    parallel_for_index(count1, [&](size_t i, int) {
+            float best = 0;
+            for (size_t j = 0; j < count2; j++) {
+                float d = kernels.l2_sqr_f32(query + i * SIFT_DIM,
+                                             train + j * SIFT_DIM, SIFT_DIM);
+                if (pair.nearest[i] < 0 || d < best) {
+                    best = d;
+                    pair.nearest[i] = j;
+                }
+            }
+        }, threads);
+}
+
+static void run_trial(vector<AutotunePair>& pairs, AutotuneTrial& trial) {
+    set_matcher_options(trial.options);
+
+    Matches matches;
+    if (trial.options.type != MATCHER_FLANN) {
+        // build the per image indexes
+        for (AutotunePair& pair : pairs) {
+            match_features(pair.query, pair.train, matches);
+        }
+    }
+
+    size_t queries = 0, correct = 0;
+    double seconds = 0;
+    for (AutotunePair& pair : pairs) {
+        auto start = std::chrono::steady_clock::now();
+        match_features(pair.query, pair.train, matches);
+        seconds += std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+        queries += pair.nearest.size();
+        for (const DMatch& m : matches) {
+            correct += m.trainIdx == pair.nearest[m.queryIdx];
+        }
+    }
+
+    trial.recall = queries ? correct / (double) queries : 0;
+    trial.queries_per_sec = seconds > 0 ? queries / seconds : 0;
+}
+
+bool autotune_matcher(const vector<ImageFeaturesPtr>& features,
+                      const AutotuneOptions& autotune,
+                      MatcherOptions& options) {
+    string key = cache_key(features, autotune, options);
+    string filename;
+    if (!autotune.cache_dir.empty()) {
+        filename = cache_filename(autotune, key);
+        if (load_cache(filename, key, options)) {
+            Metrics::instance().set("autotune.matcher", describe_matcher(options));
+            return true;
+        }
+    }
+
+    // consecutive images, likely to overlap, spread over the dataset
+    vector<size_t> images;
+    for (size_t i = 0; i < features.size(); i++) {
+        if (features[i] && !features[i]->keypoints.empty()) {
+            images.push_back(i);
+        }
+    }
+    if (images.size() < 2) {
+        LOG(ERROR) << "Autotune: not enough images with features";
+        return false;
+    }
+
+    size_t count = std::min<size_t>(autotune.pairs, images.size() - 1);
+    vector<AutotunePair> pairs(count);
+    for (size_t k = 0; k < count; k++) {
+        size_t i = k * (images.size() - 1) / count;
+        const ImageFeatures& query = *features[images[i]];
+        const ImageFeatures& train = *features[images[i + 1]];
+
+        size_t step = std::max<size_t>(1, query.keypoints.size() / autotune.queries);
+        sample_features(query, step, pairs[k].query);
+        sample_features(train, 1, pairs[k].train);
+        exact_nearest(pairs[k], options.threads);
+    }
+
+    vector<AutotuneTrial> trials;
+    AutotuneTrial trial;
+    trial.options = options;
+
+    trial.options.type = MATCHER_FLANN;
+#ifdef USE_SIFT_GPU
+    // exact GPU matcher, nothing to tune
+    trials.push_back(trial);
+#else
+    const int trees[] = { 1, 2, 4, 8 };
+    const int checks[] = { 16, 32, 64, 128, 256 };
+    for (int t : trees) {
+        for (int c : checks) {
+            trial.options.flann_trees = t;
+            trial.options.flann_checks = c;
+            trials.push_back(trial);
+        }
+    }
+#endif
+    trial.options = options;
+
+    trial.options.type = MATCHER_HNSW;
+    const int efs[] = { 16, 32, 64, 128, 256 };
+    for (int ef : efs) {
+        trial.options.hnsw_ef = ef;
+        trials.push_back(trial);
+    }
+    trial.options = options;
+
+    trial.options.type = MATCHER_CASCADE;
+    const int candidates[] = { 5, 10, 20, 40 };
+    for (int c : candidates) {
+        trial.options.cascade_candidates = c;
+        trials.push_back(trial);
+    }
+
+    MatcherOptions previous = get_matcher_options();
+
+    const AutotuneTrial *best = NULL;
+    for (AutotuneTrial& t : trials) {
+        run_trial(pairs, t);
+        LOG(DEBUG) << "Autotune: " << describe_matcher(t.options) << ", recall "
+                   << t.recall << ", " << t.queries_per_sec << " queries/s";
+
+        bool reached = t.recall >= autotune.target_recall;
+        if (!best) {
+            best = &t;
+        } else if (reached && best->recall >= autotune.target_recall) {
+            if (t.queries_per_sec > best->queries_per_sec) {
+                best = &t;
+            }
+        } else if (reached || t.recall > best->recall) {
+            best = &t;
+        }
+    }
+
+    set_matcher_options(previous);
+
+    options = best->options;
+    LOG(INFO) << "Autotune: " << describe_matcher(options) << ", recall "
+              << best->recall << ", " << best->queries_per_sec << " queries/s";
+    Metrics::instance().set("autotune.matcher", describe_matcher(options));
+    Metrics::instance().add("autotune.trials", trials.size());
+
+    if (!filename.empty()) {
+        if (make_dirs(autotune.cache_dir)) {
+            save_cache(filename, key, *best);
+        } else {
+            LOG(ERROR) << "Can't create autotune cache directory " << autotune.cache_dir;
+        }
+    }
+
+    return true;
+}
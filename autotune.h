@@ -0,0 +1,63 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Matcher parameter tuning, per dataset and host.
+//
+// A few image pairs are sampled, the exact nearest neighbor of their
+// descriptors computed by brute force, then every configuration of a
+// grid is timed and its recall@1 measured:
+//  - FLANN randomized kd-trees: trees x checks,
+//  - HNSW: ef (the graph itself is built once, see hnsw.hpp),
+//  - cascade hashing: candidates.
+// The fastest configuration reaching the target recall wins, or the one
+// with the best recall if none does.
+//
+// Per image indexes (HNSW, cascade hashes) are built by an untimed first
+// match: they are shared by all the pairs of an image, the FLANN index
+// is rebuilt for every pair and always timed.
+//
+// The choice is cached in cache_dir, keyed on the descriptor counts of
+// the images, the host name, SIMD level and thread count.
+
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <string>
+#include <vector>
+
+#include "photogram.h"
+#include "features2d.h"
+
+struct AutotuneOptions {
+    AutotuneOptions()
+        : target_recall(0.9), pairs(4), queries(2000)
+    {};
+
+    // recall@1 against brute force
+    double  target_recall;
+
+    // image pairs sampled, query descriptors per pair
+    int     pairs;
+    int     queries;
+
+    // "" to always tune
+    string  cache_dir;
+};
+
+// one configuration of the grid and its measures
+struct AutotuneTrial {
+    MatcherOptions  options;
+    double          recall;
+    double          queries_per_sec;
+};
+
+// human readable matcher configuration
+string describe_matcher(const MatcherOptions& options);
+
+// tune options in place, the settings out of the grid (threads,
+// descriptors_f16, hnsw_m ..) are kept. false if no pair could be
+// sampled, options are left untouched.
+bool autotune_matcher(const vector<ImageFeaturesPtr>& features,
+                      const AutotuneOptions& autotune,
+                      MatcherOptions& options);
+
+#endif // !AUTOTUNE_H
@@ -0,0 +1,631 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <string.h>
+
+#include <algorithm>
+#include <limits>
+
+#include "batch_ransac.h"
+#include "metrics.h"
+#include "simd_kernels.h"
+#include "util.h"
+
+// pairs handled by one worker, its lanes refill from them
+#define BATCH_CHUNK (16 * SAMPSON_LANES)
+
+///////////////
+/// solvers ///
+///////////////
+
+// eigen decomposition of a symmetric 9x9 matrix (cyclic Jacobi), A is
+// destroyed, the eigenvectors are the columns of V
+static void jacobi_eigen9(double A[9][9], double V[9][9], double w[9]) {
+    for (int i = 0; i < 9; i++) {
+        for (int j = 0; j < 9; j++) {
+            V[i][j] = i == j;
+        }
+    }
+
+    for (int sweep = 0; sweep < 50; sweep++) {
+        double off = 0, diag = 0;
+        for (int p = 0; p < 9; p++) {
+            diag += A[p][p] * A[p][p];
+            for (int q = p + 1; q < 9; q++) {
+                off += A[p][q] * A[p][q];
+            }
+        }
+        if (off <= 1e-26 * diag) {
+            break;
+        }
+
+        for (int p = 0; p < 9; p++) {
+            for (int q = p + 1; q < 9; q++) {
+                if (A[p][q] == 0) {
+                    continue;
+                }
+
+                // rotation zeroing A[p][q]
+                double theta = (A[q][q] - A[p][p]) / (2 * A[p][q]);
+                double t = fabs(theta) > 1e150 ? 0.5 / theta :
+                    (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+                double c = 1 / sqrt(t * t + 1), s = t * c;
+
+                for (int k = 0; k < 9; k++) {
+                    double akp = A[k][p], akq = A[k][q];
+                    A[k][p] = c * akp - s * akq;
+                    A[k][q] = s * akp + c * akq;
+                }
+                for (int k = 0; k < 9; k++) {
+                    double apk = A[p][k], aqk = A[q][k];
+                    A[p][k] = c * apk - s * aqk;
+                    A[q][k] = s * apk + c * aqk;
+                }
+                for (int k = 0; k < 9; k++) {
+                    double vkp = V[k][p], vkq = V[k][q];
+                    V[k][p] = c * vkp - s * vkq;
+                    V[k][q] = s * vkp + c * vkq;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < 9; i++) {
+        w[i] = A[i][i];
+    }
+}
+
+// A' A of the epipolar constraints x2' F x1 = 0 of the points at
+// indexes, F row major
+static void epipolar_normal(const double *pts, const int *indexes, size_t n,
+                            double M[9][9]) {
+    memset(M, 0, sizeof(double) * 81);
+
+    for (size_t i = 0; i < n; i++) {
+        const double *p = pts + 4 * indexes[i];
+        double x1 = p[0], y1 = p[1], x2 = p[2], y2 = p[3];
+        double r[9] = { x2 * x1, x2 * y1, x2, y2 * x1, y2 * y1, y2, x1, y1, 1 };
+
+        for (int j = 0; j < 9; j++) {
+            for (int k = j; k < 9; k++) {
+                M[j][k] += r[j] * r[k];
+            }
+        }
+    }
+
+    for (int j = 0; j < 9; j++) {
+        for (int k = 0; k < j; k++) {
+            M[j][k] = M[k][j];
+        }
+    }
+}
+
+// eigenvectors of M for its smallest eigenvalues, count of them
+static void smallest_eigenvectors(double M[9][9], int count, double f[][9]) {
+    double V[9][9], w[9];
+    jacobi_eigen9(M, V, w);
+
+    int order[9] = { 0, 1, 2, 3, 4, 5, 6, 7, 8 };
+    std::sort(order, order + 9, [&w](int a, int b) { return w[a] < w[b]; });
+
+    for (int k = 0; k < count; k++) {
+        for (int i = 0; i < 9; i++) {
+            f[k][i] = V[i][order[k]];
+        }
+    }
+}
+
+static double det3(const double *F) {
+    return F[0] * (F[4] * F[8] - F[5] * F[7]) -
+        F[1] * (F[3] * F[8] - F[5] * F[6]) +
+        F[2] * (F[3] * F[7] - F[4] * F[6]);
+}
+
+// real roots of c[3] x^3 + c[2] x^2 + c[1] x + c[0]
+static int solve_cubic(const double *c, double *roots) {
+    double scale = std::max(std::max(fabs(c[0]), fabs(c[1])),
+                            std::max(fabs(c[2]), fabs(c[3])));
+    if (scale == 0) {
+        return 0;
+    }
+
+    if (fabs(c[3]) < 1e-12 * scale) {
+        // quadratic, or linear
+        if (fabs(c[2]) < 1e-12 * scale) {
+            if (c[1] == 0) {
+                return 0;
+            }
+            roots[0] = -c[0] / c[1];
+            return 1;
+        }
+        double d = c[1] * c[1] - 4 * c[2] * c[0];
+        if (d < 0) {
+            return 0;
+        }
+        roots[0] = (-c[1] + sqrt(d)) / (2 * c[2]);
+        roots[1] = (-c[1] - sqrt(d)) / (2 * c[2]);
+        return 2;
+    }
+
+    double a = c[2] / c[3], b = c[1] / c[3], d = c[0] / c[3];
+    double Q = (a * a - 3 * b) / 9;
+    double R = (2 * a * a * a - 9 * a * b + 27 * d) / 54;
+
+    if (R * R < Q * Q * Q) {
+        double theta = acos(R / sqrt(Q * Q * Q));
+        double q = -2 * sqrt(Q);
+        roots[0] = q * cos(theta / 3) - a / 3;
+        roots[1] = q * cos((theta + 2 * M_PI) / 3) - a / 3;
+        roots[2] = q * cos((theta - 2 * M_PI) / 3) - a / 3;
+        return 3;
+    }
+
+    double A = -(R >= 0 ? 1 : -1) * cbrt(fabs(R) + sqrt(R * R - Q * Q * Q));
+    double B = A != 0 ? Q / A : 0;
+    roots[0] = A + B - a / 3;
+    return 1;
+}
+
+// null space of the 7 epipolar constraints, Gauss-Jordan elimination
+// with full pivoting: a few hundred flops instead of an eigen
+// decomposition. false for degenerate samples.
+static bool seven_point_null_space(const double *pts, const int *indexes, double f[2][9]) {
+    double A[7][9];
+    for (int i = 0; i < 7; i++) {
+        const double *p = pts + 4 * indexes[i];
+        double x1 = p[0], y1 = p[1], x2 = p[2], y2 = p[3];
+        double r[9] = { x2 * x1, x2 * y1, x2, y2 * x1, y2 * y1, y2, x1, y1, 1 };
+        memcpy(A[i], r, sizeof(r));
+    }
+
+    // columns of the pivots, the 2 left are free
+    int cols[9] = { 0, 1, 2, 3, 4, 5, 6, 7, 8 };
+    for (int r = 0; r < 7; r++) {
+        int best_row = r, best_col = r;
+        double best = 0;
+        for (int i = r; i < 7; i++) {
+            for (int j = r; j < 9; j++) {
+                double v = fabs(A[i][cols[j]]);
+                if (v > best) {
+                    best = v;
+                    best_row = i;
+                    best_col = j;
+                }
+            }
+        }
+        if (best < 1e-12) {
+            return false;
+        }
+
+        std::swap(cols[r], cols[best_col]);
+        if (best_row != r) {
+            for (int j = 0; j < 9; j++) {
+                std::swap(A[r][j], A[best_row][j]);
+            }
+        }
+
+        double inv = 1 / A[r][cols[r]];
+        for (int j = 0; j < 9; j++) {
+            A[r][j] *= inv;
+        }
+        for (int i = 0; i < 7; i++) {
+            if (i == r || A[i][cols[r]] == 0) {
+                continue;
+            }
+            double factor = A[i][cols[r]];
+            for (int j = 0; j < 9; j++) {
+                A[i][j] -= factor * A[r][j];
+            }
+        }
+    }
+
+    // one free variable at 1, the other at 0
+    for (int k = 0; k < 2; k++) {
+        int free_col = cols[7 + k];
+        memset(f[k], 0, sizeof(f[k]));
+        f[k][free_col] = 1;
+        for (int r = 0; r < 7; r++) {
+            f[k][cols[r]] = -A[r][free_col];
+        }
+    }
+
+    return true;
+}
+
+// up to 3 fundamental matrices through 7 points, unit norm
+static int seven_point(const double *pts, const int *indexes, Matx33d *F) {
+    double f[2][9];
+    if (!seven_point_null_space(pts, indexes, f)) {
+        return 0;
+    }
+
+    // det(f1 + l (f0 - f1)) = 0, a cubic in l from 4 samples
+    double diff[9], G[9];
+    for (int i = 0; i < 9; i++) {
+        diff[i] = f[0][i] - f[1][i];
+    }
+    double d[4];
+    const double at[4] = { 0, 1, -1, 2 };
+    for (int s = 0; s < 4; s++) {
+        for (int i = 0; i < 9; i++) {
+            G[i] = f[1][i] + at[s] * diff[i];
+        }
+        d[s] = det3(G);
+    }
+
+    double c[4];
+    c[0] = d[0];
+    c[2] = (d[1] + d[2]) / 2 - d[0];
+    double odd = (d[1] - d[2]) / 2;
+    c[3] = (d[3] - d[0] - 4 * c[2] - 2 * odd) / 6;
+    c[1] = odd - c[3];
+
+    double roots[3];
+    int count = solve_cubic(c, roots);
+
+    for (int r = 0; r < count; r++) {
+        double norm = 0;
+        for (int i = 0; i < 9; i++) {
+            G[i] = f[1][i] + roots[r] * diff[i];
+            norm += G[i] * G[i];
+        }
+        norm = 1 / sqrt(norm);
+        for (int i = 0; i < 9; i++) {
+            F[r].val[i] = G[i] * norm;
+        }
+    }
+
+    return count;
+}
+
+// least squares F on the points at indexes, rank 2
+static Matx33d eight_point(const double *pts, const vector<int>& indexes) {
+    double M[9][9], f[1][9];
+    epipolar_normal(pts, &indexes[0], indexes.size(), M);
+    smallest_eigenvectors(M, 1, f);
+
+    Matx33d F(f[0]);
+    Matx31d w;
+    Matx33d u, vt;
+    SVD::compute(F, w, u, vt);
+    w(2) = 0;
+
+    return u * Matx33d::diag(w) * vt;
+}
+
+static double sampson(const Matx33d& F, const double *p) {
+    double x1 = p[0], y1 = p[1], x2 = p[2], y2 = p[3];
+
+    double fx0 = F(0, 0) * x1 + F(0, 1) * y1 + F(0, 2);
+    double fx1 = F(1, 0) * x1 + F(1, 1) * y1 + F(1, 2);
+    double fx2 = F(2, 0) * x1 + F(2, 1) * y1 + F(2, 2);
+    double ftx0 = F(0, 0) * x2 + F(1, 0) * y2 + F(2, 0);
+    double ftx1 = F(0, 1) * x2 + F(1, 1) * y2 + F(2, 1);
+    double e = x2 * fx0 + y2 * fx1 + fx2;
+
+    return e * e / (fx0 * fx0 + fx1 * fx1 + ftx0 * ftx0 + ftx1 * ftx1);
+}
+
+// hypotheses needed to draw an all inliers sample with confidence
+static int ransac_iterations(double inlier_ratio, double confidence, int max_iterations) {
+    double p = pow(inlier_ratio, 7);
+    if (p >= 1) {
+        return 0;
+    }
+
+    double num = log(1 - confidence), den = log(1 - p);
+    if (den >= 0 || num <= max_iterations * den) {
+        return max_iterations;
+    }
+    return (int) ceil(num / den);
+}
+
+//////////////
+/// ransac ///
+//////////////
+
+// a pair in its normalized frame
+struct NormalizedPair {
+    NormalizedPair()
+        : n(0), threshold(0)
+    {};
+
+    // x1, y1, x2, y2 per point
+    vector<double>  pts;
+    size_t          n;
+    Matx33d         T1, T2;
+
+    // squared Sampson distance, normalized
+    double          threshold;
+};
+
+// centroids at 0, mean distance to them sqrt(2), one scale for both
+// images so Sampson distances scale with it
+static void normalize_pair(const vector<Point2f>& pts1, const vector<Point2f>& pts2,
+                           double threshold, NormalizedPair& pair) {
+    size_t n = std::min(pts1.size(), pts2.size());
+    pair.n = n;
+    pair.pts.resize(4 * n);
+
+    Point2d c1(0, 0), c2(0, 0);
+    for (size_t i = 0; i < n; i++) {
+        c1 += Point2d(pts1[i].x, pts1[i].y);
+        c2 += Point2d(pts2[i].x, pts2[i].y);
+    }
+    if (n > 0) {
+        c1 *= 1.0 / n;
+        c2 *= 1.0 / n;
+    }
+
+    double dist = 0;
+    for (size_t i = 0; i < n; i++) {
+        dist += norm(Point2d(pts1[i].x, pts1[i].y) - c1);
+        dist += norm(Point2d(pts2[i].x, pts2[i].y) - c2);
+    }
+    double s = dist > 0 ? sqrt(2.0) * 2 * n / dist : 1;
+
+    for (size_t i = 0; i < n; i++) {
+        pair.pts[4 * i] = s * (pts1[i].x - c1.x);
+        pair.pts[4 * i + 1] = s * (pts1[i].y - c1.y);
+        pair.pts[4 * i + 2] = s * (pts2[i].x - c2.x);
+        pair.pts[4 * i + 3] = s * (pts2[i].y - c2.y);
+    }
+
+    pair.T1 = Matx33d(s, 0, -s * c1.x, 0, s, -s * c1.y, 0, 0, 1);
+    pair.T2 = Matx33d(s, 0, -s * c2.x, 0, s, -s * c2.y, 0, 0, 1);
+    pair.threshold = threshold * threshold * s * s;
+}
+
+// a SIMD lane, the pair it runs RANSAC for
+struct RansacLane {
+    RansacLane()
+        : pair(-1), n(0), iterations(0), needed(0), best(-1), pending(0)
+    {};
+
+    long        pair;
+    size_t      n;
+    int         iterations;
+    int         needed;
+    int         best;
+    Matx33d     best_F;
+
+    // solutions of the last 7 point sample, not scored yet
+    Matx33d     hypotheses[3];
+    int         pending;
+};
+
+struct RansacResult {
+    RansacResult()
+        : found(false)
+    {};
+
+    bool        found;
+    Matx33d     F;
+};
+
+// RANSAC for the chunk [begin, end) of order, largest pairs first
+static void ransac_chunk(const vector<NormalizedPair>& pairs, const vector<size_t>& order,
+                         size_t begin, size_t end, const BatchRansacOptions& options,
+                         vector<RansacResult>& results) {
+    const SimdKernels& kernels = simd_kernels();
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+
+    // lanes of the first pair fit every other one
+    size_t n_max = pairs[order[begin]].n;
+    vector<float> packed(4 * n_max * SAMPSON_LANES, nan);
+    float F[9 * SAMPSON_LANES];
+    float threshold[SAMPSON_LANES];
+    uint32_t counts[SAMPSON_LANES];
+
+    RansacLane lanes[SAMPSON_LANES];
+    size_t next = begin;
+    size_t hypotheses = 0, rounds = 0;
+
+    // columns of lane l for pair p, NaN after its points
+    auto start = [&](int l, size_t p) {
+        RansacLane& lane = lanes[l];
+        const NormalizedPair& pair = pairs[p];
+
+        for (size_t i = 0; i < pair.n; i++) {
+            for (int k = 0; k < 4; k++) {
+                packed[(4 * i + k) * SAMPSON_LANES + l] = (float) pair.pts[4 * i + k];
+            }
+        }
+        for (size_t i = pair.n; i < lane.n; i++) {
+            for (int k = 0; k < 4; k++) {
+                packed[(4 * i + k) * SAMPSON_LANES + l] = nan;
+            }
+        }
+
+        lane = RansacLane();
+        lane.pair = p;
+        lane.n = pair.n;
+        lane.needed = options.max_iterations;
+    };
+
+    // a hypothesis ready in lane l, false once the chunk is done
+    auto fetch = [&](int l) {
+        RansacLane& lane = lanes[l];
+        while (true) {
+            if (lane.pair < 0) {
+                // skip the pairs too small for 8 points
+                while (next < end && pairs[order[next]].n < 8) {
+                    next++;
+                }
+                if (next == end) {
+                    return false;
+                }
+                start(l, order[next++]);
+                continue;
+            }
+
+            if (lane.pending > 0) {
+                return true;
+            }
+
+            if (lane.iterations >= lane.needed) {
+                RansacResult& result = results[lane.pair];
+                result.found = lane.best >= 0;
+                result.F = lane.best_F;
+                lane.pair = -1;
+                continue;
+            }
+
+            // 7 distinct points
+            const NormalizedPair& pair = pairs[lane.pair];
+            RNG rng((uint64) lane.pair * 7919 + lane.iterations + 1);
+            int sample[7];
+            for (int k = 0; k < 7; k++) {
+                do {
+                    sample[k] = rng.uniform(0, (int) pair.n);
+                } while (std::find(sample, sample + k, sample[k]) != sample + k);
+            }
+
+            lane.pending = seven_point(&pair.pts[0], sample, lane.hypotheses);
+            lane.iterations++;
+        }
+    };
+
+    while (true) {
+        size_t n = 0;
+        bool active[SAMPSON_LANES];
+        bool any = false;
+
+        for (int l = 0; l < SAMPSON_LANES; l++) {
+            RansacLane& lane = lanes[l];
+            active[l] = fetch(l);
+            any |= active[l];
+
+            // NaN coefficients score no inlier
+            for (int c = 0; c < 9; c++) {
+                F[c * SAMPSON_LANES + l] = active[l] ?
+                    (float) lane.hypotheses[lane.pending - 1].val[c] : nan;
+            }
+            if (active[l]) {
+                threshold[l] = (float) pairs[lane.pair].threshold;
+                n = std::max(n, lane.n);
+            } else {
+                threshold[l] = 0;
+            }
+        }
+
+        if (!any) {
+            break;
+        }
+
+        kernels.sampson_count_lanes(F, &packed[0], n, threshold, counts);
+
+        for (int l = 0; l < SAMPSON_LANES; l++) {
+            if (!active[l]) {
+                continue;
+            }
+
+            RansacLane& lane = lanes[l];
+            const Matx33d& H = lane.hypotheses[--lane.pending];
+            hypotheses++;
+
+            if ((int) counts[l] > lane.best) {
+                lane.best = counts[l];
+                lane.best_F = H;
+                lane.needed = std::min(lane.needed,
+                                       ransac_iterations((double) lane.best / lane.n,
+                                                         options.confidence,
+                                                         options.max_iterations));
+            }
+        }
+        rounds++;
+    }
+
+    Metrics::instance().add("ransac.batch.hypotheses", hypotheses);
+    Metrics::instance().add("ransac.batch.lanes", rounds * SAMPSON_LANES);
+}
+
+void batch_fundamental(const vector<vector<Point2f> >& pts1,
+                       const vector<vector<Point2f> >& pts2,
+                       const BatchRansacOptions& options,
+                       vector<Mat>& F, vector<vector<char> >& inliers) {
+    size_t count = pts1.size();
+    F.assign(count, Mat());
+    inliers.assign(count, vector<char>());
+
+    vector<NormalizedPair> pairs(count);
+    for (size_t i = 0; i < count; i++) {
+        normalize_pair(pts1[i], pts2[i], options.threshold, pairs[i]);
+    }
+
+    // largest first, lanes refill with smaller pairs
+    vector<size_t> order(count);
+    for (size_t i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&pairs](size_t a, size_t b) {
+            return pairs[a].n > pairs[b].n;
+        });
+
+    vector<RansacResult> results(count);
+    size_t chunks = (count + BATCH_CHUNK - 1) / BATCH_CHUNK;
+    parallel_for_index(chunks, [&](size_t chunk, int) {
+            size_t begin = chunk * BATCH_CHUNK;
+            size_t end = std::min(begin + BATCH_CHUNK, count);
+            ransac_chunk(pairs, order, begin, end, options, results);
+        }, options.threads);
+
+    // refit on the inliers, back to pixels
+    parallel_for_index(count, [&](size_t i, int) {
+            const NormalizedPair& pair = pairs[i];
+            inliers[i].assign(pair.n, 0);
+            if (!results[i].found) {
+                return;
+            }
+
+            Matx33d best = results[i].F;
+            vector<int> indexes;
+            for (size_t j = 0; j < pair.n; j++) {
+                if (sampson(best, &pair.pts[4 * j]) <= pair.threshold) {
+                    indexes.push_back(j);
+                }
+            }
+
+            if (indexes.size() >= 8) {
+                Matx33d refit = eight_point(&pair.pts[0], indexes);
+                vector<int> refit_indexes;
+                for (size_t j = 0; j < pair.n; j++) {
+                    if (sampson(refit, &pair.pts[4 * j]) <= pair.threshold) {
+                        refit_indexes.push_back(j);
+                    }
+                }
+                if (refit_indexes.size() >= indexes.size()) {
+                    best = refit;
+                    indexes.swap(refit_indexes);
+                }
+            }
+
+            for (int j : indexes) {
+                inliers[i][j] = 1;
+            }
+
+            // F(2, 2) = 1 like findFundamentalMat()
+            Matx33d pixel = pair.T2.t() * best * pair.T1;
+            double scale = fabs(pixel(2, 2)) > 1e-12 ? pixel(2, 2) : norm(pixel);
+            F[i] = Mat(pixel * (1 / scale));
+        }, options.threads);
+
+    Metrics::instance().add("ransac.batch.pairs", count);
+}
+
+void batch_compute_F(vector<ImagePair>& pairs, const BatchRansacOptions& options,
+                     vector<char>& verified) {
+    // features are loaded lazily, not from several threads
+    vector<vector<Point2f> > pts1(pairs.size()), pts2(pairs.size());
+    for (size_t i = 0; i < pairs.size(); i++) {
+        pairs[i].get_match_points(pts1[i], pts2[i]);
+    }
+
+    vector<Mat> F;
+    vector<vector<char> > inliers;
+    batch_fundamental(pts1, pts2, options, F, inliers);
+
+    verified.assign(pairs.size(), 0);
+    for (size_t i = 0; i < pairs.size(); i++) {
+        verified[i] = pairs[i].set_F_mat(F[i], inliers[i]);
+    }
+}
@@ -0,0 +1,52 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Fundamental matrix RANSAC over many small pairs at once.
+//
+// Sequential and dense captures verify a lot of pairs with 50 to 300
+// putative matches, where a findFundamentalMat() call is mostly setup.
+// Here pairs are sorted by size and run SAMPSON_LANES at a time: each
+// round draws one 7 point hypothesis per pair, and one
+// sampson_count_lanes() call scores all of them, a pair per SIMD lane.
+// A lane whose pair is done takes the next (smaller) pair, the packed
+// points and the scratch buffers are allocated once per chunk of pairs.
+//
+// Points are normalized per pair (centroids at 0, mean distance sqrt(2))
+// so hypotheses are scored in float. The best hypothesis of a pair is
+// then refit with the 8 point algorithm on its inliers.
+//
+// Inliers are within threshold of F in Sampson distance, close to the
+// epipolar distance findFundamentalMat() uses.
+
+#ifndef BATCH_RANSAC_H
+#define BATCH_RANSAC_H
+
+#include "photogram.h"
+#include "image_pairs.h"
+
+struct BatchRansacOptions {
+    BatchRansacOptions()
+        : threshold(1.0), confidence(0.99), max_iterations(1000), threads(0)
+    {};
+
+    // pixels, same as compute_F_mat()
+    double      threshold;
+    double      confidence;
+    int         max_iterations;
+
+    // <= 0 for default_thread_count()
+    int         threads;
+};
+
+// F matrix and inliers of every pair from its matches, verified[i] is
+// what pairs[i].compute_F_mat() would return
+void batch_compute_F(vector<ImagePair>& pairs, const BatchRansacOptions& options,
+                     vector<char>& verified);
+
+// same on points, F is empty when there are less than 8 points. Used by
+// batch_compute_F(), and to compare with findFundamentalMat()
+void batch_fundamental(const vector<vector<Point2f> >& pts1,
+                       const vector<vector<Point2f> >& pts2,
+                       const BatchRansacOptions& options,
+                       vector<Mat>& F, vector<vector<char> >& inliers);
+
+#endif // !BATCH_RANSAC_H
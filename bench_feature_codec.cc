@@ -0,0 +1,99 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Size and speed of the feature files (feature_codec.h) on the features
+// of real images, against their raw arrays.
+//
+//   bench_feature_codec --block 1024 img1.jpg img2.jpg ...
+//
+// Decode speeds are in raw MB/s, the bytes a plain dump would have to
+// read from disk instead.
+
+#include <stdio.h>
+
+#include <chrono>
+
+#include "photogram.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+#include "tclap/CmdLine.h"
+
+#include "feature_codec.h"
+#include "image.h"
+#include "util.h"
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+    vector<string> filenames;
+    int block_size = 1024;
+    bool f16 = false;
+
+    try {
+        TCLAP::CmdLine cmd("Feature file size and speed", ' ', "0.1");
+
+        TCLAP::ValueArg<int> block_arg("", "block", "Keypoints per block", false, 1024,
+                                       "keypoints");
+        cmd.add(block_arg);
+        TCLAP::SwitchArg f16_arg("", "f16", "Half precision descriptors", false);
+        cmd.add(f16_arg);
+        TCLAP::UnlabeledMultiArg<string> files_arg("files", "Images", true, "images");
+        cmd.add(files_arg);
+
+        cmd.parse(argc, argv);
+
+        block_size = block_arg.getValue();
+        f16 = f16_arg.getValue();
+        filenames = files_arg.getValue();
+    } catch (TCLAP::ArgException &e)  {
+        LOG(ERROR) << "error: " << e.error() << " for arg " << e.argId();
+        return 1;
+    }
+
+    FeatureCodecOptions options;
+    options.block_size = block_size;
+
+    vector<ImageFeatures> features(filenames.size());
+    size_t raw = 0;
+    for (size_t i = 0; i < filenames.size(); i++) {
+        Image image(filenames[i]);
+        get_features(image.get_image_gray(), features[i]);
+        if (f16) {
+            compact_descriptors_f16(features[i]);
+        }
+        size_t n = features[i].keypoints.size();
+        raw += n * 16 + n * SIFT_DIM * (f16 ? 2 : 4);
+    }
+
+    vector<string> files(features.size());
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < features.size(); i++) {
+        encode_features(features[i], options, files[i]);
+    }
+    double encode = seconds_since(start);
+
+    size_t coded = 0;
+    for (const string& file : files) {
+        coded += file.size();
+    }
+
+    int threads[] = { 1, default_thread_count() };
+    for (int t : threads) {
+        set_thread_count(t);
+        start = std::chrono::steady_clock::now();
+        for (const string& file : files) {
+            FeatureFileReader reader;
+            ImageFeatures decoded;
+            reader.open((const unsigned char*) file.data(), file.size());
+            reader.decode(decoded);
+        }
+        double decode = seconds_since(start);
+        printf("decode  %2d threads  %9.1f MB/s\n", t, raw / decode / 1e6);
+    }
+
+    printf("images %zu  raw %zu bytes  coded %zu bytes  ratio %.2f  encode %.1f MB/s\n",
+           filenames.size(), raw, coded, (double) raw / coded, raw / encode / 1e6);
+    return 0;
+}
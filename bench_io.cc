@@ -0,0 +1,137 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Throughput of the output writes: blocking stdio per file from the
+// workers, as before, against the AsyncWriter backends.
+//
+//   bench_io --dir /mnt/nfs/scratch --producers 8 --fsync none
+//
+// Each case writes files of one size from all the producers, then
+// appends records of that size to one file per producer. Times include
+// the final flush().
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#include "photogram.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+#include "tclap/CmdLine.h"
+
+#include "async_io.h"
+#include "util.h"
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void print(const char *name, size_t size, size_t count, double seconds) {
+    printf("%-11s %8zu bytes x %6zu  %8.3fs  %9.1f MB/s  %9.0f writes/s\n", name, size, count,
+           seconds, size * count / seconds / 1e6, count / seconds);
+}
+
+int main(int argc, char **argv) {
+    string dir;
+    int producers = 8;
+    string fsync_name;
+
+    try {
+        TCLAP::CmdLine cmd("Synchronous and asynchronous output writes", ' ', "0.1");
+
+        TCLAP::ValueArg<string> dir_arg("", "dir", "Scratch directory", false, "/tmp",
+                                        "directory");
+        cmd.add(dir_arg);
+        TCLAP::ValueArg<int> producers_arg("", "producers", "Threads producing records",
+                                           false, 8, "threads");
+        cmd.add(producers_arg);
+        TCLAP::ValueArg<string> fsync_arg("", "fsync", "none, file or flush", false, "none",
+                                          "policy");
+        cmd.add(fsync_arg);
+
+        cmd.parse(argc, argv);
+
+        dir = dir_arg.getValue();
+        producers = producers_arg.getValue();
+        fsync_name = fsync_arg.getValue();
+    } catch (TCLAP::ArgException &e)  {
+        LOG(ERROR) << "error: " << e.error() << " for arg " << e.argId();
+        return 1;
+    }
+
+    AsyncIoOptions options;
+    if (!parse_fsync_policy(fsync_name, options.fsync)) {
+        LOG(ERROR) << "unknown fsync policy " << fsync_name;
+        return 1;
+    }
+
+    char tmpl[4096];
+    snprintf(tmpl, sizeof(tmpl), "%s/bench_io.XXXXXX", dir.c_str());
+    if (!mkdtemp(tmpl)) {
+        LOG(ERROR) << "can't create a directory in " << dir;
+        return 1;
+    }
+    string scratch = tmpl;
+    set_thread_count(producers);
+
+    // small per image records, and large feature files
+    size_t sizes[] = { 4 << 10, 4 << 20 };
+    size_t counts[] = { 4000, 64 };
+
+    for (int c = 0; c < 2; c++) {
+        size_t size = sizes[c], count = counts[c];
+        string record(size, 'x');
+
+        auto start = std::chrono::steady_clock::now();
+        parallel_for_index(count, [&](size_t i, int) {
+                string filename = scratch + "/stdio_" + std::to_string(i);
+                FILE *f = fopen(filename.c_str(), "wb");
+                if (!f) {
+                    return;
+                }
+                fwrite(record.data(), 1, record.size(), f);
+                if (options.fsync != FSYNC_NONE) {
+                    fflush(f);
+                    fdatasync(fileno(f));
+                }
+                fclose(f);
+            });
+        print("stdio", size, count, seconds_since(start));
+
+        AsyncIoBackend backends[] = { ASYNC_IO_SYNC, ASYNC_IO_THREADS, ASYNC_IO_URING };
+        const char *names[] = { "auto", "uring", "threads", "sync" };
+
+        for (AsyncIoBackend backend : backends) {
+            options.backend = backend;
+            AsyncWriter writer(options);
+            if (writer.get_backend() != backend) {
+                continue;
+            }
+
+            start = std::chrono::steady_clock::now();
+            parallel_for_index(count, [&](size_t i, int) {
+                    writer.write_file(scratch + "/" + names[backend] + "_" + std::to_string(i),
+                                      record);
+                });
+            writer.flush();
+            print(names[backend], size, count, seconds_since(start));
+
+            start = std::chrono::steady_clock::now();
+            parallel_for_index(count, [&](size_t, int worker) {
+                    writer.append(scratch + "/log_" + std::to_string(worker),
+                                  record.data(), record.size());
+                });
+            writer.flush();
+            string appended = string(names[backend]) + "+app";
+            print(appended.c_str(), size, count, seconds_since(start));
+        }
+    }
+
+    string cleanup = "rm -rf " + scratch;
+    if (system(cleanup.c_str()) != 0) {
+        LOG(ERROR) << "can't remove " << scratch;
+    }
+    return 0;
+}
@@ -0,0 +1,270 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Recall / throughput of the approximate descriptor matchers against an
+// exact brute force matcher, on the same image pairs.
+//
+//   bench_matchers --pairs 20 img1.jpg img2.jpg ...
+//
+// recall is the fraction of query descriptors whose approximate nearest
+// neighbor is the exact one, throughput counts queries per second of
+// search (index build times are reported apart).
+//
+// The linear scans compare float and half precision descriptors: memory
+// is the size of the train descriptors (or index), bandwidth the bytes
+// of descriptors read per second of search.
+
+#include <chrono>
+
+#include "photogram.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+#include "tclap/CmdLine.h"
+
+#include "cascade_hash.h"
+#include "features2d.h"
+#include "hnsw.hpp"
+#include "image.h"
+#include "simd_kernels.h"
+
+struct BenchResult {
+    BenchResult()
+        : build_seconds(0), search_seconds(0), queries(0), correct(0),
+          memory(0), pairs(0), scanned(0)
+    {};
+
+    double  build_seconds;
+    double  search_seconds;
+    size_t  queries;
+    size_t  correct;
+
+    // train descriptors or index bytes, summed over the pairs
+    size_t  memory;
+    size_t  pairs;
+
+    // descriptor bytes read by the linear scans
+    size_t  scanned;
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void score(const Matches& exact, const Matches& approx, BenchResult& result) {
+    // both matchers return one match per query, in query order
+    for (size_t i = 0; i < approx.size() && i < exact.size(); i++) {
+        if (approx[i].trainIdx == exact[i].trainIdx) {
+            result.correct++;
+        }
+    }
+    result.queries += exact.size();
+}
+
+static void print_result(const string& name, const BenchResult& r) {
+    printf("%-24s recall %6.4f  %10.0f queries/s  build %7.3fs",
+           name.c_str(), r.queries ? r.correct / (double) r.queries : 0,
+           r.search_seconds > 0 ? r.queries / r.search_seconds : 0,
+           r.build_seconds);
+    if (r.pairs) {
+        printf("  mem %7.2f MB", r.memory / (double) r.pairs / (1 << 20));
+    }
+    if (r.scanned && r.search_seconds > 0) {
+        printf("  %6.2f GB/s", r.scanned / r.search_seconds / 1e9);
+    }
+    printf("\n");
+}
+
+// exact nearest neighbor by linear scan, dist(query index, train index)
+template <typename Distance>
+static void scan(size_t queries, size_t train, size_t row_bytes,
+                 Distance dist, BenchResult& result, const Matches& exact) {
+    Matches approx;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t q = 0; q < queries; q++) {
+        float best = 1e30;
+        int best_id = -1;
+        for (size_t t = 0; t < train; t++) {
+            float d = dist(q, t);
+            if (d < best) {
+                best = d;
+                best_id = t;
+            }
+        }
+        approx.push_back(DMatch(q, best_id, 0));
+    }
+    result.search_seconds += seconds_since(start);
+    result.scanned += queries * train * row_bytes;
+    result.memory += train * row_bytes;
+    result.pairs++;
+    score(exact, approx, result);
+}
+
+int main(int argc, char **argv) {
+    vector<string> filenames;
+    int max_pairs;
+    int hnsw_m;
+
+    try {
+        TCLAP::CmdLine cmd("Compare descriptor matchers", ' ', "0.1");
+
+        TCLAP::ValueArg<int> pairs("", "pairs", "Maximum number of pairs", false, 20, "N");
+        cmd.add(pairs);
+        TCLAP::ValueArg<int> m("", "hnsw_m", "HNSW links per node", false, 16, "M");
+        cmd.add(m);
+        TCLAP::UnlabeledMultiArg<string> images("images", "Image list", true, "filename");
+        cmd.add(images);
+
+        cmd.parse(argc, argv);
+
+        filenames = images.getValue();
+        max_pairs = pairs.getValue();
+        hnsw_m = m.getValue();
+    } catch (TCLAP::ArgException &e)  {
+        std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
+        return 1;
+    }
+
+    vector<ImageFeaturesPtr> features;
+    vector<Mat> descriptors;
+    for (auto filename : filenames) {
+        Image image(filename);
+        ImageFeaturesPtr f = image.get_image_features();
+        if (!f) {
+            continue;
+        }
+
+        size_t count;
+        vector<float> storage;
+        const float *desc = get_descriptors(*f, count, storage);
+        features.push_back(f);
+        descriptors.push_back(desc ? Mat(count, 128, CV_32F, (void*) desc).clone() : Mat());
+    }
+
+    const SimdKernels& kernels = simd_kernels();
+
+    // cascade hashes are computed once per image
+    BenchResult cascade_result;
+    CascadeHasher hasher(128);
+    vector<CascadeHashes::ptr> hashes;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < descriptors.size(); i++) {
+        const Mat& desc = descriptors[i];
+        if (!hasher.is_initialized() && !desc.empty()) {
+            hasher.init(desc.ptr<float>(), desc.rows);
+        }
+        hashes.push_back(hasher.hash(desc.empty() ? NULL : desc.ptr<float>(), desc.rows));
+    }
+    cascade_result.build_seconds = seconds_since(start);
+
+    const int efs[] = { 16, 32, 64, 128, 256 };
+    const int ef_count = sizeof(efs) / sizeof(efs[0]);
+
+    BenchResult flann_result;
+    BenchResult hnsw_results[ef_count];
+    BenchResult hnsw_f16_result;
+    BenchResult scan_f32, scan_f16;
+    BFMatcher exact_matcher(NORM_L2);
+    FlannBasedMatcher flann;
+    int pair_count = 0;
+
+    for (size_t i = 0; i < features.size() && pair_count < max_pairs; i++) {
+        for (size_t j = i + 1; j < features.size() && pair_count < max_pairs; j++) {
+            const Mat& query = descriptors[i];
+            const Mat& train = descriptors[j];
+            if (query.empty() || train.empty()) {
+                continue;
+            }
+            pair_count++;
+
+            Matches exact;
+            exact_matcher.match(query, train, exact);
+
+            // linear scans, float against half precision converted
+            // on the fly (F16C)
+            const size_t dim = 128;
+            vector<Half> query_f16(query.rows * dim), train_f16(train.rows * dim);
+            kernels.f32_to_f16(query.ptr<float>(), &query_f16[0], query_f16.size());
+            kernels.f32_to_f16(train.ptr<float>(), &train_f16[0], train_f16.size());
+
+            scan(query.rows, train.rows, dim * sizeof(float), [&](size_t q, size_t t) {
+                    return kernels.l2_sqr_f32(query.ptr<float>(q), train.ptr<float>(t), dim);
+                }, scan_f32, exact);
+            scan(query.rows, train.rows, dim * sizeof(Half), [&](size_t q, size_t t) {
+                    return kernels.l2_sqr_f16(&query_f16[q * dim], &train_f16[t * dim], dim);
+                }, scan_f16, exact);
+
+            // FLANN rebuilds its kd-forest on every match() call
+            Matches approx;
+            start = std::chrono::steady_clock::now();
+            flann.match(query, train, approx);
+            flann_result.search_seconds += seconds_since(start);
+            score(exact, approx, flann_result);
+
+            approx.clear();
+            start = std::chrono::steady_clock::now();
+            hasher.match(*hashes[i], query.ptr<float>(), *hashes[j], train.ptr<float>(),
+                         10, approx, 1);
+            cascade_result.search_seconds += seconds_since(start);
+            // queries without candidates count as misses
+            for (size_t a = 0, e = 0; a < approx.size() && e < exact.size(); e++) {
+                if (approx[a].queryIdx == exact[e].queryIdx) {
+                    cascade_result.correct += approx[a++].trainIdx == exact[e].trainIdx;
+                }
+            }
+            cascade_result.queries += exact.size();
+
+            start = std::chrono::steady_clock::now();
+            HnswIndex<float> index(128, hnsw_m, 200);
+            index.build(train.ptr<float>(), train.rows);
+            double build = seconds_since(start);
+
+            HnswVisited visited;
+            vector<HnswIndex<float>::Neighbor> neighbors;
+            for (int e = 0; e < ef_count; e++) {
+                approx.clear();
+                start = std::chrono::steady_clock::now();
+                for (int q = 0; q < query.rows; q++) {
+                    index.search(query.ptr<float>(q), 1, efs[e], neighbors, visited);
+                    approx.push_back(DMatch(q, neighbors.empty() ? -1 : neighbors[0].second, 0));
+                }
+                hnsw_results[e].search_seconds += seconds_since(start);
+                hnsw_results[e].build_seconds += build;
+                hnsw_results[e].memory += index.memory_size();
+                hnsw_results[e].pairs++;
+                score(exact, approx, hnsw_results[e]);
+            }
+
+            start = std::chrono::steady_clock::now();
+            HnswIndex<Half> index_f16(dim, hnsw_m, 200);
+            index_f16.build(&train_f16[0], train.rows);
+            hnsw_f16_result.build_seconds += seconds_since(start);
+            hnsw_f16_result.memory += index_f16.memory_size();
+            hnsw_f16_result.pairs++;
+
+            approx.clear();
+            start = std::chrono::steady_clock::now();
+            for (int q = 0; q < query.rows; q++) {
+                index_f16.search(&query_f16[q * dim], 1, 64, neighbors, visited);
+                approx.push_back(DMatch(q, neighbors.empty() ? -1 : neighbors[0].second, 0));
+            }
+            hnsw_f16_result.search_seconds += seconds_since(start);
+            score(exact, approx, hnsw_f16_result);
+        }
+    }
+
+    printf("%d pairs, single threaded search, %s kernels\n", pair_count, kernels.name);
+    print_result("scan f32 (l2)", scan_f32);
+    print_result("scan f16 (l2)", scan_f16);
+    print_result("flann (kd-forest)", flann_result);
+    print_result("cascade hashing k=10", cascade_result);
+    for (int e = 0; e < ef_count; e++) {
+        ostringstream name;
+        name << "hnsw M=" << hnsw_m << " ef=" << efs[e];
+        print_result(name.str(), hnsw_results[e]);
+    }
+    ostringstream name;
+    name << "hnsw f16 M=" << hnsw_m << " ef=64";
+    print_result(name.str(), hnsw_f16_result);
+
+    return 0;
+}
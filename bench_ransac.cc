@@ -0,0 +1,159 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Throughput of the batched fundamental matrix RANSAC against one
+// findFundamentalMat() call per pair, on small synthetic pairs.
+//
+//   bench_ransac --pairs 10000 --min 50 --max 300 --outliers 0.3
+//
+// Both run on a single thread. Inliers are counted against the
+// synthetic ground truth. With --panorama the camera only turns, and the
+// rotation only model (rotation_ransac.h) runs too.
+
+#include <chrono>
+#include <random>
+
+#include "photogram.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include "tclap/CmdLine.h"
+
+#include "batch_ransac.h"
+#include "rotation_ransac.h"
+#include "simd_kernels.h"
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// a random scene seen from two cameras, truth[i] unset for mismatches
+static void synthetic_pair(std::mt19937& rng, int n, double outliers, bool panorama,
+                           vector<Point2f>& pts1, vector<Point2f>& pts2,
+                           vector<char>& truth) {
+    std::uniform_real_distribution<double> u(-1, 1);
+    std::normal_distribution<double> noise(0, 0.3);
+    const double f = 1000, cx = 960, cy = 540;
+
+    double yaw = 0.05 * u(rng);
+    double tx = 0.5 + 0.2 * u(rng), ty = 0.1 * u(rng), tz = 0.1 * u(rng);
+    if (panorama) {
+        yaw = 0.3 * u(rng);
+        tx = ty = tz = 0;
+    }
+
+    for (int i = 0; i < n; i++) {
+        double X = 3 * u(rng), Y = 2 * u(rng), Z = 5 + 2 * u(rng);
+        double Xr = cos(yaw) * X + sin(yaw) * Z - tx;
+        double Yr = Y - ty;
+        double Zr = -sin(yaw) * X + cos(yaw) * Z - tz;
+
+        double x2 = f * Xr / Zr + cx, y2 = f * Yr / Zr + cy;
+        bool inlier = (u(rng) + 1) / 2 >= outliers;
+        if (!inlier) {
+            x2 = cx + 900 * u(rng);
+            y2 = cy + 500 * u(rng);
+        }
+
+        pts1.push_back(Point2f(f * X / Z + cx + noise(rng), f * Y / Z + cy + noise(rng)));
+        pts2.push_back(Point2f(x2 + noise(rng), y2 + noise(rng)));
+        truth.push_back(inlier);
+    }
+}
+
+static void report(const char *name, double seconds, size_t count,
+                   const vector<vector<char> >& truth,
+                   const vector<vector<char> >& inliers) {
+    size_t tp = 0, fp = 0, fn = 0;
+    for (size_t i = 0; i < truth.size(); i++) {
+        for (size_t j = 0; j < truth[i].size() && j < inliers[i].size(); j++) {
+            tp += inliers[i][j] && truth[i][j];
+            fp += inliers[i][j] && !truth[i][j];
+            fn += !inliers[i][j] && truth[i][j];
+        }
+    }
+
+    printf("%-20s %8.1f pairs/s  %7.1f us/pair  recall %6.4f  precision %6.4f\n",
+           name, count / seconds, seconds / count * 1e6,
+           tp / (double) (tp + fn), tp / (double) (tp + fp));
+}
+
+int main(int argc, char **argv) {
+    int count = 10000, min_size = 50, max_size = 300;
+    double outliers = 0.3;
+    bool panorama = false;
+
+    try {
+        TCLAP::CmdLine cmd("Compare batched and per pair F RANSAC", ' ', "0.1");
+
+        TCLAP::ValueArg<int> pairs_arg("", "pairs", "Number of pairs", false, count, "N");
+        cmd.add(pairs_arg);
+        TCLAP::ValueArg<int> min_arg("", "min", "Fewest matches of a pair", false, min_size, "N");
+        cmd.add(min_arg);
+        TCLAP::ValueArg<int> max_arg("", "max", "Most matches of a pair", false, max_size, "N");
+        cmd.add(max_arg);
+        TCLAP::ValueArg<double> outliers_arg("", "outliers", "Outlier ratio", false,
+                                             outliers, "ratio");
+        cmd.add(outliers_arg);
+        TCLAP::SwitchArg panorama_arg("", "panorama", "Camera turning on a tripod", false);
+        cmd.add(panorama_arg);
+
+        cmd.parse(argc, argv);
+
+        count = pairs_arg.getValue();
+        min_size = min_arg.getValue();
+        max_size = std::max(max_arg.getValue(), min_size);
+        outliers = outliers_arg.getValue();
+        panorama = panorama_arg.getValue();
+    } catch (TCLAP::ArgException &e)  {
+        LOG(ERROR) << "error: " << e.error() << " for arg " << e.argId();
+        return 1;
+    }
+
+    std::mt19937 rng(1);
+    vector<vector<Point2f> > pts1(count), pts2(count);
+    vector<vector<char> > truth(count);
+    for (int i = 0; i < count; i++) {
+        int n = min_size + rng() % (max_size - min_size + 1);
+        synthetic_pair(rng, n, outliers, panorama, pts1[i], pts2[i], truth[i]);
+    }
+
+    printf("%d pairs of %d to %d matches, %.0f%% outliers, %s kernels\n",
+           count, min_size, max_size, outliers * 100, simd_kernels().name);
+
+    vector<vector<char> > inliers(count);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        vector<unsigned char> status;
+        findFundamentalMat(pts1[i], pts2[i], FM_RANSAC, 1, 0.99, status);
+        inliers[i].assign(status.begin(), status.end());
+    }
+    double per_pair = seconds_since(start);
+    report("findFundamentalMat", per_pair, count, truth, inliers);
+
+    BatchRansacOptions options;
+    options.threads = 1;
+    vector<Mat> F;
+    start = std::chrono::steady_clock::now();
+    batch_fundamental(pts1, pts2, options, F, inliers);
+    double batched = seconds_since(start);
+    report("batch_fundamental", batched, count, truth, inliers);
+
+    printf("speedup %.1fx\n", per_pair / batched);
+
+    if (panorama) {
+        Matx33d K(1000, 0, 960, 0, 1000, 540, 0, 0, 1);
+        Matx33d R;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; i++) {
+            find_rotation(pts1[i], pts2[i], K, K, RotationRansacOptions(), R, inliers[i]);
+        }
+        double rotation = seconds_since(start);
+        report("find_rotation", rotation, count, truth, inliers);
+
+        printf("speedup %.1fx\n", per_pair / rotation);
+    }
+
+    return 0;
+}
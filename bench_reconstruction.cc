@@ -0,0 +1,137 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Time per registered image of the incremental reconstruction, as the
+// model grows, over a synthetic survey: nadir images on a grid flown in
+// strips above uneven ground.
+//
+//   bench_reconstruction --rows 20 --cols 20
+//
+// Prints the mean time of each quarter of the registrations, it should
+// stay flat. --window 1000000 --global_growth 1 refines everything after
+// each image, for comparison.
+
+#include <chrono>
+#include <map>
+#include <random>
+
+#include "photogram.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+#include "tclap/CmdLine.h"
+
+#include "reconstruction.h"
+
+// meters
+#define HEIGHT 50.0
+#define SPACING 25.0
+#define RELIEF 8.0
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+    int rows = 20, cols = 20;
+    double density = 0.1;
+    ReconstructionOptions options;
+
+    try {
+        TCLAP::CmdLine cmd("Incremental reconstruction time per image", ' ', "0.1");
+
+        TCLAP::ValueArg<int> rows_arg("", "rows", "Strips", false, rows, "N");
+        cmd.add(rows_arg);
+        TCLAP::ValueArg<int> cols_arg("", "cols", "Images per strip", false, cols, "N");
+        cmd.add(cols_arg);
+        TCLAP::ValueArg<double> density_arg("", "density", "Ground points per square meter",
+                                            false, density, "points");
+        cmd.add(density_arg);
+        TCLAP::ValueArg<int> window_arg("", "window", "Cameras refined after each image",
+                                        false, options.window, "cameras");
+        cmd.add(window_arg);
+        TCLAP::ValueArg<double> growth_arg("", "global_growth",
+                                           "Model growth between global refinements",
+                                           false, options.global_growth, "ratio");
+        cmd.add(growth_arg);
+
+        cmd.parse(argc, argv);
+
+        rows = rows_arg.getValue();
+        cols = cols_arg.getValue();
+        density = density_arg.getValue();
+        options.window = window_arg.getValue();
+        options.global_growth = growth_arg.getValue();
+    } catch (TCLAP::ArgException &e)  {
+        LOG(ERROR) << "error: " << e.error() << " for arg " << e.argId();
+        return 1;
+    }
+
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<double> u(-1, 1);
+    std::normal_distribution<double> noise(0, 0.5);
+    Matx33d K(1000, 0, 960, 0, 1000, 540, 0, 0, 1);
+
+    // looking down, x east, y south
+    Matx33d R(1, 0, 0, 0, -1, 0, 0, 0, -1);
+    vector<Matx31d> t;
+    IncrementalReconstruction sfm(options);
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) {
+            // strips flown back and forth, a bit of drift
+            int column = r % 2 ? cols - 1 - c : c;
+            Matx31d center(SPACING * column + u(rng), SPACING * r + u(rng),
+                           HEIGHT + u(rng));
+            t.push_back(-(R * center));
+            sfm.add_image(K);
+        }
+    }
+
+    double width = SPACING * cols, height = SPACING * rows;
+    size_t points = density * (width + 60) * (height + 60);
+    for (size_t p = 0; p < points; p++) {
+        Matx31d X(width * (u(rng) + 1) / 2 - 30, height * (u(rng) + 1) / 2 - 30,
+                  RELIEF * u(rng));
+
+        std::map<size_t, Point2f> observations;
+        for (size_t i = 0; i < t.size(); i++) {
+            Matx31d x = K * (R * X + t[i]);
+            Point2f pixel(x(0) / x(2) + noise(rng), x(1) / x(2) + noise(rng));
+            if (pixel.x >= 0 && pixel.y >= 0 && pixel.x < 1920 && pixel.y < 1080) {
+                observations[i] = pixel;
+            }
+        }
+        sfm.add_track(observations);
+    }
+
+    printf("%d images, %zu tracks\n", rows * cols, sfm.track_count());
+
+    auto start = std::chrono::steady_clock::now();
+    if (!sfm.initialize()) {
+        return 1;
+    }
+    printf("seed pair  %8.3fs\n", seconds_since(start));
+
+    vector<double> times;
+    for (;;) {
+        auto step_start = std::chrono::steady_clock::now();
+        if (!sfm.step()) {
+            break;
+        }
+        times.push_back(seconds_since(step_start));
+    }
+
+    size_t quarter = std::max((size_t) 1, times.size() / 4);
+    for (size_t begin = 0; begin < times.size(); begin += quarter) {
+        size_t end = std::min(times.size(), begin + quarter);
+        double total = 0;
+        for (size_t i = begin; i < end; i++) {
+            total += times[i];
+        }
+        printf("images %4zu - %4zu  %8.2f ms/image\n", begin + 2, end + 1,
+               1000 * total / (end - begin));
+    }
+
+    printf("registered %zu / %d, %zu points, %.3fs\n", sfm.get_registered_count(),
+           rows * cols, sfm.get_point_count(), seconds_since(start));
+    return 0;
+}
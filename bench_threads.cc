@@ -0,0 +1,124 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Wall time of a per image workload with OpenCV loops nested in our own
+// parallel loop, at several thread counts.
+//
+//   bench_threads --images 64 --size 1024 1 8 32 64
+//
+// "unmanaged" runs one std::thread per worker and leaves OpenCV with its
+// own threads, as before the shared pool. "pool" goes through
+// set_thread_count(): our loop and OpenCV's share the same threads.
+// Unmanaged runs first, set_thread_count() changes OpenCV for good.
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "photogram.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+#include "tclap/CmdLine.h"
+
+#include "util.h"
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// gray conversion, blur and warp, as decoding and registration do
+static void process(const Mat& img, const Mat& H, Mat& out) {
+    Mat gray, blurred;
+    cvtColor(img, gray, COLOR_BGR2GRAY);
+    GaussianBlur(gray, blurred, Size(9, 9), 2.0);
+    warpPerspective(blurred, out, H, img.size());
+}
+
+static void run_unmanaged(const vector<Mat>& images, const Mat& H, int threads) {
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        Mat out;
+        for (size_t i = next++; i < images.size(); i = next++) {
+            process(images[i], H, out);
+        }
+    };
+
+    vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(std::thread(work));
+    }
+    for (auto &t : workers) {
+        t.join();
+    }
+}
+
+static void run_pool(const vector<Mat>& images, const Mat& H) {
+    parallel_for_index(images.size(), [&](size_t i, int) {
+            Mat out;
+            process(images[i], H, out);
+        });
+}
+
+int main(int argc, char **argv) {
+    int image_count = 64;
+    int size = 1024;
+    vector<int> thread_counts;
+
+    try {
+        TCLAP::CmdLine cmd("Nested parallelism with and without the shared pool", ' ', "0.1");
+
+        TCLAP::ValueArg<int> images_arg("", "images", "Number of images", false, 64, "N");
+        cmd.add(images_arg);
+        TCLAP::ValueArg<int> size_arg("", "size", "Image side in pixels", false, 1024, "pixels");
+        cmd.add(size_arg);
+        TCLAP::UnlabeledMultiArg<int> threads_arg("threads", "Thread counts", false, "threads");
+        cmd.add(threads_arg);
+
+        cmd.parse(argc, argv);
+
+        image_count = images_arg.getValue();
+        size = size_arg.getValue();
+        thread_counts = threads_arg.getValue();
+    } catch (TCLAP::ArgException &e)  {
+        LOG(ERROR) << "error: " << e.error() << " for arg " << e.argId();
+        return 1;
+    }
+
+    if (thread_counts.empty()) {
+        thread_counts = { 1, 8, 32, 64 };
+    }
+
+    RNG rng(42);
+    vector<Mat> images(image_count);
+    for (auto &img : images) {
+        img.create(size, size, CV_8UC3);
+        rng.fill(img, RNG::UNIFORM, 0, 256);
+    }
+
+    // a small rotation and shift
+    Mat H = getRotationMatrix2D(Point2f(size / 2, size / 2), 3.0, 1.0);
+    H.push_back(Mat((Mat_<double>(1, 3) << 0, 0, 1)));
+
+    printf("%d images of %dx%d, %u hardware threads\n", image_count, size, size,
+           std::thread::hardware_concurrency());
+
+    for (int threads : thread_counts) {
+        auto start = std::chrono::steady_clock::now();
+        run_unmanaged(images, H, threads);
+        double seconds = seconds_since(start);
+        printf("unmanaged %3d threads  %8.3fs  %8.1f images/s\n",
+               threads, seconds, image_count / seconds);
+    }
+
+    for (int threads : thread_counts) {
+        set_thread_count(threads);
+
+        auto start = std::chrono::steady_clock::now();
+        run_pool(images, H);
+        double seconds = seconds_since(start);
+        printf("pool      %3d threads  %8.3fs  %8.1f images/s\n",
+               threads, seconds, image_count / seconds);
+    }
+
+    return 0;
+}
@@ -34,6 +34,10 @@ class Bundle {
         return image_pairs[i];
     }
 
+    inline void set_image_pair(const int i, const ImagePair& pair) {
+        image_pairs[i] = pair;
+    }
+
     void add_image(Image::ptr image);
 
     inline Image::ptr get_image(const int i) const {
@@ -0,0 +1,173 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <random>
+
+#include "cascade_hash.h"
+#include "simd_kernels.h"
+#include "util.h"
+
+#define CASCADE_PROJECTIONS (CASCADE_TABLES * CASCADE_BUCKET_BITS + CASCADE_CODE_BITS)
+
+CascadeHasher::CascadeHasher(int dim, unsigned seed)
+    : dim(dim), initialized(false),
+      mean(Mat::zeros(1, dim, CV_32F)),
+      projections(CASCADE_PROJECTIONS, dim, CV_32F) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> normal(0, 1);
+
+    for (int i = 0; i < projections.rows; i++) {
+        float *row = projections.ptr<float>(i);
+        for (int j = 0; j < dim; j++) {
+            row[j] = normal(rng);
+        }
+    }
+}
+
+void CascadeHasher::init(const float *descriptors, size_t count) {
+    if (count) {
+        Mat desc(count, dim, CV_32F, (void*) descriptors);
+        reduce(desc, mean, 0, CV_REDUCE_AVG);
+    }
+    initialized = true;
+}
+
+CascadeHashes::ptr CascadeHasher::hash(const float *descriptors, size_t count) const {
+    CascadeHashes::ptr hashes(new CascadeHashes());
+    hashes->count = count;
+    hashes->codes.assign(count * CASCADE_CODE_WORDS, 0);
+    hashes->bucket_ids.resize(count * CASCADE_TABLES);
+    hashes->buckets.resize(CASCADE_TABLES * CASCADE_BUCKETS);
+
+    if (count == 0) {
+        return hashes;
+    }
+
+    // all the projections at once, count x CASCADE_PROJECTIONS
+    Mat desc(count, dim, CV_32F, (void*) descriptors);
+    Mat centered, projected;
+    subtract(desc, repeat(mean, count, 1), centered);
+    gemm(centered, projections, 1, noArray(), 0, projected, GEMM_2_T);
+
+    for (size_t i = 0; i < count; i++) {
+        const float *p = projected.ptr<float>(i);
+
+        for (int t = 0; t < CASCADE_TABLES; t++) {
+            uint8_t bucket = 0;
+            for (int b = 0; b < CASCADE_BUCKET_BITS; b++) {
+                bucket |= (p[t * CASCADE_BUCKET_BITS + b] > 0) << b;
+            }
+            hashes->bucket_ids[i * CASCADE_TABLES + t] = bucket;
+            hashes->buckets[t * CASCADE_BUCKETS + bucket].push_back(i);
+        }
+
+        p += CASCADE_TABLES * CASCADE_BUCKET_BITS;
+        uint64_t *code = &hashes->codes[i * CASCADE_CODE_WORDS];
+        for (int b = 0; b < CASCADE_CODE_BITS; b++) {
+            code[b / 64] |= (uint64_t) (p[b] > 0) << (b % 64);
+        }
+    }
+
+    return hashes;
+}
+
+static inline int hamming(const uint64_t *a, const uint64_t *b) {
+    int d = 0;
+    for (int w = 0; w < CASCADE_CODE_WORDS; w++) {
+        d += __builtin_popcountll(a[w] ^ b[w]);
+    }
+    return d;
+}
+
+// per worker state of the queries
+struct CascadeScratch {
+    CascadeScratch()
+        : tag(0), by_distance(CASCADE_CODE_BITS + 1)
+    {};
+
+    // train descriptors already seen by the current query
+    std::vector<uint32_t>               seen;
+    uint32_t                            tag;
+
+    // candidates binned by Hamming distance
+    std::vector<std::vector<uint32_t> > by_distance;
+};
+
+void CascadeHasher::match(const CascadeHashes& query_hashes, const float *query,
+                          const CascadeHashes& train_hashes, const float *train,
+                          int candidates, std::vector<DMatch>& matches,
+                          int threads) const {
+    const SimdKernels& kernels = simd_kernels();
+    size_t count = query_hashes.count;
+
+    if (threads <= 0) {
+        threads = default_thread_count();
+    }
+    std::vector<CascadeScratch> scratch(threads);
+
+    matches.assign(count, DMatch());
+    std::vector<char> valid(count, 0);
+
+    parallel_for_index(count, [&](size_t i, int worker) {
+            CascadeScratch& s = scratch[worker];
+            if (s.seen.size() != train_hashes.count) {
+                s.seen.assign(train_hashes.count, 0);
+            }
+            if (++s.tag == 0) {
+                std::fill(s.seen.begin(), s.seen.end(), 0);
+                s.tag = 1;
+            }
+
+            // coarse: union of the buckets of the query in every table
+            const uint64_t *code = &query_hashes.codes[i * CASCADE_CODE_WORDS];
+            int min_distance = CASCADE_CODE_BITS + 1;
+            int max_distance = -1;
+            for (int t = 0; t < CASCADE_TABLES; t++) {
+                uint8_t bucket = query_hashes.bucket_ids[i * CASCADE_TABLES + t];
+                for (uint32_t id : train_hashes.buckets[t * CASCADE_BUCKETS + bucket]) {
+                    if (s.seen[id] == s.tag) {
+                        continue;
+                    }
+                    s.seen[id] = s.tag;
+
+                    int d = hamming(code, &train_hashes.codes[id * CASCADE_CODE_WORDS]);
+                    s.by_distance[d].push_back(id);
+                    min_distance = std::min(min_distance, d);
+                    max_distance = std::max(max_distance, d);
+                }
+            }
+
+            // fine: full distance of the closest candidates in Hamming space
+            float best = 0;
+            int best_id = -1;
+            int compared = 0;
+            for (int d = min_distance; d <= max_distance; d++) {
+                for (uint32_t id : s.by_distance[d]) {
+                    if (compared >= candidates) {
+                        break;
+                    }
+                    compared++;
+
+                    float dist = kernels.l2_sqr_f32(query + i * dim, train + id * dim, dim);
+                    if (best_id < 0 || dist < best) {
+                        best = dist;
+                        best_id = id;
+                    }
+                }
+                s.by_distance[d].clear();
+            }
+
+            if (best_id >= 0) {
+                matches[i] = DMatch(i, best_id, sqrt(best));
+                valid[i] = 1;
+            }
+        }, threads);
+
+    // drop the queries without candidate
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (valid[i]) {
+            matches[kept++] = matches[i];
+        }
+    }
+    matches.resize(kept);
+}
@@ -0,0 +1,91 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Cascade hashing matcher for SIFT descriptors.
+//
+//  [1] J. Cheng, C. Leng, J. Wu, H. Cui and H. Lu, "Fast and accurate
+//    image matching with cascade hashing for 3D reconstruction",
+//    CVPR 2014.
+//
+// Centered descriptors are projected on random hyperplanes, the signs
+// giving binary codes:
+//  - CASCADE_TABLES short codes of CASCADE_BUCKET_BITS bits index as
+//    many hash tables, a query only looks at the train descriptors
+//    sharing a bucket with it in at least one table,
+//  - those candidates are ranked by the Hamming distance of 128 bit
+//    codes,
+//  - only the closest few are compared with the full L2 distance.
+//
+// Hashes are computed once per image (CascadeHashes, cached in
+// ImageFeatures) and reused by every pair the image is part of.
+
+#ifndef CASCADE_HASH_H
+#define CASCADE_HASH_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "photogram.h"
+
+#define CASCADE_TABLES          6
+#define CASCADE_BUCKET_BITS     8
+#define CASCADE_BUCKETS         (1 << CASCADE_BUCKET_BITS)
+#define CASCADE_CODE_BITS       128
+#define CASCADE_CODE_WORDS      (CASCADE_CODE_BITS / 64)
+
+// hash codes and tables of the descriptors of one image
+struct CascadeHashes {
+    typedef std::shared_ptr<CascadeHashes>  ptr;
+
+    CascadeHashes()
+        : count(0)
+    {};
+
+    size_t                                  count;
+
+    // CASCADE_CODE_WORDS per descriptor
+    std::vector<uint64_t>                   codes;
+
+    // CASCADE_TABLES per descriptor
+    std::vector<uint8_t>                    bucket_ids;
+
+    // descriptors of each bucket, CASCADE_BUCKETS per table
+    std::vector<std::vector<uint32_t> >     buckets;
+};
+
+class CascadeHasher {
+ public:
+    // random hyperplanes drawn from seed, the same for every image
+    CascadeHasher(int dim = 128, unsigned seed = 100);
+
+    // center the projections on the mean of these descriptors, once,
+    // before hashing any image
+    void init(const float *descriptors, size_t count);
+
+    inline bool is_initialized() const {
+        return initialized;
+    }
+
+    CascadeHashes::ptr hash(const float *descriptors, size_t count) const;
+
+    // nearest train descriptor of each query, among the candidates
+    // closest in Hamming distance
+    void match(const CascadeHashes& query_hashes, const float *query,
+               const CascadeHashes& train_hashes, const float *train,
+               int candidates, std::vector<DMatch>& matches,
+               int threads = 0) const;
+
+ private:
+    int     dim;
+    bool    initialized;
+
+    // 1 x dim
+    Mat     mean;
+
+    // one hyperplane per row, the bucket bits of every table then
+    // the code bits
+    Mat     projections;
+};
+
+#endif // !CASCADE_HASH_H
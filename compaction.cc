@@ -0,0 +1,117 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <algorithm>
+#include <map>
+
+#include "compaction.h"
+#include "feature_codec.h"
+#include "metrics.h"
+#include "util.h"
+
+// mark the features of the matches of a pair kept by verification
+static void mark_matched(const ImagePair& pair, vector<char>& used1, vector<char>& used2) {
+    Matches matches = pair.get_matches();
+    vector<char> inliers = pair.get_inliers();
+
+    for (size_t i = 0; i < matches.size(); i++) {
+        if (!inliers.empty() && !inliers[i]) {
+            continue;
+        }
+        if (matches[i].queryIdx >= 0 && matches[i].queryIdx < (int) used1.size()) {
+            used1[matches[i].queryIdx] = 1;
+        }
+        if (matches[i].trainIdx >= 0 && matches[i].trainIdx < (int) used2.size()) {
+            used2[matches[i].trainIdx] = 1;
+        }
+    }
+}
+
+// the reserve strongest unmatched keypoints
+static void mark_reserve(const KeypointSet& keypoints, size_t reserve, vector<char>& used) {
+    vector<uint32_t> unmatched;
+    for (size_t i = 0; i < used.size(); i++) {
+        if (!used[i]) {
+            unmatched.push_back(i);
+        }
+    }
+    if (unmatched.empty() || reserve == 0) {
+        return;
+    }
+
+    const vector<float>& strength = keypoints.has_response() ? keypoints.response :
+        keypoints.scale;
+    reserve = std::min(reserve, unmatched.size());
+    std::nth_element(unmatched.begin(), unmatched.begin() + reserve - 1, unmatched.end(),
+                     [&strength](uint32_t a, uint32_t b) {
+                         return strength[a] > strength[b];
+                     });
+    for (size_t i = 0; i < reserve; i++) {
+        used[unmatched[i]] = 1;
+    }
+}
+
+size_t compact_bundle(Bundle& bundle, const CompactionOptions& options,
+                      std::vector<std::vector<int> > *remap) {
+    vector<Image::ptr> images = bundle.get_images();
+    vector<ImageFeaturesPtr> features(images.size());
+    std::map<Image::ptr, size_t> index;
+    for (size_t i = 0; i < images.size(); i++) {
+        features[i] = images[i]->get_image_features();
+        index[images[i]] = i;
+    }
+
+    vector<vector<char> > used(images.size());
+    for (size_t i = 0; i < images.size(); i++) {
+        used[i].assign(features[i] ? features[i]->keypoints.size() : 0, 0);
+    }
+
+    for (size_t p = 0; p < bundle.pair_count(); p++) {
+        ImagePair pair = bundle.get_image_pair(p);
+        mark_matched(pair, used[index[pair.first()]], used[index[pair.second()]]);
+    }
+
+    // old index -> new per image, keypoints in their previous order
+    vector<vector<int> > new_index(images.size());
+    vector<size_t> before(images.size(), 0);
+    parallel_for_index(images.size(), [&](size_t i, int) {
+            if (!features[i]) {
+                return;
+            }
+
+            mark_reserve(features[i]->keypoints, options.reserve, used[i]);
+
+            vector<uint32_t> keep;
+            new_index[i].assign(used[i].size(), -1);
+            for (size_t k = 0; k < used[i].size(); k++) {
+                if (used[i][k]) {
+                    new_index[i][k] = keep.size();
+                    keep.push_back(k);
+                }
+            }
+
+            before[i] = features[i]->keypoints.size();
+            select_features(*features[i], keep);
+        }, options.threads);
+
+    for (size_t p = 0; p < bundle.pair_count(); p++) {
+        ImagePair pair = bundle.get_image_pair(p);
+        pair.remap_features(new_index[index[pair.first()]], new_index[index[pair.second()]]);
+        bundle.set_image_pair(p, pair);
+    }
+
+    size_t total_before = 0, total_after = 0;
+    for (size_t i = 0; i < images.size(); i++) {
+        total_before += before[i];
+        total_after += features[i] ? features[i]->keypoints.size() : 0;
+    }
+
+    LOG(INFO) << "Compaction: kept " << total_after << " / " << total_before
+              << " keypoints";
+    Metrics::instance().add("compaction.keypoints_before", total_before);
+    Metrics::instance().add("compaction.keypoints_after", total_after);
+
+    if (remap) {
+        remap->swap(new_index);
+    }
+    return total_after;
+}
@@ -0,0 +1,52 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Feature compaction after verification.
+//
+// Most of the keypoints extracted from an image never make it into a
+// verified match, yet their coordinates and descriptors are what the
+// .feat files, the PQ store and bundle.txt are made of. Once the pairs
+// are verified, compact_bundle() keeps in each image:
+//  - the keypoints of the inlier matches of its pairs (all the matches
+//    of a pair without inliers),
+//  - and optionally the reserve strongest others (by response with
+//    OpenCV SIFT, by scale with SiftGPU which has none), for matching
+//    new images later,
+// in their previous order, so a spatial sort (feature_codec.h) holds.
+// The matches of every pair are renumbered, those that lost a side are
+// dropped: only outliers can. The per image remap (old index to new, -1
+// if gone) renumbers anything else keyed by features, like a track
+// table (remap_track_table() in external_tracks.h).
+//
+// Compact before writing the stores, they come out the smaller for it.
+//
+// Usage :
+//  vector<vector<int> > remap;
+//  compact_bundle(bundle, CompactionOptions(), &remap);
+//  remap_track_table("tracks.bin", remap);
+
+#ifndef COMPACTION_H
+#define COMPACTION_H
+
+#include <vector>
+
+#include "photogram.h"
+#include "bundle.h"
+
+struct CompactionOptions {
+    CompactionOptions()
+        : reserve(0), threads(0)
+    {};
+
+    // unmatched keypoints kept per image, strongest first
+    size_t      reserve;
+
+    int         threads;
+};
+
+// keep the matched keypoints of the images of bundle, renumber the
+// matches. remap[image][old] is the new index of a feature, or -1.
+// Returns the number of keypoints left.
+size_t compact_bundle(Bundle& bundle, const CompactionOptions& options = CompactionOptions(),
+                      std::vector<std::vector<int> > *remap = NULL);
+
+#endif // !COMPACTION_H
@@ -0,0 +1,99 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <algorithm>
+#include <map>
+
+#include "lemon/list_graph.h"
+#include "lemon/connectivity.h"
+
+#include "components.h"
+#include "metrics.h"
+
+size_t split_components(const Bundle& bundle, std::vector<Bundle>& components,
+                        const ComponentOptions& options) {
+    components.clear();
+
+    vector<Image::ptr> images = bundle.get_images();
+    vector<ImagePair> pairs = bundle.get_image_pairs();
+
+    lemon::ListGraph graph;
+    vector<lemon::ListGraph::Node> nodes(images.size());
+    std::map<Image::ptr, size_t> index;
+    for (size_t i = 0; i < images.size(); i++) {
+        nodes[i] = graph.addNode();
+        index[images[i]] = i;
+    }
+
+    vector<size_t> degree(images.size(), 0);
+    for (const ImagePair& pair : pairs) {
+        size_t image1 = index[pair.first()];
+        size_t image2 = index[pair.second()];
+        graph.addEdge(nodes[image1], nodes[image2]);
+        degree[image1]++;
+        degree[image2]++;
+    }
+
+    lemon::ListGraph::NodeMap<int> component_map(graph);
+    int count = lemon::connectedComponents(graph, component_map);
+
+    // images per component, without the images of no pair
+    vector<size_t> sizes(count, 0);
+    for (size_t i = 0; i < images.size(); i++) {
+        if (degree[i] > 0) {
+            sizes[component_map[nodes[i]]]++;
+        }
+    }
+
+    // largest first, so a parallel loop starts with the longest ones
+    vector<int> order;
+    for (int c = 0; c < count; c++) {
+        if (sizes[c] >= std::max<size_t>(options.min_images, 2)) {
+            order.push_back(c);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [&sizes](int a, int b) {
+            return sizes[a] > sizes[b];
+        });
+
+    vector<int> slot(count, -1);
+    for (size_t i = 0; i < order.size(); i++) {
+        slot[order[i]] = i;
+    }
+
+    components.resize(order.size());
+    size_t kept = 0;
+    for (size_t i = 0; i < images.size(); i++) {
+        int s = slot[component_map[nodes[i]]];
+        if (degree[i] > 0 && s >= 0) {
+            components[s].add_image(images[i]);
+            kept++;
+        }
+    }
+
+    for (ImagePair& pair : pairs) {
+        int s = slot[component_map[nodes[index[pair.first()]]]];
+        if (s >= 0) {
+            components[s].add_pair(pair);
+        }
+    }
+
+    size_t dropped = images.size() - kept;
+    LOG(INFO) << "Components: " << components.size() << ", "
+              << dropped << " images dropped";
+    Metrics::instance().add("components.count", components.size());
+    Metrics::instance().add("components.dropped_images", dropped);
+
+    return dropped;
+}
+
+void add_bundle_pairs(const Bundle& bundle, PairTracks& tracks) {
+    std::map<Image::ptr, size_t> index;
+    for (size_t i = 0; i < bundle.image_count(); i++) {
+        index[bundle.get_image(i)] = i;
+    }
+
+    for (const ImagePair& pair : bundle.get_image_pairs()) {
+        tracks.add_pair(index[pair.first()], index[pair.second()],
+                        pair.get_matches(), pair.get_inliers());
+    }
+}
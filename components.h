@@ -0,0 +1,46 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Connected components of the view graph.
+//
+// Images are the nodes, verified pairs the edges. Unordered collections
+// often split into groups that share no pair: nothing links their
+// reconstructions, so tracks and everything after them can run on each
+// group alone, in parallel. split_components() makes one sub-bundle per
+// component with lemon's connectedComponents(), largest first. Images of
+// no verified pair, and components smaller than min_images, are dropped.
+//
+// Usage :
+//  vector<Bundle> components;
+//  split_components(bundle, components);
+//  parallel_for_index(components.size(), [&](size_t i, int) {
+//          IncrementalTracks tracks;
+//          add_bundle_pairs(components[i], tracks);
+//          ...
+//      });
+
+#ifndef COMPONENTS_H
+#define COMPONENTS_H
+
+#include <vector>
+
+#include "photogram.h"
+#include "bundle.h"
+#include "ingest.h"
+
+struct ComponentOptions {
+    ComponentOptions()
+        : min_images(2)
+    {};
+
+    size_t      min_images;
+};
+
+// sub-bundles of the connected images, largest first, images and pairs
+// in bundle order. Returns the number of images dropped.
+size_t split_components(const Bundle& bundle, std::vector<Bundle>& components,
+                        const ComponentOptions& options = ComponentOptions());
+
+// feed the verified pairs of a bundle to tracks, with its image indexes
+void add_bundle_pairs(const Bundle& bundle, PairTracks& tracks);
+
+#endif // !COMPONENTS_H
@@ -0,0 +1,137 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include "debug_writer.h"
+#include "metrics.h"
+
+// pairs within this factor of MIN_INLIERS are borderline
+#define BORDERLINE_FACTOR 2
+
+DebugWriter::DebugWriter(const DebugOptions& options)
+    : options(options), candidates(0), busy(false), done(false) {
+    if (options.every > 0) {
+        worker = std::thread(&DebugWriter::run, this);
+    }
+}
+
+DebugWriter::~DebugWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    job_ready.notify_all();
+
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+bool DebugWriter::sample(bool verified, unsigned int inliers_count) {
+    if (options.every <= 0) {
+        return false;
+    }
+
+    bool candidate;
+    switch (options.sample) {
+        case DEBUG_SAMPLE_VERIFIED:
+            candidate = verified;
+            break;
+        case DEBUG_SAMPLE_FAILURES:
+            candidate = !verified;
+            break;
+        case DEBUG_SAMPLE_BORDERLINE:
+            candidate = inliers_count * BORDERLINE_FACTOR >= MIN_INLIERS &&
+                inliers_count < MIN_INLIERS * BORDERLINE_FACTOR;
+            break;
+        default:
+            candidate = true;
+            break;
+    }
+
+    if (!candidate) {
+        return false;
+    }
+
+    return candidates++ % options.every == 0;
+}
+
+void DebugWriter::queue(const ImagePair& pair) {
+    Job job;
+
+    // images and features are already cached by the matching,
+    // Mat and shared_ptr copies only bump reference counts
+    job.img1 = pair.first()->get_image_gray();
+    job.img2 = pair.second()->get_image_gray();
+    job.features1 = pair.first()->get_image_features();
+    job.features2 = pair.second()->get_image_features();
+    job.matches = pair.get_matches();
+    job.inliers = pair.get_inliers();
+
+    if (!job.features1 || !job.features2) {
+        return;
+    }
+
+    ostringstream ss;
+    ss << "matches_" << pair.first()->get_name()
+       << "_" << pair.second()->get_name();
+    if (job.inliers.size() > 0) {
+        ss << "_RANSAC";
+    } else {
+        ss << "_ALL_MATCHES";
+    }
+    ss << ".jpg";
+    job.filename = ss.str();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (jobs.size() >= options.max_queue) {
+            // never stall the pair loop on diagnostics
+            Metrics::instance().add("debug.dropped");
+            return;
+        }
+        jobs.push_back(job);
+    }
+    Metrics::instance().add("debug.queued");
+    job_ready.notify_one();
+}
+
+void DebugWriter::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    job_done.wait(lock, [this] { return jobs.empty() && !busy; });
+}
+
+void DebugWriter::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    for (;;) {
+        job_ready.wait(lock, [this] { return done || !jobs.empty(); });
+
+        if (jobs.empty()) {
+            // done and drained
+            break;
+        }
+
+        Job job = jobs.front();
+        jobs.pop_front();
+        busy = true;
+
+        lock.unlock();
+        render(job);
+        lock.lock();
+
+        busy = false;
+        job_done.notify_all();
+    }
+}
+
+void DebugWriter::render(const Job& job) const {
+    vector<int> params;
+    params.push_back(CV_IMWRITE_JPEG_QUALITY);
+    params.push_back(options.jpeg_quality);
+
+    write_matches_image(job.img1, *job.features1,
+                        job.img2, *job.features2,
+                        job.matches, job.inliers, job.filename,
+                        options.scale, params);
+
+    Metrics::instance().add("debug.written");
+}
@@ -0,0 +1,86 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#ifndef DEBUG_WRITER_H
+#define DEBUG_WRITER_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "photogram.h"
+#include "features2d.h"
+#include "image_pairs.h"
+
+// which pairs get a visual debug image
+enum DebugSample {
+    DEBUG_SAMPLE_ALL = 0,       // every Nth pair, verified or not
+    DEBUG_SAMPLE_VERIFIED,      // every Nth verified pair
+    DEBUG_SAMPLE_FAILURES,      // every Nth pair failing verification
+    DEBUG_SAMPLE_BORDERLINE     // every Nth pair close to MIN_INLIERS
+};
+
+struct DebugOptions {
+    DebugOptions()
+        : every(1), sample(DEBUG_SAMPLE_VERIFIED), scale(0.25),
+          max_queue(16), jpeg_quality(80)
+    {};
+
+    // keep one candidate out of every, 0 disables the output
+    int             every;
+    DebugSample     sample;
+
+    // downscale of the rendered images
+    double          scale;
+
+    // pending renders, new ones are dropped when full
+    size_t          max_queue;
+
+    int             jpeg_quality;
+};
+
+// Renders match images on a background thread so the pair loop only
+// pays for a sampling decision and a few reference counted copies.
+class DebugWriter {
+ public:
+    DebugWriter(const DebugOptions& options);
+
+    // waits for the pending renders
+    ~DebugWriter();
+
+    // true if this pair outcome should be rendered
+    bool sample(bool verified, unsigned int inliers_count);
+
+    // hand the pair matches to the writer thread
+    void queue(const ImagePair& pair);
+
+    // wait until the queue is empty
+    void flush();
+
+ private:
+    struct Job {
+        Mat                 img1;
+        Mat                 img2;
+        ImageFeaturesPtr    features1;
+        ImageFeaturesPtr    features2;
+        Matches             matches;
+        vector<char>        inliers;
+        string              filename;
+    };
+
+    void run();
+    void render(const Job& job) const;
+
+    DebugOptions            options;
+    size_t                  candidates;
+
+    std::deque<Job>         jobs;
+    bool                    busy;
+    bool                    done;
+    std::mutex              mutex;
+    std::condition_variable job_ready;
+    std::condition_variable job_done;
+    std::thread             worker;
+};
+
+#endif // !DEBUG_WRITER_H
@@ -0,0 +1,449 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <queue>
+
+#include "external_tracks.h"
+#include "metrics.h"
+
+#define TRACK_TABLE_MAGIC  0x4b545450  // "PTTK"
+
+// (root, feature), sorted by root then feature
+typedef std::pair<uint32_t, uint32_t> TrackRecord;
+
+template <typename T>
+static bool write_file(const std::string& path, const std::vector<T>& items) {
+    std::ofstream os(path.c_str(), std::ios::binary);
+    if (!items.empty()) {
+        os.write((const char*) &items[0], items.size() * sizeof(T));
+    }
+    if (!os) {
+        LOG(ERROR) << "Can't write " << path;
+        return false;
+    }
+    return true;
+}
+
+// items of a file, a buffer at a time
+template <typename T>
+class ChunkReader {
+ public:
+    ChunkReader(const std::string& path, size_t chunk)
+        : is(path.c_str(), std::ios::binary), buffer(chunk), pos(0), size(0)
+    {};
+
+    bool next(T& item) {
+        if (pos == size) {
+            is.read((char*) &buffer[0], buffer.size() * sizeof(T));
+            size = is.gcount() / sizeof(T);
+            pos = 0;
+            if (size == 0) {
+                return false;
+            }
+        }
+        item = buffer[pos++];
+        return true;
+    }
+
+ private:
+    std::ifstream   is;
+    std::vector<T>  buffer;
+    size_t          pos;
+    size_t          size;
+};
+
+static uint32_t find(std::vector<uint32_t>& parent, uint32_t n) {
+    // path halving
+    while (parent[n] != n) {
+        parent[n] = parent[parent[n]];
+        n = parent[n];
+    }
+    return n;
+}
+
+ExternalTracks::~ExternalTracks() {
+    for (const std::string& file : edge_files) {
+        unlink(file.c_str());
+    }
+    if (!scratch.empty()) {
+        rmdir(scratch.c_str());
+    }
+}
+
+bool ExternalTracks::make_scratch() {
+    if (!scratch.empty()) {
+        return true;
+    }
+
+    string tmpl = options.directory + "/tracks.XXXXXX";
+    vector<char> path(tmpl.begin(), tmpl.end());
+    path.push_back('\0');
+    if (!mkdtemp(&path[0])) {
+        LOG(ERROR) << "Can't create a scratch directory in " << options.directory
+                   << ": " << strerror(errno);
+        return false;
+    }
+
+    scratch = &path[0];
+    return true;
+}
+
+void ExternalTracks::add_pair(size_t image1, size_t image2, const Matches& matches,
+                              const vector<char>& inliers) {
+    size_t images = std::max(image1, image2) + 1;
+    if (feature_counts.size() < images) {
+        feature_counts.resize(images, 0);
+    }
+
+    for (size_t i = 0; i < matches.size(); i++) {
+        if (i < inliers.size() && !inliers[i]) {
+            continue;
+        }
+
+        // query features are from the first image, see matches2points()
+        TrackEdge edge;
+        edge.image1 = image1;
+        edge.feature1 = matches[i].queryIdx;
+        edge.image2 = image2;
+        edge.feature2 = matches[i].trainIdx;
+        edges.push_back(edge);
+
+        feature_counts[image1] = std::max(feature_counts[image1], edge.feature1 + 1);
+        feature_counts[image2] = std::max(feature_counts[image2], edge.feature2 + 1);
+    }
+
+    if (edges.size() >= options.chunk_edges) {
+        spill();
+    }
+}
+
+bool ExternalTracks::spill() {
+    if (edges.empty()) {
+        return true;
+    }
+    if (!make_scratch()) {
+        failed = true;
+        return false;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "/edges_%zu.bin", edge_files.size());
+    string file = scratch + name;
+    edge_files.push_back(file);
+
+    if (!write_file(file, edges)) {
+        failed = true;
+        return false;
+    }
+
+    edge_count += edges.size();
+    Metrics::instance().add("tracks.external.spilled_edges", edges.size());
+
+    // release the memory, not just the size
+    std::vector<TrackEdge>().swap(edges);
+    return true;
+}
+
+bool ExternalTracks::build(const std::string& path, size_t *track_count) {
+    if (!spill() || failed) {
+        return false;
+    }
+
+    // dense ids, image by image
+    std::vector<uint64_t> offsets(feature_counts.size() + 1, 0);
+    for (size_t i = 0; i < feature_counts.size(); i++) {
+        offsets[i + 1] = offsets[i] + feature_counts[i];
+    }
+    uint64_t features = offsets.back();
+    if (features >= 0xffffffffull) {
+        LOG(ERROR) << features << " features, track ids are 32 bits";
+        return false;
+    }
+
+    // semi-external union-find, roots are the smallest ids
+    std::vector<uint32_t> parent(features);
+    for (uint32_t n = 0; n < features; n++) {
+        parent[n] = n;
+    }
+
+    for (const std::string& file : edge_files) {
+        ChunkReader<TrackEdge> reader(file, options.chunk_edges);
+        TrackEdge edge;
+        while (reader.next(edge)) {
+            uint32_t a = find(parent, offsets[edge.image1] + edge.feature1);
+            uint32_t b = find(parent, offsets[edge.image2] + edge.feature2);
+            if (a < b) {
+                parent[b] = a;
+            } else if (b < a) {
+                parent[a] = b;
+            }
+        }
+    }
+
+    // parent[n] <= n, one ascending pass points everybody at its root
+    for (uint32_t n = 0; n < features; n++) {
+        parent[n] = parent[parent[n]];
+    }
+
+    std::vector<std::string> runs;
+    bool ok = write_runs(parent, runs);
+
+    // only the runs are needed from now on
+    std::vector<uint32_t>().swap(parent);
+
+    ok = ok && merge_runs(runs, offsets, path, track_count);
+
+    for (const std::string& run : runs) {
+        unlink(run.c_str());
+    }
+    return ok;
+}
+
+bool ExternalTracks::write_runs(const std::vector<uint32_t>& parent,
+                                std::vector<std::string>& runs) {
+    if (!make_scratch()) {
+        return false;
+    }
+
+    // roots are implicit: a track is its root and the features pointing
+    // at it, features alone in their track are skipped
+    std::vector<TrackRecord> run;
+    run.reserve(std::min<size_t>(options.chunk_edges, parent.size()));
+
+    for (uint32_t n = 0; n < parent.size(); n++) {
+        if (parent[n] != n) {
+            run.push_back(TrackRecord(parent[n], n));
+        }
+
+        if (run.size() == options.chunk_edges || (n + 1 == parent.size() && !run.empty())) {
+            std::sort(run.begin(), run.end());
+
+            char name[32];
+            snprintf(name, sizeof(name), "/run_%zu.bin", runs.size());
+            runs.push_back(scratch + name);
+            if (!write_file(runs.back(), run)) {
+                return false;
+            }
+            run.clear();
+        }
+    }
+
+    Metrics::instance().add("tracks.external.runs", runs.size());
+    return true;
+}
+
+bool ExternalTracks::merge_runs(const std::vector<std::string>& runs,
+                                const std::vector<uint64_t>& offsets,
+                                const std::string& path, size_t *track_count) {
+    std::ofstream os(path.c_str(), std::ios::binary);
+    uint32_t header[2] = { TRACK_TABLE_MAGIC, 0 };
+    os.write((const char*) header, sizeof(header));
+
+    // small buffers per run, there can be many of them
+    size_t buffer = std::max<size_t>(options.chunk_edges / (runs.size() + 1), 1024);
+    std::vector<std::unique_ptr<ChunkReader<TrackRecord> > > readers;
+    for (const std::string& run : runs) {
+        readers.push_back(std::unique_ptr<ChunkReader<TrackRecord> >(
+            new ChunkReader<TrackRecord>(run, buffer)));
+    }
+
+    // (record, run), smallest first
+    typedef std::pair<TrackRecord, size_t> Head;
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head> > heads;
+    for (size_t r = 0; r < readers.size(); r++) {
+        TrackRecord record;
+        if (readers[r]->next(record)) {
+            heads.push(Head(record, r));
+        }
+    }
+
+    size_t written = 0, conflicts = 0, short_tracks = 0;
+    std::vector<uint32_t> track;
+
+    // image of a feature id
+    auto image_of = [&offsets](uint32_t id) {
+        return (uint32_t) (std::upper_bound(offsets.begin(), offsets.end(), (uint64_t) id) -
+                           offsets.begin() - 1);
+    };
+
+    // the Filter() rules on a track, its features in id order
+    auto flush = [&]() {
+        if (track.empty()) {
+            return;
+        }
+
+        bool conflict = false;
+        std::vector<uint32_t> pairs;
+        pairs.reserve(2 * track.size());
+        for (size_t i = 0; i < track.size(); i++) {
+            uint32_t image = image_of(track[i]);
+            if (!pairs.empty() && pairs[pairs.size() - 2] == image) {
+                conflict = true;
+                break;
+            }
+            pairs.push_back(image);
+            pairs.push_back(track[i] - offsets[image]);
+        }
+
+        if (conflict) {
+            conflicts++;
+        } else if (track.size() < options.min_length) {
+            short_tracks++;
+        } else {
+            uint32_t length = track.size();
+            os.write((const char*) &length, sizeof(length));
+            os.write((const char*) &pairs[0], pairs.size() * sizeof(uint32_t));
+            written++;
+        }
+        track.clear();
+    };
+
+    while (!heads.empty()) {
+        Head head = heads.top();
+        heads.pop();
+
+        const TrackRecord& record = head.first;
+        if (track.empty() || track[0] != record.first) {
+            flush();
+            track.push_back(record.first);
+        }
+        track.push_back(record.second);
+
+        TrackRecord next;
+        if (readers[head.second]->next(next)) {
+            heads.push(Head(next, head.second));
+        }
+    }
+    flush();
+
+    header[1] = written;
+    os.seekp(0);
+    os.write((const char*) header, sizeof(header));
+
+    if (!os) {
+        LOG(ERROR) << "Can't write the track table " << path;
+        return false;
+    }
+
+    LOG(INFO) << "Tracks: " << written << " written to " << path << ", "
+              << conflicts << " conflicting, " << short_tracks << " too short";
+    Metrics::instance().add("tracks.external.tracks", written);
+    Metrics::instance().add("tracks.external.conflicts", conflicts);
+
+    if (track_count) {
+        *track_count = written;
+    }
+    return true;
+}
+
+//////////////
+/// reader ///
+//////////////
+
+bool TrackTableReader::open(const std::string& path) {
+    is.open(path.c_str(), std::ios::binary);
+
+    uint32_t header[2];
+    is.read((char*) header, sizeof(header));
+    if (!is || header[0] != TRACK_TABLE_MAGIC) {
+        LOG(ERROR) << "Not a track table: " << path;
+        return false;
+    }
+
+    count = header[1];
+    read = 0;
+    return true;
+}
+
+bool TrackTableReader::next(std::map<size_t, int>& track) {
+    track.clear();
+    if (read == count) {
+        return false;
+    }
+
+    uint32_t length;
+    is.read((char*) &length, sizeof(length));
+    std::vector<uint32_t> pairs(2 * length);
+    if (length > 0) {
+        is.read((char*) &pairs[0], pairs.size() * sizeof(uint32_t));
+    }
+    if (!is) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < length; i++) {
+        track[pairs[2 * i]] = pairs[2 * i + 1];
+    }
+    read++;
+    return true;
+}
+
+bool remap_track_table(const std::string& path,
+                       const std::vector<std::vector<int> >& remap,
+                       size_t min_length, size_t *track_count) {
+    TrackTableReader reader;
+    if (!reader.open(path)) {
+        return false;
+    }
+
+    std::string tmp = path + ".tmp";
+    std::ofstream os(tmp.c_str(), std::ios::binary);
+    uint32_t header[2] = { TRACK_TABLE_MAGIC, 0 };
+    os.write((const char*) header, sizeof(header));
+
+    size_t read = 0, written = 0;
+    std::map<size_t, int> track;
+    std::vector<uint32_t> pairs;
+    while (reader.next(track)) {
+        read++;
+
+        pairs.clear();
+        for (auto it = track.begin(); it != track.end(); ++it) {
+            if (it->first < remap.size() && it->second < (int) remap[it->first].size() &&
+                remap[it->first][it->second] >= 0) {
+                pairs.push_back(it->first);
+                pairs.push_back(remap[it->first][it->second]);
+            }
+        }
+
+        uint32_t length = pairs.size() / 2;
+        if (length < min_length) {
+            continue;
+        }
+        os.write((const char*) &length, sizeof(length));
+        os.write((const char*) &pairs[0], pairs.size() * sizeof(uint32_t));
+        written++;
+    }
+
+    header[1] = written;
+    os.seekp(0);
+    os.write((const char*) header, sizeof(header));
+    os.close();
+
+    if (read != reader.track_count() || !os) {
+        LOG(ERROR) << "Can't remap the track table " << path;
+        unlink(tmp.c_str());
+        return false;
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        LOG(ERROR) << "Can't rename " << tmp << ": " << strerror(errno);
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    LOG(INFO) << "Tracks: " << written << " / " << read << " left after the remap";
+    Metrics::instance().add("tracks.external.remapped", written);
+
+    if (track_count) {
+        *track_count = written;
+    }
+    return true;
+}
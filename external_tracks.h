@@ -0,0 +1,146 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Track building for match sets larger than memory.
+//
+// Inlier matches are appended to a buffer of edges, spilled to scratch
+// files every chunk_edges. build() then:
+//  - numbers the features densely, image by image, from the largest
+//    feature index seen per image,
+//  - streams the edge files through a semi-external union-find: the
+//    parent array (4 bytes per feature) is the only per feature state in
+//    memory, roots link to the smaller id so a root is the smallest
+//    feature of its track,
+//  - writes (root, feature) records in sorted runs of chunk_edges, and
+//    merges them: each track comes out contiguous, its features in id
+//    order, so images come in order too,
+//  - drops the tracks shorter than min_length, or seeing an image twice
+//    (the TracksBuilder::Filter() rules) in that streaming pass, and
+//    appends the others to the track table on disk.
+//
+// Memory is the parent array plus a chunk of edges, whatever the number
+// of matches. Feature ids are 32 bits: up to 4G features per project.
+//
+// Track table format: a header (magic, track count), then per track
+// its length and (image, feature) pairs, all uint32.
+//
+// Usage :
+//  ExternalTracks tracks(options);
+//  tracks.add_pair(image1, image2, matches, inliers);  // per verified pair
+//  tracks.build("tracks.bin", &count);
+//  TrackTableReader reader;
+//  reader.open("tracks.bin");
+//  while (reader.next(track)) ...
+
+#ifndef EXTERNAL_TRACKS_H
+#define EXTERNAL_TRACKS_H
+
+#include <stdint.h>
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "photogram.h"
+#include "ingest.h"
+
+struct ExternalTracksOptions {
+    ExternalTracksOptions()
+        : directory("/tmp"), chunk_edges(1 << 22), min_length(2)
+    {};
+
+    // scratch files go to a new directory in there, removed after
+    std::string directory;
+
+    // edges in memory before spilling, also the sort run size
+    size_t      chunk_edges;
+
+    size_t      min_length;
+};
+
+// a match between two features, (image, feature) on both sides
+struct TrackEdge {
+    uint32_t    image1;
+    uint32_t    feature1;
+    uint32_t    image2;
+    uint32_t    feature2;
+};
+
+class ExternalTracks : public PairTracks {
+ public:
+    ExternalTracks(const ExternalTracksOptions& options = ExternalTracksOptions())
+        : options(options), edge_count(0), failed(false)
+    {};
+
+    // removes the scratch files
+    ~ExternalTracks();
+
+    // buffer the inlier matches, spilled to disk every chunk_edges
+    void add_pair(size_t image1, size_t image2, const Matches& matches,
+                  const vector<char>& inliers);
+
+    inline uint64_t get_edge_count() const {
+        return edge_count;
+    }
+
+    // tracks of the edges added so far to the table at path, count of
+    // tracks written. false on I/O error or too many features.
+    bool build(const std::string& path, size_t *track_count = NULL);
+
+ private:
+    bool make_scratch();
+    bool spill();
+
+    // sorted runs of (root, feature), their file names
+    bool write_runs(const std::vector<uint32_t>& parent, std::vector<std::string>& runs);
+
+    // k-way merge of the runs, filters and writes the tracks
+    bool merge_runs(const std::vector<std::string>& runs,
+                    const std::vector<uint64_t>& offsets,
+                    const std::string& path, size_t *track_count);
+
+    ExternalTracksOptions       options;
+    std::string                 scratch;
+
+    std::vector<TrackEdge>      edges;
+    std::vector<std::string>    edge_files;
+    uint64_t                    edge_count;
+
+    // features per image, from the largest index seen
+    std::vector<uint32_t>       feature_counts;
+
+    // a spill failed, build() will too
+    bool                        failed;
+};
+
+// Tracks of a table written by ExternalTracks::build(), one at a time.
+class TrackTableReader {
+ public:
+    TrackTableReader()
+        : count(0), read(0)
+    {};
+
+    bool open(const std::string& path);
+
+    inline size_t track_count() const {
+        return count;
+    }
+
+    // next track, image -> feature. false at the end or on error.
+    bool next(std::map<size_t, int>& track);
+
+ private:
+    std::ifstream   is;
+    size_t          count;
+    size_t          read;
+};
+
+// renumber the features of the table at path after a compaction
+// (compaction.h), remap[image][old] is the new index or -1. Tracks left
+// with less than min_length images are dropped. The table is rewritten
+// next to path, then renamed over it.
+bool remap_track_table(const std::string& path,
+                       const std::vector<std::vector<int> >& remap,
+                       size_t min_length = 2, size_t *track_count = NULL);
+
+#endif // !EXTERNAL_TRACKS_H
@@ -0,0 +1,684 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+
+#include "feature_codec.h"
+#include "image_source.h"
+#include "metrics.h"
+#include "util.h"
+
+#define FEATURE_FILE_MAGIC    0x54464650  // "PFFT"
+#define FEATURE_FILE_VERSION  1
+
+// flags
+#define FEATURE_HAS_RESPONSE  1
+
+// descriptor modes
+enum {
+    DESCRIPTORS_U8 = 0,     // integers in [0, 255], one plane
+    DESCRIPTORS_F16,        // half precision bits, two planes
+    DESCRIPTORS_F32         // float bits, four planes
+};
+
+struct FeatureFileHeader {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    flags;
+    uint32_t    mode;
+    uint64_t    count;
+    uint32_t    block_size;
+    uint32_t    block_count;
+};
+
+////////////
+/// rANS ///
+////////////
+
+#define RANS_PROB_BITS  12
+#define RANS_PROB_SCALE (1 << RANS_PROB_BITS)
+#define RANS_L          (1u << 23)
+
+// how a plane is stored
+enum {
+    PLANE_RAW = 0,
+    PLANE_RANS,
+    PLANE_CONSTANT
+};
+
+// counts scaled to RANS_PROB_SCALE, every symbol seen keeps at least 1
+static void normalize_freqs(const uint32_t counts[256], size_t total, uint32_t freqs[256]) {
+    uint32_t sum = 0;
+    int largest = 0;
+    for (int s = 0; s < 256; s++) {
+        freqs[s] = 0;
+        if (counts[s]) {
+            freqs[s] = std::max<uint64_t>(1, (uint64_t) counts[s] * RANS_PROB_SCALE / total);
+            sum += freqs[s];
+            if (freqs[s] > freqs[largest]) {
+                largest = s;
+            }
+        }
+    }
+
+    // the rounding error goes to the most frequent symbol when it can
+    // take it, else one at a time from the largest ones
+    int error = (int) RANS_PROB_SCALE - (int) sum;
+    if ((int) freqs[largest] + error >= 1) {
+        freqs[largest] += error;
+        return;
+    }
+    while (error < 0) {
+        int s = std::max_element(freqs, freqs + 256) - freqs;
+        freqs[s]--;
+        error++;
+    }
+}
+
+template <typename T>
+static void put(std::string& out, T value) {
+    out.append((const char*) &value, sizeof(value));
+}
+
+// a plane: mode, decoded size, then the raw bytes, the constant, or the
+// table and the rANS stream (two interleaved states)
+static void put_plane(const uint8_t *bytes, size_t n, std::string& out,
+                      std::vector<uint8_t>& scratch) {
+    uint32_t counts[256] = { 0 };
+    for (size_t i = 0; i < n; i++) {
+        counts[bytes[i]]++;
+    }
+
+    int symbols = 0;
+    for (int s = 0; s < 256; s++) {
+        symbols += counts[s] != 0;
+    }
+
+    if (n > 0 && symbols == 1) {
+        out.push_back(PLANE_CONSTANT);
+        put<uint32_t>(out, n);
+        out.push_back(bytes[0]);
+        return;
+    }
+
+    if (n >= 64) {
+        uint32_t freqs[256], cums[257];
+        normalize_freqs(counts, n, freqs);
+        cums[0] = 0;
+        for (int s = 0; s < 256; s++) {
+            cums[s + 1] = cums[s] + freqs[s];
+        }
+
+        // written backwards from the end of the scratch
+        scratch.resize(n + n / 4 + 64);
+        uint8_t *end = &scratch[0] + scratch.size();
+        uint8_t *ptr = end;
+        bool overflow = false;
+        uint32_t state[2] = { RANS_L, RANS_L };
+
+        for (size_t i = n; i-- > 0; ) {
+            uint32_t& x = state[i & 1];
+            uint32_t freq = freqs[bytes[i]];
+            uint32_t x_max = ((RANS_L >> RANS_PROB_BITS) << 8) * freq;
+            while (x >= x_max) {
+                if (ptr == &scratch[0]) {
+                    overflow = true;
+                    break;
+                }
+                *--ptr = (uint8_t) x;
+                x >>= 8;
+            }
+            if (overflow) {
+                break;
+            }
+            x = ((x / freq) << RANS_PROB_BITS) + (x % freq) + cums[bytes[i]];
+        }
+
+        // state 1 then state 0 in front, read back in the other order
+        for (int k = 1; k >= 0 && !overflow; k--) {
+            if (ptr - &scratch[0] < 4) {
+                overflow = true;
+                break;
+            }
+            ptr -= 4;
+            memcpy(ptr, &state[k], 4);
+        }
+
+        // presence bitmap, then 2 bytes per symbol seen
+        size_t coded = end - ptr;
+        size_t table = 32 + 2 * symbols;
+        if (!overflow && table + coded + 4 < n) {
+            out.push_back(PLANE_RANS);
+            put<uint32_t>(out, n);
+
+            uint8_t present[32] = { 0 };
+            for (int s = 0; s < 256; s++) {
+                if (freqs[s]) {
+                    present[s >> 3] |= 1 << (s & 7);
+                }
+            }
+            out.append((const char*) present, 32);
+            for (int s = 0; s < 256; s++) {
+                if (freqs[s]) {
+                    put<uint16_t>(out, freqs[s]);
+                }
+            }
+
+            put<uint32_t>(out, coded);
+            out.append((const char*) ptr, coded);
+            return;
+        }
+    }
+
+    out.push_back(PLANE_RAW);
+    put<uint32_t>(out, n);
+    out.append((const char*) bytes, n);
+}
+
+// reads a plane of n bytes at *cursor, false if corrupted
+static bool get_plane(const uint8_t **cursor, const uint8_t *end, uint8_t *bytes, size_t n) {
+    const uint8_t *p = *cursor;
+    if (end - p < 5) {
+        return false;
+    }
+    uint8_t mode = *p++;
+    uint32_t size;
+    memcpy(&size, p, 4);
+    p += 4;
+    if (size != n) {
+        return false;
+    }
+
+    if (mode == PLANE_RAW) {
+        if ((size_t) (end - p) < n) {
+            return false;
+        }
+        memcpy(bytes, p, n);
+        *cursor = p + n;
+        return true;
+    }
+
+    if (mode == PLANE_CONSTANT) {
+        if (end - p < 1) {
+            return false;
+        }
+        memset(bytes, *p, n);
+        *cursor = p + 1;
+        return true;
+    }
+
+    if (mode != PLANE_RANS || end - p < 32) {
+        return false;
+    }
+
+    const uint8_t *present = p;
+    p += 32;
+    uint16_t freqs[256] = { 0 };
+    uint16_t cums[256] = { 0 };
+    uint8_t symbol_of[RANS_PROB_SCALE];
+    uint32_t cum = 0;
+    for (int s = 0; s < 256; s++) {
+        if (!(present[s >> 3] & (1 << (s & 7)))) {
+            continue;
+        }
+        if (end - p < 2) {
+            return false;
+        }
+        memcpy(&freqs[s], p, 2);
+        p += 2;
+        if (freqs[s] == 0 || cum + freqs[s] > RANS_PROB_SCALE) {
+            return false;
+        }
+        cums[s] = cum;
+        memset(symbol_of + cum, s, freqs[s]);
+        cum += freqs[s];
+    }
+    if (cum != RANS_PROB_SCALE) {
+        return false;
+    }
+
+    uint32_t coded;
+    if (end - p < 4) {
+        return false;
+    }
+    memcpy(&coded, p, 4);
+    p += 4;
+    if ((size_t) (end - p) < coded || coded < 8) {
+        return false;
+    }
+
+    const uint8_t *stream = p;
+    const uint8_t *stream_end = p + coded;
+    uint32_t state[2];
+    memcpy(&state[0], stream, 4);
+    memcpy(&state[1], stream + 4, 4);
+    stream += 8;
+
+    for (size_t i = 0; i < n; i++) {
+        uint32_t& x = state[i & 1];
+        uint32_t slot = x & (RANS_PROB_SCALE - 1);
+        uint8_t s = symbol_of[slot];
+        bytes[i] = s;
+        x = freqs[s] * (x >> RANS_PROB_BITS) + slot - cums[s];
+        while (x < RANS_L) {
+            if (stream == stream_end) {
+                return false;
+            }
+            x = (x << 8) | *stream++;
+        }
+    }
+
+    *cursor = stream_end;
+    return true;
+}
+
+// n values of width bytes, one plane per byte
+static void put_planes(const uint8_t *values, size_t n, size_t width, std::string& out,
+                       std::vector<uint8_t>& plane, std::vector<uint8_t>& scratch) {
+    plane.resize(n);
+    for (size_t b = 0; b < width; b++) {
+        for (size_t i = 0; i < n; i++) {
+            plane[i] = values[i * width + b];
+        }
+        put_plane(plane.empty() ? NULL : &plane[0], n, out, scratch);
+    }
+}
+
+static bool get_planes(const uint8_t **cursor, const uint8_t *end, uint8_t *values,
+                       size_t n, size_t width, std::vector<uint8_t>& plane) {
+    plane.resize(n);
+    for (size_t b = 0; b < width; b++) {
+        if (!get_plane(cursor, end, plane.empty() ? NULL : &plane[0], n)) {
+            return false;
+        }
+        for (size_t i = 0; i < n; i++) {
+            values[i * width + b] = plane[i];
+        }
+    }
+    return true;
+}
+
+static inline uint32_t float_bits(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, 4);
+    return bits;
+}
+
+static inline float bits_float(uint32_t bits) {
+    float f;
+    memcpy(&f, &bits, 4);
+    return f;
+}
+
+// difference of the bits with the previous value, zigzag: sorted
+// positive floats give small numbers
+static void delta_bits(const float *values, size_t n, std::vector<uint32_t>& out) {
+    out.resize(n);
+    uint32_t previous = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t bits = float_bits(values[i]);
+        int32_t delta = (int32_t) (bits - previous);
+        out[i] = ((uint32_t) delta << 1) ^ (uint32_t) (delta >> 31);
+        previous = bits;
+    }
+}
+
+static void undelta_bits(const uint32_t *zigzag, size_t n, float *values) {
+    uint32_t previous = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t delta = (zigzag[i] >> 1) ^ (0u - (zigzag[i] & 1));
+        previous += delta;
+        values[i] = bits_float(previous);
+    }
+}
+
+/////////////////
+/// features  ///
+/////////////////
+
+void sort_features_spatially(ImageFeatures& features) {
+    KeypointSet& keypoints = features.keypoints;
+    size_t n = keypoints.size();
+
+    vector<uint32_t> order(n);
+    for (size_t i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&keypoints](uint32_t a, uint32_t b) {
+            int band_a = (int) keypoints.y[a] / FEATURE_SORT_BAND;
+            int band_b = (int) keypoints.y[b] / FEATURE_SORT_BAND;
+            if (band_a != band_b) {
+                return band_a < band_b;
+            }
+            return keypoints.x[a] < keypoints.x[b];
+        });
+
+    select_features(features, order);
+}
+
+void select_features(ImageFeatures& features, const vector<uint32_t>& order) {
+    KeypointSet& keypoints = features.keypoints;
+    size_t n = order.size();
+
+    KeypointSet selected;
+    selected.reserve(n);
+    for (uint32_t i : order) {
+        selected.push_back(keypoints.x[i], keypoints.y[i], keypoints.scale[i],
+                           keypoints.orientation[i]);
+        if (keypoints.has_response()) {
+            selected.response.push_back(keypoints.response[i]);
+        }
+    }
+    keypoints = selected;
+
+    if (!features.descriptors_f16.empty()) {
+        vector<Half> half(n * SIFT_DIM);
+        for (size_t k = 0; k < n; k++) {
+            memcpy(&half[k * SIFT_DIM], &features.descriptors_f16[order[k] * SIFT_DIM],
+                   SIFT_DIM * sizeof(Half));
+        }
+        features.descriptors_f16.swap(half);
+    }
+
+#ifdef USE_SIFT_GPU
+    if (!features.descriptors.empty()) {
+        vector<float> desc(n * SIFT_DIM);
+        for (size_t k = 0; k < n; k++) {
+            memcpy(&desc[k * SIFT_DIM], &features.descriptors[order[k] * SIFT_DIM],
+                   SIFT_DIM * sizeof(float));
+        }
+        features.descriptors.swap(desc);
+    }
+#else
+    if (!features.descriptors.empty()) {
+        Mat desc(n, features.descriptors.cols, features.descriptors.type());
+        for (size_t k = 0; k < n; k++) {
+            features.descriptors.row(order[k]).copyTo(desc.row(k));
+        }
+        features.descriptors = desc;
+    }
+#endif
+
+    // built on the old indexes
+    features.hnsw.reset();
+    features.hnsw_u8.reset();
+    features.hnsw_f16.reset();
+    features.cascade.reset();
+}
+
+// all integers in [0, 255], bit for bit (no -0)
+static bool fits_u8(const float *desc, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint32_t bits = float_bits(desc[i]);
+        if (desc[i] < 0 || desc[i] > 255 ||
+            float_bits((float) (uint8_t) desc[i]) != bits) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool encode_features(const ImageFeatures& features, const FeatureCodecOptions& options,
+                     std::string& out) {
+    const KeypointSet& keypoints = features.keypoints;
+    size_t n = keypoints.size();
+    size_t block_size = std::max<size_t>(options.block_size, 1);
+
+    // descriptors, one of the three
+    size_t desc_count = 0;
+    vector<float> storage;
+    const float *desc = NULL;
+    const Half *half = NULL;
+    uint32_t mode;
+    if (!features.descriptors_f16.empty()) {
+        half = &features.descriptors_f16[0];
+        desc_count = features.descriptors_f16.size() / SIFT_DIM;
+        mode = DESCRIPTORS_F16;
+    } else {
+        desc = get_descriptors(features, desc_count, storage);
+        mode = fits_u8(desc, desc_count * SIFT_DIM) ? DESCRIPTORS_U8 : DESCRIPTORS_F32;
+    }
+    if (desc_count != n) {
+        LOG(ERROR) << n << " keypoints but " << desc_count << " descriptors";
+        return false;
+    }
+
+    FeatureFileHeader header;
+    header.magic = FEATURE_FILE_MAGIC;
+    header.version = FEATURE_FILE_VERSION;
+    header.flags = keypoints.has_response() ? FEATURE_HAS_RESPONSE : 0;
+    header.mode = mode;
+    header.count = n;
+    header.block_size = block_size;
+    header.block_count = (n + block_size - 1) / block_size;
+
+    out.clear();
+    put(out, header);
+    size_t index_at = out.size();
+    out.resize(out.size() + (header.block_count + 1) * sizeof(uint64_t));
+
+    vector<uint64_t> offsets;
+    vector<uint32_t> words;
+    vector<uint8_t> bytes, plane, scratch;
+    for (size_t first = 0; first < n; first += block_size) {
+        size_t count = std::min(block_size, n - first);
+        offsets.push_back(out.size());
+
+        delta_bits(&keypoints.x[first], count, words);
+        put_planes((const uint8_t*) &words[0], count, 4, out, plane, scratch);
+        delta_bits(&keypoints.y[first], count, words);
+        put_planes((const uint8_t*) &words[0], count, 4, out, plane, scratch);
+        put_planes((const uint8_t*) &keypoints.scale[first], count, 4, out, plane, scratch);
+        put_planes((const uint8_t*) &keypoints.orientation[first], count, 4, out,
+                   plane, scratch);
+        if (keypoints.has_response()) {
+            put_planes((const uint8_t*) &keypoints.response[first], count, 4, out,
+                       plane, scratch);
+        }
+
+        size_t values = count * SIFT_DIM;
+        if (mode == DESCRIPTORS_U8) {
+            bytes.resize(values);
+            for (size_t i = 0; i < values; i++) {
+                bytes[i] = (uint8_t) desc[first * SIFT_DIM + i];
+            }
+            put_plane(&bytes[0], values, out, scratch);
+        } else if (mode == DESCRIPTORS_F16) {
+            put_planes((const uint8_t*) (half + first * SIFT_DIM), values, 2, out,
+                       plane, scratch);
+        } else {
+            put_planes((const uint8_t*) (desc + first * SIFT_DIM), values, 4, out,
+                       plane, scratch);
+        }
+    }
+    offsets.push_back(out.size());
+    memcpy(&out[index_at], &offsets[0], offsets.size() * sizeof(uint64_t));
+
+    Metrics::instance().add("features.file_bytes", out.size());
+    Metrics::instance().add("features.raw_bytes", n * (header.flags ? 20 : 16) +
+                            n * SIFT_DIM * (mode == DESCRIPTORS_F16 ? 2 : 4));
+    return true;
+}
+
+//////////////
+/// reader ///
+//////////////
+
+bool FeatureFileReader::open(const unsigned char *file, size_t length) {
+    data = file;
+    size = length;
+    offsets.clear();
+
+    FeatureFileHeader header;
+    if (size < sizeof(header)) {
+        LOG(ERROR) << "Truncated feature file";
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != FEATURE_FILE_MAGIC || header.version != FEATURE_FILE_VERSION ||
+        header.mode > DESCRIPTORS_F32 || header.block_size == 0 ||
+        header.block_count != (header.count + header.block_size - 1) / header.block_size) {
+        LOG(ERROR) << "Not a feature file";
+        return false;
+    }
+
+    size_t index_size = (header.block_count + 1) * sizeof(uint64_t);
+    if (size - sizeof(header) < index_size) {
+        LOG(ERROR) << "Truncated feature file";
+        return false;
+    }
+    offsets.resize(header.block_count + 1);
+    memcpy(&offsets[0], data + sizeof(header), index_size);
+    for (size_t b = 0; b < header.block_count; b++) {
+        if (offsets[b] > offsets[b + 1] || offsets[b + 1] > size) {
+            LOG(ERROR) << "Truncated feature file";
+            offsets.clear();
+            return false;
+        }
+    }
+
+    count = header.count;
+    block_size = header.block_size;
+    flags = header.flags;
+    mode = header.mode;
+    return true;
+}
+
+void FeatureFileReader::allocate(size_t n, ImageFeatures& features) const {
+    features.keypoints.clear();
+    features.keypoints.resize(n);
+    if (flags & FEATURE_HAS_RESPONSE) {
+        features.keypoints.response.resize(n);
+    }
+
+    features.descriptors_f16.clear();
+#ifdef USE_SIFT_GPU
+    features.descriptors.clear();
+#else
+    features.descriptors.release();
+#endif
+
+    if (mode == DESCRIPTORS_F16) {
+        features.descriptors_f16.resize(n * SIFT_DIM);
+    } else {
+#ifdef USE_SIFT_GPU
+        features.descriptors.resize(n * SIFT_DIM);
+#else
+        features.descriptors.create(n, SIFT_DIM, CV_32F);
+#endif
+    }
+
+    features.hnsw.reset();
+    features.hnsw_u8.reset();
+    features.hnsw_f16.reset();
+    features.cascade.reset();
+}
+
+bool FeatureFileReader::decode_into(size_t b, size_t first, ImageFeatures& features) const {
+    size_t n = std::min(block_size, count - b * block_size);
+    const uint8_t *cursor = data + offsets[b];
+    const uint8_t *end = data + offsets[b + 1];
+    KeypointSet& keypoints = features.keypoints;
+
+    vector<uint32_t> words(n);
+    vector<uint8_t> plane;
+    bool ok = get_planes(&cursor, end, (uint8_t*) &words[0], n, 4, plane);
+    if (ok) {
+        undelta_bits(&words[0], n, &keypoints.x[first]);
+        ok = get_planes(&cursor, end, (uint8_t*) &words[0], n, 4, plane);
+    }
+    if (ok) {
+        undelta_bits(&words[0], n, &keypoints.y[first]);
+        ok = get_planes(&cursor, end, (uint8_t*) &keypoints.scale[first], n, 4, plane) &&
+            get_planes(&cursor, end, (uint8_t*) &keypoints.orientation[first], n, 4, plane);
+    }
+    if (ok && (flags & FEATURE_HAS_RESPONSE)) {
+        ok = get_planes(&cursor, end, (uint8_t*) &keypoints.response[first], n, 4, plane);
+    }
+    if (!ok) {
+        return false;
+    }
+
+    size_t values = n * SIFT_DIM;
+    if (mode == DESCRIPTORS_F16) {
+        return get_planes(&cursor, end, (uint8_t*) &features.descriptors_f16[first * SIFT_DIM],
+                          values, 2, plane);
+    }
+
+#ifdef USE_SIFT_GPU
+    float *desc = &features.descriptors[first * SIFT_DIM];
+#else
+    float *desc = features.descriptors.ptr<float>(first);
+#endif
+    if (mode == DESCRIPTORS_F32) {
+        return get_planes(&cursor, end, (uint8_t*) desc, values, 4, plane);
+    }
+
+    plane.resize(values);
+    if (!get_plane(&cursor, end, &plane[0], values)) {
+        return false;
+    }
+    for (size_t i = 0; i < values; i++) {
+        desc[i] = plane[i];
+    }
+    return true;
+}
+
+bool FeatureFileReader::decode(ImageFeatures& features) const {
+    allocate(count, features);
+
+    // blocks are independent
+    std::atomic<bool> ok(true);
+    parallel_for_index(block_count(), [&](size_t b, int) {
+            if (!decode_into(b, b * block_size, features)) {
+                ok = false;
+            }
+        });
+
+    if (!ok) {
+        LOG(ERROR) << "Corrupted feature file";
+    }
+    return ok;
+}
+
+bool FeatureFileReader::decode_block(size_t b, size_t& first, ImageFeatures& features) const {
+    if (b >= block_count()) {
+        return false;
+    }
+
+    first = b * block_size;
+    allocate(std::min(block_size, count - first), features);
+    if (!decode_into(b, 0, features)) {
+        LOG(ERROR) << "Corrupted feature file block " << b;
+        return false;
+    }
+    return true;
+}
+
+bool write_features_file(const std::string& path, const ImageFeatures& features) {
+    std::string encoded;
+    if (!encode_features(features, FeatureCodecOptions(), encoded)) {
+        return false;
+    }
+
+    std::ofstream os(path.c_str(), std::ios::binary);
+    os.write(encoded.data(), encoded.size());
+    if (!os) {
+        LOG(ERROR) << "Can't write " << path;
+        return false;
+    }
+    return true;
+}
+
+bool read_features_file(const std::string& path, ImageFeatures& features) {
+    MappedFile::ptr file = MappedFile::open(path);
+    if (!file) {
+        return false;
+    }
+
+    FeatureFileReader reader;
+    return reader.open(file->data(), file->size()) && reader.decode(features);
+}
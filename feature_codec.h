@@ -0,0 +1,113 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Lossless binary feature files.
+//
+// Keypoints are cut in blocks of block_size, each block decodes alone
+// (random access through a block index). Inside a block every value is
+// split in byte planes, and each plane is entropy coded on its own with
+// a static rANS coder [1] (12 bit frequencies, raw when that's smaller):
+//  - x and y as the integer difference of their IEEE bits with the
+//    previous keypoint (zigzag), small once keypoints are sorted in
+//    bands of rows, see sort_features_spatially(),
+//  - scale, orientation and response as their IEEE bits,
+//  - descriptors as one uint8 plane when they are all integers in
+//    [0, 255] (OpenCV SIFT), else 2 (half) or 4 (float) planes.
+// Decoding gives back the exact bits of every value, in the same order.
+//
+//  [1] J. Duda, "Asymmetric numeral systems", arXiv:1311.2540, 2013.
+//      F. Giesen, "rANS notes", 2014.
+//
+// File layout, little endian:
+//  header: magic, version, flags, descriptor mode, keypoint count,
+//          block size, block count
+//  index:  block count + 1 uint64 offsets, from the start of the file
+//  blocks: per plane a mode byte, the decoded size and the coded bytes
+//
+// Usage :
+//  std::string file;
+//  encode_features(features, FeatureCodecOptions(), file);
+//  FeatureFileReader reader;
+//  reader.open(data, size);                 // a mapping of the file
+//  reader.decode(features);                 // everything
+//  reader.decode_block(b, first, features); // keypoints first, first + n
+
+#ifndef FEATURE_CODEC_H
+#define FEATURE_CODEC_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "photogram.h"
+#include "features2d.h"
+
+// rows per band of sort_features_spatially()
+#define FEATURE_SORT_BAND 32
+
+struct FeatureCodecOptions {
+    FeatureCodecOptions()
+        : block_size(1024)
+    {};
+
+    // keypoints per block, the unit of random access
+    size_t      block_size;
+};
+
+// reorder keypoints and descriptors by bands of FEATURE_SORT_BAND rows,
+// then x. Before anything indexes the keypoints (matches, ANN indexes).
+void sort_features_spatially(ImageFeatures& features);
+
+// keep the keypoints and descriptors at order, in that order: keypoint
+// k is the old order[k]. Drops the ANN indexes.
+void select_features(ImageFeatures& features, const std::vector<uint32_t>& order);
+
+// the whole file in out
+bool encode_features(const ImageFeatures& features, const FeatureCodecOptions& options,
+                     std::string& out);
+
+// Blocks of a feature file in memory, not copied.
+class FeatureFileReader {
+ public:
+    FeatureFileReader()
+        : data(NULL), size(0), count(0), block_size(0), flags(0), mode(0)
+    {};
+
+    // false if this isn't a feature file, or it's truncated
+    bool open(const unsigned char *data, size_t size);
+
+    inline size_t keypoint_count() const {
+        return count;
+    }
+
+    inline size_t block_count() const {
+        return offsets.empty() ? 0 : offsets.size() - 1;
+    }
+
+    // every block
+    bool decode(ImageFeatures& features) const;
+
+    // keypoints and descriptors of block b, first is its first keypoint
+    bool decode_block(size_t b, size_t& first, ImageFeatures& features) const;
+
+ private:
+    // block b into the arrays of features, from keypoint first
+    bool decode_into(size_t b, size_t first, ImageFeatures& features) const;
+
+    // features sized for n keypoints
+    void allocate(size_t n, ImageFeatures& features) const;
+
+    const unsigned char    *data;
+    size_t                  size;
+    size_t                  count;
+    size_t                  block_size;
+    uint32_t                flags;
+    uint32_t                mode;
+    std::vector<uint64_t>   offsets;
+};
+
+// whole files, read through a mapping (see MappedFile)
+bool write_features_file(const std::string& path, const ImageFeatures& features);
+bool read_features_file(const std::string& path, ImageFeatures& features);
+
+#endif // !FEATURE_CODEC_H
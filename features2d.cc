@@ -1,5 +1,6 @@
 /* Copyright 2014 Matthieu Tourne */
 
+#include <mutex>
 #include <sstream>
 #include <string>
 
@@ -10,81 +11,454 @@
 
 #include "photogram.h"
 #include "features2d.h"
+#include "feature_codec.h"
+#include "metrics.h"
+#include "simd_kernels.h"
 #include "util.h"
 
 #ifdef USE_SIFT_GPU
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <thread>
+
 #include "sift_gpu_wrapper.h"
 #endif
 
 void ImageFeatures::write(FileStorage &fs) const {
-    fs << "{"
-       << "keypoints" << keypoints
-       << "descriptors" << descriptors
-       << "}";
+    fs << "{";
+    keypoints.write(fs, "keypoints");
+
+    if (!descriptors_f16.empty()) {
+        // raw half precision bits
+        fs << "descriptors_f16"
+           << Mat(descriptors_f16.size() / SIFT_DIM, SIFT_DIM, CV_16U,
+                  (void*) &descriptors_f16[0]);
+    } else {
+        fs << "descriptors" << descriptors;
+    }
+
+    fs << "}";
 }
 
 void ImageFeatures::read(const FileNode &node) {
     LOG(DEBUG) << "De-serializing ImageFeatures";
 
-    cv::read(node["keypoints"], keypoints);
+    keypoints.read(node["keypoints"]);
 #ifdef USE_SIFT_GPU
     node["descriptors"] >> descriptors;
 #else
     // descriptor is a Mat
     node["descriptors"] >> descriptors;
 #endif
+
+    if (!node["descriptors_f16"].empty()) {
+        Mat half;
+        node["descriptors_f16"] >> half;
+        assert(half.type() == CV_16U && half.isContinuous());
+        descriptors_f16.assign((const Half*) half.data,
+                               (const Half*) half.data + half.total());
+    }
 }
 
 
 SiftFeatureDetector opencv_sift_detector;
 SiftDescriptorExtractor opencv_sift_extractor;
-FlannBasedMatcher flann_matcher;
-
+Ptr<FlannBasedMatcher> flann_matcher = new FlannBasedMatcher();
 
+MatcherOptions matcher_options;
 
 // for surf, use this
 // SurfFeatureDetector opencv_surf_detector;
 // SurfDescriptorExtractor opencv_surf_extractor;
 
+#ifdef USE_SIFT_GPU
+// SiftGPU's OpenGL context belongs to the thread that created it, and the
+// wrapper keeps one image buffer: every SiftGPU call runs on this one
+// thread, in order, whichever thread extracts or matches.
+class SiftGpuThread {
+ public:
+    static SiftGpuThread& instance() {
+        static SiftGpuThread gpu_thread;
+        return gpu_thread;
+    }
+
+    // run job on the SiftGPU thread, returns when it's done
+    void run(const std::function<void(SiftGPUWrapper*)>& job) {
+        std::packaged_task<void()> task([&job]() {
+                job(SiftGPUWrapper::getInstance());
+            });
+        std::future<void> done = task.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(task));
+        }
+        cond.notify_one();
+        done.get();
+    }
+
+ private:
+    SiftGpuThread()
+        : stopping(false), thread(&SiftGpuThread::loop, this)
+    {};
+
+    ~SiftGpuThread() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cond.notify_one();
+        thread.join();
+    }
+
+    void loop() {
+        for (;;) {
+            std::packaged_task<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                if (jobs.empty()) {
+                    break;
+                }
+                task = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            task();
+        }
+        SiftGPUWrapper::destroyInstance();
+    }
+
+    std::mutex                              mutex;
+    std::condition_variable                 cond;
+    std::deque<std::packaged_task<void()> > jobs;
+    bool                                    stopping;
+    std::thread                             thread;
+};
+#endif
+
 int get_features(Mat img_gray, ImageFeatures &features) {
 
 #ifdef USE_SIFT_GPU
     LOG(DEBUG) << "using SIFT gpu";
 
-    SiftGPUWrapper* siftgpu = SiftGPUWrapper::getInstance();
-    siftgpu->detect(img_gray, features.keypoints, features.descriptors);
+    SiftGpuThread::instance().run([&](SiftGPUWrapper* siftgpu) {
+            siftgpu->detect(img_gray, features.keypoints, features.descriptors);
+        });
 
     LOG(DEBUG) << "feature descriptors, count: " << features.descriptors.size();
 
 #else
     LOG(DEBUG) << "using opencv SIFT";
 
-    opencv_sift_detector.detect(img_gray, features.keypoints);
-    opencv_sift_extractor.compute(img_gray, features.keypoints, features.descriptors);
+    // the extractor needs the octaves of the keypoints, dropped after.
+    // Responses stay, they rank the keypoints kept by a compaction
+    Keypoints keypoints;
+    opencv_sift_detector.detect(img_gray, keypoints);
+    opencv_sift_extractor.compute(img_gray, keypoints, features.descriptors);
+    features.keypoints.assign(keypoints, true);
 
     LOG(DEBUG) << "Found " << features.keypoints.size() << " features";
 #endif
 
+    // neighbours next to each other, for the feature files. Keypoints
+    // keep their order in memory and on disk
+    if (!matcher_options.features_dir.empty()) {
+        sort_features_spatially(features);
+    }
+
+    if (matcher_options.descriptors_f16) {
+        compact_descriptors_f16(features);
+    }
+
+    size_t count = features.keypoints.size();
+    Metrics::instance().add("features.count", count);
+    Metrics::instance().add("features.descriptor_bytes", count * SIFT_DIM *
+                            (features.descriptors_f16.empty() ? sizeof(float) : sizeof(Half)));
+
     return 0;
 }
 
+// same hyperplanes for every image
+static CascadeHasher cascade_hasher(SIFT_DIM);
+static std::once_flag cascade_hasher_once;
+
+#ifdef USE_SIFT_GPU
+// SiftGPU descriptors are normalized
+#define DESCRIPTOR_U8_SCALE 512
+#else
+#define DESCRIPTOR_U8_SCALE 1
+#endif
+
+void set_matcher_options(const MatcherOptions& options) {
+    matcher_options = options;
+    if (options.descriptors_f16 && (options.type != MATCHER_HNSW || options.hnsw_u8)) {
+        LOG(WARNING) << "Half precision descriptors need the HNSW float matcher, ignored";
+        matcher_options.descriptors_f16 = false;
+    }
+    flann_matcher = new FlannBasedMatcher(
+        new flann::KDTreeIndexParams(options.flann_trees),
+        new flann::SearchParams(options.flann_checks));
+}
+
+const MatcherOptions& get_matcher_options() {
+    return matcher_options;
+}
+
+const float* get_descriptors(const ImageFeatures& features, size_t& count,
+                             vector<float>& storage) {
+    if (!features.descriptors_f16.empty()) {
+        count = features.descriptors_f16.size() / SIFT_DIM;
+        storage.resize(count * SIFT_DIM);
+        simd_kernels().f16_to_f32(&features.descriptors_f16[0], &storage[0],
+                                  storage.size());
+        return &storage[0];
+    }
+
+#ifdef USE_SIFT_GPU
+    count = features.descriptors.size() / SIFT_DIM;
+    return count ? &features.descriptors[0] : NULL;
+#else
+    assert(features.descriptors.empty() ||
+           (features.descriptors.type() == CV_32F &&
+            features.descriptors.isContinuous()));
+    count = features.descriptors.rows;
+    return count ? features.descriptors.ptr<float>() : NULL;
+#endif
+}
+
+const Half* get_descriptors_f16(const ImageFeatures& features, size_t& count,
+                                vector<Half>& storage) {
+    if (!features.descriptors_f16.empty()) {
+        count = features.descriptors_f16.size() / SIFT_DIM;
+        return &features.descriptors_f16[0];
+    }
+
+    vector<float> unused;
+    const float *desc = get_descriptors(features, count, unused);
+    if (!desc) {
+        return NULL;
+    }
+
+    storage.resize(count * SIFT_DIM);
+    simd_kernels().f32_to_f16(desc, &storage[0], storage.size());
+    return &storage[0];
+}
+
+void compact_descriptors_f16(ImageFeatures& features) {
+    if (!features.descriptors_f16.empty()) {
+        return;
+    }
+
+    size_t count;
+    vector<Half> half;
+    if (!get_descriptors_f16(features, count, half)) {
+        return;
+    }
+
+    features.descriptors_f16.swap(half);
+#ifdef USE_SIFT_GPU
+    vector<float>().swap(features.descriptors);
+#else
+    features.descriptors.release();
+#endif
+}
+
+static void descriptors_to_u8(const float *desc, size_t n, vector<uint8_t>& out) {
+    out.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        out[i] = saturate_cast<uchar>(desc[i] * DESCRIPTOR_U8_SCALE);
+    }
+}
+
+template <typename T>
+static typename HnswIndex<T>::ptr new_index(const T *desc, size_t count) {
+    LOG(DEBUG) << "Building HNSW index, descriptors: " << count;
+
+    typename HnswIndex<T>::ptr index(
+        new HnswIndex<T>(SIFT_DIM, matcher_options.hnsw_m,
+                         matcher_options.hnsw_ef_construction));
+    index->build(desc, count, matcher_options.threads);
+
+    return index;
+}
+
+// 1-NN of each query descriptor in the train index
+template <typename T>
+static void match_hnsw(const HnswIndex<T>& index, const T *query, size_t count,
+                       Matches &matches) {
+    int threads = matcher_options.threads > 0 ?
+        matcher_options.threads : default_thread_count();
+    vector<HnswVisited> visited(threads);
+
+    matches.assign(count, DMatch());
+    vector<char> valid(count, 0);
+
+    parallel_for_index(count, [&](size_t i, int worker) {
+            vector<typename HnswIndex<T>::Neighbor> neighbors;
+            index.search(query + i * SIFT_DIM, 1, matcher_options.hnsw_ef,
+                         neighbors, visited[worker]);
+            if (!neighbors.empty()) {
+                matches[i] = DMatch(i, neighbors[0].second, sqrt(neighbors[0].first));
+                valid[i] = 1;
+            }
+        }, threads);
+
+    // drop the queries without neighbor (empty index)
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (valid[i]) {
+            matches[kept++] = matches[i];
+        }
+    }
+    matches.resize(kept);
+}
+
+static void match_features_hnsw(ImageFeatures &features1,
+                                ImageFeatures &features2, Matches &matches) {
+    size_t count1, count2;
+    matches.clear();
+
+    if (matcher_options.descriptors_f16 && !matcher_options.hnsw_u8) {
+        // half precision index and queries, converted on the fly
+        // by the distance kernel
+        vector<Half> storage1, storage2;
+        const Half *desc1 = get_descriptors_f16(features1, count1, storage1);
+        const Half *desc2 = get_descriptors_f16(features2, count2, storage2);
+        if (!desc1 || !desc2) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(features2.index_mutex.mutex);
+            if (!features2.hnsw_f16) {
+                features2.hnsw_f16 = new_index<Half>(desc2, count2);
+            }
+        }
+
+        match_hnsw(*features2.hnsw_f16, desc1, count1, matches);
+        return;
+    }
+
+    vector<float> storage1, storage2;
+    const float *desc1 = get_descriptors(features1, count1, storage1);
+    const float *desc2 = get_descriptors(features2, count2, storage2);
+    if (!desc1 || !desc2) {
+        return;
+    }
+
+    {
+        // the train index is built once, by the first pair using the image
+        std::lock_guard<std::mutex> lock(features2.index_mutex.mutex);
+        if (matcher_options.hnsw_u8 && !features2.hnsw_u8) {
+            vector<uint8_t> train;
+            descriptors_to_u8(desc2, count2 * SIFT_DIM, train);
+            features2.hnsw_u8 = new_index<uint8_t>(&train[0], count2);
+        } else if (!matcher_options.hnsw_u8 && !features2.hnsw) {
+            features2.hnsw = new_index<float>(desc2, count2);
+        }
+    }
+
+    if (matcher_options.hnsw_u8) {
+        vector<uint8_t> query;
+        descriptors_to_u8(desc1, count1 * SIFT_DIM, query);
+        match_hnsw(*features2.hnsw_u8, &query[0], count1, matches);
+    } else {
+        match_hnsw(*features2.hnsw, desc1, count1, matches);
+    }
+}
+
+static void match_features_cascade(ImageFeatures &features1,
+                                   ImageFeatures &features2, Matches &matches) {
+    size_t count1, count2;
+    vector<float> storage1, storage2;
+    const float *desc1 = get_descriptors(features1, count1, storage1);
+    const float *desc2 = get_descriptors(features2, count2, storage2);
+
+    matches.clear();
+    if (!desc1 || !desc2) {
+        return;
+    }
+
+    // hashes are computed once per image, centered on the descriptors
+    // of the first image hashed
+    std::call_once(cascade_hasher_once, [&]() {
+            cascade_hasher.init(desc1, count1);
+        });
+    {
+        std::lock_guard<std::mutex> lock(features1.index_mutex.mutex);
+        if (!features1.cascade) {
+            features1.cascade = cascade_hasher.hash(desc1, count1);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(features2.index_mutex.mutex);
+        if (!features2.cascade) {
+            features2.cascade = cascade_hasher.hash(desc2, count2);
+        }
+    }
+
+    cascade_hasher.match(*features1.cascade, desc1, *features2.cascade, desc2,
+                         matcher_options.cascade_candidates, matches,
+                         matcher_options.threads);
+}
+
 int match_features(ImageFeatures &features1,
                    ImageFeatures &features2, Matches &matches) {
 
+    if (matcher_options.type == MATCHER_CASCADE) {
+        LOG(DEBUG) << "Using a cascade hashing matcher";
+
+        match_features_cascade(features1, features2, matches);
+
+        LOG(DEBUG) << "Matches: " << matches.size();
+        return 0;
+    }
+
+    if (matcher_options.type == MATCHER_HNSW) {
+        LOG(DEBUG) << "Using a HNSW graph matcher";
+
+        match_features_hnsw(features1, features2, matches);
+
+        LOG(DEBUG) << "Matches: " << matches.size();
+        return 0;
+    }
+
 #ifdef USE_SIFT_GPU
     LOG(DEBUG) << "Using GPU bruteforce matcher";
 
-    SiftGPUWrapper* siftgpu = SiftGPUWrapper::getInstance();
+    // half precision descriptors are expanded for the matcher
+    size_t count1, count2;
+    vector<float> storage1, storage2;
+    get_descriptors(features1, count1, storage1);
+    get_descriptors(features2, count2, storage2);
+
     // each descriptor is 128 element with SIFT
     // num is the number of descriptors ..
-    siftgpu->match(features1.descriptors, features1.descriptors.size() / 128,
-        features2.descriptors, features2.descriptors.size() / 128,
-        &matches);
+    SiftGpuThread::instance().run([&](SiftGPUWrapper* siftgpu) {
+            siftgpu->match(storage1.empty() ? features1.descriptors : storage1, count1,
+                           storage2.empty() ? features2.descriptors : storage2, count2,
+                           &matches);
+        });
 
 #else
     LOG(DEBUG) << "Using a FLANN based matcher";
 
-    flann_matcher.match(features1.descriptors, features2.descriptors, matches);
+    // match() trains the matcher: one per call, pairs are matched
+    // concurrently
+    Ptr<DescriptorMatcher> matcher = flann_matcher->clone(true);
+
+    if (features1.descriptors_f16.empty() && features2.descriptors_f16.empty()) {
+        matcher->match(features1.descriptors, features2.descriptors, matches);
+    } else {
+        // half precision descriptors are expanded for the matcher
+        size_t count1, count2;
+        vector<float> storage1, storage2;
+        const float *desc1 = get_descriptors(features1, count1, storage1);
+        const float *desc2 = get_descriptors(features2, count2, storage2);
+        matcher->match(Mat(count1, SIFT_DIM, CV_32F, (void*) desc1),
+                       Mat(count2, SIFT_DIM, CV_32F, (void*) desc2), matches);
+    }
 #endif
 
     LOG(DEBUG) << "Matches: " << matches.size();
@@ -118,15 +492,18 @@ void get_good_matches(Matches &matches, Matches &good_matches) {
 void matches2points(const Matches& matches,
                     ImageFeatures& features1, ImageFeatures& features2,
                     vector<Point2f>& pts1, vector<Point2f>& pts2) {
-    pts1.clear();
-    pts2.clear();
-    pts1.reserve(matches.size());
-    pts2.reserve(matches.size());
-
+    pts1.resize(matches.size());
+    pts2.resize(matches.size());
+
+    // gathers from the packed positions
+    const float *x1 = features1.keypoints.x.data();
+    const float *y1 = features1.keypoints.y.data();
+    const float *x2 = features2.keypoints.x.data();
+    const float *y2 = features2.keypoints.y.data();
     for (size_t i = 0; i < matches.size(); i++) {
         const DMatch& match = matches[i];
-        pts1.push_back(features1.keypoints[match.queryIdx].pt);
-        pts2.push_back(features2.keypoints[match.trainIdx].pt);
+        pts1[i] = Point2f(x1[match.queryIdx], y1[match.queryIdx]);
+        pts2[i] = Point2f(x2[match.trainIdx], y2[match.trainIdx]);
     }
 
     LOG(DEBUG) << "points1: " << pts1.size() << ", points2: " << pts2.size();
@@ -158,13 +535,41 @@ void write_matches_image(const Mat img1, const ImageFeatures &features1,
                          const Mat img2, const ImageFeatures &features2,
                          const Matches &matches,
                          const vector<char> &keypointMask,
-                         const string output) {
+                         const string output,
+                         double scale,
+                         const vector<int> &params) {
     Mat img_matches;
-    drawMatches(img1, features1.keypoints,
-                img2, features2.keypoints,
-                matches, img_matches, Scalar::all(-1), Scalar::all(-1),
-                keypointMask, DrawMatchesFlags::NOT_DRAW_SINGLE_POINTS);
+
+    Keypoints keypoints1, keypoints2;
+    features1.keypoints.to_keypoints(keypoints1);
+    features2.keypoints.to_keypoints(keypoints2);
+
+    if (scale != 1.0) {
+        // render on downscaled images, keypoints follow
+        Mat small1, small2;
+        resize(img1, small1, Size(), scale, scale, INTER_AREA);
+        resize(img2, small2, Size(), scale, scale, INTER_AREA);
+
+        for (KeyPoint &kp : keypoints1) {
+            kp.pt *= scale;
+            kp.size *= scale;
+        }
+        for (KeyPoint &kp : keypoints2) {
+            kp.pt *= scale;
+            kp.size *= scale;
+        }
+
+        drawMatches(small1, keypoints1,
+                    small2, keypoints2,
+                    matches, img_matches, Scalar::all(-1), Scalar::all(-1),
+                    keypointMask, DrawMatchesFlags::NOT_DRAW_SINGLE_POINTS);
+    } else {
+        drawMatches(img1, keypoints1,
+                    img2, keypoints2,
+                    matches, img_matches, Scalar::all(-1), Scalar::all(-1),
+                    keypointMask, DrawMatchesFlags::NOT_DRAW_SINGLE_POINTS);
+    }
 
     LOG(DEBUG) << "Writing image: " << output;
-    imwrite(output.c_str(), img_matches);
+    imwrite(output.c_str(), img_matches, params);
 }
@@ -4,16 +4,81 @@
 #define FEATURES2D_H
 
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <opencv2/features2d/features2d.hpp>
 
 #include "photogram.h"
+#include "cascade_hash.h"
+#include "hnsw.hpp"
+#include "keypoints.h"
 
-typedef std::vector<KeyPoint>   Keypoints;
 typedef std::vector<DMatch>     Matches;
 
+// SIFT descriptor length
+#define SIFT_DIM 128
+
+enum MatcherType {
+    MATCHER_FLANN = 0,  // OpenCV FlannBasedMatcher (or SiftGPU)
+    MATCHER_HNSW,       // hnsw.hpp graph index
+    MATCHER_CASCADE     // cascade_hash.h
+};
+
+struct MatcherOptions {
+    MatcherOptions()
+        : type(MATCHER_FLANN), flann_trees(4), flann_checks(32),
+          hnsw_m(16), hnsw_ef_construction(200),
+          hnsw_ef(64), hnsw_u8(false), cascade_candidates(10),
+          descriptors_f16(false), features_dir(), threads(0)
+    {};
+
+    MatcherType     type;
+
+    // randomized kd-trees and leaves checked per query, same defaults
+    // as FlannBasedMatcher
+    int             flann_trees;
+    int             flann_checks;
+
+    // see hnsw.hpp
+    int             hnsw_m;
+    int             hnsw_ef_construction;
+    int             hnsw_ef;
+
+    // index descriptors quantized to uint8, 4x smaller
+    bool            hnsw_u8;
+
+    // descriptors compared in full per query, see cascade_hash.h
+    int             cascade_candidates;
+
+    // keep descriptors and the HNSW indexes in half precision, 2x
+    // smaller at a small recall cost, see bench_matchers. HNSW float
+    // indexes only: its distance kernel reads half precision, the other
+    // matchers would expand the descriptors for every pair
+    bool            descriptors_f16;
+
+    // <name>.feat files (feature_codec.h): images read their features
+    // there instead of extracting them when the file exists, and
+    // extraction sorts keypoints spatially for the files to come
+    std::string     features_dir;
+
+    // <= 0 for all cores
+    int             threads;
+};
+
+// a mutex copied as a new one, ImageFeatures stay copyable
+struct IndexMutex {
+    IndexMutex() {};
+    IndexMutex(const IndexMutex&) {};
+
+    IndexMutex& operator=(const IndexMutex&) {
+        return *this;
+    }
+
+    std::mutex  mutex;
+};
+
 struct ImageFeatures {
-    Keypoints           keypoints;
+    KeypointSet         keypoints;
 
 #ifdef USE_SIFT_GPU
     std::vector<float>  descriptors;
@@ -21,6 +86,22 @@ struct ImageFeatures {
     Mat                 descriptors;
 #endif
 
+    // half precision descriptors, replace the float ones when
+    // MatcherOptions::descriptors_f16 is set
+    std::vector<Half>   descriptors_f16;
+
+    // ANN indexes of the descriptors, built on first match
+    HnswIndex<float>::ptr   hnsw;
+    HnswIndex<uint8_t>::ptr hnsw_u8;
+    HnswIndex<Half>::ptr    hnsw_f16;
+
+    // cascade hashing codes and tables, computed on first match
+    CascadeHashes::ptr      cascade;
+
+    // held while the first match of the image builds its indexes, pairs
+    // of other images don't wait
+    IndexMutex              index_mutex;
+
     // serialization
     void write(FileStorage &fs) const;
 
@@ -46,6 +127,24 @@ inline void read(const FileNode& node, ImageFeatures& x,
 }
 
 int get_features(const Mat img_gray, ImageFeatures& features);
+
+// matcher used by match_features() for the rest of the run
+void set_matcher_options(const MatcherOptions& options);
+const MatcherOptions& get_matcher_options();
+
+// row major float descriptors and their count, half precision
+// descriptors are converted into storage
+const float* get_descriptors(const ImageFeatures& features, size_t& count,
+                             std::vector<float>& storage);
+
+// row major half precision descriptors and their count, float
+// descriptors are converted into storage
+const Half* get_descriptors_f16(const ImageFeatures& features, size_t& count,
+                                std::vector<Half>& storage);
+
+// convert the descriptors to half precision, drops the float ones
+void compact_descriptors_f16(ImageFeatures& features);
+
 int match_features(ImageFeatures &features1,
                    ImageFeatures &features2, Matches& match);
 void matches2points(const Matches& matches,
@@ -59,6 +158,8 @@ void write_matches_image(const Mat img1, const ImageFeatures &features1,
                          const Mat img2, const ImageFeatures &features2,
                          const Matches &matches,
                          const vector<char> &keypointMask = vector<char>(),
-                         const string output = "matches.jpg");
+                         const string output = "matches.jpg",
+                         double scale = 1.0,
+                         const vector<int> &params = vector<int>());
 
 #endif // !FEATURES2D_H
@@ -0,0 +1,222 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <algorithm>
+#include <map>
+#include <utility>
+
+#include "global_matcher.h"
+#include "metrics.h"
+#include "util.h"
+
+bool GlobalMatcher::build(const vector<ImageFeaturesPtr>& images) {
+    features = images;
+    offsets.assign(1, 0);
+    shards.clear();
+
+    for (size_t i = 0; i < features.size(); i++) {
+        size_t count = 0;
+        vector<float> storage;
+        const float *desc = features[i] ?
+            get_descriptors(*features[i], count, storage) : NULL;
+
+        // whole images per shard
+        if (shards.empty() ||
+            (shards.back().descriptors.rows > 0 &&
+             shards.back().descriptors.rows + count > options.shard_size)) {
+            Shard shard;
+            shard.image = i;
+            shard.offset = offsets.back();
+            shards.push_back(shard);
+        }
+        if (count) {
+            shards.back().descriptors.push_back(
+                Mat(count, SIFT_DIM, CV_32F, (void*) desc));
+        }
+        offsets.push_back(offsets.back() + count);
+    }
+
+    // drop a trailing shard of empty images
+    if (!shards.empty() && shards.back().descriptors.empty()) {
+        shards.pop_back();
+    }
+
+    if (shards.empty()) {
+        LOG(ERROR) << "No descriptor to index";
+        return false;
+    }
+
+    parallel_for_index(shards.size(), [&](size_t i, int) {
+            Shard& shard = shards[i];
+            shard.index.reset(new cv::flann::Index(
+                shard.descriptors, cv::flann::KDTreeIndexParams(options.trees)));
+        }, options.threads);
+
+    LOG(INFO) << "Global index: " << size() << " descriptors of "
+              << features.size() << " images, " << shards.size() << " shards";
+    Metrics::instance().add("global.descriptors", size());
+    Metrics::instance().add("global.shards", shards.size());
+
+    return true;
+}
+
+void GlobalMatcher::locate(size_t id, uint32_t& image, uint32_t& keypoint) const {
+    // offsets is sorted, empty images share their offset with the next
+    vector<size_t>::const_iterator it =
+        std::upper_bound(offsets.begin(), offsets.end(), id);
+    image = it - offsets.begin() - 1;
+    keypoint = id - offsets[image];
+}
+
+static bool compare_matches(const DMatch& a, const DMatch& b) {
+    return a.queryIdx < b.queryIdx ||
+        (a.queryIdx == b.queryIdx && a.trainIdx < b.trainIdx);
+}
+
+static bool same_match(const DMatch& a, const DMatch& b) {
+    return a.queryIdx == b.queryIdx && a.trainIdx == b.trainIdx;
+}
+
+static bool compare_votes(const GlobalPair& a, const GlobalPair& b) {
+    return a.votes > b.votes;
+}
+
+void GlobalMatcher::match(vector<GlobalPair>& pairs) const {
+    pairs.clear();
+
+    // sparse vote matrix, one row per query image: matches to each
+    // other image
+    typedef std::map<uint32_t, Matches> VoteRow;
+    vector<VoteRow> rows(features.size());
+
+    float ratio_sqr = options.ratio * options.ratio;
+
+    parallel_for_index(features.size(), [&](size_t a, int) {
+            size_t count = 0;
+            vector<float> storage;
+            const float *desc = features[a] ?
+                get_descriptors(*features[a], count, storage) : NULL;
+            if (!count) {
+                return;
+            }
+
+            Mat queries(count, SIFT_DIM, CV_32F, (void*) desc);
+
+            // neighbors of every query over all the shards,
+            // squared distances
+            vector<vector<std::pair<float, size_t> > > neighbors(count);
+            for (const Shard& shard : shards) {
+                int knn = std::min(options.knn, shard.descriptors.rows);
+                Mat indices, dists;
+                shard.index->knnSearch(queries, indices, dists, knn,
+                                       cv::flann::SearchParams(options.checks));
+
+                for (size_t q = 0; q < count; q++) {
+                    const int *idx = indices.ptr<int>(q);
+                    const float *dist = dists.ptr<float>(q);
+                    for (int k = 0; k < knn; k++) {
+                        if (idx[k] >= 0) {
+                            neighbors[q].push_back(
+                                std::make_pair(dist[k], shard.offset + idx[k]));
+                        }
+                    }
+                }
+            }
+
+            VoteRow& row = rows[a];
+            vector<uint32_t> seen;
+            for (size_t q = 0; q < count; q++) {
+                vector<std::pair<float, size_t> >& n = neighbors[q];
+                if (shards.size() > 1) {
+                    size_t knn = std::min(n.size(), (size_t) options.knn);
+                    std::partial_sort(n.begin(), n.begin() + knn, n.end());
+                    n.resize(knn);
+                }
+
+                if (n.empty()) {
+                    continue;
+                }
+
+                // one vote per image, its nearest neighbor, if much closer
+                // than the farthest of the knn: the density of unrelated
+                // descriptors around the query
+                float background = ratio_sqr * n.back().first;
+                seen.clear();
+                for (size_t k = 0; k < n.size() && n[k].first < background; k++) {
+                    uint32_t image, keypoint;
+                    locate(n[k].second, image, keypoint);
+                    if (image == a ||
+                        std::find(seen.begin(), seen.end(), image) != seen.end()) {
+                        continue;
+                    }
+                    seen.push_back(image);
+
+                    row[image].push_back(DMatch(q, keypoint, sqrt(n[k].first)));
+                }
+            }
+        }, options.threads);
+
+    // symmetric pairs, a -> b and flipped b -> a matches
+    for (size_t a = 0; a < rows.size(); a++) {
+        for (VoteRow::iterator it = rows[a].begin(); it != rows[a].end(); ++it) {
+            uint32_t b = it->first;
+            VoteRow::iterator reverse = rows[b].find(a);
+            if (b < a && reverse != rows[b].end()) {
+                // already merged from row b
+                continue;
+            }
+
+            GlobalPair pair;
+            pair.image1 = std::min<uint32_t>(a, b);
+            pair.image2 = std::max<uint32_t>(a, b);
+
+            if (a < b) {
+                pair.matches = it->second;
+                if (reverse != rows[b].end()) {
+                    for (const DMatch& m : reverse->second) {
+                        pair.matches.push_back(DMatch(m.trainIdx, m.queryIdx, m.distance));
+                    }
+                }
+            } else {
+                for (const DMatch& m : it->second) {
+                    pair.matches.push_back(DMatch(m.trainIdx, m.queryIdx, m.distance));
+                }
+            }
+
+            // mutual nearest neighbors were found from both sides
+            std::sort(pair.matches.begin(), pair.matches.end(), compare_matches);
+            pair.matches.erase(std::unique(pair.matches.begin(), pair.matches.end(),
+                                           same_match),
+                               pair.matches.end());
+
+            pair.votes = pair.matches.size();
+            if (pair.votes >= (uint32_t) options.min_votes) {
+                pairs.push_back(pair);
+            }
+        }
+    }
+
+    std::stable_sort(pairs.begin(), pairs.end(), compare_votes);
+
+    // keep a pair if it is one of the best of either image
+    if (options.pairs_per_image > 0) {
+        vector<int> kept(features.size(), 0);
+        size_t out = 0;
+        for (size_t i = 0; i < pairs.size(); i++) {
+            GlobalPair& pair = pairs[i];
+            if (kept[pair.image1] >= options.pairs_per_image &&
+                kept[pair.image2] >= options.pairs_per_image) {
+                continue;
+            }
+            kept[pair.image1]++;
+            kept[pair.image2]++;
+            if (out != i) {
+                pairs[out] = pair;
+            }
+            out++;
+        }
+        pairs.resize(out);
+    }
+
+    LOG(INFO) << "Global matching: " << pairs.size() << " candidate pairs";
+    Metrics::instance().add("global.candidate_pairs", pairs.size());
+}
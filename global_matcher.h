@@ -0,0 +1,123 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Project wide descriptor matching, for candidate pair discovery.
+//
+// Instead of matching every pair of images, the descriptors of all the
+// images go in one kd-forest (FLANN randomized kd-trees) and each
+// descriptor is queried once against it: the images its nearest
+// neighbors come from vote for a pair, and the neighbors themselves are
+// the putative matches of that pair. The O(n^2) pair loop becomes
+// O(N log N) for N descriptors in the project, only the pairs with
+// enough votes go through geometric verification.
+//
+// The index is split in shards of at most shard_size descriptors
+// (whole images), each query visits all the shards and keeps the knn
+// best neighbors overall.
+//
+// Usage :
+//  GlobalMatcher matcher(options);
+//  matcher.build(features);            // one ImageFeaturesPtr per image
+//  vector<GlobalPair> pairs;
+//  matcher.match(pairs);               // sorted by decreasing votes
+
+#ifndef GLOBAL_MATCHER_H
+#define GLOBAL_MATCHER_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include <opencv2/flann/flann.hpp>
+
+#include "photogram.h"
+#include "features2d.h"
+
+struct GlobalMatcherOptions {
+    GlobalMatcherOptions()
+        : trees(4), checks(64), knn(8), ratio(0.8),
+          shard_size(4000000), min_votes(50),
+          pairs_per_image(20), threads(0)
+    {};
+
+    // randomized kd-trees per shard, leaves checked per query
+    int     trees;
+    int     checks;
+
+    // neighbors of each descriptor, over all the shards
+    int     knn;
+
+    // a neighbor votes if closer than ratio times the farthest of the
+    // knn, ratio test against unrelated descriptors
+    float   ratio;
+
+    // descriptors per shard
+    size_t  shard_size;
+
+    // matches needed for a candidate pair
+    int     min_votes;
+
+    // best pairs kept per image, 0 to keep them all
+    int     pairs_per_image;
+
+    int     threads;
+};
+
+// candidate pair, queryIdx are keypoints of image1, trainIdx of image2
+struct GlobalPair {
+    GlobalPair()
+        : image1(0), image2(0), votes(0)
+    {};
+
+    uint32_t    image1;
+    uint32_t    image2;
+    uint32_t    votes;
+    Matches     matches;
+};
+
+class GlobalMatcher {
+ public:
+    GlobalMatcher(const GlobalMatcherOptions& options = GlobalMatcherOptions())
+        : options(options)
+    {};
+
+    // index the descriptors of all the images, missing features are
+    // indexed as empty images
+    bool build(const vector<ImageFeaturesPtr>& features);
+
+    // query every descriptor once, candidate pairs (image1 < image2)
+    // by decreasing votes
+    void match(vector<GlobalPair>& pairs) const;
+
+    // indexed descriptors
+    inline size_t size() const {
+        return offsets.empty() ? 0 : offsets.back();
+    }
+
+    inline size_t shard_count() const {
+        return shards.size();
+    }
+
+ private:
+    struct Shard {
+        // first image, first descriptor
+        uint32_t                            image;
+        size_t                              offset;
+
+        Mat                                 descriptors;
+        std::shared_ptr<cv::flann::Index>   index;
+    };
+
+    // image and keypoint of a descriptor id
+    void locate(size_t id, uint32_t& image, uint32_t& keypoint) const;
+
+    GlobalMatcherOptions        options;
+    vector<ImageFeaturesPtr>    features;
+
+    // first descriptor id of each image, image count + 1 entries
+    vector<size_t>              offsets;
+
+    vector<Shard>               shards;
+};
+
+#endif // !GLOBAL_MATCHER_H
@@ -0,0 +1,386 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <math.h>
+
+#include <algorithm>
+
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include "gravity_ransac.h"
+#include "simd_kernels.h"
+
+// highest degree of the polynomial of a sample
+#define GRAVITY_DEGREE 6
+
+/////////////////////
+/// polynomials   ///
+/////////////////////
+
+// coefficients by increasing power
+
+static double poly_eval(const double *p, int n, double x) {
+    double y = p[n];
+    for (int i = n - 1; i >= 0; i--) {
+        y = y * x + p[i];
+    }
+    return y;
+}
+
+// c = a b, degrees na and nb
+static void poly_mul(const double *a, int na, const double *b, int nb, double *c) {
+    for (int i = 0; i <= na + nb; i++) {
+        c[i] = 0;
+    }
+    for (int i = 0; i <= na; i++) {
+        for (int j = 0; j <= nb; j++) {
+            c[i + j] += a[i] * b[j];
+        }
+    }
+}
+
+// root of p in [lo, hi] where p changes sign
+static double bisect(const double *p, int n, double lo, double hi) {
+    double f_lo = poly_eval(p, n, lo);
+    for (int i = 0; i < 100 && hi - lo > 1e-12 * (1 + fabs(lo)); i++) {
+        double mid = (lo + hi) / 2;
+        double f_mid = poly_eval(p, n, mid);
+        if ((f_mid < 0) == (f_lo < 0)) {
+            lo = mid;
+            f_lo = f_mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo + hi) / 2;
+}
+
+// sorted real roots of p of degree n: the roots of p' split the line in
+// intervals holding at most one root each
+static int real_roots(const double *p, int n, double *roots) {
+    double largest = 0;
+    for (int i = 0; i <= n; i++) {
+        largest = std::max(largest, fabs(p[i]));
+    }
+    while (n > 0 && fabs(p[n]) <= 1e-12 * largest) {
+        n--;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    if (n == 1) {
+        roots[0] = -p[0] / p[1];
+        return 1;
+    }
+
+    // every root is within the Cauchy bound
+    double bound = 0;
+    for (int i = 0; i < n; i++) {
+        bound = std::max(bound, fabs(p[i] / p[n]));
+    }
+    bound += 1;
+
+    double derivative[GRAVITY_DEGREE];
+    for (int i = 1; i <= n; i++) {
+        derivative[i - 1] = i * p[i];
+    }
+    double ends[GRAVITY_DEGREE + 1];
+    int count = real_roots(derivative, n - 1, ends + 1);
+    ends[0] = -bound;
+    ends[count + 1] = bound;
+
+    int found = 0;
+    for (int i = 0; i <= count; i++) {
+        double lo = ends[i], hi = ends[i + 1];
+        if (lo >= hi) {
+            continue;
+        }
+        double f_lo = poly_eval(p, n, lo), f_hi = poly_eval(p, n, hi);
+        if (f_lo == 0) {
+            roots[found++] = lo;
+        } else if ((f_lo < 0) != (f_hi < 0)) {
+            roots[found++] = bisect(p, n, lo, hi);
+        }
+    }
+    return found;
+}
+
+///////////////
+/// solver  ///
+///////////////
+
+// K^-1 of an upper triangular K
+static Matx33d inverse_camera(const Matx33d& K) {
+    double fx = K(0, 0), s = K(0, 1), cx = K(0, 2), fy = K(1, 1), cy = K(1, 2);
+    return Matx33d(1 / fx, -s / (fx * fy), (s * cy - cx * fy) / (fx * fy),
+                   0, 1 / fy, -cy / fy,
+                   0, 0, 1);
+}
+
+// rotation taking the unit vector g to y (Rodrigues)
+static Matx33d align_to_y(const Matx31d& gravity) {
+    double norm = sqrt(gravity(0) * gravity(0) + gravity(1) * gravity(1) +
+                       gravity(2) * gravity(2));
+    double gx = gravity(0) / norm, gy = gravity(1) / norm, gz = gravity(2) / norm;
+
+    // k = g x y, c = g . y
+    double kx = -gz, kz = gx, c = gy;
+    double s2 = kx * kx + kz * kz;
+    if (s2 < 1e-18) {
+        return c > 0 ? Matx33d::eye() : Matx33d(1, 0, 0, 0, -1, 0, 0, 0, -1);
+    }
+
+    // I + [k]x + [k]x^2 (1 - c) / s^2
+    Matx33d kx_m(0, -kz, 0,
+                 kz, 0, -kx,
+                 0, kx, 0);
+    return Matx33d::eye() + kx_m + kx_m * kx_m * ((1 - c) / s2);
+}
+
+static inline void cross(const double *a, const double *b, double *c) {
+    c[0] = a[1] * b[2] - a[2] * b[1];
+    c[1] = a[2] * b[0] - a[0] * b[2];
+    c[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+// Ry(theta) a x b as polynomials in q = tan(theta / 2), times 1 + q^2
+static void rotated_cross(const double *a, const double *b, double v[3][3]) {
+    double u[3][3] = {
+        { a[0], 2 * a[2], -a[0] },
+        { a[1], 0, a[1] },
+        { a[2], -2 * a[0], -a[2] }
+    };
+    for (int k = 0; k < 3; k++) {
+        v[0][k] = u[1][k] * b[2] - u[2][k] * b[1];
+        v[1][k] = u[2][k] * b[0] - u[0][k] * b[2];
+        v[2][k] = u[0][k] * b[1] - u[1][k] * b[0];
+    }
+}
+
+// essential matrices of the aligned frames (x2' E x1 = 0) from 3
+// aligned bearing pairs
+static int solve_3pt(const double *a[3], const double *b[3], Matx33d E[GRAVITY_DEGREE]) {
+    double v[3][3][3];
+    for (int i = 0; i < 3; i++) {
+        rotated_cross(a[i], b[i], v[i]);
+    }
+
+    // v0 . (v1 x v2)
+    double det[GRAVITY_DEGREE + 1] = { 0 };
+    for (int k = 0; k < 3; k++) {
+        int k1 = (k + 1) % 3, k2 = (k + 2) % 3;
+        double m1[5], m2[5], c[5], term[GRAVITY_DEGREE + 1];
+        poly_mul(v[1][k1], 2, v[2][k2], 2, m1);
+        poly_mul(v[1][k2], 2, v[2][k1], 2, m2);
+        for (int i = 0; i < 5; i++) {
+            c[i] = m1[i] - m2[i];
+        }
+        poly_mul(v[0][k], 2, c, 4, term);
+        for (int i = 0; i <= GRAVITY_DEGREE; i++) {
+            det[i] += term[i];
+        }
+    }
+
+    double roots[GRAVITY_DEGREE];
+    int count = real_roots(det, GRAVITY_DEGREE, roots);
+
+    int solutions = 0;
+    for (int r = 0; r < count; r++) {
+        double q = roots[r];
+        double c = (1 - q * q) / (1 + q * q), s = 2 * q / (1 + q * q);
+        Matx33d Ry(c, 0, s,
+                   0, 1, 0,
+                   -s, 0, c);
+
+        // t orthogonal to the cross products of the 3 matches
+        double w[3][3];
+        for (int i = 0; i < 3; i++) {
+            double ra[3] = { c * a[i][0] + s * a[i][2], a[i][1], -s * a[i][0] + c * a[i][2] };
+            cross(ra, b[i], w[i]);
+        }
+        double t[3];
+        cross(w[0], w[1], t);
+        double norm = sqrt(t[0] * t[0] + t[1] * t[1] + t[2] * t[2]);
+        if (norm < 1e-12) {
+            cross(w[0], w[2], t);
+            norm = sqrt(t[0] * t[0] + t[1] * t[1] + t[2] * t[2]);
+        }
+        if (norm < 1e-12) {
+            continue;
+        }
+
+        Matx33d tx(0, -t[2] / norm, t[1] / norm,
+                   t[2] / norm, 0, -t[0] / norm,
+                   -t[1] / norm, t[0] / norm, 0);
+        E[solutions++] = tx * Ry;
+    }
+    return solutions;
+}
+
+///////////////
+/// ransac  ///
+///////////////
+
+// squared Sampson distance of a match to F, in pixels
+static inline double sampson(const Matx33d& F, const Point2f& p1, const Point2f& p2) {
+    double x1 = p1.x, y1 = p1.y, x2 = p2.x, y2 = p2.y;
+    double fx0 = F(0, 0) * x1 + F(0, 1) * y1 + F(0, 2);
+    double fx1 = F(1, 0) * x1 + F(1, 1) * y1 + F(1, 2);
+    double fx2 = F(2, 0) * x1 + F(2, 1) * y1 + F(2, 2);
+    double ftx0 = F(0, 0) * x2 + F(1, 0) * y2 + F(2, 0);
+    double ftx1 = F(0, 1) * x2 + F(1, 1) * y2 + F(2, 1);
+    double e = x2 * fx0 + y2 * fx1 + fx2;
+
+    return e * e / (fx0 * fx0 + fx1 * fx1 + ftx0 * ftx0 + ftx1 * ftx1);
+}
+
+static size_t count_inliers(const Matx33d& F, const vector<Point2f>& pts1,
+                            const vector<Point2f>& pts2, double threshold,
+                            vector<char> *inliers) {
+    double t2 = threshold * threshold;
+    size_t count = 0;
+    for (size_t i = 0; i < pts1.size(); i++) {
+        bool inlier = sampson(F, pts1[i], pts2[i]) <= t2;
+        count += inlier;
+        if (inliers) {
+            (*inliers)[i] = inlier;
+        }
+    }
+    return count;
+}
+
+// inliers within threshold, the Sampson errors of all the matches at
+// once
+static size_t select_inliers(const Matx33d& F, const vector<Point2f>& pts1,
+                             const vector<Point2f>& pts2, size_t n, double threshold,
+                             vector<char>& inliers) {
+    vector<float> err(n);
+    simd_kernels().sampson_error(F.val, (const float*) &pts1[0], (const float*) &pts2[0],
+                                 n, &err[0]);
+
+    float t2 = threshold * threshold;
+    size_t count = 0;
+    inliers.assign(n, 0);
+    for (size_t i = 0; i < n; i++) {
+        inliers[i] = err[i] <= t2;
+        count += inliers[i];
+    }
+    return count;
+}
+
+// samples of 3 needed to draw an all inliers one with confidence
+static int ransac_iterations(double inlier_ratio, double confidence, int max_iterations) {
+    double p = inlier_ratio * inlier_ratio * inlier_ratio;
+    if (p >= 1) {
+        return 0;
+    }
+
+    double num = log(1 - confidence), den = log(1 - p);
+    if (den >= 0 || num <= max_iterations * den) {
+        return max_iterations;
+    }
+    return (int) ceil(num / den);
+}
+
+bool find_F_gravity(const vector<Point2f>& pts1, const vector<Point2f>& pts2,
+                    const Matx33d& K1, const Matx33d& K2,
+                    const Matx31d& g1, const Matx31d& g2,
+                    const GravityRansacOptions& options,
+                    Mat& F, vector<char>& inliers) {
+    size_t n = std::min(pts1.size(), pts2.size());
+    F = Mat();
+    inliers.assign(n, 0);
+    if (n < 8) {
+        return false;
+    }
+
+    // bearings in the frames where gravity is y
+    Matx33d A1 = align_to_y(g1) * inverse_camera(K1);
+    Matx33d A2 = align_to_y(g2) * inverse_camera(K2);
+    vector<double> a(3 * n), b(3 * n);
+    for (size_t i = 0; i < n; i++) {
+        for (int k = 0; k < 3; k++) {
+            a[3 * i + k] = A1(k, 0) * pts1[i].x + A1(k, 1) * pts1[i].y + A1(k, 2);
+            b[3 * i + k] = A2(k, 0) * pts2[i].x + A2(k, 1) * pts2[i].y + A2(k, 2);
+        }
+    }
+
+    // x2' A2' E A1 x1 = 0
+    Matx33d A2t = A2.t();
+    double focal = (K1(0, 0) + K1(1, 1) + K2(0, 0) + K2(1, 1)) / 4;
+    double wide = options.threshold + focal * tan(options.gravity_error * M_PI / 180);
+
+    RNG rng((uint64) n * 7919 + 3);
+    size_t best_count = 0;
+    Matx33d best;
+    int iterations = options.max_iterations;
+
+    for (int it = 0; it < iterations; it++) {
+        int idx[3];
+        idx[0] = rng.uniform(0, (int) n);
+        do {
+            idx[1] = rng.uniform(0, (int) n);
+        } while (idx[1] == idx[0]);
+        do {
+            idx[2] = rng.uniform(0, (int) n);
+        } while (idx[2] == idx[0] || idx[2] == idx[1]);
+
+        const double *sa[3], *sb[3];
+        for (int k = 0; k < 3; k++) {
+            sa[k] = &a[3 * idx[k]];
+            sb[k] = &b[3 * idx[k]];
+        }
+
+        Matx33d E[GRAVITY_DEGREE];
+        int solutions = solve_3pt(sa, sb, E);
+        for (int s = 0; s < solutions; s++) {
+            Matx33d hypothesis = A2t * E[s] * A1;
+            size_t count = count_inliers(hypothesis, pts1, pts2, wide, NULL);
+            if (count > best_count) {
+                best_count = count;
+                best = hypothesis;
+                iterations = std::min(iterations,
+                                      ransac_iterations((double) count / n,
+                                                        options.confidence,
+                                                        options.max_iterations));
+            }
+        }
+    }
+
+    if (best_count < 8) {
+        return false;
+    }
+
+    // the wide threshold lets in outliers next to the epipolar lines: 8
+    // points on the inliers within threshold, while it gains inliers
+    size_t count = select_inliers(best, pts1, pts2, n, options.threshold, inliers);
+    for (int k = 0; k < 2; k++) {
+        vector<Point2f> in1, in2;
+        for (size_t i = 0; i < n; i++) {
+            if (inliers[i]) {
+                in1.push_back(pts1[i]);
+                in2.push_back(pts2[i]);
+            }
+        }
+        if (in1.size() < 8) {
+            break;
+        }
+
+        Mat refit = findFundamentalMat(in1, in2, FM_8POINT);
+        if (refit.rows != 3 || refit.cols != 3) {
+            break;
+        }
+        Matx33d R(refit.ptr<double>());
+
+        vector<char> refit_inliers;
+        size_t refit_count = select_inliers(R, pts1, pts2, n, options.threshold, refit_inliers);
+        if (refit_count <= count) {
+            break;
+        }
+        count = refit_count;
+        best = R;
+        inliers.swap(refit_inliers);
+    }
+
+    F = Mat(best, true);
+    return true;
+}
@@ -0,0 +1,60 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Fundamental matrix RANSAC with the vertical known in both cameras.
+//
+// Drone gimbals report pitch and roll from their IMU (attitude.h). With
+// both cameras rotated so gravity is their y axis, what's left of the
+// relative pose is a rotation about y and a translation: 3 degrees of
+// freedom, so 3 matches instead of 7 or 8, and far fewer RANSAC samples
+// (about 35 at 50% inliers, against 590 for 7 points).
+//
+// For 3 matches a, b of aligned bearings, t is orthogonal to every
+// Ry(theta) a_i x b_i: their determinant vanishes. With q = tan(theta/2)
+// it's a polynomial of degree 6 in q [1], each real root gives theta,
+// then t from two of the cross products.
+//
+//  [1] F. Fraundorfer, P. Tanskanen, M. Pollefeys, "A minimal case
+//      solution to the calibrated relative pose problem for the case of
+//      two known orientation angles", ECCV 2010.
+//
+// The IMU angles are off by a fraction of a degree: hypotheses are
+// scored with the threshold widened by gravity_error at the focal
+// length. Its inliers are then selected again within threshold, so the
+// 8 point refit sees no match the wide threshold let in, and the refit
+// is counted within threshold, as compute_F_mat() would.
+//
+// Usage :
+//  Mat F;
+//  vector<char> inliers;
+//  find_F_gravity(pts1, pts2, K1, K2, g1, g2, GravityRansacOptions(), F, inliers);
+
+#ifndef GRAVITY_RANSAC_H
+#define GRAVITY_RANSAC_H
+
+#include "photogram.h"
+
+struct GravityRansacOptions {
+    GravityRansacOptions()
+        : threshold(1.0), gravity_error(0.5), confidence(0.99), max_iterations(500)
+    {};
+
+    // pixels in Sampson distance, same as compute_F_mat()
+    double      threshold;
+
+    // degrees, error of the vertical of each camera
+    double      gravity_error;
+
+    double      confidence;
+    int         max_iterations;
+};
+
+// F (x2' F x1 = 0) and the inliers of the matches, with g1 and g2 the
+// gravity in each camera (gravity_in_camera()). false with less than 8
+// points or without a model
+bool find_F_gravity(const vector<Point2f>& pts1, const vector<Point2f>& pts2,
+                    const Matx33d& K1, const Matx33d& K2,
+                    const Matx31d& g1, const Matx31d& g2,
+                    const GravityRansacOptions& options,
+                    Mat& F, vector<char>& inliers);
+
+#endif // !GRAVITY_RANSAC_H
@@ -0,0 +1,551 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Hierarchical navigable small world graph index for approximate
+// nearest neighbor search of descriptors.
+//
+//  [1] Yu. A. Malkov and D. A. Yashunin, "Efficient and robust approximate
+//    nearest neighbor search using Hierarchical Navigable Small World
+//    graphs", TPAMI 2018.
+//
+// Usage :
+//  HnswIndex<float> index(128, 16, 200);  // dimension, M, ef_construction
+//  index.build(descriptors, count);       // multithreaded
+//  index.search(query, 1, 64, neighbors); // k, ef
+//  index.save("image.hnsw");
+//
+// M is the number of links per node (2M on the bottom layer), higher
+// values raise recall and memory. ef is the size of the candidate list:
+// ef_construction trades build time for graph quality, ef at query time
+// trades throughput for recall and must be >= k.
+//
+// bench_matchers compares recall and throughput against FLANN and an
+// exact brute force matcher on the pairs of a set of images.
+
+#ifndef HNSW_HPP
+#define HNSW_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "simd_kernels.h"
+#include "util.h"
+
+// squared L2 distance through the dispatched kernels
+template <typename T>
+struct HnswDistance;
+
+template <>
+struct HnswDistance<float> {
+    static inline float eval(const SimdKernels& k, const float *a,
+                             const float *b, size_t n) {
+        return k.l2_sqr_f32(a, b, n);
+    }
+};
+
+template <>
+struct HnswDistance<Half> {
+    static inline float eval(const SimdKernels& k, const Half *a,
+                             const Half *b, size_t n) {
+        return k.l2_sqr_f16(a, b, n);
+    }
+};
+
+template <>
+struct HnswDistance<uint8_t> {
+    static inline float eval(const SimdKernels& k, const uint8_t *a,
+                             const uint8_t *b, size_t n) {
+        return (float) k.l2_sqr_u8(a, b, n);
+    }
+};
+
+// visited marks of a search, reused between searches of a same worker
+class HnswVisited {
+ public:
+    HnswVisited()
+        : tag(0)
+    {};
+
+    inline void reset(size_t n) {
+        if (marks.size() < n) {
+            marks.assign(n, 0);
+            tag = 0;
+        }
+        if (++tag == 0) {
+            std::fill(marks.begin(), marks.end(), 0);
+            tag = 1;
+        }
+    }
+
+    // true if id was already visited
+    inline bool visit(uint32_t id) {
+        if (marks[id] == tag) {
+            return true;
+        }
+        marks[id] = tag;
+        return false;
+    }
+
+ private:
+    std::vector<uint16_t>   marks;
+    uint16_t                tag;
+};
+
+template <typename T>
+class HnswIndex {
+ public:
+    typedef std::shared_ptr<HnswIndex<T> >  ptr;
+
+    // squared distance, id
+    typedef std::pair<float, uint32_t>      Neighbor;
+
+    HnswIndex(size_t dim = 0, int M = 16, int ef_construction = 200)
+        : dim(dim), M(M), ef_construction(ef_construction),
+          entry(0), max_level(-1), building(false),
+          kernels(&simd_kernels())
+    {};
+
+    inline size_t size() const {
+        return levels.size();
+    }
+
+    inline size_t dimension() const {
+        return dim;
+    }
+
+    // bytes held by the vectors and the links
+    size_t memory_size() const {
+        size_t bytes = data.size() * sizeof(T);
+        for (size_t i = 0; i < links.size(); i++) {
+            for (size_t l = 0; l < links[i].size(); l++) {
+                bytes += links[i][l].capacity() * sizeof(uint32_t);
+            }
+        }
+        return bytes;
+    }
+
+    // build the graph over n row major vectors (copied)
+    void build(const T *vectors, size_t n, int threads = 0) {
+        data.assign(vectors, vectors + n * dim);
+        levels.resize(n);
+        links.assign(n, std::vector<std::vector<uint32_t> >());
+        entry = 0;
+        max_level = -1;
+
+        if (n == 0) {
+            return;
+        }
+
+        // deterministic levels, drawn before going parallel
+        std::mt19937 rng(100);
+        std::uniform_real_distribution<double> uniform(0, 1);
+        double level_mult = 1 / log(std::max(M, 2));
+        for (size_t i = 0; i < n; i++) {
+            levels[i] = (int) (-log(1 - uniform(rng)) * level_mult);
+            links[i].resize(levels[i] + 1);
+        }
+
+        entry = 0;
+        max_level = levels[0];
+
+        locks.reset(new std::mutex[n]);
+        building = true;
+
+        if (threads <= 0) {
+            threads = default_thread_count();
+        }
+        std::vector<HnswVisited> visited(threads);
+
+        parallel_for_index(n - 1, [&](size_t i, int worker) {
+                insert(i + 1, visited[worker]);
+            }, threads);
+
+        building = false;
+        locks.reset();
+    }
+
+    // k nearest neighbors of query, closest first
+    void search(const T *query, size_t k, int ef,
+                std::vector<Neighbor>& result, HnswVisited& visited) const {
+        result.clear();
+        if (size() == 0) {
+            return;
+        }
+
+        uint32_t cur = greedy_closest(query, entry, max_level, 1);
+        search_layer(query, cur, std::max<size_t>(ef, k), 0, visited, result);
+
+        if (result.size() > k) {
+            result.resize(k);
+        }
+    }
+
+    void search(const T *query, size_t k, int ef,
+                std::vector<Neighbor>& result) const {
+        HnswVisited visited;
+        search(query, k, ef, result, visited);
+    }
+
+    // serialization, native endianness
+    bool save(std::ostream& os) const {
+        uint32_t header[6] = { HNSW_MAGIC, (uint32_t) sizeof(T), (uint32_t) dim,
+                               (uint32_t) M, (uint32_t) ef_construction,
+                               (uint32_t) size() };
+        os.write((const char*) header, sizeof(header));
+        os.write((const char*) &entry, sizeof(entry));
+        os.write((const char*) &max_level, sizeof(max_level));
+        if (!data.empty()) {
+            os.write((const char*) &data[0], data.size() * sizeof(T));
+        }
+
+        for (size_t i = 0; i < size(); i++) {
+            int32_t level = levels[i];
+            os.write((const char*) &level, sizeof(level));
+            for (int l = 0; l <= level; l++) {
+                uint32_t count = links[i][l].size();
+                os.write((const char*) &count, sizeof(count));
+                if (count) {
+                    os.write((const char*) &links[i][l][0], count * sizeof(uint32_t));
+                }
+            }
+        }
+
+        return os.good();
+    }
+
+    // false, and an empty index, on a truncated or inconsistent stream
+    bool load(std::istream& is) {
+        if (!read_graph(is)) {
+            data.clear();
+            levels.clear();
+            links.clear();
+            entry = 0;
+            max_level = -1;
+            return false;
+        }
+        return true;
+    }
+
+    bool save(const std::string& filename) const {
+        std::ofstream os(filename.c_str(), std::ios::binary);
+        return os && save(os);
+    }
+
+    bool load(const std::string& filename) {
+        std::ifstream is(filename.c_str(), std::ios::binary);
+        return is && load(is);
+    }
+
+ private:
+    enum { HNSW_MAGIC = 0x57534e48 }; // "HNSW"
+
+    struct FurtherFirst {
+        bool operator()(const Neighbor& a, const Neighbor& b) const {
+            return a.first < b.first;
+        }
+    };
+
+    struct CloserFirst {
+        bool operator()(const Neighbor& a, const Neighbor& b) const {
+            return a.first > b.first;
+        }
+    };
+
+    // bytes left in a seekable stream, -1 otherwise
+    static int64_t remaining(std::istream& is) {
+        std::streampos pos = is.tellg();
+        if (pos < 0 || !is.seekg(0, std::ios::end)) {
+            is.clear();
+            return -1;
+        }
+        std::streampos end = is.tellg();
+        is.seekg(pos);
+        return end - pos;
+    }
+
+    // read a saved graph, ids and sizes checked before they're used
+    bool read_graph(std::istream& is) {
+        uint32_t header[6];
+        is.read((char*) header, sizeof(header));
+        if (!is || header[0] != HNSW_MAGIC || header[1] != sizeof(T) ||
+            header[3] == 0 || (header[5] && header[2] == 0)) {
+            return false;
+        }
+
+        dim = header[2];
+        M = header[3];
+        ef_construction = header[4];
+        size_t n = header[5];
+
+        is.read((char*) &entry, sizeof(entry));
+        is.read((char*) &max_level, sizeof(max_level));
+        if (!is || (n && (entry >= n || max_level < 0)) || (!n && max_level != -1)) {
+            return false;
+        }
+
+        // don't allocate more than the stream holds
+        int64_t left = remaining(is);
+        if (left >= 0 && (uint64_t) n * dim * sizeof(T) > (uint64_t) left) {
+            return false;
+        }
+        data.resize(n * dim);
+        if (!data.empty()) {
+            is.read((char*) &data[0], data.size() * sizeof(T));
+        }
+
+        levels.resize(n);
+        links.assign(n, std::vector<std::vector<uint32_t> >());
+        for (size_t i = 0; i < n && is; i++) {
+            int32_t level;
+            is.read((char*) &level, sizeof(level));
+            if (!is || level < 0 || level > max_level) {
+                return false;
+            }
+            levels[i] = level;
+            links[i].resize(level + 1);
+            for (int l = 0; l <= level; l++) {
+                uint32_t count;
+                is.read((char*) &count, sizeof(count));
+                if (!is || count > max_links(l)) {
+                    return false;
+                }
+                links[i][l].resize(count);
+                if (count) {
+                    is.read((char*) &links[i][l][0], count * sizeof(uint32_t));
+                }
+            }
+        }
+        if (!is || (n && levels[entry] != max_level)) {
+            return false;
+        }
+
+        // a link at level l goes to a node that has that level
+        for (size_t i = 0; i < n; i++) {
+            for (size_t l = 0; l < links[i].size(); l++) {
+                for (uint32_t id : links[i][l]) {
+                    if (id >= n || levels[id] < (int) l) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    inline const T* vec(uint32_t id) const {
+        return &data[(size_t) id * dim];
+    }
+
+    inline float distance(const T *a, const T *b) const {
+        return HnswDistance<T>::eval(*kernels, a, b, dim);
+    }
+
+    inline size_t max_links(int level) const {
+        return level ? M : 2 * M;
+    }
+
+    // links of a node, copied under its lock while the graph is built
+    inline void get_links(uint32_t id, int level,
+                          std::vector<uint32_t>& out) const {
+        if (building) {
+            std::lock_guard<std::mutex> lock(locks[id]);
+            out = links[id][level];
+        } else {
+            out = links[id][level];
+        }
+    }
+
+    // greedy descent from level from down to level to
+    uint32_t greedy_closest(const T *q, uint32_t cur, int from, int to) const {
+        float cur_dist = distance(q, vec(cur));
+        std::vector<uint32_t> neighbors;
+
+        for (int level = from; level >= to; level--) {
+            bool changed = true;
+            while (changed) {
+                changed = false;
+                get_links(cur, level, neighbors);
+                for (uint32_t n : neighbors) {
+                    float d = distance(q, vec(n));
+                    if (d < cur_dist) {
+                        cur_dist = d;
+                        cur = n;
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        return cur;
+    }
+
+    // best first search of one layer, result sorted closest first
+    void search_layer(const T *q, uint32_t ep, size_t ef, int level,
+                      HnswVisited& visited, std::vector<Neighbor>& result) const {
+        std::priority_queue<Neighbor, std::vector<Neighbor>, CloserFirst> candidates;
+        std::priority_queue<Neighbor, std::vector<Neighbor>, FurtherFirst> best;
+        std::vector<uint32_t> neighbors;
+
+        visited.reset(size());
+        visited.visit(ep);
+
+        Neighbor start(distance(q, vec(ep)), ep);
+        candidates.push(start);
+        best.push(start);
+
+        while (!candidates.empty()) {
+            Neighbor c = candidates.top();
+            if (c.first > best.top().first) {
+                break;
+            }
+            candidates.pop();
+
+            get_links(c.second, level, neighbors);
+            for (uint32_t n : neighbors) {
+                if (visited.visit(n)) {
+                    continue;
+                }
+
+                float d = distance(q, vec(n));
+                if (best.size() < ef || d < best.top().first) {
+                    candidates.push(Neighbor(d, n));
+                    best.push(Neighbor(d, n));
+                    if (best.size() > ef) {
+                        best.pop();
+                    }
+                }
+            }
+        }
+
+        result.resize(best.size());
+        for (size_t i = best.size(); i > 0; i--) {
+            result[i - 1] = best.top();
+            best.pop();
+        }
+    }
+
+    // keep candidates closer to the base than to any kept neighbor,
+    // spreads the links in all directions (heuristic of [1])
+    void select_neighbors(std::vector<Neighbor>& candidates, size_t m) const {
+        if (candidates.size() <= m) {
+            return;
+        }
+
+        std::vector<Neighbor> selected;
+        selected.reserve(m);
+
+        for (const Neighbor& c : candidates) {
+            if (selected.size() >= m) {
+                break;
+            }
+
+            bool keep = true;
+            for (const Neighbor& s : selected) {
+                if (distance(vec(c.second), vec(s.second)) < c.first) {
+                    keep = false;
+                    break;
+                }
+            }
+            if (keep) {
+                selected.push_back(c);
+            }
+        }
+
+        candidates.swap(selected);
+    }
+
+    void insert(uint32_t id, HnswVisited& visited) {
+        const T *q = vec(id);
+        int level = levels[id];
+
+        uint32_t ep;
+        int top;
+        {
+            std::lock_guard<std::mutex> lock(entry_lock);
+            ep = entry;
+            top = max_level;
+        }
+
+        uint32_t cur = ep;
+        if (top > level) {
+            cur = greedy_closest(q, cur, top, level + 1);
+        }
+
+        std::vector<Neighbor> candidates;
+        for (int l = std::min(level, top); l >= 0; l--) {
+            search_layer(q, cur, ef_construction, l, visited, candidates);
+            cur = candidates[0].second;
+
+            select_neighbors(candidates, M);
+
+            {
+                std::lock_guard<std::mutex> lock(locks[id]);
+                links[id][l].clear();
+                for (const Neighbor& n : candidates) {
+                    links[id][l].push_back(n.second);
+                }
+            }
+
+            // back links, shrinking overfull lists with the same heuristic
+            for (const Neighbor& n : candidates) {
+                std::lock_guard<std::mutex> lock(locks[n.second]);
+                std::vector<uint32_t>& back = links[n.second][l];
+                back.push_back(id);
+
+                if (back.size() > max_links(l)) {
+                    std::vector<Neighbor> pruned;
+                    pruned.reserve(back.size());
+                    for (uint32_t b : back) {
+                        pruned.push_back(Neighbor(distance(vec(n.second), vec(b)), b));
+                    }
+                    std::sort(pruned.begin(), pruned.end());
+                    select_neighbors(pruned, max_links(l));
+
+                    back.clear();
+                    for (const Neighbor& p : pruned) {
+                        back.push_back(p.second);
+                    }
+                }
+            }
+        }
+
+        if (level > top) {
+            std::lock_guard<std::mutex> lock(entry_lock);
+            if (level > max_level) {
+                entry = id;
+                max_level = level;
+            }
+        }
+    }
+
+    size_t                  dim;
+    int                     M;
+    int                     ef_construction;
+
+    std::vector<T>          data;
+    std::vector<int>        levels;
+
+    // [node][level] -> neighbor ids
+    std::vector<std::vector<std::vector<uint32_t> > > links;
+
+    uint32_t                entry;
+    int32_t                 max_level;
+
+    // per node locks, only while building
+    bool                    building;
+    std::unique_ptr<std::mutex[]> locks;
+    std::mutex              entry_lock;
+
+    const SimdKernels      *kernels;
+};
+
+#endif // !HNSW_HPP
@@ -10,6 +10,8 @@ _INITIALIZE_EASYLOGGINGPP
 
 #include "features2d.h"
 #include "image.h"
+#include "metrics.h"
+#include "phase_correlation.h"
 
 #define VISUAL_DEBUG 0
 
@@ -56,6 +58,9 @@ int main(int argc, char** argv) {
         cmd.add(output);
         TCLAP::ValueArg<std::string> alpha("", "alpha_chan", "Transparency layer", false, "", "filename");
         cmd.add(alpha);
+        TCLAP::SwitchArg features_only("", "features_only",
+            "Skip the phase correlation fast path", false);
+        cmd.add(features_only);
 
         cmd.parse(argc, argv);
 
@@ -71,35 +76,46 @@ int main(int argc, char** argv) {
 
         Image truth(ground_truth_filename);
 
-        ImageFeaturesPtr img_features = img.get_image_features();
-        ImageFeaturesPtr truth_features = truth.get_image_features();
-
-        Matches matches;
-        vector<Point2f> truth_pts, img_pts;
         Mat H;
 
-        // match image descriptors
-        match_features(*img_features, *truth_features, matches);
+        // nadir frames over an orthophoto are close to a similarity,
+        // try to register without features first
+        PhaseCorrelationOptions phase_options;
+        if (!features_only.getValue() &&
+            phase_correlation_homography(img.get_image_gray(), truth.get_image_gray(),
+                                         phase_options, H)) {
+            LOG(DEBUG) << "Registered by phase correlation";
+            Metrics::instance().add("homography.phase");
+        } else {
+            ImageFeaturesPtr img_features = img.get_image_features();
+            ImageFeaturesPtr truth_features = truth.get_image_features();
 
-        matches2points(matches, *img_features, *truth_features, img_pts, truth_pts);
+            Matches matches;
+            vector<Point2f> truth_pts, img_pts;
 
-        vector<unsigned char> status;
-        H = findHomography(img_pts, truth_pts, CV_RANSAC, 3, status);
+            // match image descriptors
+            match_features(*img_features, *truth_features, matches);
 
-        LOG(DEBUG) << "Homography matrix H: " << endl << H;
+            matches2points(matches, *img_features, *truth_features, img_pts, truth_pts);
+
+            vector<unsigned char> status;
+            H = findHomography(img_pts, truth_pts, CV_RANSAC, 3, status);
+            Metrics::instance().add("homography.features");
 
 #if VISUAL_DEBUG
-        // print out RANSAC'ed matched keypoints
-        vector<char> keypointMask;
+            // print out RANSAC'ed matched keypoints
+            vector<char> keypointMask;
 
-        keypointMask = vector<char> (status.begin(), status.end());
+            keypointMask = vector<char> (status.begin(), status.end());
 
-        write_matches_image(img->get_image_gray(), *img_features,
-                            truth->get_image_gray(), *truth_features,
-                            matches,
-                            keypointMask, "matches_RANSAC.jpg");
+            write_matches_image(img->get_image_gray(), *img_features,
+                                truth->get_image_gray(), *truth_features,
+                                matches,
+                                keypointMask, "matches_RANSAC.jpg");
 #endif
+        }
 
+        LOG(DEBUG) << "Homography matrix H: " << endl << H;
 
         Size truth_size = truth.get_image_gray().size();
         Size img_size = img.get_image_gray().size();
@@ -127,6 +143,8 @@ int main(int argc, char** argv) {
         Mat dewarped = dewarp_channels(img.get_image(), H, truth_size);
         imwrite(output_filename, dewarped);
 
+        Metrics::instance().write_report("metrics.yml");
+
         return 0;
 
     } catch (TCLAP::ArgException &e)  {
@@ -1,5 +1,10 @@
+#include <sys/stat.h>
+
 #include <stdexcept>
 #include "image.h"
+#include "feature_codec.h"
+#include "metrics.h"
+#include "simd_kernels.h"
 
 Mat Image::get_image() {
     if (img.data) {
@@ -8,8 +13,13 @@ Mat Image::get_image() {
     }
 
     // load on the fly image from file
-    LOG(DEBUG) << "Loading image from file: " << filename;
-    img = imread(filename, CV_LOAD_IMAGE_UNCHANGED);
+    if (source.in_memory()) {
+        LOG(DEBUG) << "Decoding image from archive: " << filename;
+        img = source.decode(CV_LOAD_IMAGE_UNCHANGED);
+    } else {
+        LOG(DEBUG) << "Loading image from file: " << filename;
+        img = imread(filename, CV_LOAD_IMAGE_UNCHANGED);
+    }
     if (!img.data) {
         throw std::runtime_error("Could not open file.");
     }
@@ -49,7 +59,18 @@ Mat Image::get_image_gray() {
 
     img_color = get_image();
     LOG(DEBUG) << "Converting color to gray image";
-    cvtColor(img, img_gray, COLOR_BGR2GRAY);
+    if (img_color.type() == CV_8UC3) {
+        const SimdKernels& kernels = simd_kernels();
+        img_gray.create(img_color.size(), CV_8UC1);
+        for (int y = 0; y < img_color.rows; y++) {
+            kernels.bgr_to_gray_u8(img_color.ptr<uint8_t>(y),
+                                   img_gray.ptr<uint8_t>(y), img_color.cols);
+        }
+    } else if (img_color.channels() == 1) {
+        img_gray = img_color;
+    } else {
+        cvtColor(img_color, img_gray, COLOR_BGR2GRAY);
+    }
     if (!img_gray.data) {
         throw std::runtime_error("Could not get gray image");
     }
@@ -62,10 +83,26 @@ ImageFeaturesPtr Image::get_image_features() {
         return features;
     }
 
-    Mat image_gray = get_image_gray();
-
     features.reset(new ImageFeatures);
 
+    // written by an earlier run
+    const string& features_dir = get_matcher_options().features_dir;
+    if (!features_dir.empty() && !name.empty()) {
+        string path = features_dir + "/" + name + ".feat";
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0 && read_features_file(path, *features)) {
+            LOG(DEBUG) << "Features of " << name << " read from " << path;
+            if (get_matcher_options().descriptors_f16) {
+                compact_descriptors_f16(*features);
+            }
+            Metrics::instance().add("features.read", features->keypoints.size());
+            return features;
+        }
+        features.reset(new ImageFeatures);
+    }
+
+    Mat image_gray = get_image_gray();
+
     // get SIFT like features
     int rc;
     LOG(DEBUG) << "Getting SIFT-like features";
@@ -111,8 +148,28 @@ Mat dewarp_channels(const Mat input, const Mat H, Size output_size) {
 
     split(input, input_channels);
 
-    for (int i = 0; i < channels; i++) {
-        warpPerspective(input_channels[i], output_channels[i], H, output_size);
+    if (input.depth() == CV_8U) {
+        // warpPerspective maps destination pixels through H^-1 too
+        const SimdKernels& kernels = simd_kernels();
+        Mat H_inv;
+        H.convertTo(H_inv, CV_64F);
+        H_inv = H_inv.inv();
+
+        for (int i = 0; i < channels; i++) {
+            const Mat& src = input_channels[i];
+            output_channels[i].create(output_size, CV_8UC1);
+
+            for (int y = 0; y < output_size.height; y++) {
+                kernels.warp_row_bilinear_u8(src.ptr<uint8_t>(), src.cols, src.rows,
+                                             src.step, H_inv.ptr<double>(), y,
+                                             output_channels[i].ptr<uint8_t>(y),
+                                             output_size.width);
+            }
+        }
+    } else {
+        for (int i = 0; i < channels; i++) {
+            warpPerspective(input_channels[i], output_channels[i], H, output_size);
+        }
     }
 
     Mat output;
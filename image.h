@@ -5,6 +5,7 @@
 
 #include "photogram.h"
 #include "features2d.h"
+#include "image_source.h"
 #include "util.h"
 
 class Image {
@@ -12,13 +13,20 @@ public:
     typedef std::shared_ptr<Image>  ptr;
 
     Image()
-        : filename("NA"), name("NA")
+        : filename("NA"), name("NA"), has_attitude(false)
     {};
 
-    Image(const string filename) {
+    Image(const string filename)
+        : has_attitude(false) {
         set_filename(filename);
     }
 
+    // image from a manifest, a glob or an archive member
+    Image(const ImageSource& image_source)
+        : source(image_source), has_attitude(false) {
+        set_filename(image_source.path);
+    }
+
     ~Image() {};
 
     inline void set_filename(const string file) {
@@ -35,6 +43,9 @@ public:
     }
 
     inline void set_gps_coordinates(double lat, double lon) {
+        if (coords.empty()) {
+            coords = Mat::zeros(1, 2, CV_64F);
+        }
         coords.at<double>(0,0) = lat;
         coords.at<double>(0,1) = lon;
     }
@@ -43,14 +54,36 @@ public:
         return coords;
     }
 
+    inline void set_attitude(const Attitude& new_attitude) {
+        attitude = new_attitude;
+        has_attitude = true;
+    }
+
+    // false when the gimbal angles aren't known
+    inline bool get_attitude(Attitude& out) const {
+        out = attitude;
+        return has_attitude;
+    }
+
     inline void set_camera_matrix(Mat K) {
-        K = K;
+        this->K = K;
     }
 
     inline Mat get_camera_matrix() const {
         return K;
     }
 
+    inline const ImageSource& get_source() const {
+        return source;
+    }
+
+    // decoded image kept in memory, get_image() won't read the file
+    inline void set_image(Mat image) {
+        img = image;
+        img_gray = Mat();
+        features.reset();
+    }
+
     Mat get_image();
     void add_transparency_layer(string filename);
 
@@ -79,6 +112,9 @@ protected:
     // file name
     string filename;
 
+    // encoded bytes in memory, if not read from filename
+    ImageSource source;
+
     // name
     string name;
 
@@ -91,6 +127,10 @@ protected:
     // coordinates in 3d space, can be gps coords
     // used to create a pairlist
     Mat coords;
+
+    // gimbal angles, see attitude.h
+    bool        has_attitude;
+    Attitude    attitude;
 };
 
 // serialization
@@ -1,5 +1,8 @@
 #include "image_pairs.h"
 #include "image.h"
+#include "metrics.h"
+
+#include <algorithm>
 
 #include <opencv2/calib3d/calib3d.hpp>
 
@@ -32,7 +35,8 @@ void ImagePair::write(FileStorage& fs, bool save_image) const {
     LOG(DEBUG) << "Serializing Image Pair";
 
     fs << "{"
-       << "F" << F;
+       << "F" << F
+       << "R" << R;
 
     write_matches(fs, "matches", matches);
 
@@ -54,6 +58,7 @@ void ImagePair::read(const FileNode& node, bool load_image) {
     LOG(DEBUG) << "De-serializing Image Pair";
 
     node["F"] >> F;
+    node["R"] >> R;
 
     read_matches(node["matches"], matches);
 
@@ -94,13 +99,9 @@ bool ImagePair::compute_matches() {
     return true;
 }
 
-bool ImagePair::compute_F_mat() {
-    // use RANSAC to get F matrix
-    // return better_matches for all the matches that make sense
+bool ImagePair::get_match_points(vector<Point2f>& pts1, vector<Point2f>& pts2) const {
     ImageFeaturesPtr features1 = image1->get_image_features();
     ImageFeaturesPtr features2 = image2->get_image_features();
-    vector<Point2f> pts1, pts2;
-    vector<unsigned char> status;
 
     if (!features1 || !features2) {
         LOG(ERROR) << "Unable to load features from images";
@@ -108,13 +109,32 @@ bool ImagePair::compute_F_mat() {
     }
 
     matches2points(matches, *features1, *features2, pts1, pts2);
+    return true;
+}
+
+bool ImagePair::compute_F_mat() {
+    // use RANSAC to get F matrix
+    // return better_matches for all the matches that make sense
+    vector<Point2f> pts1, pts2;
+    vector<unsigned char> status;
 
-    F = findFundamentalMat(pts1, pts2, FM_RANSAC, 1, 0.99, status);
+    if (!get_match_points(pts1, pts2)) {
+        return false;
+    }
+
+    Mat new_F = findFundamentalMat(pts1, pts2, FM_RANSAC, 1, 0.99, status);
 
     // XX (mtourne): stupid vector<unsigned char> to vector<char> conversion
-    keypointsInliers = vector<char> (status.begin(), status.end());
+    vector<char> inliers(status.begin(), status.end());
 
-    inliers_count = countNonZero(keypointsInliers);
+    return set_F_mat(new_F, inliers);
+}
+
+bool ImagePair::set_F_mat(const Mat& new_F, const vector<char>& inliers) {
+    F = new_F;
+    R = Mat();
+    keypointsInliers = inliers;
+    inliers_count = inliers.empty() ? 0 : countNonZero(keypointsInliers);
 
     LOG(DEBUG) << "F matrix: " << endl << F;
 
@@ -130,6 +150,112 @@ bool ImagePair::compute_F_mat() {
     return true;
 }
 
+bool ImagePair::compute_F_gravity(const GravityRansacOptions& options) {
+    Attitude attitude1, attitude2;
+    Mat K1, K2;
+    image1->get_camera_matrix().convertTo(K1, CV_64F);
+    image2->get_camera_matrix().convertTo(K2, CV_64F);
+    if (!image1->get_attitude(attitude1) || !image2->get_attitude(attitude2) ||
+        K1.rows != 3 || K1.cols != 3 || K2.rows != 3 || K2.cols != 3) {
+        return compute_F_mat();
+    }
+
+    vector<Point2f> pts1, pts2;
+    if (!get_match_points(pts1, pts2)) {
+        return false;
+    }
+
+    Mat new_F;
+    vector<char> inliers;
+    find_F_gravity(pts1, pts2, Matx33d(K1.ptr<double>()), Matx33d(K2.ptr<double>()),
+                   gravity_in_camera(attitude1), gravity_in_camera(attitude2),
+                   options, new_F, inliers);
+    Metrics::instance().add("verify.gravity");
+
+    return set_F_mat(new_F, inliers);
+}
+
+bool ImagePair::compute_motion(const RotationRansacOptions& options) {
+    Mat K1, K2;
+    image1->get_camera_matrix().convertTo(K1, CV_64F);
+    image2->get_camera_matrix().convertTo(K2, CV_64F);
+    if (K1.rows != 3 || K1.cols != 3 || K2.rows != 3 || K2.cols != 3) {
+        return compute_F_mat();
+    }
+
+    vector<Point2f> pts1, pts2;
+    if (!get_match_points(pts1, pts2)) {
+        return false;
+    }
+
+    Matx33d rotation;
+    vector<char> rotation_inliers;
+    find_rotation(pts1, pts2, Matx33d(K1.ptr<double>()), Matx33d(K2.ptr<double>()),
+                  options, rotation, rotation_inliers);
+    size_t rotation_count = rotation_inliers.size() -
+        std::count(rotation_inliers.begin(), rotation_inliers.end(), 0);
+
+    // most matches agree with a rotation, F would be degenerate
+    bool rotation_only = rotation_count >= MIN_INLIERS;
+    if (rotation_only && rotation_count >= options.min_ratio * pts1.size()) {
+        Metrics::instance().add("verify.rotation");
+        return set_rotation(rotation, rotation_inliers);
+    }
+
+    // else translation explains more than the margin
+    bool verified = compute_F_gravity();
+    if (rotation_only && rotation_count * (1 + options.margin) >= inliers_count) {
+        Metrics::instance().add("verify.rotation");
+        return set_rotation(rotation, rotation_inliers);
+    }
+
+    Metrics::instance().add("verify.general");
+    return verified;
+}
+
+bool ImagePair::set_rotation(const Matx33d& new_R, const vector<char>& inliers) {
+    R = Mat(new_R, true);
+    F = Mat();
+    keypointsInliers = inliers;
+    inliers_count = inliers.size() - std::count(inliers.begin(), inliers.end(), 0);
+
+    LOG(DEBUG) << "Rotation only, keeping " << inliers_count << " / "
+               << keypointsInliers.size();
+
+    if (inliers_count < MIN_INLIERS) {
+        LOG(DEBUG) << "Not enough inliers: " << inliers_count
+                   << ", at least " << MIN_INLIERS << "needed.";
+        return false;
+    }
+
+    return true;
+}
+
+void ImagePair::remap_features(const vector<int>& index1, const vector<int>& index2) {
+    Matches remapped;
+    vector<char> inliers;
+    remapped.reserve(matches.size());
+
+    for (size_t i = 0; i < matches.size(); i++) {
+        DMatch match = matches[i];
+        int query = match.queryIdx < (int) index1.size() ? index1[match.queryIdx] : -1;
+        int train = match.trainIdx < (int) index2.size() ? index2[match.trainIdx] : -1;
+        if (query < 0 || train < 0) {
+            continue;
+        }
+
+        match.queryIdx = query;
+        match.trainIdx = train;
+        remapped.push_back(match);
+        if (!keypointsInliers.empty()) {
+            inliers.push_back(keypointsInliers[i]);
+        }
+    }
+
+    matches.swap(remapped);
+    keypointsInliers.swap(inliers);
+}
+
 bool ImagePair::filterPutativeMatches() {
     if (keypointsInliers.size() <= 0) {
         LOG(ERROR) << "No keypoint inliers defined";
@@ -5,6 +5,8 @@
 #include "features2d.h"
 #include "image.h"
 #include "indexed_matches.h"
+#include "gravity_ransac.h"
+#include "rotation_ransac.h"
 
 #define MIN_FEATURE_MATCHES 50
 #define MIN_INLIERS 50
@@ -12,9 +14,10 @@
 // Image pair is a pair of images from the same camera at different point in the space
 class ImagePair {
  public:
-    ImagePair() {};
+    ImagePair()
+        : inliers_count(0) {};
     ImagePair(Image::ptr image1, Image::ptr image2)
-        : image1(image1), image2(image2) {};
+        : image1(image1), image2(image2), inliers_count(0) {};
 
     ~ImagePair() {};
 
@@ -23,6 +26,30 @@ class ImagePair {
     // compute fundamental matrix
     bool compute_F_mat();
 
+    // keep a fundamental matrix estimated elsewhere (see batch_ransac.h),
+    // false with less than MIN_INLIERS inliers like compute_F_mat()
+    bool set_F_mat(const Mat& new_F, const vector<char>& inliers);
+
+    // F with the 3 point solver when both images know their gimbal
+    // angles, see gravity_ransac.h. compute_F_mat() otherwise
+    bool compute_F_gravity(const GravityRansacOptions& options = GravityRansacOptions());
+
+    // rotation only model when the camera didn't move (panoramas), else
+    // the fundamental matrix (compute_F_gravity()), see
+    // rotation_ransac.h. compute_F_mat() without the camera matrices
+    bool compute_motion(const RotationRansacOptions& options = RotationRansacOptions());
+
+    // keep a rotation only model, F is left empty
+    bool set_rotation(const Matx33d& new_R, const vector<char>& inliers);
+
+    // renumber the matches after the features of the images were
+    // compacted (see compaction.h), index1[old] is the new index in the
+    // first image, -1 if gone. Matches losing a side are dropped.
+    void remap_features(const vector<int>& index1, const vector<int>& index2);
+
+    // pixel coordinates of the matches, pts1 in the first image
+    bool get_match_points(vector<Point2f>& pts1, vector<Point2f>& pts2) const;
+
     // compute camera matrix P
     int compute_camera_mat();
 
@@ -56,6 +83,27 @@ class ImagePair {
         matches = new_matches;
     }
 
+    inline Mat get_F() const {
+        return F;
+    }
+
+    // empty unless the pair is a rotation only one
+    inline Mat get_R() const {
+        return R;
+    }
+
+    inline bool is_rotation() const {
+        return !R.empty();
+    }
+
+    inline vector<char> get_inliers() const {
+        return keypointsInliers;
+    }
+
+    inline unsigned int get_inliers_count() const {
+        return inliers_count;
+    }
+
  private:
 
     Image::ptr          image1;
@@ -66,6 +114,10 @@ class ImagePair {
     // Fundamental Matrix between 2 images
     Mat                 F;
 
+    // rotation of the second camera from the first (b2 = R b1), instead
+    // of F when the camera only turned
+    Mat                 R;
+
     // vector of inliers associated to matches
     // keypointsInlierns[i] != 0 => matches[i] good match
     vector<char>        keypointsInliers;
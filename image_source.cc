@@ -0,0 +1,393 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+
+#include "rapidjson/document.h"
+
+#include "image_source.h"
+#include "util.h"
+
+MappedFile::ptr MappedFile::open(const std::string& filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        LOG(ERROR) << "Can't open file " << filename;
+        return ptr();
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        LOG(ERROR) << "Can't stat file " << filename;
+        close(fd);
+        return ptr();
+    }
+
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping keeps its own reference to the file
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        LOG(ERROR) << "Can't mmap file " << filename;
+        return ptr();
+    }
+
+    ptr file(new MappedFile());
+    file->addr = (const unsigned char*) addr;
+    file->length = st.st_size;
+    file->filename = filename;
+
+    return file;
+}
+
+MappedFile::~MappedFile() {
+    if (addr) {
+        munmap((void*) addr, length);
+    }
+}
+
+bool ImageSource::get_encoded(const unsigned char **data, size_t *length,
+                              std::vector<unsigned char>& storage) const {
+    if (in_memory()) {
+        *data = archive->data() + offset;
+        *length = size;
+        return true;
+    }
+
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file) {
+        LOG(ERROR) << "Can't read file " << path;
+        return false;
+    }
+
+    file.seekg(0, std::ios::end);
+    storage.resize(file.tellg());
+    file.seekg(0, std::ios::beg);
+
+    if (!file.read((char*) &storage[0], storage.size())) {
+        LOG(ERROR) << "Can't read file " << path;
+        return false;
+    }
+
+    *data = &storage[0];
+    *length = storage.size();
+    return true;
+}
+
+Mat ImageSource::decode(int flags) const {
+    if (!in_memory()) {
+        return imread(path, flags);
+    }
+
+    // header only Mat on the mapping, imdecode reads it in place
+    Mat buf(1, size, CV_8UC1, (void*) (archive->data() + offset));
+    return imdecode(buf, flags);
+}
+
+/////////////////
+/// manifests ///
+/////////////////
+
+static std::string trim(const std::string& s) {
+    size_t begin = s.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    size_t end = s.find_last_not_of(" \t\r\n");
+    return s.substr(begin, end - begin + 1);
+}
+
+static std::string relative_to(const std::string& base, const std::string& path) {
+    if (path.empty() || path[0] == '/' || base.empty()) {
+        return path;
+    }
+    return base + "/" + path;
+}
+
+static bool read_json_entry(const rapidjson::Value& entry, const std::string& base,
+                            ImageSource& source) {
+    if (entry.IsString()) {
+        source.path = relative_to(base, entry.GetString());
+        return true;
+    }
+
+    if (!entry.IsObject() || !entry.HasMember("path") || !entry["path"].IsString()) {
+        LOG(ERROR) << "Manifest entry without a path";
+        return false;
+    }
+
+    source.path = relative_to(base, entry["path"].GetString());
+
+    if (entry.HasMember("gps")) {
+        const rapidjson::Value& gps = entry["gps"];
+        if (!gps.IsArray() || gps.Size() < 2) {
+            LOG(ERROR) << "gps of " << source.path << " is not [lat, lon, alt]";
+            return false;
+        }
+        source.has_gps = true;
+        source.lat = gps[0u].GetDouble();
+        source.lon = gps[1u].GetDouble();
+        source.alt = gps.Size() > 2 ? gps[2u].GetDouble() : 0;
+    }
+
+    if (entry.HasMember("attitude")) {
+        const rapidjson::Value& attitude = entry["attitude"];
+        if (!attitude.IsArray() || attitude.Size() < 3) {
+            LOG(ERROR) << "attitude of " << source.path << " is not [pitch, roll, yaw, height]";
+            return false;
+        }
+        source.has_attitude = true;
+        source.attitude.pitch = attitude[0u].GetDouble();
+        source.attitude.roll = attitude[1u].GetDouble();
+        source.attitude.yaw = attitude[2u].GetDouble();
+        if (attitude.Size() > 3) {
+            source.attitude.has_height = true;
+            source.attitude.height = attitude[3u].GetDouble();
+        }
+    }
+
+    if (entry.HasMember("K")) {
+        const rapidjson::Value& k = entry["K"];
+        if (!k.IsArray() || k.Size() != 9) {
+            LOG(ERROR) << "K of " << source.path << " is not a 3x3 matrix";
+            return false;
+        }
+        source.K = Mat(3, 3, CV_64F);
+        for (rapidjson::SizeType i = 0; i < 9; i++) {
+            source.K.at<double>(i / 3, i % 3) = k[i].GetDouble();
+        }
+    }
+
+    return true;
+}
+
+static bool read_json_manifest(const std::string& content, const std::string& base,
+                               std::vector<ImageSource>& sources) {
+    rapidjson::Document doc;
+    doc.Parse<0>(content.c_str());
+    if (doc.HasParseError()) {
+        LOG(ERROR) << "Invalid JSON manifest";
+        return false;
+    }
+
+    const rapidjson::Value* images = &doc;
+    if (doc.IsObject() && doc.HasMember("images")) {
+        images = &doc["images"];
+    }
+    if (!images->IsArray()) {
+        LOG(ERROR) << "JSON manifest has no image list";
+        return false;
+    }
+
+    for (rapidjson::SizeType i = 0; i < images->Size(); i++) {
+        ImageSource source;
+        if (!read_json_entry((*images)[i], base, source)) {
+            return false;
+        }
+        sources.push_back(source);
+    }
+
+    return true;
+}
+
+bool read_manifest(const std::string& filename, std::vector<ImageSource>& sources) {
+    std::ifstream file(filename.c_str());
+    if (!file) {
+        LOG(ERROR) << "Can't read manifest " << filename;
+        return false;
+    }
+
+    std::stringstream ss;
+    ss << file.rdbuf();
+    std::string content = ss.str();
+    std::string base = dirname(filename);
+    size_t count = sources.size();
+
+    std::string start = trim(content).substr(0, 1);
+    if (start == "{" || start == "[") {
+        if (!read_json_manifest(content, base, sources)) {
+            return false;
+        }
+    } else {
+        std::string line;
+        while (std::getline(ss, line)) {
+            line = trim(line);
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            sources.push_back(ImageSource(relative_to(base, line)));
+        }
+    }
+
+    LOG(INFO) << "Manifest " << filename << ": "
+              << sources.size() - count << " images";
+
+    return true;
+}
+
+bool glob_images(const std::string& pattern, std::vector<ImageSource>& sources) {
+    std::string expr = pattern;
+    bool directory = false;
+
+    struct stat st;
+    if (stat(pattern.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        expr = pattern + "/*";
+        directory = true;
+    }
+
+    glob_t results;
+    int rc = glob(expr.c_str(), GLOB_TILDE | GLOB_BRACE, NULL, &results);
+    if (rc == GLOB_NOMATCH) {
+        LOG(WARNING) << "No image matching " << pattern;
+        globfree(&results);
+        return true;
+    }
+    if (rc != 0) {
+        LOG(ERROR) << "Can't glob " << pattern;
+        globfree(&results);
+        return false;
+    }
+
+    // glob results are sorted
+    for (size_t i = 0; i < results.gl_pathc; i++) {
+        std::string path = results.gl_pathv[i];
+        if (directory && !is_image_filename(path)) {
+            continue;
+        }
+        sources.push_back(ImageSource(path));
+    }
+
+    globfree(&results);
+    return true;
+}
+
+////////////
+/// tar ///
+///////////
+
+#define TAR_BLOCK 512
+
+// numeric fields are octal ascii, or base-256 when the high bit is set
+static size_t tar_number(const unsigned char *field, size_t len) {
+    size_t value = 0;
+
+    if (field[0] & 0x80) {
+        for (size_t i = 1; i < len; i++) {
+            value = (value << 8) | field[i];
+        }
+        return value;
+    }
+
+    for (size_t i = 0; i < len && field[i]; i++) {
+        if (field[i] >= '0' && field[i] <= '7') {
+            value = value * 8 + (field[i] - '0');
+        }
+    }
+    return value;
+}
+
+static std::string tar_string(const unsigned char *field, size_t len) {
+    size_t n = 0;
+    while (n < len && field[n]) {
+        n++;
+    }
+    return std::string((const char*) field, n);
+}
+
+// "path" record of a pax extended header, empty if none
+static std::string pax_path(const unsigned char *data, size_t size) {
+    size_t pos = 0;
+
+    // records are "<len> <key>=<value>\n"
+    while (pos < size) {
+        size_t len = 0;
+        size_t i = pos;
+        while (i < size && data[i] >= '0' && data[i] <= '9') {
+            len = len * 10 + (data[i++] - '0');
+        }
+        if (len == 0 || pos + len > size) {
+            break;
+        }
+
+        std::string record((const char*) data + i + 1, len - (i + 1 - pos) - 1);
+        if (record.compare(0, 5, "path=") == 0) {
+            return record.substr(5);
+        }
+        pos += len;
+    }
+
+    return "";
+}
+
+bool read_tar(const std::string& filename, std::vector<ImageSource>& sources) {
+    MappedFile::ptr archive = MappedFile::open(filename);
+    if (!archive) {
+        return false;
+    }
+
+    const unsigned char *data = archive->data();
+    size_t size = archive->size();
+    size_t pos = 0;
+    size_t count = 0;
+    std::string long_name;
+
+    while (pos + TAR_BLOCK <= size) {
+        const unsigned char *header = data + pos;
+
+        // end of archive: zero block
+        if (header[0] == 0) {
+            break;
+        }
+
+        std::string name = tar_string(header, 100);
+        size_t member_size = tar_number(header + 124, 12);
+        char type = header[156];
+
+        // POSIX ustar splits long names, old GNU headers use
+        // the same bytes for times
+        if (memcmp(header + 257, "ustar", 6) == 0 && header[345]) {
+            name = tar_string(header + 345, 155) + "/" + name;
+        }
+
+        size_t member = pos + TAR_BLOCK;
+        if (member + member_size > size) {
+            LOG(ERROR) << "Truncated tar archive " << filename;
+            return false;
+        }
+
+        if (type == 'L') {
+            // GNU long name of the next member
+            long_name = tar_string(data + member, member_size);
+        } else if (type == 'x') {
+            // pax extended header of the next member
+            long_name = pax_path(data + member, member_size);
+        } else if (type == '0' || type == '\0') {
+            if (!long_name.empty()) {
+                name = long_name;
+            }
+            if (is_image_filename(name)) {
+                ImageSource source(name);
+                source.archive = archive;
+                source.offset = member;
+                source.size = member_size;
+                sources.push_back(source);
+                count++;
+            }
+            long_name.clear();
+        } else if (type != 'g') {
+            long_name.clear();
+        }
+
+        pos = member + (member_size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    }
+
+    LOG(INFO) << "Archive " << filename << ": " << count << " images";
+
+    return true;
+}
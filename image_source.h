@@ -0,0 +1,106 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#ifndef IMAGE_SOURCE_H
+#define IMAGE_SOURCE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "photogram.h"
+#include "attitude.h"
+
+// Read only memory mapping of a whole file, unmapped with the last reference.
+class MappedFile {
+ public:
+    typedef std::shared_ptr<MappedFile>  ptr;
+
+    // NULL if the file can't be opened or mapped
+    static ptr open(const std::string& filename);
+
+    ~MappedFile();
+
+    inline const unsigned char* data() const {
+        return addr;
+    }
+
+    inline size_t size() const {
+        return length;
+    }
+
+    inline const std::string& get_filename() const {
+        return filename;
+    }
+
+ private:
+    MappedFile()
+        : addr(NULL), length(0)
+    {};
+
+    const unsigned char    *addr;
+    size_t                  length;
+    std::string             filename;
+};
+
+// Where an image comes from: a file on disk or a member of a mapped
+// archive, with optional metadata known ahead of EXIF.
+struct ImageSource {
+    ImageSource()
+        : offset(0), size(0), has_gps(false), lat(0), lon(0), alt(0),
+          has_attitude(false)
+    {};
+
+    ImageSource(const std::string& path)
+        : path(path), offset(0), size(0),
+          has_gps(false), lat(0), lon(0), alt(0), has_attitude(false)
+    {};
+
+    // file name, or member name inside the archive
+    std::string         path;
+
+    // archive holding the encoded bytes, NULL for plain files
+    MappedFile::ptr     archive;
+    size_t              offset;
+    size_t              size;
+
+    // known gps position
+    bool                has_gps;
+    double              lat;
+    double              lon;
+    double              alt;
+
+    // known gimbal angles, else from XMP
+    bool                has_attitude;
+    Attitude            attitude;
+
+    // known intrinsic matrix, empty to use EXIF
+    Mat                 K;
+
+    inline bool in_memory() const {
+        return archive.get() != NULL;
+    }
+
+    // encoded image bytes, points into the archive mapping when
+    // possible, otherwise the file is read into storage
+    bool get_encoded(const unsigned char **data, size_t *length,
+                     std::vector<unsigned char>& storage) const;
+
+    // decode the image, without copying archive members
+    Mat decode(int flags) const;
+};
+
+// one path per line (# comments), or JSON:
+//   { "images": [ "a.jpg", { "path": "b.jpg", "gps": [lat, lon, alt],
+//                            "attitude": [pitch, roll, yaw, height],
+//                            "K": [fx, 0, cx, 0, fy, cy, 0, 0, 1] } ] }
+// (height above the ground is optional, see attitude.h)
+// relative paths are relative to the manifest
+bool read_manifest(const std::string& filename, std::vector<ImageSource>& sources);
+
+// shell glob, or all the images of a directory
+bool glob_images(const std::string& pattern, std::vector<ImageSource>& sources);
+
+// images stored in an uncompressed tar archive, read through mmap
+bool read_tar(const std::string& filename, std::vector<ImageSource>& sources);
+
+#endif // !IMAGE_SOURCE_H
@@ -0,0 +1,407 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "ingest.h"
+#include "batch_ransac.h"
+#include "haversine_dist.h"
+#include "metrics.h"
+#include "util.h"
+
+//////////////////////////
+/// directory watcher ///
+/////////////////////////
+
+DirectoryWatcher::~DirectoryWatcher() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool DirectoryWatcher::open(const std::string& dir) {
+    directory = dir;
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        LOG(ERROR) << "Can't init inotify: " << strerror(errno);
+        return false;
+    }
+
+    // uploads are either written in place or renamed once complete
+    wd = inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd < 0) {
+        LOG(ERROR) << "Can't watch " << directory << ": " << strerror(errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool DirectoryWatcher::wait(std::vector<std::string>& paths, int timeout_ms) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    int rc = poll(&pfd, 1, timeout_ms);
+    if (rc < 0 && errno != EINTR) {
+        LOG(ERROR) << "Can't poll inotify: " << strerror(errno);
+        return false;
+    }
+    if (rc <= 0) {
+        return false;
+    }
+
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len <= 0) {
+            // EAGAIN, all the events are read
+            break;
+        }
+
+        for (char *p = buf; p < buf + len; ) {
+            const struct inotify_event *event = (const struct inotify_event *) p;
+            if (event->len > 0 && !(event->mask & IN_ISDIR)) {
+                paths.push_back(directory + "/" + event->name);
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    return true;
+}
+
+//////////////
+/// tracks ///
+//////////////
+
+size_t IncrementalTracks::node(size_t image, int feature) {
+    uint64_t key = ((uint64_t) image << 32) | (uint32_t) feature;
+
+    auto it = nodes.find(key);
+    if (it != nodes.end()) {
+        return it->second;
+    }
+
+    size_t n = parent.size();
+    nodes[key] = n;
+    parent.push_back(n);
+    rank.push_back(0);
+    keys.push_back(key);
+    return n;
+}
+
+size_t IncrementalTracks::find(size_t n) {
+    // path halving
+    while (parent[n] != n) {
+        parent[n] = parent[parent[n]];
+        n = parent[n];
+    }
+    return n;
+}
+
+void IncrementalTracks::add_pair(size_t image1, size_t image2, const Matches& matches,
+                                 const vector<char>& inliers) {
+    for (size_t i = 0; i < matches.size(); i++) {
+        if (i < inliers.size() && !inliers[i]) {
+            continue;
+        }
+
+        // query features are from the first image, see matches2points()
+        size_t a = find(node(image1, matches[i].queryIdx));
+        size_t b = find(node(image2, matches[i].trainIdx));
+        if (a == b) {
+            continue;
+        }
+
+        if (rank[a] < rank[b]) {
+            std::swap(a, b);
+        }
+        parent[b] = a;
+        if (rank[a] == rank[b]) {
+            rank[a]++;
+        }
+    }
+}
+
+void IncrementalTracks::get_tracks(std::map<size_t, std::map<size_t, int> >& tracks,
+                                   size_t min_length) {
+    tracks.clear();
+
+    // roots with two features of the same image
+    std::set<size_t> conflicts;
+    for (size_t n = 0; n < parent.size(); n++) {
+        size_t root = find(n);
+        size_t image = keys[n] >> 32;
+        int feature = (int) (keys[n] & 0xffffffff);
+
+        std::map<size_t, int>& track = tracks[root];
+        auto it = track.find(image);
+        if (it != track.end() && it->second != feature) {
+            conflicts.insert(root);
+        }
+        track[image] = feature;
+    }
+
+    for (auto it = tracks.begin(); it != tracks.end(); ) {
+        if (conflicts.count(it->first) || it->second.size() < min_length) {
+            it = tracks.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+/////////////////
+/// neighbors ///
+/////////////////
+
+void GeoPositions::add(const Mat& position) {
+    double q[4] = { NAN, NAN, NAN, NAN };
+    if (!position.empty()) {
+        haversine_prepare(position.at<double>(0, 0), position.at<double>(0, 1), q);
+    }
+    sin_lat.push_back(q[0]);
+    cos_lat.push_back(q[1]);
+    sin_lon.push_back(q[2]);
+    cos_lon.push_back(q[3]);
+}
+
+std::vector<size_t> select_neighbors(const std::vector<Mat>& coords, size_t index,
+                                     const IngestOptions& options,
+                                     const std::vector<Footprint>* footprints,
+                                     const GeoPositions* positions) {
+    std::vector<size_t> neighbors;
+
+    size_t first = index > (size_t) options.temporal ? index - options.temporal : 0;
+    for (size_t i = first; i < index; i++) {
+        neighbors.push_back(i);
+    }
+
+    const Mat& position = coords[index];
+    if (position.empty() || options.spatial <= 0) {
+        return neighbors;
+    }
+
+    const Footprint *footprint = footprints ? &(*footprints)[index] : NULL;
+    if (footprint && footprint->radius_km <= 0) {
+        footprint = NULL;
+    }
+
+    // gps distances to all the earlier images in one pass
+    GeoPositions prepared;
+    if (!positions || positions->size() < first) {
+        for (size_t i = 0; i < first; i++) {
+            prepared.add(coords[i]);
+        }
+        positions = &prepared;
+    }
+    double q[4];
+    haversine_prepare(position.at<double>(0, 0), position.at<double>(0, 1), q);
+    std::vector<double> a(first);
+    if (first > 0) {
+        GeoTable table = positions->table();
+        simd_kernels().haversine_batch(q, &table, first, &a[0]);
+    }
+
+    // (distance, image) of the earlier images in range, overlapping
+    // footprints by how far they are from not overlapping (< 0)
+    std::vector<std::pair<double, size_t> > nearby;
+    for (size_t i = 0; i < first; i++) {
+        if (footprint && (*footprints)[i].radius_km > 0) {
+            const Footprint& other = (*footprints)[i];
+            double km = haversine<double>(footprint->lat, footprint->lon, other.lat, other.lon);
+            double slack = km - footprint->radius_km - other.radius_km;
+            if (slack <= 0) {
+                nearby.push_back(std::make_pair(slack, i));
+            }
+            continue;
+        }
+
+        if (coords[i].empty()) {
+            continue;
+        }
+        double km = haversine_km(a[i]);
+        if (km <= options.radius_km) {
+            nearby.push_back(std::make_pair(km, i));
+        }
+    }
+
+    size_t count = std::min(nearby.size(), (size_t) options.spatial);
+    std::partial_sort(nearby.begin(), nearby.begin() + count, nearby.end());
+    for (size_t i = 0; i < count; i++) {
+        neighbors.push_back(nearby[i].second);
+    }
+
+    return neighbors;
+}
+
+////////////////
+/// ingestor ///
+////////////////
+
+// where the camera looks on the ground, radius 0 when unknown
+static Footprint image_footprint(const Image::ptr& image) {
+    Footprint footprint;
+    Mat position = image->get_coordinates();
+    Attitude attitude;
+    Mat K;
+    image->get_camera_matrix().convertTo(K, CV_64F);
+    if (position.empty() || !image->get_attitude(attitude) || K.rows != 3 || K.cols != 3) {
+        return footprint;
+    }
+
+    camera_footprint(position.at<double>(0, 0), position.at<double>(0, 1), attitude,
+                     Matx33d(K.ptr<double>()), footprint);
+    return footprint;
+}
+
+bool Ingestor::add(const ImageSource& source) {
+    // a partial file throws on decode
+    Image::ptr image;
+    try {
+        image = load(source);
+        if (image && image->get_image_gray().empty()) {
+            image.reset();
+        }
+    } catch (const std::exception&) {
+        image.reset();
+    }
+    if (!image) {
+        LOG(ERROR) << "Can't load " << source.path;
+        return false;
+    }
+
+    // extract now, the pairs reuse the features
+    if (!image->get_image_features()) {
+        LOG(ERROR) << "No features in " << source.path;
+        return false;
+    }
+
+    // images already in the bundle are neighbors too
+    size_t index = bundle.image_count();
+    while (coords.size() < index) {
+        Image::ptr known = bundle.get_image(coords.size());
+        coords.push_back(known->get_coordinates());
+        footprints.push_back(image_footprint(known));
+    }
+
+    bundle.add_image(image);
+    coords.push_back(image->get_coordinates());
+    footprints.push_back(image_footprint(image));
+    Metrics::instance().add("ingest.images");
+    while (positions.size() < coords.size()) {
+        positions.add(coords[positions.size()]);
+    }
+
+    std::vector<size_t> neighbors = select_neighbors(coords, index, options, &footprints,
+                                                     &positions);
+
+    // matched pairs are verified in one batch
+    std::vector<ImagePair> pairs, unmatched;
+    std::vector<size_t> matched_neighbors;
+    for (size_t neighbor : neighbors) {
+        ImagePair pair(bundle.get_image(neighbor), image);
+        if (pair.compute_matches()) {
+            pairs.push_back(pair);
+            matched_neighbors.push_back(neighbor);
+        } else {
+            unmatched.push_back(pair);
+        }
+    }
+
+    std::vector<char> verified;
+    if (options.gravity) {
+        verified.resize(pairs.size());
+        parallel_for_index(pairs.size(), [&](size_t i, int) {
+                verified[i] = pairs[i].compute_F_gravity();
+            });
+    } else {
+        batch_compute_F(pairs, BatchRansacOptions(), verified);
+    }
+
+    size_t verified_count = 0;
+    for (size_t i = 0; i < pairs.size(); i++) {
+        on_pair(pairs[i], verified[i]);
+
+        if (verified[i]) {
+            tracks.add_pair(matched_neighbors[i], index, pairs[i].get_matches(),
+                            pairs[i].get_inliers());
+            verified_count++;
+        }
+    }
+    for (ImagePair& pair : unmatched) {
+        on_pair(pair, false);
+    }
+
+    Metrics::instance().add("ingest.pairs", neighbors.size());
+    Metrics::instance().add("ingest.verified_pairs", verified_count);
+
+    LOG(INFO) << "Ingested " << image->get_name() << ": " << verified_count
+              << " of " << neighbors.size() << " neighbors verified, "
+              << tracks.feature_count() << " features in tracks";
+    return true;
+}
+
+bool Ingestor::run() {
+    DirectoryWatcher watcher;
+
+    // watch before listing, images arriving in between are seen twice
+    // at worst
+    if (!watcher.open(options.directory)) {
+        return false;
+    }
+
+    std::vector<ImageSource> existing;
+    if (!glob_images(options.directory, existing)) {
+        return false;
+    }
+
+    std::vector<std::string> paths;
+    for (const ImageSource& source : existing) {
+        paths.push_back(source.path);
+    }
+
+    int timeout_ms = options.idle_timeout > 0 ? options.idle_timeout * 1000 : -1;
+
+    // the flight may be over already
+    string marker = options.directory + "/" + options.marker;
+    bool done = access(marker.c_str(), F_OK) == 0;
+
+    while (true) {
+        // arrival order, then name order for the initial listing
+        for (const std::string& path : paths) {
+            if (basename(path) == options.marker) {
+                done = true;
+                continue;
+            }
+            // seen once loaded: a file listed while it's still written
+            // comes again with its close event
+            if (!is_image_filename(path) || seen.count(path)) {
+                continue;
+            }
+            if (add(ImageSource(path))) {
+                seen.insert(path);
+            }
+        }
+        paths.clear();
+
+        if (done) {
+            break;
+        }
+        if (!watcher.wait(paths, timeout_ms)) {
+            LOG(INFO) << "No new image for " << options.idle_timeout
+                      << " seconds, ending ingestion";
+            break;
+        }
+    }
+
+    return true;
+}
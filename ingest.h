@@ -0,0 +1,197 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Incremental ingestion of a directory filled during a flight.
+//
+// The directory is watched with inotify (closed after writing, or
+// renamed into it), images already there are ingested first. Each new
+// image is extracted on arrival and matched only against its neighbors:
+//  - temporal: the images that arrived just before it,
+//  - spatial: the nearest earlier images with a gps position, within
+//    radius_km. When both images know their gimbal angles and height
+//    (attitude.h), their ground footprints must overlap instead, the
+//    most overlapping first: oblique images are planned by where they
+//    look, not where the drone was.
+// Verified pairs go to the bundle as they are found, and their inlier
+// matches update the tracks with a union-find, without rebuilding.
+//
+// Ingestion ends when the marker file appears in the directory, or
+// after idle_timeout seconds without a new image.
+
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "photogram.h"
+#include "attitude.h"
+#include "bundle.h"
+#include "image.h"
+#include "image_pairs.h"
+#include "image_source.h"
+#include "simd_kernels.h"
+
+struct IngestOptions {
+    IngestOptions()
+        : temporal(3), spatial(8), radius_km(0.2), idle_timeout(600),
+          marker(".done"), gravity(false)
+    {};
+
+    // directory to watch, empty when not ingesting
+    std::string directory;
+
+    // previous images matched with each new one
+    int         temporal;
+
+    // nearest images by gps matched with each new one
+    int         spatial;
+    double      radius_km;
+
+    // seconds without a new image before giving up, 0 to wait forever
+    int         idle_timeout;
+
+    // file name ending the ingestion
+    std::string marker;
+
+    // verify with the gimbal angles (ImagePair::compute_F_gravity())
+    // instead of the batched 8 point RANSAC
+    bool        gravity;
+};
+
+// New files of a directory, through inotify.
+class DirectoryWatcher {
+ public:
+    DirectoryWatcher()
+        : fd(-1), wd(-1)
+    {};
+
+    ~DirectoryWatcher();
+
+    // start watching, false on error
+    bool open(const std::string& directory);
+
+    // wait up to timeout_ms (< 0 forever) for files to be written or
+    // moved into the directory, appends their paths. false on timeout
+    // or error.
+    bool wait(std::vector<std::string>& paths, int timeout_ms);
+
+ private:
+    int             fd;
+    int             wd;
+    std::string     directory;
+};
+
+// Something taking the verified pairs to make tracks.
+class PairTracks {
+ public:
+    virtual ~PairTracks() {};
+
+    // the inlier matches of a pair of images (bundle indexes)
+    virtual void add_pair(size_t image1, size_t image2, const Matches& matches,
+                          const vector<char>& inliers) = 0;
+};
+
+// Tracks updated one verified pair at a time: features are nodes of a
+// union-find, each inlier match joins two of them.
+class IncrementalTracks : public PairTracks {
+ public:
+    // join the inlier matches of a pair of images (bundle indexes)
+    void add_pair(size_t image1, size_t image2, const Matches& matches,
+                  const vector<char>& inliers);
+
+    inline size_t feature_count() const {
+        return parent.size();
+    }
+
+    // tracks of at least min_length images, without two features of
+    // the same image: track id -> (image, feature)
+    void get_tracks(std::map<size_t, std::map<size_t, int> >& tracks,
+                    size_t min_length = 2);
+
+ private:
+    size_t node(size_t image, int feature);
+    size_t find(size_t node);
+
+    std::unordered_map<uint64_t, size_t>  nodes;
+    std::vector<size_t>                     parent;
+    std::vector<uint32_t>                   rank;
+
+    // (image, feature) of each node
+    std::vector<uint64_t>                   keys;
+};
+
+// gps positions prepared once for haversine_batch(), per image, NaN
+// without one
+struct GeoPositions {
+    void add(const Mat& position);
+
+    inline size_t size() const {
+        return sin_lat.size();
+    }
+
+    inline GeoTable table() const {
+        GeoTable geo = { &sin_lat[0], &cos_lat[0], &sin_lon[0], &cos_lon[0] };
+        return geo;
+    }
+
+    std::vector<double>     sin_lat;
+    std::vector<double>     cos_lat;
+    std::vector<double>     sin_lon;
+    std::vector<double>     cos_lon;
+};
+
+// images to match a new one with: the temporal ones before it, and the
+// spatial nearest with a position (empty Mat without), or an overlapping
+// footprint (radius 0 without). positions are coords prepared for
+// haversine_batch(), made on the fly when NULL.
+std::vector<size_t> select_neighbors(const std::vector<Mat>& coords, size_t index,
+                                     const IngestOptions& options,
+                                     const std::vector<Footprint>* footprints = NULL,
+                                     const GeoPositions* positions = NULL);
+
+class Ingestor {
+ public:
+    // image with its camera matrix from a source
+    typedef std::function<Image::ptr(const ImageSource&)>  LoadFunction;
+
+    // a pair was matched, verified or not
+    typedef std::function<void(ImagePair&, bool)>          PairFunction;
+
+    Ingestor(const IngestOptions& options, Bundle& bundle,
+             LoadFunction load, PairFunction on_pair)
+        : options(options), bundle(bundle), load(load), on_pair(on_pair)
+    {};
+
+    // add an image to the bundle, match it with its neighbors. false if
+    // it can't be loaded (yet: a file still being written)
+    bool add(const ImageSource& source);
+
+    // ingest the directory until the marker or the idle timeout, false
+    // if it can't be watched. A file that doesn't load is tried again
+    // when it's written next
+    bool run();
+
+    inline IncrementalTracks& get_tracks() {
+        return tracks;
+    }
+
+ private:
+    IngestOptions           options;
+    Bundle&                 bundle;
+    LoadFunction            load;
+    PairFunction            on_pair;
+
+    std::set<std::string>   seen;
+    std::vector<Mat>        coords;
+    std::vector<Footprint>  footprints;
+    GeoPositions            positions;
+    IncrementalTracks       tracks;
+};
+
+#endif // !INGEST_H
@@ -0,0 +1,165 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Keypoints as a structure of arrays.
+//
+// cv::KeyPoint is 28 bytes with response, octave and class_id, and
+// gathering positions through match indexes (matches2points, RANSAC)
+// pulls a whole cache line per point. Here positions are two dense
+// float arrays, scale and orientation live apart, responses are only
+// kept when asked for: 16 bytes per keypoint, and the feature files
+// store one float table instead of 7 values per keypoint.
+//
+// scale and orientation follow cv::KeyPoint size (diameter, pixels) and
+// angle. to_keypoints() / assign() adapt to OpenCV APIs.
+
+#ifndef KEYPOINTS_H
+#define KEYPOINTS_H
+
+#include <vector>
+
+#include <opencv2/features2d/features2d.hpp>
+
+#include "photogram.h"
+
+typedef std::vector<KeyPoint>   Keypoints;
+
+struct KeypointSet {
+    std::vector<float>  x;
+    std::vector<float>  y;
+    std::vector<float>  scale;
+    std::vector<float>  orientation;
+
+    // empty, or one per keypoint
+    std::vector<float>  response;
+
+    inline size_t size() const {
+        return x.size();
+    }
+
+    inline bool empty() const {
+        return x.empty();
+    }
+
+    inline bool has_response() const {
+        return !response.empty();
+    }
+
+    void clear() {
+        x.clear();
+        y.clear();
+        scale.clear();
+        orientation.clear();
+        response.clear();
+    }
+
+    void reserve(size_t n) {
+        x.reserve(n);
+        y.reserve(n);
+        scale.reserve(n);
+        orientation.reserve(n);
+    }
+
+    // new keypoints are at 0, 0
+    void resize(size_t n) {
+        x.resize(n);
+        y.resize(n);
+        scale.resize(n);
+        orientation.resize(n);
+        if (has_response()) {
+            response.resize(n);
+        }
+    }
+
+    // only without responses
+    inline void push_back(float px, float py, float s, float angle) {
+        x.push_back(px);
+        y.push_back(py);
+        scale.push_back(s);
+        orientation.push_back(angle);
+    }
+
+    inline Point2f pt(size_t i) const {
+        return Point2f(x[i], y[i]);
+    }
+
+    // octave and class_id are not kept
+    KeyPoint at(size_t i) const {
+        return KeyPoint(x[i], y[i], scale[i], orientation[i],
+                        has_response() ? response[i] : 0);
+    }
+
+    void assign(const Keypoints& keypoints, bool with_response = false) {
+        clear();
+        reserve(keypoints.size());
+        for (const KeyPoint& kp : keypoints) {
+            push_back(kp.pt.x, kp.pt.y, kp.size, kp.angle);
+            if (with_response) {
+                response.push_back(kp.response);
+            }
+        }
+    }
+
+    void to_keypoints(Keypoints& keypoints) const {
+        keypoints.resize(size());
+        for (size_t i = 0; i < size(); i++) {
+            keypoints[i] = at(i);
+        }
+    }
+
+    // serialization, one row per keypoint: x, y, scale, orientation
+    // [, response]
+    void write(FileStorage& fs, const string& name) const {
+        int cols = has_response() ? 5 : 4;
+        Mat table(size(), cols, CV_32F);
+        for (size_t i = 0; i < size(); i++) {
+            float *row = table.ptr<float>(i);
+            row[0] = x[i];
+            row[1] = y[i];
+            row[2] = scale[i];
+            row[3] = orientation[i];
+            if (cols == 5) {
+                row[4] = response[i];
+            }
+        }
+        fs << name << table;
+    }
+
+    // deserialization, also reads a vector<KeyPoint> (older files)
+    void read(const FileNode& node) {
+        clear();
+        if (node.empty()) {
+            return;
+        }
+
+        if (node.isSeq()) {
+            Keypoints keypoints;
+            cv::read(node, keypoints);
+            assign(keypoints, true);
+            return;
+        }
+
+        Mat table;
+        node >> table;
+        if (table.empty()) {
+            return;
+        }
+        assert(table.type() == CV_32F && (table.cols == 4 || table.cols == 5));
+
+        resize(table.rows);
+        if (table.cols == 5) {
+            response.resize(table.rows);
+        }
+        for (int i = 0; i < table.rows; i++) {
+            const float *row = table.ptr<float>(i);
+            x[i] = row[0];
+            y[i] = row[1];
+            scale[i] = row[2];
+            orientation[i] = row[3];
+            if (table.cols == 5) {
+                response[i] = row[4];
+            }
+        }
+    }
+};
+
+#endif // !KEYPOINTS_H
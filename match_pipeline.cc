@@ -0,0 +1,139 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include "match_pipeline.h"
+#include "pipeline.hpp"
+#include "util.h"
+
+// an image between stages
+struct PipelineImage {
+    PipelineImage()
+        : index(0)
+    {};
+
+    size_t          index;
+    Image::ptr      image;
+};
+
+// a pair between stages, image1 < image2 (source indexes)
+struct PipelinePair {
+    PipelinePair()
+        : image1(0), image2(0), matched(false), verified(false)
+    {};
+
+    size_t          image1;
+    size_t          image2;
+    ImagePair       pair;
+    bool            matched;
+    bool            verified;
+};
+
+static int workers(int count) {
+    return count > 0 ? count : default_thread_count();
+}
+
+void match_pipeline(const std::vector<ImageSource>& sources,
+                    const MatchPipelineOptions& options,
+                    Ingestor::LoadFunction load, Bundle& bundle,
+                    Ingestor::PairFunction on_pair, PairTracks& tracks) {
+    size_t capacity = options.queue_capacity;
+    std::vector<Image::ptr> images(sources.size());
+
+    // the stage workers add up past the cores, --threads bounds those
+    // computing at once
+    Pipeline pipeline("match", default_thread_count());
+    PipelineQueue<size_t> *indexes = pipeline.queue<size_t>("sources", capacity);
+    PipelineQueue<PipelineImage> *decoded = pipeline.queue<PipelineImage>("decoded", capacity);
+    PipelineQueue<PipelineImage> *extracted = pipeline.queue<PipelineImage>("extracted", capacity);
+    PipelineQueue<PipelinePair> *planned = pipeline.queue<PipelinePair>("planned", capacity);
+    PipelineQueue<PipelinePair> *matched = pipeline.queue<PipelinePair>("matched", capacity);
+    PipelineQueue<PipelinePair> *verified = pipeline.queue<PipelinePair>("verified", capacity);
+
+    pipeline.source<size_t>("sources", indexes, [&](const PipelineEmit<size_t>& emit) {
+            for (size_t i = 0; i < sources.size(); i++) {
+                emit(i);
+            }
+        });
+
+    pipeline.stage<size_t, PipelineImage>(
+        "decode", workers(options.decode_workers), indexes, decoded,
+        [&](size_t& i, const PipelineEmit<PipelineImage>& emit) {
+            PipelineImage item;
+            item.index = i;
+            item.image = load(sources[i]);
+            emit(item);
+        });
+
+#ifdef USE_SIFT_GPU
+    // SiftGPU runs one image at a time on its own thread (features2d.cc),
+    // more workers would only wait for it
+    int extract_workers = 1;
+#else
+    int extract_workers = workers(options.extract_workers);
+#endif
+    pipeline.stage<PipelineImage, PipelineImage>(
+        "extract", extract_workers, decoded, extracted,
+        [&](PipelineImage& item, const PipelineEmit<PipelineImage>& emit) {
+            if (!item.image->get_image_features()) {
+                LOG(ERROR) << "No features in " << sources[item.index].path;
+            }
+            emit(item);
+        });
+
+    // one worker: the arrived images are its own state
+    pipeline.stage<PipelineImage, PipelinePair>(
+        "plan", 1, extracted, planned,
+        [&](PipelineImage& item, const PipelineEmit<PipelinePair>& emit) {
+            images[item.index] = item.image;
+            for (size_t i = 0; i < images.size(); i++) {
+                if (i == item.index || !images[i]) {
+                    continue;
+                }
+
+                PipelinePair pair;
+                pair.image1 = std::min(i, item.index);
+                pair.image2 = std::max(i, item.index);
+                emit(pair);
+            }
+        });
+
+    pipeline.stage<PipelinePair, PipelinePair>(
+        "match", workers(options.match_workers), planned, matched,
+        [&](PipelinePair& item, const PipelineEmit<PipelinePair>& emit) {
+            item.pair = ImagePair(images[item.image1], images[item.image2]);
+            item.matched = item.pair.compute_matches();
+            emit(item);
+        });
+
+    // F matrix from matches with 8 point RANSAC, 3 points with gravity,
+    // or a rotation. One pair at a time as they arrive, the batched
+    // RANSAC (batch_ransac.h) is for the pair sets of the other modes
+    pipeline.stage<PipelinePair, PipelinePair>(
+        "verify", workers(options.verify_workers), matched, verified,
+        [&](PipelinePair& item, const PipelineEmit<PipelinePair>& emit) {
+            if (!item.matched) {
+                item.verified = false;
+            } else if (options.rotation) {
+                item.verified = item.pair.compute_motion();
+            } else if (options.gravity) {
+                item.verified = item.pair.compute_F_gravity();
+            } else {
+                item.verified = item.pair.compute_F_mat();
+            }
+            emit(item);
+        });
+
+    pipeline.sink<PipelinePair>("tracks", 1, verified, [&](PipelinePair& item) {
+            on_pair(item.pair, item.verified);
+            if (item.verified) {
+                tracks.add_pair(item.image1, item.image2, item.pair.get_matches(),
+                                item.pair.get_inliers());
+            }
+        });
+
+    pipeline.run();
+
+    // pairs reference the images by pointer, their order can come last
+    for (size_t i = 0; i < images.size(); i++) {
+        bundle.add_image(images[i]);
+    }
+}
@@ -0,0 +1,62 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Exhaustive pair matching as a stage graph (see pipeline.hpp):
+//
+//  sources -> decode -> extract -> pair plan -> match -> verify -> tracks
+//
+// The pair plan emits a pair as soon as both of its images are
+// extracted, so the pairs of the first images are matched and verified
+// while the last ones are still decoded and extracted. Queues are
+// bounded: a slow stage holds the stages before it instead of piling up
+// decoded images in memory.
+//
+// The tracks stage is the only one touching the bundle: verified pairs
+// are added in completion order, and their inliers update the tracks.
+
+#ifndef MATCH_PIPELINE_H
+#define MATCH_PIPELINE_H
+
+#include <functional>
+#include <vector>
+
+#include "photogram.h"
+#include "bundle.h"
+#include "image.h"
+#include "image_pairs.h"
+#include "image_source.h"
+#include "ingest.h"
+
+struct MatchPipelineOptions {
+    MatchPipelineOptions()
+        : decode_workers(2), extract_workers(0), match_workers(2),
+          verify_workers(2), queue_capacity(32), rotation(false), gravity(false)
+    {};
+
+    // workers of each stage, <= 0 for all cores. Extraction has one
+    // with SiftGPU, which runs one image at a time. At most
+    // default_thread_count() of them compute at once, over all stages
+    int     decode_workers;
+    int     extract_workers;
+    int     match_workers;
+    int     verify_workers;
+
+    // items between two stages
+    int     queue_capacity;
+
+    // verify with the rotation only model when it fits (panoramas), see
+    // ImagePair::compute_motion()
+    bool    rotation;
+
+    // verify with the 3 point solver when the gimbal angles are known,
+    // see ImagePair::compute_F_gravity()
+    bool    gravity;
+};
+
+// match all the pairs of sources, images are added to the bundle in
+// source order
+void match_pipeline(const std::vector<ImageSource>& sources,
+                    const MatchPipelineOptions& options,
+                    Ingestor::LoadFunction load, Bundle& bundle,
+                    Ingestor::PairFunction on_pair, PairTracks& tracks);
+
+#endif // !MATCH_PIPELINE_H
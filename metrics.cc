@@ -0,0 +1,62 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <algorithm>
+
+#include "metrics.h"
+
+Metrics& Metrics::instance() {
+    static Metrics metrics;
+    return metrics;
+}
+
+void Metrics::add(const std::string& key, double value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    counters[key] += value;
+}
+
+void Metrics::set(const std::string& key, const std::string& value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    values[key] = value;
+}
+
+double Metrics::get(const std::string& key) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<std::string, double>::const_iterator it = counters.find(key);
+    if (it == counters.end()) {
+        return 0;
+    }
+    return it->second;
+}
+
+// FileStorage keys can't contain dots
+static std::string storage_key(const std::string& key) {
+    std::string s = key;
+    std::replace(s.begin(), s.end(), '.', '_');
+    return s;
+}
+
+void Metrics::write(FileStorage& fs) const {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    fs << "{";
+    for (auto value : values) {
+        fs << storage_key(value.first) << value.second;
+    }
+    for (auto counter : counters) {
+        fs << storage_key(counter.first) << counter.second;
+    }
+    fs << "}";
+}
+
+bool Metrics::write_report(const std::string& filename) const {
+    FileStorage fs(filename, FileStorage::WRITE);
+    if (!fs.isOpened()) {
+        LOG(ERROR) << "Unable to write metrics report: " << filename;
+        return false;
+    }
+
+    fs << "metrics" << *this;
+    fs.release();
+
+    return true;
+}
@@ -0,0 +1,45 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "photogram.h"
+
+// Process wide run metrics: named counters and string values,
+// dumped as a report at the end of a run. Thread safe.
+class Metrics {
+ public:
+    static Metrics& instance();
+
+    // add to a counter (created at 0)
+    void add(const std::string& key, double value = 1);
+
+    // set a string value (chosen code path, build options ..)
+    void set(const std::string& key, const std::string& value);
+
+    double get(const std::string& key) const;
+
+    // serialization
+    void write(FileStorage& fs) const;
+
+    // write the report to a file
+    bool write_report(const std::string& filename) const;
+
+ private:
+    Metrics() {};
+
+    mutable std::mutex                  mutex;
+    std::map<std::string, double>       counters;
+    std::map<std::string, std::string>  values;
+};
+
+// serialization
+inline void write(FileStorage& fs, const std::string&, const Metrics& x) {
+    x.write(fs);
+}
+
+#endif // !METRICS_H
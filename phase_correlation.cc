@@ -0,0 +1,344 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <cmath>
+
+#include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "phase_correlation.h"
+#include "metrics.h"
+#include "util.h"
+
+// gray image downscaled into the center of a size x size canvas, zero
+// mean, windowed. D maps image pixels to canvas pixels.
+static void make_canvas(const Mat& gray, int size, Mat& canvas, Matx33d& D) {
+    double f = size / (double) max(gray.rows, gray.cols);
+    Size small_size(max(1, (int) round(gray.cols * f)),
+                    max(1, (int) round(gray.rows * f)));
+
+    Mat small;
+    resize(gray, small, small_size, 0, 0, INTER_AREA);
+    small.convertTo(small, CV_32F);
+    small -= mean(small);
+
+    Mat window;
+    createHanningWindow(window, small_size, CV_32F);
+    small = small.mul(window);
+
+    int ox = (size - small.cols) / 2;
+    int oy = (size - small.rows) / 2;
+    canvas = Mat::zeros(size, size, CV_32F);
+    small.copyTo(canvas(Rect(ox, oy, small.cols, small.rows)));
+
+    D = Matx33d(small.cols / (double) gray.cols, 0, ox,
+                0, small.rows / (double) gray.rows, oy,
+                0, 0, 1);
+}
+
+// zero frequency to the center, even sizes
+static void shift_quadrants(Mat& m) {
+    int cx = m.cols / 2;
+    int cy = m.rows / 2;
+
+    Mat q0(m, Rect(0, 0, cx, cy));
+    Mat q1(m, Rect(cx, 0, cx, cy));
+    Mat q2(m, Rect(0, cy, cx, cy));
+    Mat q3(m, Rect(cx, cy, cx, cy));
+
+    Mat tmp;
+    q0.copyTo(tmp);
+    q3.copyTo(q0);
+    tmp.copyTo(q3);
+    q1.copyTo(tmp);
+    q2.copyTo(q1);
+    tmp.copyTo(q2);
+}
+
+// log magnitude spectrum, centered, high pass filtered [1] so the low
+// frequencies, the same in all images, don't dominate
+static Mat log_spectrum(const Mat& canvas) {
+    int n = canvas.rows;
+
+    Mat spectrum;
+    dft(canvas, spectrum, DFT_COMPLEX_OUTPUT);
+
+    Mat planes[2];
+    split(spectrum, planes);
+    Mat mag;
+    magnitude(planes[0], planes[1], mag);
+    mag += Scalar::all(1);
+    log(mag, mag);
+    shift_quadrants(mag);
+
+    for (int y = 0; y < n; y++) {
+        float *row = mag.ptr<float>(y);
+        double v = cos(CV_PI * (y - n / 2) / n);
+        for (int x = 0; x < n; x++) {
+            double c = v * cos(CV_PI * (x - n / 2) / n);
+            row[x] *= (1 - c) * (2 - c);
+        }
+    }
+
+    return mag;
+}
+
+// rows are angles over [0, pi), columns log radius: the radius of
+// column x is exp(x * log_base)
+static Mat log_polar(const Mat& mag, double log_base) {
+    int n = mag.rows;
+    double center = n / 2;
+
+    Mat map_x(n, n, CV_32F);
+    Mat map_y(n, n, CV_32F);
+    for (int a = 0; a < n; a++) {
+        double theta = CV_PI * a / n;
+        double c = cos(theta);
+        double s = sin(theta);
+        float *mx = map_x.ptr<float>(a);
+        float *my = map_y.ptr<float>(a);
+        for (int r = 0; r < n; r++) {
+            double radius = exp(r * log_base);
+            mx[r] = center + radius * c;
+            my[r] = center + radius * s;
+        }
+    }
+
+    Mat polar;
+    remap(mag, polar, map_x, map_y, INTER_LINEAR, BORDER_CONSTANT, Scalar());
+    return polar;
+}
+
+Point2d phase_correlate(const Mat& a, const Mat& b, double *response) {
+    assert(a.size() == b.size() && a.type() == CV_32F && b.type() == CV_32F);
+
+    Mat fa, fb, cross;
+    dft(a, fa, DFT_COMPLEX_OUTPUT);
+    dft(b, fb, DFT_COMPLEX_OUTPUT);
+    mulSpectrums(fb, fa, cross, 0, true);
+
+    // cross power spectrum: phase only
+    for (int y = 0; y < cross.rows; y++) {
+        Vec2f *row = cross.ptr<Vec2f>(y);
+        for (int x = 0; x < cross.cols; x++) {
+            float norm = sqrtf(row[x][0] * row[x][0] + row[x][1] * row[x][1]);
+            if (norm > 0) {
+                row[x] *= 1 / norm;
+            }
+        }
+    }
+
+    Mat corr;
+    idft(cross, corr, DFT_SCALE | DFT_REAL_OUTPUT);
+
+    Point peak;
+    minMaxLoc(corr, NULL, NULL, NULL, &peak);
+
+    // centroid of the 3x3 neighborhood, the correlation wraps around
+    double sum = 0, sx = 0, sy = 0;
+    for (int dy = -1; dy <= 1; dy++) {
+        int y = (peak.y + dy + corr.rows) % corr.rows;
+        for (int dx = -1; dx <= 1; dx++) {
+            int x = (peak.x + dx + corr.cols) % corr.cols;
+            double w = corr.at<float>(y, x);
+            sum += w;
+            sx += w * (peak.x + dx);
+            sy += w * (peak.y + dy);
+        }
+    }
+
+    Point2d shift(peak.x, peak.y);
+    if (sum > 0) {
+        shift = Point2d(sx / sum, sy / sum);
+    }
+    if (shift.x > corr.cols / 2) {
+        shift.x -= corr.cols;
+    }
+    if (shift.y > corr.rows / 2) {
+        shift.y -= corr.rows;
+    }
+
+    if (response) {
+        *response = sum;
+    }
+    return shift;
+}
+
+// rotation theta and scale about the center of a size x size canvas
+static Matx33d similarity(double theta, double scale, int size) {
+    double c = cos(theta) * scale;
+    double s = sin(theta) * scale;
+    double center = size / 2;
+
+    return Matx33d(c, -s, center - c * center + s * center,
+                   s, c, center - s * center - c * center,
+                   0, 0, 1);
+}
+
+// similarity from img to truth, false under min_response
+static bool global_similarity(const Mat& img, const Mat& truth,
+                              const PhaseCorrelationOptions& options,
+                              Matx33d& H) {
+    int n = options.size;
+    double log_base = log(n / 2.0) / n;
+
+    Mat canvas_img, canvas_truth;
+    Matx33d D_img, D_truth;
+    make_canvas(img, n, canvas_img, D_img);
+    make_canvas(truth, n, canvas_truth, D_truth);
+
+    Mat polar_img = log_polar(log_spectrum(canvas_img), log_base);
+    Mat polar_truth = log_polar(log_spectrum(canvas_truth), log_base);
+
+    // scaling img up shrinks its spectrum: the log radius shift is -log s
+    Point2d shift = phase_correlate(polar_img, polar_truth, NULL);
+    double scale = exp(-shift.x * log_base);
+    double theta = CV_PI * shift.y / n;
+
+    // the magnitude spectra can't tell theta from theta + pi
+    double best_response = -1;
+    Matx33d best;
+    for (int k = 0; k < 2; k++) {
+        Matx33d S = similarity(theta + k * CV_PI, scale, n);
+
+        Mat rotated;
+        warpAffine(canvas_img, rotated, Mat(S).rowRange(0, 2), canvas_img.size());
+
+        double response;
+        Point2d t = phase_correlate(rotated, canvas_truth, &response);
+        if (response > best_response) {
+            best_response = response;
+            best = Matx33d(1, 0, t.x, 0, 1, t.y, 0, 0, 1) * S;
+        }
+    }
+
+    LOG(DEBUG) << "Phase correlation: scale " << scale << ", rotation "
+               << theta * 180 / CV_PI << ", response " << best_response;
+
+    if (best_response < options.min_response) {
+        return false;
+    }
+
+    H = D_truth.inv() * best * D_img;
+    return true;
+}
+
+// homography from the shifts of tiles of img warped onto truth by H0
+static bool refine_tiles(const Mat& img, const Mat& truth, const Matx33d& H0,
+                         const PhaseCorrelationOptions& options, Matx33d& H) {
+    double r = min(1.0, options.refine_size / (double) max(truth.rows, truth.cols));
+    Matx33d D_truth(r, 0, 0, 0, r, 0, 0, 0, 1);
+
+    Mat truth_small;
+    resize(truth, truth_small, Size(), r, r, INTER_AREA);
+    truth_small.convertTo(truth_small, CV_32F);
+
+    // downscale img first when the warp shrinks it, warpPerspective
+    // doesn't filter
+    Matx33d W = D_truth * H0;
+    double shrink = sqrt(fabs(W(0, 0) * W(1, 1) - W(0, 1) * W(1, 0)));
+    Mat src = img;
+    if (shrink < 0.5) {
+        resize(img, src, Size(), shrink, shrink, INTER_AREA);
+        W = W * Matx33d(1 / shrink, 0, 0, 0, 1 / shrink, 0, 0, 0, 1);
+    }
+
+    Mat warped, mask;
+    warpPerspective(src, warped, Mat(W), truth_small.size(), INTER_LINEAR);
+    warpPerspective(Mat(src.size(), CV_8U, Scalar(255)), mask, Mat(W),
+                    truth_small.size(), INTER_NEAREST);
+    warped.convertTo(warped, CV_32F);
+
+    int tile = options.tile;
+    vector<Point> origins;
+    for (int y = 0; y + tile <= truth_small.rows; y += tile / 2) {
+        for (int x = 0; x + tile <= truth_small.cols; x += tile / 2) {
+            if (countNonZero(mask(Rect(x, y, tile, tile))) == tile * tile) {
+                origins.push_back(Point(x, y));
+            }
+        }
+    }
+
+    Mat window;
+    createHanningWindow(window, Size(tile, tile), CV_32F);
+
+    // shift of each tile, NaN when it doesn't correlate
+    vector<Point2d> shifts(origins.size());
+    parallel_for_index(origins.size(), [&](size_t i, int) {
+            Rect rect(origins[i], Size(tile, tile));
+            shifts[i] = Point2d(NAN, NAN);
+
+            Scalar mean_a, stddev_a, mean_b, stddev_b;
+            meanStdDev(warped(rect), mean_a, stddev_a);
+            meanStdDev(truth_small(rect), mean_b, stddev_b);
+            // flat (water, sky ..)
+            if (stddev_a[0] < 2 || stddev_b[0] < 2) {
+                return;
+            }
+
+            Mat a = (warped(rect) - mean_a).mul(window);
+            Mat b = (truth_small(rect) - mean_b).mul(window);
+
+            double response;
+            Point2d shift = phase_correlate(a, b, &response);
+            if (response >= options.tile_response) {
+                shifts[i] = shift;
+            }
+        }, options.threads);
+
+    // tile center in img, and where truth has it
+    Matx33d W_inv = W.inv();
+    double to_src = src.cols / (double) img.cols;
+    vector<Point2f> img_pts, truth_pts;
+    for (size_t i = 0; i < origins.size(); i++) {
+        if (std::isnan(shifts[i].x)) {
+            continue;
+        }
+
+        Vec3d c(origins[i].x + tile / 2.0, origins[i].y + tile / 2.0, 1);
+        Vec3d p = W_inv * c;
+        img_pts.push_back(Point2f(p[0] / p[2] / to_src, p[1] / p[2] / to_src));
+        truth_pts.push_back(Point2f((c[0] + shifts[i].x) / r, (c[1] + shifts[i].y) / r));
+    }
+
+    if ((int) img_pts.size() < max(options.min_tiles, 4)) {
+        LOG(DEBUG) << "Phase correlation: " << img_pts.size() << " of "
+                   << origins.size() << " tiles correlate";
+        return false;
+    }
+
+    vector<unsigned char> status;
+    Mat found = findHomography(img_pts, truth_pts, CV_RANSAC, options.threshold, status);
+    int inliers = countNonZero(status);
+
+    LOG(DEBUG) << "Phase correlation: " << inliers << " inlier tiles of "
+               << origins.size();
+
+    if (found.empty() || inliers < options.min_tiles) {
+        return false;
+    }
+
+    H = found;
+    return true;
+}
+
+bool phase_correlation_homography(const Mat& img, const Mat& truth,
+                                  const PhaseCorrelationOptions& options,
+                                  Mat& H) {
+    assert(img.type() == CV_8U && truth.type() == CV_8U);
+
+    Matx33d estimate;
+    if (!global_similarity(img, truth, options, estimate)) {
+        Metrics::instance().add("phase.low_response");
+        return false;
+    }
+
+    for (int pass = 0; pass < options.passes; pass++) {
+        if (!refine_tiles(img, truth, estimate, options, estimate)) {
+            Metrics::instance().add("phase.refine_failed");
+            return false;
+        }
+    }
+
+    H = Mat(estimate);
+    return true;
+}
@@ -0,0 +1,74 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Registration by phase correlation, without features.
+//
+//  [1] B. S. Reddy, B. N. Chatterji, "An FFT-based technique for
+//    translation, rotation, and scale-invariant image registration",
+//    TIP 1996.
+//
+// A nadir frame against an orthophoto of about the same footprint is
+// close to a similarity. On downscaled copies of both images:
+//  - the log-polar transform of the magnitude spectra turns scale and
+//    rotation into a translation, found by phase correlation,
+//  - the image is rotated and scaled back (both 180 degree candidates,
+//    the spectra being symmetric), a second phase correlation gives the
+//    translation and the confidence of the whole estimate.
+// A confident similarity is then refined locally: the image is warped
+// onto the truth at refine_size, tiles are phase correlated against the
+// truth, and their shifts give a RANSAC homography. A second pass from
+// that homography removes the bias of the residual rotation and scale
+// on the tile shifts.
+//
+// Low confidence or too few agreeing tiles return false, the caller
+// falls back to features.
+
+#ifndef PHASE_CORRELATION_H
+#define PHASE_CORRELATION_H
+
+#include "photogram.h"
+
+struct PhaseCorrelationOptions {
+    PhaseCorrelationOptions()
+        : size(512), min_response(0.08), refine_size(2048), tile(128),
+          tile_response(0.2), min_tiles(8), threshold(3.0), passes(2),
+          threads(0)
+    {};
+
+    // side of the square FFT of the global estimate, a power of 2
+    int     size;
+
+    // peak energy (1 for a perfect match, ~0.03 for unrelated images)
+    // of the translation correlation under which the estimate is dropped
+    double  min_response;
+
+    // larger side of the truth during the local refinement
+    int     refine_size;
+
+    // refinement tiles, side and peak energy to keep a tile
+    int     tile;
+    double  tile_response;
+
+    // RANSAC inlier tiles to accept the homography
+    int     min_tiles;
+
+    // RANSAC reprojection threshold, truth pixels
+    double  threshold;
+
+    // refinement passes
+    int     passes;
+
+    int     threads;
+};
+
+// peak of the phase correlation of two images of the same size and
+// type CV_32F: b(x) ~ a(x - shift), response is the energy around the
+// peak, sub pixel by centroid
+Point2d phase_correlate(const Mat& a, const Mat& b, double *response);
+
+// homography from img to truth (8 bit gray images), false when not
+// confident
+bool phase_correlation_homography(const Mat& img, const Mat& truth,
+                                  const PhaseCorrelationOptions& options,
+                                  Mat& H);
+
+#endif // !PHASE_CORRELATION_H
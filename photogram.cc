@@ -1,20 +1,451 @@
 /* Copyright 2014 Matthieu Tourne */
 
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+
 #include "photogram.h"
 #include "tracks.hpp"
 
 _INITIALIZE_EASYLOGGINGPP
 
+#include "tclap/CmdLine.h"
+
 #include "easyexif/exif.h"
 #include "features2d.h"
+#include "global_matcher.h"
+#include "ingest.h"
+#include "match_pipeline.h"
+#include "external_tracks.h"
+#include "async_io.h"
+#include "attitude.h"
+#include "feature_codec.h"
+#include "autotune.h"
+#include "batch_ransac.h"
+#include "compaction.h"
 #include "image_pairs.h"
 #include "bundle.h"
+#include "components.h"
+#include "debug_writer.h"
+#include "metrics.h"
+#include "pq.h"
+#include "reconstruction.h"
+#include "simd_kernels.h"
+#include "stereo.h"
+#include "util.h"
 
 
 #define VISUAL_DEBUG 1
 
-void help(void) {
-    cout << "Usage: photogram [image list]" << endl;
+// parse the command line, false on error
+static bool parse_args(int argc, char **argv,
+                       vector<ImageSource> &sources,
+                       MatcherOptions &matcher_options,
+                       DebugOptions &debug_options,
+                       string &pq_filename, int &pq_m,
+                       bool &global_pairs,
+                       GlobalMatcherOptions &global_options,
+                       bool &autotune, AutotuneOptions &autotune_options,
+                       string &dense_prefix, int &dense_pairs,
+                       StereoOptions &stereo_options,
+                       IngestOptions &ingest_options,
+                       MatchPipelineOptions &pipeline_options,
+                       string &tracks_filename,
+                       ExternalTracksOptions &tracks_options,
+                       bool &split,
+                       string &sparse_filename,
+                       ReconstructionOptions &sparse_options,
+                       bool &compact, CompactionOptions &compaction_options,
+                       AsyncIoOptions &io_options, string &features_dir,
+                       int &threads) {
+    try {
+        TCLAP::CmdLine cmd("Match a set of images", ' ', "0.1");
+
+        TCLAP::MultiArg<string> manifests("", "manifest",
+            "Image list, one path per line or JSON with metadata", false, "filename");
+        cmd.add(manifests);
+
+        TCLAP::MultiArg<string> globs("", "glob",
+            "Images matching a shell pattern, or all the images of a directory",
+            false, "pattern");
+        cmd.add(globs);
+
+        TCLAP::MultiArg<string> archives("", "tar",
+            "Images of an uncompressed tar archive, read in place", false, "filename");
+        cmd.add(archives);
+
+        vector<string> matchers;
+        matchers.push_back("flann");
+        matchers.push_back("hnsw");
+        matchers.push_back("cascade");
+        TCLAP::ValuesConstraint<string> matcher_constraint(matchers);
+        TCLAP::ValueArg<string> matcher("", "matcher",
+            "Descriptor matcher", false, "flann", &matcher_constraint);
+        cmd.add(matcher);
+
+        TCLAP::ValueArg<int> flann_trees("", "flann_trees",
+            "FLANN randomized kd-trees", false, matcher_options.flann_trees, "N");
+        cmd.add(flann_trees);
+
+        TCLAP::ValueArg<int> flann_checks("", "flann_checks",
+            "FLANN leaves checked per query", false, matcher_options.flann_checks, "N");
+        cmd.add(flann_checks);
+
+        TCLAP::ValueArg<int> hnsw_m("", "hnsw_m",
+            "HNSW links per node", false, matcher_options.hnsw_m, "M");
+        cmd.add(hnsw_m);
+
+        TCLAP::ValueArg<int> hnsw_ef_construction("", "hnsw_ef_construction",
+            "HNSW candidate list size while building", false,
+            matcher_options.hnsw_ef_construction, "ef");
+        cmd.add(hnsw_ef_construction);
+
+        TCLAP::ValueArg<int> hnsw_ef("", "hnsw_ef",
+            "HNSW candidate list size while searching", false,
+            matcher_options.hnsw_ef, "ef");
+        cmd.add(hnsw_ef);
+
+        TCLAP::SwitchArg hnsw_u8("", "hnsw_u8",
+            "Index descriptors quantized to 8 bits", false);
+        cmd.add(hnsw_u8);
+
+        TCLAP::ValueArg<int> cascade_candidates("", "cascade_candidates",
+            "Cascade hashing descriptors compared in full per query", false,
+            matcher_options.cascade_candidates, "N");
+        cmd.add(cascade_candidates);
+
+        TCLAP::SwitchArg descriptors_f16("", "descriptors_f16",
+            "Keep descriptors in half precision, half the memory (HNSW matcher, "
+            "without --hnsw_u8)", false);
+        cmd.add(descriptors_f16);
+
+        TCLAP::ValueArg<int> debug_every("", "debug_every",
+            "Render one debug image every N sampled pairs, 0 to disable",
+            false, debug_options.every, "N");
+        cmd.add(debug_every);
+
+        vector<string> samples;
+        samples.push_back("all");
+        samples.push_back("verified");
+        samples.push_back("failures");
+        samples.push_back("borderline");
+        TCLAP::ValuesConstraint<string> sample_constraint(samples);
+        TCLAP::ValueArg<string> debug_sample("", "debug_sample",
+            "Pairs sampled for debug images", false, "verified", &sample_constraint);
+        cmd.add(debug_sample);
+
+        TCLAP::ValueArg<double> debug_scale("", "debug_scale",
+            "Downscale of the debug images", false, debug_options.scale, "scale");
+        cmd.add(debug_scale);
+
+        TCLAP::ValueArg<string> pq_store("", "pq_store",
+            "Write the product quantized descriptors of all the images, for other tools:"
+            " matching doesn't read it back", false,
+            "", "filename");
+        cmd.add(pq_store);
+
+        vector<int> pq_ms;
+        pq_ms.push_back(32);
+        pq_ms.push_back(64);
+        TCLAP::ValuesConstraint<int> pq_m_constraint(pq_ms);
+        TCLAP::ValueArg<int> pq_m_arg("", "pq_m",
+            "PQ sub quantizers, 32 (16 bytes per descriptor) or 64 (32 bytes)",
+            false, pq_m, &pq_m_constraint);
+        cmd.add(pq_m_arg);
+
+        vector<string> pair_modes;
+        pair_modes.push_back("exhaustive");
+        pair_modes.push_back("global");
+        TCLAP::ValuesConstraint<string> pairs_constraint(pair_modes);
+        TCLAP::ValueArg<string> pairs("", "pairs",
+            "Candidate pairs: match all of them, or vote with a project wide index",
+            false, "exhaustive", &pairs_constraint);
+        cmd.add(pairs);
+
+        TCLAP::ValueArg<int> global_knn("", "global_knn",
+            "Global index neighbors per descriptor", false, global_options.knn, "K");
+        cmd.add(global_knn);
+
+        TCLAP::ValueArg<int> global_checks("", "global_checks",
+            "Global index leaves checked per descriptor", false,
+            global_options.checks, "N");
+        cmd.add(global_checks);
+
+        TCLAP::ValueArg<int> global_pairs_per_image("", "global_pairs_per_image",
+            "Best candidate pairs kept per image, 0 for all", false,
+            global_options.pairs_per_image, "N");
+        cmd.add(global_pairs_per_image);
+
+        TCLAP::SwitchArg autotune_arg("", "autotune",
+            "Pick the fastest matcher parameters reaching a target recall on a few pairs",
+            false);
+        cmd.add(autotune_arg);
+
+        TCLAP::ValueArg<double> autotune_recall("", "autotune_recall",
+            "Autotune target recall@1", false, autotune_options.target_recall, "recall");
+        cmd.add(autotune_recall);
+
+        const char *home = getenv("HOME");
+        TCLAP::ValueArg<string> autotune_cache("", "autotune_cache",
+            "Autotune cache directory, empty to always tune", false,
+            home ? string(home) + "/.cache/photogram" : "", "directory");
+        cmd.add(autotune_cache);
+
+        TCLAP::ValueArg<string> dense("", "dense",
+            "Dense stereo of the best verified pairs, to <prefix>_<n>.ply", false, "", "prefix");
+        cmd.add(dense);
+
+        TCLAP::ValueArg<int> dense_pairs_arg("", "dense_pairs",
+            "Number of pairs for dense stereo", false, dense_pairs, "pairs");
+        cmd.add(dense_pairs_arg);
+
+        TCLAP::ValueArg<int> dense_size("", "dense_size",
+            "Larger side of the rectified images", false, stereo_options.max_size, "pixels");
+        cmd.add(dense_size);
+
+        TCLAP::ValueArg<int> dense_disparities("", "dense_disparities",
+            "Disparity range searched", false, stereo_options.disparities, "pixels");
+        cmd.add(dense_disparities);
+
+        TCLAP::ValueArg<string> watch("", "watch",
+            "Ingest the images of a directory as they arrive", false, "", "directory");
+        cmd.add(watch);
+
+        TCLAP::ValueArg<int> watch_temporal("", "watch_temporal",
+            "Previous images matched with a new one", false,
+            ingest_options.temporal, "images");
+        cmd.add(watch_temporal);
+
+        TCLAP::ValueArg<int> watch_spatial("", "watch_spatial",
+            "Nearest images by gps matched with a new one", false,
+            ingest_options.spatial, "images");
+        cmd.add(watch_spatial);
+
+        TCLAP::ValueArg<double> watch_radius("", "watch_radius",
+            "Largest distance to a gps neighbor", false, ingest_options.radius_km, "km");
+        cmd.add(watch_radius);
+
+        TCLAP::ValueArg<int> watch_idle("", "watch_idle",
+            "Seconds without a new image ending the ingestion, 0 to wait for the marker",
+            false, ingest_options.idle_timeout, "seconds");
+        cmd.add(watch_idle);
+
+        TCLAP::ValueArg<string> watch_marker("", "watch_marker",
+            "File name ending the ingestion", false, ingest_options.marker, "name");
+        cmd.add(watch_marker);
+
+        TCLAP::ValueArg<int> decode_workers("", "decode_workers",
+            "Decode stage workers, 0 for all cores", false,
+            pipeline_options.decode_workers, "threads");
+        cmd.add(decode_workers);
+
+        TCLAP::ValueArg<int> extract_workers("", "extract_workers",
+            "Feature extraction stage workers, 0 for all cores", false,
+            pipeline_options.extract_workers, "threads");
+        cmd.add(extract_workers);
+
+        TCLAP::ValueArg<int> match_workers("", "match_workers",
+            "Matching stage workers, 0 for all cores", false,
+            pipeline_options.match_workers, "threads");
+        cmd.add(match_workers);
+
+        TCLAP::ValueArg<int> verify_workers("", "verify_workers",
+            "Verification stage workers, 0 for all cores", false,
+            pipeline_options.verify_workers, "threads");
+        cmd.add(verify_workers);
+
+        TCLAP::SwitchArg rotation_arg("", "rotation",
+            "Verify pairs with a rotation only model when it fits (panoramas)", false);
+        cmd.add(rotation_arg);
+
+        TCLAP::SwitchArg gravity_arg("", "gravity",
+            "Verify pairs with the 3 point solver when the gimbal angles are known", false);
+        cmd.add(gravity_arg);
+
+        TCLAP::ValueArg<int> queue_capacity("", "queue_capacity",
+            "Items queued between two stages", false,
+            pipeline_options.queue_capacity, "items");
+        cmd.add(queue_capacity);
+
+        TCLAP::ValueArg<string> tracks_arg("", "tracks",
+            "Build the tracks out of core, write the track table there", false, "",
+            "filename");
+        cmd.add(tracks_arg);
+
+        TCLAP::ValueArg<string> tracks_scratch("", "tracks_scratch",
+            "Directory for the track building scratch files", false,
+            tracks_options.directory, "directory");
+        cmd.add(tracks_scratch);
+
+        TCLAP::ValueArg<int> tracks_chunk("", "tracks_chunk",
+            "Matches kept in memory by the track building", false,
+            tracks_options.chunk_edges, "matches");
+        cmd.add(tracks_chunk);
+
+        TCLAP::SwitchArg split_arg("", "components",
+            "Split the verified pairs in connected components, without the images of no "
+            "pair: compaction, tracks, --sparse (name_N.ply) and bundle_N.txt per component",
+            false);
+        cmd.add(split_arg);
+
+        TCLAP::ValueArg<string> sparse_arg("", "sparse",
+            "Incremental reconstruction of the verified pairs, points to a PLY file",
+            false, "", "filename");
+        cmd.add(sparse_arg);
+
+        TCLAP::ValueArg<int> sparse_window("", "sparse_window",
+            "Cameras refined after each registered image", false,
+            sparse_options.window, "cameras");
+        cmd.add(sparse_window);
+
+        TCLAP::SwitchArg compact_arg("", "compact",
+            "Keep only the matched keypoints of each image before writing the outputs",
+            false);
+        cmd.add(compact_arg);
+
+        TCLAP::ValueArg<int> compact_reserve("", "compact_reserve",
+            "Strongest unmatched keypoints also kept per image by --compact, by detector "
+            "response (by scale with SiftGPU, which gives none)", false,
+            compaction_options.reserve, "keypoints");
+        cmd.add(compact_reserve);
+
+        TCLAP::ValueArg<string> io_backend("", "io_backend",
+            "Output writes: auto (io_uring, or threads), uring, threads or sync", false,
+            "auto", "backend");
+        cmd.add(io_backend);
+
+        TCLAP::ValueArg<string> fsync_arg("", "fsync",
+            "Output sync: none, file (each file) or flush (all at the end)", false,
+            "none", "policy");
+        cmd.add(fsync_arg);
+
+        TCLAP::ValueArg<string> features_dir_arg("", "features_dir",
+            "Write the features of each image there (.feat files), read them back "
+            "from there on the next run", false, "", "directory");
+        cmd.add(features_dir_arg);
+
+        TCLAP::ValueArg<int> threads_arg("", "threads",
+            "Cores used by all the parallel work, OpenCV included, 0 for all cores",
+            false, threads, "threads");
+        cmd.add(threads_arg);
+
+        TCLAP::UnlabeledMultiArg<string> images("images", "Image list", false, "filename");
+        cmd.add(images);
+
+        cmd.parse(argc, argv);
+
+        for (auto manifest : manifests.getValue()) {
+            if (!read_manifest(manifest, sources)) {
+                return false;
+            }
+        }
+        for (auto pattern : globs.getValue()) {
+            if (!glob_images(pattern, sources)) {
+                return false;
+            }
+        }
+        for (auto archive : archives.getValue()) {
+            if (!read_tar(archive, sources)) {
+                return false;
+            }
+        }
+        for (auto filename : images.getValue()) {
+            sources.push_back(ImageSource(filename));
+        }
+
+        if (sources.empty()) {
+            std::cerr << "error: no input image" << std::endl;
+            return false;
+        }
+
+        if (matcher.getValue() == "hnsw") {
+            matcher_options.type = MATCHER_HNSW;
+        } else if (matcher.getValue() == "cascade") {
+            matcher_options.type = MATCHER_CASCADE;
+        } else {
+            matcher_options.type = MATCHER_FLANN;
+        }
+        matcher_options.flann_trees = flann_trees.getValue();
+        matcher_options.flann_checks = flann_checks.getValue();
+        matcher_options.hnsw_m = hnsw_m.getValue();
+        matcher_options.hnsw_ef_construction = hnsw_ef_construction.getValue();
+        matcher_options.hnsw_ef = hnsw_ef.getValue();
+        matcher_options.hnsw_u8 = hnsw_u8.getValue();
+        matcher_options.cascade_candidates = cascade_candidates.getValue();
+        matcher_options.descriptors_f16 = descriptors_f16.getValue();
+
+        pq_filename = pq_store.getValue();
+        pq_m = pq_m_arg.getValue();
+
+        global_pairs = pairs.getValue() == "global";
+        global_options.knn = global_knn.getValue();
+        global_options.checks = global_checks.getValue();
+        global_options.pairs_per_image = global_pairs_per_image.getValue();
+
+        autotune = autotune_arg.getValue();
+        autotune_options.target_recall = autotune_recall.getValue();
+        autotune_options.cache_dir = autotune_cache.getValue();
+
+        dense_prefix = dense.getValue();
+        dense_pairs = dense_pairs_arg.getValue();
+        stereo_options.max_size = dense_size.getValue();
+        stereo_options.disparities = dense_disparities.getValue();
+
+        ingest_options.directory = watch.getValue();
+        ingest_options.temporal = watch_temporal.getValue();
+        ingest_options.spatial = watch_spatial.getValue();
+        ingest_options.radius_km = watch_radius.getValue();
+        ingest_options.idle_timeout = watch_idle.getValue();
+        ingest_options.marker = watch_marker.getValue();
+
+        pipeline_options.decode_workers = decode_workers.getValue();
+        pipeline_options.extract_workers = extract_workers.getValue();
+        pipeline_options.match_workers = match_workers.getValue();
+        pipeline_options.verify_workers = verify_workers.getValue();
+        pipeline_options.queue_capacity = queue_capacity.getValue();
+        pipeline_options.rotation = rotation_arg.getValue();
+        pipeline_options.gravity = gravity_arg.getValue();
+        ingest_options.gravity = gravity_arg.getValue();
+
+        tracks_filename = tracks_arg.getValue();
+        tracks_options.directory = tracks_scratch.getValue();
+        tracks_options.chunk_edges = tracks_chunk.getValue();
+
+        split = split_arg.getValue();
+
+        sparse_filename = sparse_arg.getValue();
+        sparse_options.window = sparse_window.getValue();
+
+        compact = compact_arg.getValue();
+        compaction_options.reserve = compact_reserve.getValue();
+
+        if (!parse_async_io_backend(io_backend.getValue(), io_options.backend)) {
+            std::cerr << "error: unknown io backend " << io_backend.getValue() << std::endl;
+            return false;
+        }
+        if (!parse_fsync_policy(fsync_arg.getValue(), io_options.fsync)) {
+            std::cerr << "error: unknown fsync policy " << fsync_arg.getValue() << std::endl;
+            return false;
+        }
+        features_dir = features_dir_arg.getValue();
+        matcher_options.features_dir = features_dir;
+
+        threads = threads_arg.getValue();
+
+        debug_options.every = debug_every.getValue();
+        debug_options.scale = debug_scale.getValue();
+        for (size_t i = 0; i < samples.size(); i++) {
+            if (samples[i] == debug_sample.getValue()) {
+                debug_options.sample = (DebugSample) i;
+            }
+        }
+    } catch (TCLAP::ArgException &e)  {
+        std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
+        return false;
+    }
+
+    return true;
 }
 
 // debug exif data
@@ -40,29 +471,21 @@ void print_exif_data(EXIFInfo &data) {
     printf("GPS Altitude      : %f m\n", data.GeoLocation.Altitude);
 }
 
-// read exif data for a file
-int read_exif(const char *filename, EXIFInfo &exif_data) {
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        cerr << "Can't read file " << filename << endl;
-        return -1;
-    }
+// read exif data of an image, in place for archive members
+int read_exif(const ImageSource &source, EXIFInfo &exif_data) {
+    const unsigned char *buf;
+    size_t size;
+    vector<unsigned char> storage;
 
-    fseek(fp, 0, SEEK_END);
-    unsigned long fsize = ftell(fp);
-    rewind(fp);
-    unsigned char buf[fsize];
-    if (fread(buf, 1, fsize, fp) != fsize) {
-        cerr << "Can't read file " << filename << endl;
-        return -2;
+    if (!source.get_encoded(&buf, &size, storage)) {
+        return -1;
     }
-    fclose(fp);
 
-    int code = exif_data.parseFrom(buf, fsize);
+    int code = exif_data.parseFrom(buf, size);
 
     if (code) {
         cerr << "Error parsing EXIF from file " <<
-            filename << ", code: " << code << endl;
+            source.path << ", code: " << code << endl;
         return -3;
     }
 
@@ -78,12 +501,43 @@ int get_camera_sensor_size(const string camera_model,
     return 0;
 }
 
+// camera matrix of an image of cols x rows pixels from its EXIF
+static int camera_matrix_from_exif(const EXIFInfo& exif_data, int cols, int rows, Mat& K) {
+    // ccd size in mm
+    float width, height;
+
+    int rc = get_camera_sensor_size(exif_data.Model, width, height);
+    if (rc != 0) {
+        return rc;
+    }
+
+    // half fov in both directions
+    // tan(tetha/2) = width / 2f
+    double tan_half_x_fov = width / (2 * exif_data.FocalLength);
+    double tan_half_y_fov = height / (2 * exif_data.FocalLength);
+
+    // focal length in pixels :
+    // f = (W/2) * (1 / tan(tetha/2))
+    double f_x = cols / (2 * tan_half_x_fov);
+    double f_y = rows / (2 * tan_half_y_fov);
+
+    // center of the sensor is set at width and height / 2. A new
+    // buffer: K can share the one of the fallback matrix
+    K = Mat(Matx33d(f_x, 0, cols / 2,
+                    0, f_y, rows / 2,
+                    0, 0, 1), true);
+
+    LOG(DEBUG) << "K intrinsic matrix: " << endl << K << endl;
+
+    return 0;
+}
+
 // get the intrinsic matrix of the camera
-int get_k_matrix_from_exif(const char *filename, Mat& img, Mat &K) {
+int get_k_matrix_from_exif(const ImageSource &source, Mat& img, Mat &K) {
     EXIFInfo exif_data;
     int rc;
 
-    rc = read_exif(filename, exif_data);
+    rc = read_exif(source, exif_data);
     if (rc != 0) {
         return rc;
     }
@@ -95,116 +549,570 @@ int get_k_matrix_from_exif(const char *filename, Mat& img, Mat &K) {
     assert(exif_data.ImageWidth == img.cols &&
            exif_data.ImageHeight == img.rows);
 
-    // ccd size in mm
-    float width, height;
+    return camera_matrix_from_exif(exif_data, img.cols, img.rows, K);
+}
 
-    rc = get_camera_sensor_size(exif_data.Model, width, height);
-    if (rc != 0) {
-        return rc;
+// camera matrix of the first source with EXIF, for the images without
+static Mat fallback_camera_matrix(const vector<ImageSource>& sources) {
+    for (const ImageSource& source : sources) {
+        EXIFInfo exif_data;
+        Mat K;
+        if (source.K.empty() && read_exif(source, exif_data) == 0 &&
+            exif_data.ImageWidth > 0 && exif_data.ImageHeight > 0 &&
+            camera_matrix_from_exif(exif_data, exif_data.ImageWidth,
+                                    exif_data.ImageHeight, K) == 0) {
+            return K;
+        }
     }
+    return Mat();
+}
 
-    // half fov in both directions
-    // tan(tetha/2) = width / 2f
-    double tan_half_x_fov = width / (2 * exif_data.FocalLength);
-    double tan_half_y_fov = height / (2 * exif_data.FocalLength);
+// image with its camera matrix and position, K is the camera matrix of
+// images without EXIF
+static Image::ptr load_image(const ImageSource& source, Mat& K) {
+    Image::ptr img_ptr(new Image(source));
 
-    // focal length in pixels :
-    // f = (W/2) * (1 / tan(tetha/2))
-    double f_x = img.cols / (2 * tan_half_x_fov);
-    double f_y = img.rows / (2 * tan_half_y_fov);
+    // TODO (mtourne): catch exception
+    Mat img_gray = img_ptr->get_image_gray();
+
+    // metadata from the manifest wins over EXIF
+    if (source.K.empty()) {
+        // TODO (mtourne): replace with parse_exif_data
+        // inside Image obj.
+        // get instrinsic camera matrix K
+        get_k_matrix_from_exif(source, img_gray, K);
+        img_ptr->set_camera_matrix(K);
+    } else {
+        img_ptr->set_camera_matrix(source.K);
+    }
+
+    if (source.has_gps) {
+        img_ptr->set_gps_coordinates(source.lat, source.lon);
+    } else {
+        // drones tag their frames
+        EXIFInfo exif_data;
+        if (read_exif(source, exif_data) == 0 &&
+            (exif_data.GeoLocation.Latitude != 0 || exif_data.GeoLocation.Longitude != 0)) {
+            img_ptr->set_gps_coordinates(exif_data.GeoLocation.Latitude,
+                                         exif_data.GeoLocation.Longitude);
+        }
+    }
+
+    if (source.has_attitude) {
+        img_ptr->set_attitude(source.attitude);
+    } else {
+        // and their gimbal angles, in XMP
+        const unsigned char *buf;
+        size_t size;
+        vector<unsigned char> storage;
+        Attitude attitude;
+        if (source.get_encoded(&buf, &size, storage) &&
+            parse_xmp_attitude(buf, size, attitude)) {
+            img_ptr->set_attitude(attitude);
+        }
+    }
 
-    K = Mat::eye(3, 3, CV_64F);
-    K.at<double>(0,0) = f_x;
-    K.at<double>(1,1) = f_y;
+    return img_ptr;
+}
 
-    // center of the sensor is set at width and height / 2
-    K.at<double>(0,2) = img.cols / 2;
-    K.at<double>(1,2) = img.rows / 2;
+// count the consistent tracks of the verified pairs
+static void report_tracks(IncrementalTracks& tracks) {
+    std::map<size_t, std::map<size_t, int> > consistent;
+    tracks.get_tracks(consistent);
 
-    LOG(DEBUG) << "K intrinsic matrix: " << endl << K << endl;
+    LOG(INFO) << "Tracks: " << consistent.size();
+    Metrics::instance().add("tracks.count", consistent.size());
+}
 
-    return 0;
+// serialized in memory, written by the I/O threads
+static void write_bundle(AsyncWriter& writer, const string& filename, const Bundle& bundle) {
+    FileStorage fs(filename, FileStorage::WRITE | FileStorage::MEMORY);
+    fs << "bundle" << bundle;
+    writer.write_file(filename, fs.releaseAndGetString());
+}
+
+// <name>.feat per image, see feature_codec.h
+static void write_features(AsyncWriter& writer, const string& directory,
+                           const vector<Image::ptr>& images) {
+    parallel_for_index(images.size(), [&](size_t i, int) {
+            ImageFeaturesPtr features = images[i]->get_image_features();
+            string file;
+            if (!features || !encode_features(*features, FeatureCodecOptions(), file)) {
+                return;
+            }
+
+            writer.write_file(directory + "/" + images[i]->get_name() + ".feat", file);
+        });
+}
+
+// name_N.ext for component N of name.ext
+static string component_filename(const string& filename, size_t i) {
+    size_t dot = filename.rfind('.');
+    if (dot == string::npos || filename.find('/', dot) != string::npos) {
+        dot = filename.size();
+    }
+    return filename.substr(0, dot) + "_" + std::to_string(i) + filename.substr(dot);
+}
+
+// compact the features of each component, remap[image] for the images
+// of all (empty for those in no component)
+static void compact_components(vector<Bundle>& components, const vector<Image::ptr>& all,
+                               const CompactionOptions& options,
+                               vector<vector<int> >& remap) {
+    std::map<Image::ptr, size_t> index;
+    for (size_t i = 0; i < all.size(); i++) {
+        index[all[i]] = i;
+    }
+
+    remap.assign(all.size(), vector<int>());
+    for (size_t c = 0; c < components.size(); c++) {
+        vector<vector<int> > component_remap;
+        compact_bundle(components[c], options, &component_remap);
+        for (size_t i = 0; i < components[c].image_count(); i++) {
+            remap[index[components[c].get_image(i)]].swap(component_remap[i]);
+        }
+    }
+}
+
+// every image of all, in order, with the pairs of the components
+static Bundle join_components(const vector<Bundle>& components, const vector<Image::ptr>& all) {
+    Bundle bundle;
+    for (size_t i = 0; i < all.size(); i++) {
+        bundle.add_image(all[i]);
+    }
+    for (const Bundle& component : components) {
+        for (ImagePair pair : component.get_image_pairs()) {
+            bundle.add_pair(pair);
+        }
+    }
+    return bundle;
+}
+
+// the next track, image -> feature, false after the last one
+typedef std::function<bool(std::map<size_t, int>&)> NextTrack;
+
+// tracks in memory one by one
+static NextTrack next_track(const std::map<size_t, std::map<size_t, int> >& tracks) {
+    auto it = std::make_shared<std::map<size_t, std::map<size_t, int> >::const_iterator>(
+        tracks.begin());
+    return [&tracks, it](std::map<size_t, int>& track) {
+        if (*it == tracks.end()) {
+            return false;
+        }
+        track = (*it)->second;
+        ++*it;
+        return true;
+    };
+}
+
+// incremental reconstruction of the tracks of a bundle, its points to a
+// PLY file
+static bool write_sparse(const Bundle& bundle, const NextTrack& next,
+                         const ReconstructionOptions& options, const string& filename) {
+    // images without a camera matrix see no tracks
+    IncrementalReconstruction sfm(options);
+    vector<ImageFeaturesPtr> features(bundle.image_count());
+    for (size_t i = 0; i < bundle.image_count(); i++) {
+        Mat K = bundle.get_image(i)->get_camera_matrix();
+        if (K.rows == 3 && K.cols == 3) {
+            K.convertTo(K, CV_64F);
+            features[i] = bundle.get_image(i)->get_image_features();
+            sfm.add_image(Matx33d(K.ptr<double>()));
+        } else {
+            sfm.add_image(Matx33d::eye());
+        }
+    }
+
+    std::map<size_t, int> track;
+    while (next(track)) {
+        std::map<size_t, Point2f> observations;
+        for (auto feature = track.begin(); feature != track.end(); ++feature) {
+            ImageFeaturesPtr image_features = feature->first < features.size() ?
+                features[feature->first] : ImageFeaturesPtr();
+            if (image_features) {
+                const KeypointSet& keypoints = image_features->keypoints;
+                observations[feature->first] = Point2f(keypoints.x[feature->second],
+                                                       keypoints.y[feature->second]);
+            }
+        }
+        sfm.add_track(observations);
+    }
+
+    if (!sfm.run()) {
+        return false;
+    }
+
+    DensePoints sparse;
+    sfm.get_points(sparse.points);
+    sparse.gray.assign(sparse.points.size(), 255);
+    LOG(INFO) << "Sparse points to " << filename;
+    return write_ply(filename, sparse);
+}
+
+// train a quantizer on a sample of all the descriptors, then encode
+// every image of the bundle (in bundle order) to filename
+#define PQ_TRAIN_SAMPLES 100000
+
+static bool write_pq_store(const vector<Image::ptr>& images,
+                           const string& filename, int m, int threads) {
+    size_t total = 0;
+    for (size_t i = 0; i < images.size(); i++) {
+        ImageFeaturesPtr features = images[i]->get_image_features();
+        total += features ? features->keypoints.size() : 0;
+    }
+
+    // evenly spaced samples over the whole project, half precision
+    // descriptors are expanded one image at a time
+    size_t stride = std::max((size_t) 1, total / PQ_TRAIN_SAMPLES);
+    Mat samples(0, SIFT_DIM, CV_32F);
+    for (size_t i = 0; i < images.size(); i++) {
+        ImageFeaturesPtr features = images[i]->get_image_features();
+        size_t count = 0;
+        vector<float> storage;
+        const float *desc = features ? get_descriptors(*features, count, storage) : NULL;
+        for (size_t j = 0; desc && j < count; j += stride) {
+            samples.push_back(Mat(1, SIFT_DIM, CV_32F, (void*) (desc + j * SIFT_DIM)));
+        }
+    }
+
+    ProductQuantizer::ptr pq(new ProductQuantizer(SIFT_DIM, m));
+    if (!pq->train(samples, threads)) {
+        return false;
+    }
+
+    PqStore store(pq);
+    for (size_t i = 0; i < images.size(); i++) {
+        ImageFeaturesPtr features = images[i]->get_image_features();
+        size_t count = 0;
+        vector<float> storage;
+        const float *desc = features ? get_descriptors(*features, count, storage) : NULL;
+        store.add(desc, desc ? count : 0, threads);
+    }
+
+    LOG(INFO) << "PQ store: " << store.size() << " descriptors, "
+              << store.memory_size() << " bytes";
+    Metrics::instance().add("pq.descriptors", store.size());
+    Metrics::instance().add("pq.bytes", store.memory_size());
+
+    if (!store.save(filename)) {
+        LOG(ERROR) << "Can't write PQ store " << filename;
+        return false;
+    }
+    return true;
 }
 
 int main(int argc, char **argv) {
+    vector<ImageSource> sources;
+    MatcherOptions matcher_options;
+    DebugOptions debug_options;
+    string pq_filename;
+    int pq_m = 32;
+    bool global_pairs = false;
+    GlobalMatcherOptions global_options;
+    bool autotune = false;
+    AutotuneOptions autotune_options;
+    string dense_prefix;
+    int dense_pairs = 10;
+    StereoOptions stereo_options;
+    IngestOptions ingest_options;
+    MatchPipelineOptions pipeline_options;
+    string tracks_filename;
+    ExternalTracksOptions tracks_options;
+    bool split = false;
+    string sparse_filename;
+    ReconstructionOptions sparse_options;
+    bool compact = false;
+    CompactionOptions compaction_options;
+    AsyncIoOptions io_options;
+    string features_dir;
+    int threads = 0;
 
-    if (argc < 2) {
-        help();
+    if (!parse_args(argc, argv, sources, matcher_options, debug_options,
+                    pq_filename, pq_m, global_pairs, global_options,
+                    autotune, autotune_options,
+                    dense_prefix, dense_pairs, stereo_options,
+                    ingest_options, pipeline_options,
+                    tracks_filename, tracks_options, split,
+                    sparse_filename, sparse_options,
+                    compact, compaction_options,
+                    io_options, features_dir, threads)) {
         return 1;
     }
 
-    Mat K;
+    // one pool for our loops and OpenCV's
+    set_thread_count(threads);
 
-    Bundle image_bundle;
+    set_matcher_options(matcher_options);
 
-    for (int i = 1; i < argc; i++) {
-        Image::ptr img_ptr(new Image(argv[i]));
+    // images are decoded concurrently by the pipeline: those without EXIF
+    // get the camera matrix of the first source with, whatever the order
+    // they're decoded in. The ingestor loads one image at a time, new
+    // images can also give it the first one.
+    Mat K = fallback_camera_matrix(sources);
+    std::mutex K_mutex;
+    bool sequential = !ingest_options.directory.empty();
+    auto load = [&K, &K_mutex, sequential](const ImageSource& source) {
+        Mat camera;
+        {
+            // Mats share their buffer, every image gets its own
+            std::lock_guard<std::mutex> lock(K_mutex);
+            camera = K.clone();
+        }
+        Image::ptr image = load_image(source, camera);
+        std::lock_guard<std::mutex> lock(K_mutex);
+        if (sequential && K.empty()) {
+            K = camera;
+        }
+        return image;
+    };
 
-        // TODO (mtourne): catch exception
-        Mat img_gray = img_ptr->get_image_gray();
+    // pick the SIMD kernels once, logs the instruction set
+    simd_kernels();
 
-        // TODO (mtourne): replace with parse_exif_data
-        // inside Image obj.
-        // get instrinsic camera matrix K
-        get_k_matrix_from_exif(argv[i], img_gray, K);
-        img_ptr->set_camera_matrix(K);
+    Bundle image_bundle;
 
-        image_bundle.add_image(img_ptr);
-     }
+    // the exhaustive matching pipeline decodes images itself
+    bool pipelined = ingest_options.directory.empty() && !global_pairs && !autotune;
+    if (!pipelined) {
+        for (size_t i = 0; i < sources.size(); i++) {
+            image_bundle.add_image(load(sources[i]));
+        }
+    }
 
     LOG(DEBUG) << "Bundle size: " << image_bundle.image_count();
 
-    // XX (mtourne): compare all the images with each other for now
     vector<Image::ptr> images = image_bundle.get_images();
-    vector<Image::ptr>::iterator it1;
-    vector<Image::ptr>::iterator it2;
 
+#if VISUAL_DEBUG
+    // renders match images in the background
+    DebugWriter debug_writer(debug_options);
+#endif
+
+    // debug image, and keep the pair if verified
+    auto add_pair = [&](ImagePair& image_pair, bool verified) {
+#if VISUAL_DEBUG
+        if (debug_writer.sample(verified, image_pair.get_inliers_count())) {
+            debug_writer.queue(image_pair);
+        }
+#endif
+
+        if (verified) {
+            image_bundle.add_pair(image_pair);
+        }
+    };
+
+    vector<ImageFeaturesPtr> features;
+    bool tracks_built = false;
+    if (global_pairs || autotune) {
+        for (size_t i = 0; i < images.size(); i++) {
+            features.push_back(images[i]->get_image_features());
+        }
+    }
+
+    if (autotune && autotune_matcher(features, autotune_options, matcher_options)) {
+        set_matcher_options(matcher_options);
+    }
 
-    for (it1 = images.begin();
-         it1 != images.end();
-         ++it1) {
+    if (!ingest_options.directory.empty()) {
+        // match each new image with its neighbors as the flight goes
+        Ingestor ingestor(ingest_options, image_bundle, load, add_pair);
+        if (!ingestor.run()) {
+            return 1;
+        }
 
-        for (it2 = it1 + 1;
-             it2 != images.end();
-             ++it2) {
+        report_tracks(ingestor.get_tracks());
+        images = image_bundle.get_images();
+    } else if (global_pairs) {
+        // candidate pairs and their matches from one project wide index
+        GlobalMatcher global_matcher(global_options);
+        vector<GlobalPair> candidates;
+        if (global_matcher.build(features)) {
+            global_matcher.match(candidates);
+        }
 
-            ImagePair image_pair(*it1, *it2);
+        // F matrices (or rotations) of the pairs with enough voted matches
+        vector<ImagePair> image_pairs, rejected;
+        for (size_t i = 0; i < candidates.size(); i++) {
+            const GlobalPair& candidate = candidates[i];
+            ImagePair image_pair(images[candidate.image1], images[candidate.image2]);
+            image_pair.set_matches(candidate.matches);
 
-            // compute matches in a pair
-            if (!image_pair.compute_matches()) {
-                continue;
+            if (candidate.matches.size() >= MIN_FEATURE_MATCHES) {
+                image_pairs.push_back(image_pair);
+            } else {
+                rejected.push_back(image_pair);
             }
+        }
 
-            // compute F matrix from matches with 8 point RANSAC
-            if (!image_pair.compute_F_mat()) {
-                continue;
+        vector<char> verified;
+        if (pipeline_options.rotation || pipeline_options.gravity) {
+            verified.resize(image_pairs.size());
+            parallel_for_index(image_pairs.size(), [&](size_t i, int) {
+                    verified[i] = pipeline_options.rotation ? image_pairs[i].compute_motion() :
+                        image_pairs[i].compute_F_gravity();
+                });
+        } else {
+            batch_compute_F(image_pairs, BatchRansacOptions(), verified);
+        }
+
+        for (size_t i = 0; i < image_pairs.size(); i++) {
+            add_pair(image_pairs[i], verified[i]);
+        }
+        for (size_t i = 0; i < rejected.size(); i++) {
+            add_pair(rejected[i], false);
+        }
+    } else {
+        // XX (mtourne): compare all the images with each other for now,
+        // decoding, extraction, matching and verification overlap
+        if (tracks_filename.empty()) {
+            IncrementalTracks tracks;
+            match_pipeline(sources, pipeline_options, load, image_bundle, add_pair, tracks);
+            report_tracks(tracks);
+        } else {
+            // matches go to disk as they're verified
+            ExternalTracks tracks(tracks_options);
+            match_pipeline(sources, pipeline_options, load, image_bundle, add_pair, tracks);
+
+            size_t count = 0;
+            if (tracks.build(tracks_filename, &count)) {
+                Metrics::instance().add("tracks.count", count);
+                tracks_built = true;
             }
+        }
+        images = image_bundle.get_images();
+    }
 
 #if VISUAL_DEBUG
-            image_pair.print_matches();
+    debug_writer.flush();
 #endif
 
-            image_bundle.add_pair(image_pair);
+    LOG(INFO) << "Kept " << image_bundle.pair_count() << " image pairs.";
+
+    // with --components, the images of no verified pair go now, and the
+    // tracks and the reconstruction run on each component
+    vector<Bundle> components;
+    if (split) {
+        split_components(image_bundle, components);
+    } else {
+        components.push_back(image_bundle);
+    }
+
+    if (compact) {
+        // everything written below gets the compacted features
+        vector<vector<int> > remap;
+        compaction_options.threads = matcher_options.threads;
+        compact_components(components, images, compaction_options, remap);
+        if (tracks_built) {
+            remap_track_table(tracks_filename, remap);
         }
+    }
 
+    // bundle.txt keeps all the images so the track table's image indexes
+    // hold, the per image stores get the connected ones, in bundle order
+    if (split) {
+        std::set<Image::ptr> connected;
+        for (const Bundle& component : components) {
+            vector<Image::ptr> component_images = component.get_images();
+            connected.insert(component_images.begin(), component_images.end());
+        }
+        image_bundle = join_components(components, images);
+        images.clear();
+        for (const Image::ptr& image : image_bundle.get_images()) {
+            if (connected.count(image)) {
+                images.push_back(image);
+            }
+        }
+    } else {
+        image_bundle = components[0];
     }
 
-    LOG(INFO) << "Kept " << image_bundle.pair_count() << " image pairs.";
+    if (!pq_filename.empty()) {
+        write_pq_store(images, pq_filename, pq_m, matcher_options.threads);
+    }
 
-    LOG(INFO) << "Serializing to disk";
+    if (!dense_prefix.empty()) {
+        // dense stereo of the pairs with the most inliers
+        vector<ImagePair> pairs = image_bundle.get_image_pairs();
+        std::stable_sort(pairs.begin(), pairs.end(),
+                         [](const ImagePair& a, const ImagePair& b) {
+                             return a.get_inliers_count() > b.get_inliers_count();
+                         });
 
+        stereo_options.threads = matcher_options.threads;
+        for (int i = 0; i < dense_pairs && i < (int) pairs.size(); i++) {
+            DensePoints dense;
+            if (!dense_pair(pairs[i], stereo_options, dense)) {
+                continue;
+            }
 
-    FileStorage fsb("bundle.txt", FileStorage::WRITE);
+            string filename = dense_prefix + "_" + std::to_string(i) + ".ply";
+            LOG(INFO) << "Dense pair " << i << ": " << dense.points.size()
+                      << " points to " << filename;
+            write_ply(filename, dense);
+        }
+    }
 
-    fsb << "bundle" << image_bundle;
-    fsb.release();
+    if (split) {
+        // tracks of each component in parallel, reconstructions in turn
+        vector<std::map<size_t, std::map<size_t, int> > > tracks(components.size());
+        parallel_for_index(components.size(), [&](size_t i, int) {
+                IncrementalTracks incremental;
+                add_bundle_pairs(components[i], incremental);
+                incremental.get_tracks(tracks[i]);
+                LOG(INFO) << "Component " << i << ": " << components[i].image_count()
+                          << " images, " << components[i].pair_count() << " pairs, "
+                          << tracks[i].size() << " tracks";
+                Metrics::instance().add("components.tracks", tracks[i].size());
+            });
+
+        sparse_options.threads = matcher_options.threads;
+        for (size_t i = 0; i < components.size() && !sparse_filename.empty(); i++) {
+            write_sparse(components[i], next_track(tracks[i]), sparse_options,
+                         component_filename(sparse_filename, i));
+            std::map<size_t, std::map<size_t, int> >().swap(tracks[i]);
+        }
+    } else if (!sparse_filename.empty()) {
+        sparse_options.threads = matcher_options.threads;
+        if (tracks_built) {
+            // streamed from the track table, remapped by the compaction
+            TrackTableReader reader;
+            if (reader.open(tracks_filename)) {
+                write_sparse(image_bundle, [&reader](std::map<size_t, int>& track) {
+                        return reader.next(track);
+                    }, sparse_options, sparse_filename);
+            }
+        } else {
+            IncrementalTracks incremental;
+            add_bundle_pairs(image_bundle, incremental);
+            std::map<size_t, std::map<size_t, int> > tracks;
+            incremental.get_tracks(tracks);
+            write_sparse(image_bundle, next_track(tracks), sparse_options, sparse_filename);
+        }
+    }
+
+    LOG(INFO) << "Serializing to disk";
+
+    AsyncWriter writer(io_options);
+    if (!features_dir.empty()) {
+        write_features(writer, features_dir, images);
+    }
+    for (size_t i = 0; i < components.size() && split; i++) {
+        write_bundle(writer, "bundle_" + std::to_string(i) + ".txt", components[i]);
+    }
+    write_bundle(writer, "bundle.txt", image_bundle);
+    if (!writer.flush()) {
+        LOG(ERROR) << "Some outputs weren't written";
+        return 1;
+    }
 
     LOG(INFO) << "De serializing bundle";
     Bundle new_bundle;
 
-    fsb.open("bundle.txt", FileStorage::READ);
+    FileStorage fsb("bundle.txt", FileStorage::READ);
     fsb["bundle"] >> new_bundle;
     fsb.release();
 
+    Metrics::instance().write_report("metrics.yml");
+
     return 0;
 }
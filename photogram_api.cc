@@ -0,0 +1,163 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include "photogram_api.h"
+#include "image_pairs.h"
+#include "metrics.h"
+#include "util.h"
+
+Image::ptr image_from_input(const ImageInput& input) {
+    Mat decoded = input.image;
+    if (decoded.empty() && input.data && input.size) {
+        // header only Mat on the bytes, imdecode reads them in place
+        Mat buf(1, input.size, CV_8UC1, (void*) input.data);
+        decoded = imdecode(buf, CV_LOAD_IMAGE_UNCHANGED);
+    }
+    if (decoded.empty() || decoded.depth() != CV_8U) {
+        LOG(ERROR) << "Can't decode image " << input.name;
+        return Image::ptr();
+    }
+
+    Image::ptr image(new Image());
+    if (!input.name.empty()) {
+        image->set_name(input.name);
+    }
+    image->set_image(decoded);
+    image->set_camera_matrix(input.K);
+    if (input.has_gps) {
+        image->set_gps_coordinates(input.lat, input.lon);
+    }
+    return image;
+}
+
+ImageFeaturesPtr extract_features(const ImageInput& input) {
+    Image::ptr image = image_from_input(input);
+    if (!image) {
+        return ImageFeaturesPtr();
+    }
+    return image->get_image_features();
+}
+
+// homography of the F inliers, empty when RANSAC can't fit one
+static Mat fit_homography(const vector<Point2f>& pts1, const vector<Point2f>& pts2,
+                          const vector<char>& inliers, double threshold) {
+    vector<Point2f> in1, in2;
+    for (size_t i = 0; i < inliers.size(); i++) {
+        if (inliers[i]) {
+            in1.push_back(pts1[i]);
+            in2.push_back(pts2[i]);
+        }
+    }
+    if (in1.size() < 4) {
+        return Mat();
+    }
+
+    vector<unsigned char> status;
+    return findHomography(in1, in2, CV_RANSAC, threshold, status);
+}
+
+bool match_images(const vector<ImageInput>& inputs, const vector<IndexPair>& candidates,
+                  const ApiOptions& options, MatchResult& result) {
+    result.features.assign(inputs.size(), ImageFeaturesPtr());
+    result.pairs.clear();
+
+    // decode in parallel, then extract once per image, features are
+    // cached after. SiftGPU runs one image at a time on its own thread
+    // (features2d.cc), more extraction threads would only wait on it
+    vector<Image::ptr> images(inputs.size());
+    parallel_for_index(inputs.size(), [&](size_t i, int) {
+            images[i] = image_from_input(inputs[i]);
+        }, options.threads);
+
+#ifdef USE_SIFT_GPU
+    int extract_threads = 1;
+#else
+    int extract_threads = options.threads;
+#endif
+    parallel_for_index(inputs.size(), [&](size_t i, int) {
+            if (images[i]) {
+                result.features[i] = images[i]->get_image_features();
+            }
+        }, extract_threads);
+
+    bool ok = true;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        ok = ok && result.features[i];
+    }
+
+    vector<IndexPair> pairs = candidates;
+    if (pairs.empty()) {
+        for (size_t i = 0; i < inputs.size(); i++) {
+            for (size_t j = i + 1; j < inputs.size(); j++) {
+                pairs.push_back(IndexPair(i, j));
+            }
+        }
+    }
+
+    // pairs of decoded images
+    vector<IndexPair> valid;
+    for (const IndexPair& pair : pairs) {
+        if (pair.first < inputs.size() && pair.second < inputs.size() &&
+            pair.first != pair.second &&
+            result.features[pair.first] && result.features[pair.second]) {
+            valid.push_back(pair);
+        }
+    }
+
+    vector<Matches> matches(valid.size());
+    parallel_for_index(valid.size(), [&](size_t i, int) {
+            match_features(*result.features[valid[i].first],
+                           *result.features[valid[i].second], matches[i]);
+        }, options.threads);
+
+    // F matrices of the pairs with enough matches, in batches
+    vector<ImagePair> image_pairs;
+    vector<size_t> pair_index;
+    for (size_t i = 0; i < valid.size(); i++) {
+        if (matches[i].size() < options.min_matches) {
+            continue;
+        }
+        ImagePair image_pair(images[valid[i].first], images[valid[i].second]);
+        image_pair.set_matches(matches[i]);
+        image_pairs.push_back(image_pair);
+        pair_index.push_back(i);
+    }
+
+    BatchRansacOptions ransac = options.ransac;
+    if (ransac.threads <= 0) {
+        ransac.threads = options.threads;
+    }
+    vector<char> verified;
+    batch_compute_F(image_pairs, ransac, verified);
+
+    vector<size_t> kept;
+    for (size_t i = 0; i < image_pairs.size(); i++) {
+        if (verified[i]) {
+            kept.push_back(i);
+        }
+    }
+
+    result.pairs.resize(kept.size());
+    parallel_for_index(kept.size(), [&](size_t k, int) {
+            const ImagePair& image_pair = image_pairs[kept[k]];
+            const IndexPair& index = valid[pair_index[kept[k]]];
+
+            PairResult& pair = result.pairs[k];
+            pair.image1 = index.first;
+            pair.image2 = index.second;
+            pair.F = image_pair.get_F();
+            get_putative_matches(image_pair.get_matches(), image_pair.get_inliers(),
+                                 pair.matches);
+
+            vector<Point2f> pts1, pts2;
+            image_pair.get_match_points(pts1, pts2);
+            pair.H = fit_homography(pts1, pts2, image_pair.get_inliers(),
+                                    options.homography_threshold);
+        }, options.threads);
+
+    Metrics::instance().add("api.images", inputs.size());
+    Metrics::instance().add("api.verified_pairs", result.pairs.size());
+
+    return ok;
+}
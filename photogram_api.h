@@ -0,0 +1,117 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// In process API of libphotogram.
+//
+// Images come as decoded Mats or as encoded bytes (jpeg, png ..) with
+// optional metadata, and results stay in memory: features, verified
+// matches, F and homography of each pair. Nothing touches the disk.
+//
+// Calls are independent and safe from several threads: each one has its
+// own images, parallel work goes to the shared pool (see util.h), and
+// the matcher is the process one from set_matcher_options(), to set
+// before the first call. With SiftGPU, extraction and GPU matching are
+// serialized in the library: every call runs them in turn on the
+// thread owning the GL context, concurrent calls wait there.
+//
+// The program linking the library initializes the logging with
+// _INITIALIZE_EASYLOGGINGPP, as our tools do.
+//
+// Usage :
+//  vector<ImageInput> inputs(2);
+//  inputs[0].image = frame;               // decoded
+//  inputs[1].data = jpeg; inputs[1].size = jpeg_size;  // encoded
+//  MatchResult result;
+//  match_images(inputs, vector<IndexPair>(), ApiOptions(), result);
+//  for (const PairResult& pair : result.pairs) ... pair.H ...
+
+#ifndef PHOTOGRAM_API_H
+#define PHOTOGRAM_API_H
+
+#include <utility>
+#include <vector>
+
+#include "photogram.h"
+#include "batch_ransac.h"
+#include "features2d.h"
+#include "image.h"
+
+struct ImageInput {
+    ImageInput()
+        : data(NULL), size(0), has_gps(false), lat(0), lon(0), alt(0)
+    {};
+
+    // decoded 8 bit image, gray or BGR(A)
+    Mat                     image;
+
+    // or encoded bytes when image is empty, read during the call only
+    const unsigned char    *data;
+    size_t                  size;
+
+    std::string             name;
+
+    // known gps position
+    bool                    has_gps;
+    double                  lat;
+    double                  lon;
+    double                  alt;
+
+    // known intrinsic matrix, can be empty
+    Mat                     K;
+};
+
+struct ApiOptions {
+    ApiOptions()
+        : min_matches(MIN_FEATURE_MATCHES), homography_threshold(3.0), threads(0)
+    {};
+
+    // F matrix RANSAC of the pairs
+    BatchRansacOptions  ransac;
+
+    // putative matches needed to try a pair
+    size_t              min_matches;
+
+    // RANSAC threshold in pixels, fit on the F inliers
+    double              homography_threshold;
+
+    // <= 0 for default_thread_count()
+    int                 threads;
+};
+
+typedef std::pair<size_t, size_t>   IndexPair;
+
+struct PairResult {
+    // indexes of the inputs
+    size_t      image1;
+    size_t      image2;
+
+    // inlier matches, query features from image1
+    Matches     matches;
+
+    Mat         F;
+
+    // image1 to image2, empty when it can't be fit
+    Mat         H;
+};
+
+struct MatchResult {
+    // per input, NULL when it can't be decoded
+    std::vector<ImageFeaturesPtr>   features;
+
+    // the verified pairs only
+    std::vector<PairResult>         pairs;
+};
+
+// Image holding the decoded input, NULL when it can't be decoded
+Image::ptr image_from_input(const ImageInput& input);
+
+// features of one image, NULL when it can't be decoded
+ImageFeaturesPtr extract_features(const ImageInput& input);
+
+// features of all the inputs, then matches and verification of the
+// candidate pairs (every pair when empty). False when an input can't be
+// decoded, the other images are still matched.
+bool match_images(const std::vector<ImageInput>& inputs,
+                  const std::vector<IndexPair>& candidates,
+                  const ApiOptions& options, MatchResult& result);
+
+#endif // !PHOTOGRAM_API_H
@@ -0,0 +1,499 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Stages connected by bounded queues, each stage with its own workers.
+//
+//  [1] D. Vyukov, "Bounded MPMC queue", 1024cores.net.
+//
+// Usage :
+//  Pipeline pipeline("match", 8);      // up to 8 workers computing
+//  PipelineQueue<int> *numbers = pipeline.queue<int>("numbers", 64);
+//  PipelineQueue<int> *squares = pipeline.queue<int>("squares", 64);
+//  pipeline.source<int>("generate", numbers, [](const PipelineEmit<int>& emit) {
+//      for (int i = 0; i < 100; i++) emit(i);
+//  });
+//  pipeline.stage<int, int>("square", 4, numbers, squares,
+//      [](int& i, const PipelineEmit<int>& emit) { emit(i * i); });
+//  pipeline.sink<int>("print", 1, squares, [](int& i) { cout << i; });
+//  pipeline.run();                     // returns once everything drained
+//
+// Queues are lock free (a sequence number per cell [1]), workers back
+// off when a queue is full or empty: a full queue holds its producers
+// (backpressure), the queue closes when its last producer worker is done.
+//
+// Worker threads add up over the stages, a budget bounds how many of
+// them compute at once: a worker takes a slot to process an item and
+// gives it back while it waits on a queue, so a stalled stage doesn't
+// keep the others from draining it.
+//
+// run() adds to the metrics, per stage: items, busy seconds, seconds
+// starved (input queue empty) and blocked (output queue full), and the
+// occupancy busy / (workers x wall time). Per queue: the mean depth seen
+// by the producers. The bottleneck is the stage with the highest
+// occupancy, whose input queue is full and output queue empty.
+
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "photogram.h"
+#include "metrics.h"
+
+typedef std::chrono::steady_clock PipelineClock;
+
+static inline double pipeline_seconds(PipelineClock::time_point since) {
+    return std::chrono::duration<double>(PipelineClock::now() - since).count();
+}
+
+// spin a little, then yield, then sleep: queues are mostly short waits
+static inline void pipeline_backoff(unsigned int& spins) {
+    if (spins < 64) {
+        spins++;
+    } else if (spins < 128) {
+        spins++;
+        std::this_thread::yield();
+    } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+}
+
+// Bounded multi producer multi consumer queue, lock free [1].
+template <typename T>
+class BoundedQueue {
+ public:
+    // capacity is rounded up to a power of 2
+    explicit BoundedQueue(size_t capacity)
+        : enqueue_pos(0), dequeue_pos(0) {
+        size_t size = 2;
+        while (size < capacity) {
+            size *= 2;
+        }
+        mask = size - 1;
+        cells.reset(new Cell[size]);
+        for (size_t i = 0; i < size; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // false when full
+    bool try_push(T& value) {
+        Cell *cell;
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                                      std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->value = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // false when empty
+    bool try_pop(T& value) {
+        Cell *cell;
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1,
+                                                      std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        value = std::move(cell->value);
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    inline size_t capacity() const {
+        return mask + 1;
+    }
+
+    // approximate under concurrency
+    inline size_t size() const {
+        size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+        size_t head = dequeue_pos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+ private:
+    struct Cell {
+        std::atomic<size_t>     sequence;
+        T                       value;
+    };
+
+    std::unique_ptr<Cell[]>    cells;
+    size_t                     mask;
+
+    // producers and consumers on different cache lines
+    char                       pad0[64];
+    std::atomic<size_t>        enqueue_pos;
+    char                       pad1[64];
+    std::atomic<size_t>        dequeue_pos;
+    char                       pad2[64];
+};
+
+// A queue between stages: blocking push and pop, closed when all the
+// workers producing into it are done.
+template <typename T>
+class PipelineQueue {
+ public:
+    PipelineQueue(const std::string& name, size_t capacity)
+        : name(name), queue(capacity), producers(0), closed(false),
+          pushes(0), depth_sum(0)
+    {};
+
+    // blocks while full, returns the seconds spent blocked
+    double push(T& value) {
+        // depth seen by the producer, before the push
+        depth_sum += queue.size();
+        pushes++;
+
+        if (queue.try_push(value)) {
+            return 0;
+        }
+
+        PipelineClock::time_point start = PipelineClock::now();
+        unsigned int spins = 0;
+        while (!queue.try_push(value)) {
+            pipeline_backoff(spins);
+        }
+        return pipeline_seconds(start);
+    }
+
+    // blocks while empty, false once closed and drained
+    bool pop(T& value, double *waited) {
+        *waited = 0;
+        if (queue.try_pop(value)) {
+            return true;
+        }
+
+        PipelineClock::time_point start = PipelineClock::now();
+        unsigned int spins = 0;
+        while (true) {
+            if (queue.try_pop(value)) {
+                *waited = pipeline_seconds(start);
+                return true;
+            }
+            if (closed.load(std::memory_order_acquire)) {
+                // pushed before the close
+                bool popped = queue.try_pop(value);
+                *waited = pipeline_seconds(start);
+                return popped;
+            }
+            pipeline_backoff(spins);
+        }
+    }
+
+    inline void add_producers(int count) {
+        producers += count;
+    }
+
+    // the last producer closes the queue
+    inline void producer_done() {
+        if (--producers == 0) {
+            closed.store(true, std::memory_order_release);
+        }
+    }
+
+    inline const std::string& get_name() const {
+        return name;
+    }
+
+    inline size_t capacity() const {
+        return queue.capacity();
+    }
+
+    inline double mean_depth() const {
+        return pushes ? depth_sum / (double) pushes : 0;
+    }
+
+ private:
+    std::string             name;
+    BoundedQueue<T>         queue;
+    std::atomic<int>        producers;
+    std::atomic<bool>       closed;
+
+    std::atomic<uint64_t>   pushes;
+    std::atomic<uint64_t>   depth_sum;
+};
+
+// how a stage hands its outputs to the next queue
+template <typename T>
+using PipelineEmit = std::function<void(T)>;
+
+// time accounting of a stage, shared by its workers
+struct PipelineStageStats {
+    PipelineStageStats()
+        : items(0), busy_us(0), starved_us(0), blocked_us(0)
+    {};
+
+    std::atomic<uint64_t>   items;
+    std::atomic<uint64_t>   busy_us;
+    std::atomic<uint64_t>   starved_us;
+    std::atomic<uint64_t>   blocked_us;
+};
+
+// slots of workers computing at once
+class PipelineBudget {
+ public:
+    explicit PipelineBudget(int slots)
+        : slots(std::max(slots, 1))
+    {};
+
+    // seconds waited for a slot
+    double acquire() {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (slots > 0) {
+            slots--;
+            return 0;
+        }
+        PipelineClock::time_point start = PipelineClock::now();
+        cond.wait(lock, [this]() { return slots > 0; });
+        slots--;
+        return pipeline_seconds(start);
+    }
+
+    void release() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            slots++;
+        }
+        cond.notify_one();
+    }
+
+ private:
+    std::mutex              mutex;
+    std::condition_variable cond;
+    int                     slots;
+};
+
+class Pipeline {
+ public:
+    // at most budget workers computing at once, <= 0 for no limit
+    explicit Pipeline(const std::string& name, int budget = 0)
+        : name(name), budget(budget > 0 ? new PipelineBudget(budget) : NULL)
+    {};
+
+    // owned by the pipeline
+    template <typename T>
+    PipelineQueue<T>* queue(const std::string& queue_name, size_t capacity) {
+        std::shared_ptr<PipelineQueue<T> > q(new PipelineQueue<T>(queue_name, capacity));
+        queues.push_back(std::shared_ptr<void>(q));
+        queue_reports.push_back([q](const std::string& prefix) {
+                Metrics::instance().add(prefix + q->get_name() + ".capacity", q->capacity());
+                Metrics::instance().add(prefix + q->get_name() + ".mean_depth", q->mean_depth());
+            });
+        return q.get();
+    }
+
+    // one worker producing the items of out
+    template <typename Out>
+    void source(const std::string& stage_name, PipelineQueue<Out> *out,
+                std::function<void(const PipelineEmit<Out>&)> fn) {
+        PipelineStageStats *stats = add_stage(stage_name, 1);
+        PipelineBudget *slots = budget.get();
+        out->add_producers(1);
+
+        workers.push_back([=]() {
+                double blocked = 0;
+                PipelineEmit<Out> push = emitter(out, stats, slots, &blocked);
+                PipelineEmit<Out> emit = [&](Out value) {
+                    push(value);
+                    stats->items++;
+                };
+                double waited = slots ? slots->acquire() : 0;
+                stats->starved_us += (uint64_t) (waited * 1e6);
+                PipelineClock::time_point start = PipelineClock::now();
+                fn(emit);
+                add_busy(stats, pipeline_seconds(start) - blocked);
+                if (slots) {
+                    slots->release();
+                }
+                out->producer_done();
+            });
+    }
+
+    // workers taking the items of in, emitting to out
+    template <typename In, typename Out>
+    void stage(const std::string& stage_name, int count,
+               PipelineQueue<In> *in, PipelineQueue<Out> *out,
+               std::function<void(In&, const PipelineEmit<Out>&)> fn) {
+        count = std::max(count, 1);
+        PipelineStageStats *stats = add_stage(stage_name, count);
+        PipelineBudget *slots = budget.get();
+        out->add_producers(count);
+
+        for (int w = 0; w < count; w++) {
+            workers.push_back([=]() {
+                    double blocked = 0;
+                    PipelineEmit<Out> emit = emitter(out, stats, slots, &blocked);
+                    consume<In>(in, stats, slots, &blocked, [&](In& item) {
+                            fn(item, emit);
+                        });
+                    out->producer_done();
+                });
+        }
+    }
+
+    // workers taking the items of in, last stage
+    template <typename In>
+    void sink(const std::string& stage_name, int count, PipelineQueue<In> *in,
+              std::function<void(In&)> fn) {
+        count = std::max(count, 1);
+        PipelineStageStats *stats = add_stage(stage_name, count);
+        PipelineBudget *slots = budget.get();
+
+        for (int w = 0; w < count; w++) {
+            workers.push_back([=]() {
+                    double blocked = 0;
+                    consume<In>(in, stats, slots, &blocked, fn);
+                });
+        }
+    }
+
+    // run all the stages until the queues are drained, then report
+    void run() {
+        PipelineClock::time_point start = PipelineClock::now();
+
+        std::vector<std::thread> threads;
+        for (auto& worker : workers) {
+            threads.push_back(std::thread(worker));
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        report(pipeline_seconds(start));
+    }
+
+ private:
+    // blocked sums the seconds the worker spent on a full queue, or
+    // getting its slot back after the push
+    template <typename Out>
+    static PipelineEmit<Out> emitter(PipelineQueue<Out> *out, PipelineStageStats *stats,
+                                     PipelineBudget *slots, double *blocked) {
+        return [=](Out value) {
+            if (slots) {
+                slots->release();
+            }
+            double seconds = out->push(value);
+            if (slots) {
+                seconds += slots->acquire();
+            }
+            *blocked += seconds;
+            stats->blocked_us += (uint64_t) (seconds * 1e6);
+        };
+    }
+
+    // pop and process items until in is closed and drained, the time
+    // blocked emitting is not busy time
+    template <typename In>
+    static void consume(PipelineQueue<In> *in, PipelineStageStats *stats,
+                        PipelineBudget *slots, const double *blocked,
+                        const std::function<void(In&)>& fn) {
+        In item;
+        double waited;
+        while (in->pop(item, &waited)) {
+            if (slots) {
+                waited += slots->acquire();
+            }
+            stats->starved_us += (uint64_t) (waited * 1e6);
+
+            double blocked_before = *blocked;
+            PipelineClock::time_point start = PipelineClock::now();
+            fn(item);
+            add_busy(stats, pipeline_seconds(start) - (*blocked - blocked_before));
+            stats->items++;
+            if (slots) {
+                slots->release();
+            }
+        }
+        stats->starved_us += (uint64_t) (waited * 1e6);
+    }
+
+    static inline void add_busy(PipelineStageStats *stats, double seconds) {
+        if (seconds > 0) {
+            stats->busy_us += (uint64_t) (seconds * 1e6);
+        }
+    }
+
+    PipelineStageStats* add_stage(const std::string& stage_name, int count) {
+        stages.push_back(std::unique_ptr<PipelineStageStats>(new PipelineStageStats()));
+        stage_names.push_back(stage_name);
+        stage_workers.push_back(count);
+        return stages.back().get();
+    }
+
+    void report(double wall) {
+        std::string prefix = "pipeline." + name + ".";
+        Metrics& metrics = Metrics::instance();
+
+        for (size_t i = 0; i < stages.size(); i++) {
+            const PipelineStageStats& stats = *stages[i];
+            std::string key = prefix + stage_names[i] + ".";
+            double busy = stats.busy_us / 1e6;
+            double occupancy = wall > 0 ? busy / (stage_workers[i] * wall) : 0;
+
+            metrics.add(key + "workers", stage_workers[i]);
+            metrics.add(key + "items", stats.items);
+            metrics.add(key + "busy_s", busy);
+            metrics.add(key + "starved_s", stats.starved_us / 1e6);
+            metrics.add(key + "blocked_s", stats.blocked_us / 1e6);
+            metrics.add(key + "occupancy", occupancy);
+
+            LOG(INFO) << "Stage " << stage_names[i] << ": " << stats.items << " items, "
+                      << stage_workers[i] << " workers, occupancy " << occupancy
+                      << ", starved " << stats.starved_us / 1e6 << "s, blocked "
+                      << stats.blocked_us / 1e6 << "s";
+        }
+
+        for (auto& queue_report : queue_reports) {
+            queue_report(prefix);
+        }
+        metrics.add(prefix + "wall_s", wall);
+    }
+
+    std::string                                         name;
+    std::unique_ptr<PipelineBudget>                     budget;
+    std::vector<std::shared_ptr<void> >                 queues;
+    std::vector<std::function<void(const std::string&)> > queue_reports;
+    std::vector<std::function<void()> >                 workers;
+
+    std::vector<std::unique_ptr<PipelineStageStats> >   stages;
+    std::vector<std::string>                            stage_names;
+    std::vector<int>                                    stage_workers;
+};
+
+#endif // !PIPELINE_HPP
@@ -0,0 +1,415 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <queue>
+
+#include "pq.h"
+#include "simd_kernels.h"
+#include "util.h"
+
+#define PQ_MAGIC        0x34515150  // "PPQ4"
+#define PQ_STORE_MAGIC  0x53515150  // "PPQS"
+
+// dimensions of a loaded quantizer, keeps its dim x dim rotation sane
+#define PQ_MAX_DIM      4096
+
+// descriptors encoded per task when adding an image
+#define PQ_ENCODE_CHUNK 1024
+
+// blocks scanned per pass, keeps the distances in cache
+#define PQ_SCAN_BLOCKS  1024
+
+// bytes left in a stream, -1 when it can't seek
+static int64_t remaining(std::istream& is) {
+    std::streampos pos = is.tellg();
+    if (pos < 0 || !is.seekg(0, std::ios::end)) {
+        is.clear();
+        return -1;
+    }
+    std::streampos end = is.tellg();
+    is.seekg(pos);
+    return end - pos;
+}
+
+ProductQuantizer::ProductQuantizer(int dim, int m)
+    : dim(dim), m(m), sub_dim(m > 0 ? dim / m : 0) {
+    if (m <= 0 || m % 2 || dim % m) {
+        LOG(ERROR) << "PQ: " << m << " sub quantizers don't split "
+                   << dim << " dimensions in pairs";
+        this->m = 0;
+        sub_dim = 0;
+    }
+}
+
+bool ProductQuantizer::train(const Mat& samples, int threads) {
+    if (m == 0) {
+        return false;
+    }
+    if (samples.type() != CV_32F || samples.cols != dim) {
+        LOG(ERROR) << "PQ: training samples must be CV_32F rows of " << dim;
+        return false;
+    }
+    // a full rank covariance for PCA
+    if (samples.rows < dim) {
+        LOG(ERROR) << "PQ: not enough training samples (" << samples.rows << ")";
+        return false;
+    }
+
+    LOG(INFO) << "Training PQ codebooks, m: " << m << ", samples: " << samples.rows;
+
+    PCA pca(samples, noArray(), PCA::DATA_AS_ROW);
+    Mat eigenvectors, eigenvalues;
+    pca.eigenvectors.convertTo(eigenvectors, CV_32F);
+    pca.eigenvalues.convertTo(eigenvalues, CV_64F);
+
+    // eigenvalue allocation: spread the principal directions over the
+    // sub spaces so they get a balanced share of the variance, largest
+    // first to the least loaded sub space with room left
+    std::vector<std::vector<int> > sub_spaces(m);
+    std::vector<double> variance(m, 0);
+    for (int i = 0; i < dim; i++) {
+        int best = -1;
+        for (int j = 0; j < m; j++) {
+            if ((int) sub_spaces[j].size() < sub_dim &&
+                (best < 0 || variance[j] < variance[best])) {
+                best = j;
+            }
+        }
+        sub_spaces[best].push_back(i);
+        variance[best] += eigenvalues.at<double>(i);
+    }
+
+    // rotation is stored transposed: row c holds the contribution of
+    // input dimension c to every output dimension
+    mean.assign(pca.mean.ptr<float>(), pca.mean.ptr<float>() + dim);
+    rotation.assign(dim * dim, 0);
+    for (int j = 0; j < m; j++) {
+        for (int s = 0; s < sub_dim; s++) {
+            const float *v = eigenvectors.ptr<float>(sub_spaces[j][s]);
+            int out = j * sub_dim + s;
+            for (int c = 0; c < dim; c++) {
+                rotation[c * dim + out] = v[c];
+            }
+        }
+    }
+
+    Mat rotated(samples.rows, dim, CV_32F);
+    parallel_for_index(samples.rows, [&](size_t i, int) {
+            rotate(samples.ptr<float>(i), rotated.ptr<float>(i));
+        }, threads);
+
+    // sub spaces are independent, one k-means each
+    std::vector<float> trained(m * CENTROIDS * sub_dim);
+    parallel_for_index(m, [&](size_t j, int) {
+            Mat sub = rotated.colRange(j * sub_dim, (j + 1) * sub_dim).clone();
+            Mat labels, centers;
+            kmeans(sub, CENTROIDS, labels,
+                   TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, 25, 1e-4),
+                   1, KMEANS_PP_CENTERS, centers);
+            memcpy(&trained[j * CENTROIDS * sub_dim], centers.ptr<float>(),
+                   CENTROIDS * sub_dim * sizeof(float));
+        }, threads);
+
+    centroids.swap(trained);
+    return true;
+}
+
+void ProductQuantizer::rotate(const float *x, float *out) const {
+    // axpy over the rows of the transposed rotation, vectorizes
+    std::fill(out, out + dim, 0.f);
+    for (int c = 0; c < dim; c++) {
+        const float *row = &rotation[c * dim];
+        float v = x[c] - mean[c];
+        for (int r = 0; r < dim; r++) {
+            out[r] += v * row[r];
+        }
+    }
+}
+
+void ProductQuantizer::encode(const float *x, uint8_t *codes) const {
+    const SimdKernels& kernels = simd_kernels();
+    std::vector<float> r(dim);
+    rotate(x, &r[0]);
+
+    for (int j = 0; j < m; j++) {
+        const float *sub = &r[j * sub_dim];
+        const float *c = &centroids[j * CENTROIDS * sub_dim];
+        float best_dist = kernels.l2_sqr_f32(sub, c, sub_dim);
+        int best = 0;
+        for (int k = 1; k < CENTROIDS; k++) {
+            float d = kernels.l2_sqr_f32(sub, c + k * sub_dim, sub_dim);
+            if (d < best_dist) {
+                best_dist = d;
+                best = k;
+            }
+        }
+        codes[j] = best;
+    }
+}
+
+void ProductQuantizer::lookup_table(const float *query, uint8_t *lut,
+                                    float& scale, float& bias) const {
+    const SimdKernels& kernels = simd_kernels();
+    std::vector<float> r(dim);
+    std::vector<float> dist(m * CENTROIDS);
+    std::vector<float> mins(m);
+    rotate(query, &r[0]);
+
+    float range = 0;
+    bias = 0;
+    for (int j = 0; j < m; j++) {
+        const float *sub = &r[j * sub_dim];
+        float *d = &dist[j * CENTROIDS];
+        for (int k = 0; k < CENTROIDS; k++) {
+            d[k] = kernels.l2_sqr_f32(sub, &centroids[(j * CENTROIDS + k) * sub_dim], sub_dim);
+        }
+        mins[j] = *std::min_element(d, d + CENTROIDS);
+        range = std::max(range, *std::max_element(d, d + CENTROIDS) - mins[j]);
+        bias += mins[j];
+    }
+
+    // one scale for all the tables so the sums stay comparable,
+    // m * 255 fits the 16 bit accumulators of pq4_scan
+    scale = range > 0 ? 255.f / range : 1.f;
+    for (int j = 0; j < m; j++) {
+        for (int k = 0; k < CENTROIDS; k++) {
+            float v = (dist[j * CENTROIDS + k] - mins[j]) * scale + 0.5f;
+            lut[j * CENTROIDS + k] = (uint8_t) std::min(v, 255.f);
+        }
+    }
+}
+
+bool ProductQuantizer::save(std::ostream& os) const {
+    uint32_t header[3] = { PQ_MAGIC, (uint32_t) dim, (uint32_t) m };
+    os.write((const char*) header, sizeof(header));
+    if (is_trained()) {
+        os.write((const char*) &mean[0], mean.size() * sizeof(float));
+        os.write((const char*) &rotation[0], rotation.size() * sizeof(float));
+        os.write((const char*) &centroids[0], centroids.size() * sizeof(float));
+    }
+    return os.good();
+}
+
+bool ProductQuantizer::load(std::istream& is) {
+    uint32_t header[3];
+    is.read((char*) header, sizeof(header));
+
+    // m in pairs for the 4 bit layout, the arrays within the stream
+    uint64_t d = header[1];
+    if (!is || header[0] != PQ_MAGIC || header[2] == 0 || header[2] % 2 ||
+        d == 0 || d % header[2] || d > PQ_MAX_DIM) {
+        return false;
+    }
+    int64_t left = remaining(is);
+    if (left >= 0 && (d + d * d + d * CENTROIDS) * sizeof(float) > (uint64_t) left) {
+        return false;
+    }
+
+    dim = header[1];
+    m = header[2];
+    sub_dim = dim / m;
+
+    mean.resize(dim);
+    rotation.resize(dim * dim);
+    centroids.resize(m * CENTROIDS * sub_dim);
+    is.read((char*) &mean[0], mean.size() * sizeof(float));
+    is.read((char*) &rotation[0], rotation.size() * sizeof(float));
+    is.read((char*) &centroids[0], centroids.size() * sizeof(float));
+
+    return is.good();
+}
+
+///////////////
+/// PqStore ///
+///////////////
+
+uint32_t PqStore::add(const float *descriptors, size_t n, int threads) {
+    uint32_t image = offsets.size();
+    offsets.push_back(count);
+    if (n == 0) {
+        return image;
+    }
+
+    const int m = pq->get_m();
+    const int dim = pq->get_dim();
+    const size_t rows = m / 2;
+
+    // one code per byte first, in parallel
+    std::vector<uint8_t> unpacked(n * m);
+    size_t chunks = (n + PQ_ENCODE_CHUNK - 1) / PQ_ENCODE_CHUNK;
+    parallel_for_index(chunks, [&](size_t chunk, int) {
+            size_t end = std::min(n, (chunk + 1) * PQ_ENCODE_CHUNK);
+            for (size_t i = chunk * PQ_ENCODE_CHUNK; i < end; i++) {
+                pq->encode(descriptors + i * dim, &unpacked[i * m]);
+            }
+        }, threads);
+
+    // then interleaved, the image may start inside a block
+    codes.resize((count + n + 15) / 16 * rows * 16, 0);
+    for (size_t i = 0; i < n; i++) {
+        size_t id = count + i;
+        uint8_t *block = &codes[id / 16 * rows * 16];
+        const uint8_t *c = &unpacked[i * m];
+        for (size_t k = 0; k < rows; k++) {
+            block[k * 16 + id % 16] = c[2 * k] | (c[2 * k + 1] << 4);
+        }
+    }
+    count += n;
+
+    return image;
+}
+
+void PqStore::locate(size_t id, uint32_t& image, uint32_t& keypoint) const {
+    // last image starting at or before id, skips empty images
+    std::vector<size_t>::const_iterator it =
+        std::upper_bound(offsets.begin(), offsets.end(), id) - 1;
+    image = it - offsets.begin();
+    keypoint = id - *it;
+}
+
+void PqStore::search(const float *query, size_t k, size_t rerank,
+                     std::vector<PqMatch>& matches,
+                     const ExactDescriptorFn& exact) const {
+    matches.clear();
+    if (!pq || !pq->is_trained() || count == 0 || k == 0) {
+        return;
+    }
+
+    const SimdKernels& kernels = simd_kernels();
+    const int m = pq->get_m();
+    const size_t rows = m / 2;
+    size_t candidates = std::max(k, k * rerank);
+
+    std::vector<uint8_t> lut(m * ProductQuantizer::CENTROIDS);
+    float scale, bias;
+    pq->lookup_table(query, &lut[0], scale, bias);
+
+    // best candidates by approximate distance, worst on top
+    typedef std::pair<uint16_t, size_t> Candidate;
+    std::priority_queue<Candidate> best;
+
+    std::vector<uint16_t> dist(PQ_SCAN_BLOCKS * 16);
+    size_t blocks = (count + 15) / 16;
+    for (size_t start = 0; start < blocks; start += PQ_SCAN_BLOCKS) {
+        size_t n = std::min((size_t) PQ_SCAN_BLOCKS, blocks - start);
+        kernels.pq4_scan(&codes[start * rows * 16], n, m, &lut[0], &dist[0]);
+
+        size_t end = std::min(count - start * 16, n * 16);
+        for (size_t i = 0; i < end; i++) {
+            if (best.size() < candidates) {
+                best.push(Candidate(dist[i], start * 16 + i));
+            } else if (dist[i] < best.top().first) {
+                best.pop();
+                best.push(Candidate(dist[i], start * 16 + i));
+            }
+        }
+    }
+
+    while (!best.empty()) {
+        PqMatch match;
+        locate(best.top().second, match.image, match.keypoint);
+        match.distance = best.top().first / scale + bias;
+
+        const float *descriptor = exact ? exact(match.image, match.keypoint) : NULL;
+        if (descriptor) {
+            match.distance = kernels.l2_sqr_f32(query, descriptor, pq->get_dim());
+        }
+
+        matches.push_back(match);
+        best.pop();
+    }
+
+    std::sort(matches.begin(), matches.end(),
+              [](const PqMatch& a, const PqMatch& b) {
+                  return a.distance < b.distance;
+              });
+    if (matches.size() > k) {
+        matches.resize(k);
+    }
+}
+
+size_t PqStore::memory_size() const {
+    return codes.size() + offsets.size() * sizeof(size_t);
+}
+
+bool PqStore::save(std::ostream& os) const {
+    if (!pq) {
+        return false;
+    }
+
+    uint64_t header[3] = { PQ_STORE_MAGIC, count, offsets.size() };
+    os.write((const char*) header, sizeof(header));
+    if (!pq->save(os)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < offsets.size(); i++) {
+        uint64_t offset = offsets[i];
+        os.write((const char*) &offset, sizeof(offset));
+    }
+    if (!codes.empty()) {
+        os.write((const char*) &codes[0], codes.size());
+    }
+
+    return os.good();
+}
+
+bool PqStore::load(std::istream& is) {
+    uint64_t header[3];
+    is.read((char*) header, sizeof(header));
+    if (!is || header[0] != PQ_STORE_MAGIC) {
+        return false;
+    }
+
+    ProductQuantizer::ptr quantizer(new ProductQuantizer());
+    if (!quantizer->load(is)) {
+        return false;
+    }
+
+    // offsets and codes within the stream, before they're allocated
+    uint64_t images = header[2], descriptors = header[1];
+    uint64_t blocks = descriptors / 16 + (descriptors % 16 != 0);
+    int64_t left = remaining(is);
+    if (left >= 0 && (images > (uint64_t) left / sizeof(uint64_t) ||
+                      blocks > ((uint64_t) left - images * sizeof(uint64_t)) /
+                      (quantizer->code_size() * 16))) {
+        return false;
+    }
+
+    std::vector<size_t> image_offsets(images);
+    for (size_t i = 0; i < image_offsets.size(); i++) {
+        uint64_t offset;
+        is.read((char*) &offset, sizeof(offset));
+        if (!is || offset > descriptors || (i > 0 && offset < image_offsets[i - 1])) {
+            return false;
+        }
+        image_offsets[i] = offset;
+    }
+
+    std::vector<uint8_t> image_codes(blocks * quantizer->code_size() * 16);
+    if (!image_codes.empty()) {
+        is.read((char*) &image_codes[0], image_codes.size());
+    }
+    if (!is.good()) {
+        return false;
+    }
+
+    pq = quantizer;
+    count = descriptors;
+    offsets.swap(image_offsets);
+    codes.swap(image_codes);
+    return true;
+}
+
+bool PqStore::save(const std::string& filename) const {
+    std::ofstream os(filename.c_str(), std::ios::binary);
+    return os && save(os);
+}
+
+bool PqStore::load(const std::string& filename) {
+    std::ifstream is(filename.c_str(), std::ios::binary);
+    return is && load(is);
+}
@@ -0,0 +1,173 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Product quantized descriptor store, for project wide indexing.
+//
+//  [1] H. Jegou, M. Douze and C. Schmid, "Product quantization for
+//    nearest neighbor search", TPAMI 2011.
+//  [2] T. Ge, K. He, Q. Ke and J. Sun, "Optimized product quantization",
+//    TPAMI 2014 (eigenvalue allocation).
+//  [3] F. Andre, A.-M. Kermarrec and N. Le Scouarnec, "Cache locality is
+//    not enough: high-performance nearest neighbor search with product
+//    quantization fast scan", VLDB 2015.
+//
+// Descriptors are rotated with PCA, their dimensions balanced over m
+// sub spaces, and each sub space quantized to one of 16 centroids: a
+// descriptor costs m / 2 bytes instead of 512 (m = 32: 16 bytes, m = 64:
+// 32 bytes), 10k images of 10k features take 1.6 to 3.2 GB.
+//
+// Search computes query to centroid distances once (asymmetric
+// distance), quantized to 8 bits so the 16 entry tables fit in SIMD
+// registers and are looked up with byte shuffles (pq4_scan kernel).
+// The best candidates are re-ranked with the exact descriptors.
+//
+// photogram only writes the store (--pq_store), for tools that search
+// it later: nothing in the matching reads it back or calls search() yet.
+//
+// Usage :
+//  ProductQuantizer::ptr pq(new ProductQuantizer(128, 32));
+//  pq->train(samples);                // CV_32F, one descriptor per row
+//  PqStore store(pq);
+//  store.add(descriptors, count);     // per image, returns its index
+//  store.search(query, 2, 64, matches, exact);
+
+#ifndef PQ_H
+#define PQ_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "photogram.h"
+
+class ProductQuantizer {
+ public:
+    typedef std::shared_ptr<ProductQuantizer>  ptr;
+
+    enum { CENTROIDS = 16 };
+
+    // m sub quantizers, even and dividing dim
+    ProductQuantizer(int dim = 128, int m = 32);
+
+    // PCA and k-means codebooks (one per sub space, in parallel) on
+    // samples, CV_32F with one descriptor per row
+    bool train(const Mat& samples, int threads = 0);
+
+    inline bool is_trained() const {
+        return !centroids.empty();
+    }
+
+    inline int get_dim() const {
+        return dim;
+    }
+
+    inline int get_m() const {
+        return m;
+    }
+
+    // bytes per descriptor
+    inline int code_size() const {
+        return m / 2;
+    }
+
+    // m codes in [0, 16), one per byte
+    void encode(const float *x, uint8_t *codes) const;
+
+    // m x 16 quantized distances from the query to the centroids,
+    // distance ~= sum / scale + bias
+    void lookup_table(const float *query, uint8_t *lut,
+                      float& scale, float& bias) const;
+
+    // serialization, native endianness
+    bool save(std::ostream& os) const;
+    bool load(std::istream& is);
+
+ private:
+    // PCA projection, with the output dimensions reordered by sub space
+    void rotate(const float *x, float *out) const;
+
+    int                 dim;
+    int                 m;
+    int                 sub_dim;
+
+    std::vector<float>  mean;       // dim
+    std::vector<float>  rotation;   // dim x dim, one output dimension per row
+    std::vector<float>  centroids;  // m x 16 x sub_dim
+};
+
+struct PqMatch {
+    PqMatch()
+        : image(0), keypoint(0), distance(0)
+    {};
+
+    PqMatch(uint32_t image, uint32_t keypoint, float distance)
+        : image(image), keypoint(keypoint), distance(distance)
+    {};
+
+    uint32_t    image;
+    uint32_t    keypoint;
+
+    // squared L2, exact when re-ranked
+    float       distance;
+};
+
+// exact descriptor of a keypoint of an image, NULL if not available
+typedef std::function<const float*(uint32_t image, uint32_t keypoint)> ExactDescriptorFn;
+
+// 4 bit codes of all the descriptors of a project, in the interleaved
+// blocks of 16 codes of the pq4_scan kernel. Images only store the
+// offset of their first descriptor.
+class PqStore {
+ public:
+    PqStore(const ProductQuantizer::ptr& pq = ProductQuantizer::ptr())
+        : pq(pq), count(0)
+    {};
+
+    // encode the descriptors of the next image (in parallel),
+    // returns the image index
+    uint32_t add(const float *descriptors, size_t n, int threads = 0);
+
+    // k nearest descriptors of query, the best rerank * k by
+    // approximate distance are re-ranked with exact when given
+    void search(const float *query, size_t k, size_t rerank,
+                std::vector<PqMatch>& matches,
+                const ExactDescriptorFn& exact = ExactDescriptorFn()) const;
+
+    inline size_t size() const {
+        return count;
+    }
+
+    inline size_t image_count() const {
+        return offsets.size();
+    }
+
+    inline const ProductQuantizer::ptr& get_quantizer() const {
+        return pq;
+    }
+
+    // bytes held by the codes and the image offsets
+    size_t memory_size() const;
+
+    // serialization, the quantizer is saved along the codes
+    bool save(std::ostream& os) const;
+    bool load(std::istream& is);
+    bool save(const std::string& filename) const;
+    bool load(const std::string& filename);
+
+ private:
+    void locate(size_t id, uint32_t& image, uint32_t& keypoint) const;
+
+    ProductQuantizer::ptr   pq;
+    size_t                  count;
+
+    // blocks of m / 2 rows of 16 bytes
+    std::vector<uint8_t>    codes;
+
+    // first descriptor of each image
+    std::vector<size_t>     offsets;
+};
+
+#endif // !PQ_H
@@ -0,0 +1,922 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <math.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include "reconstruction.h"
+#include "metrics.h"
+#include "util.h"
+
+// damped Gauss-Newton steps of a pose or point refinement
+#define REFINE_STEPS 5
+
+typedef Matx<double, 6, 6> Matx66d;
+typedef Matx<double, 6, 1> Matx61d;
+typedef Matx<double, 12, 12> Matx1212d;
+
+/////////////////////
+/// geometry      ///
+/////////////////////
+
+// point on the z = 1 plane of a pixel, K upper triangular
+static Point2d normalize(const Matx33d& K, const Point2f& p) {
+    double y = (p.y - K(1, 2)) / K(1, 1);
+    double x = (p.x - K(0, 2) - K(0, 1) * y) / K(0, 0);
+    return Point2d(x, y);
+}
+
+// squared reprojection error in pixels, -1 behind the camera
+static double reprojection_error2(const Matx33d& K, const Matx33d& R, const Matx31d& t,
+                                  const Point3d& X, const Point2f& p) {
+    Matx31d Xc = R * Matx31d(X.x, X.y, X.z) + t;
+    if (Xc(2) <= 0) {
+        return -1;
+    }
+    double u = (K(0, 0) * Xc(0) + K(0, 1) * Xc(1)) / Xc(2) + K(0, 2);
+    double v = K(1, 1) * Xc(1) / Xc(2) + K(1, 2);
+    return (u - p.x) * (u - p.x) + (v - p.y) * (v - p.y);
+}
+
+static Matx31d camera_center(const Matx33d& R, const Matx31d& t) {
+    return -(R.t() * t);
+}
+
+// residual and its derivatives by the camera frame point, per pixel axis
+static void projection_jacobian(const Matx33d& K, const Matx31d& Xc, const Point2f& p,
+                                double r[2], Matx<double, 2, 3>& J) {
+    double iz = 1 / Xc(2);
+    double u = (K(0, 0) * Xc(0) + K(0, 1) * Xc(1)) * iz;
+    double v = K(1, 1) * Xc(1) * iz;
+    r[0] = u + K(0, 2) - p.x;
+    r[1] = v + K(1, 2) - p.y;
+
+    J(0, 0) = K(0, 0) * iz;
+    J(0, 1) = K(0, 1) * iz;
+    J(0, 2) = -u * iz;
+    J(1, 0) = 0;
+    J(1, 1) = K(1, 1) * iz;
+    J(1, 2) = -v * iz;
+}
+
+// cameras seeing a point, and where
+typedef std::vector<std::pair<size_t, Point2f> > PointObservations;
+
+// sum of squared errors of a point, -1 if behind a camera
+static double point_cost(const vector<Matx33d>& K, const vector<Matx33d>& R,
+                         const vector<Matx31d>& t, const PointObservations& obs,
+                         const Point3d& X) {
+    double cost = 0;
+    for (size_t k = 0; k < obs.size(); k++) {
+        size_t c = obs[k].first;
+        double e2 = reprojection_error2(K[c], R[c], t[c], X, obs[k].second);
+        if (e2 < 0) {
+            return -1;
+        }
+        cost += e2;
+    }
+    return cost;
+}
+
+// X minimizing the reprojection error in the cameras of obs
+static void refine_point(const vector<Matx33d>& K, const vector<Matx33d>& R,
+                         const vector<Matx31d>& t, const PointObservations& obs,
+                         Point3d& X) {
+    double cost = point_cost(K, R, t, obs, X);
+    double lambda = 1e-3;
+
+    for (int step = 0; step < REFINE_STEPS && cost > 0; step++) {
+        Matx33d JtJ;
+        Matx31d Jtr;
+        for (size_t k = 0; k < obs.size(); k++) {
+            size_t c = obs[k].first;
+            Matx31d Xc = R[c] * Matx31d(X.x, X.y, X.z) + t[c];
+            double r[2];
+            Matx<double, 2, 3> Jc;
+            projection_jacobian(K[c], Xc, obs[k].second, r, Jc);
+
+            Matx<double, 2, 3> J = Jc * R[c];
+            JtJ += J.t() * J;
+            Jtr += J.t() * Matx<double, 2, 1>(r[0], r[1]);
+        }
+
+        for (int tries = 0; tries < 4; tries++) {
+            Matx33d A = JtJ;
+            for (int i = 0; i < 3; i++) {
+                A(i, i) *= 1 + lambda;
+            }
+            Matx31d delta = A.solve(Jtr, DECOMP_CHOLESKY);
+            Point3d candidate(X.x - delta(0), X.y - delta(1), X.z - delta(2));
+            double candidate_cost = point_cost(K, R, t, obs, candidate);
+            if (candidate_cost >= 0 && candidate_cost < cost) {
+                X = candidate;
+                cost = candidate_cost;
+                lambda /= 10;
+                break;
+            }
+            lambda *= 10;
+        }
+    }
+}
+
+// 2D-3D matches of a camera
+typedef std::vector<std::pair<Point3d, Point2f> > PoseObservations;
+
+// sum of squared errors of a pose, -1 if a point is behind the camera
+static double pose_cost(const Matx33d& K, const Matx33d& R, const Matx31d& t,
+                        const PoseObservations& obs) {
+    double cost = 0;
+    for (size_t k = 0; k < obs.size(); k++) {
+        double e2 = reprojection_error2(K, R, t, obs[k].first, obs[k].second);
+        if (e2 < 0) {
+            return -1;
+        }
+        cost += e2;
+    }
+    return cost;
+}
+
+// R, t minimizing the reprojection error of the matches, rotation
+// updates on the left: R <- exp(w) R
+static void refine_pose(const Matx33d& K, const PoseObservations& obs,
+                        Matx33d& R, Matx31d& t) {
+    double cost = pose_cost(K, R, t, obs);
+    double lambda = 1e-3;
+
+    for (int step = 0; step < REFINE_STEPS && cost > 0; step++) {
+        Matx66d JtJ;
+        Matx61d Jtr;
+        for (size_t k = 0; k < obs.size(); k++) {
+            const Point3d& X = obs[k].first;
+            Matx31d RX = R * Matx31d(X.x, X.y, X.z);
+            double r[2];
+            Matx<double, 2, 3> Jc;
+            projection_jacobian(K, RX + t, obs[k].second, r, Jc);
+
+            // d(RX)/dw = -[RX]x, d/dt = I
+            Matx33d skew(0, -RX(2), RX(1), RX(2), 0, -RX(0), -RX(1), RX(0), 0);
+            Matx<double, 2, 3> Jw = Jc * (-skew);
+            Matx<double, 2, 6> J;
+            for (int i = 0; i < 2; i++) {
+                for (int j = 0; j < 3; j++) {
+                    J(i, j) = Jw(i, j);
+                    J(i, j + 3) = Jc(i, j);
+                }
+            }
+            JtJ += J.t() * J;
+            Jtr += J.t() * Matx<double, 2, 1>(r[0], r[1]);
+        }
+
+        for (int tries = 0; tries < 4; tries++) {
+            Matx66d A = JtJ;
+            for (int i = 0; i < 6; i++) {
+                A(i, i) *= 1 + lambda;
+            }
+            Matx61d delta = A.solve(Jtr, DECOMP_CHOLESKY);
+
+            Matx33d dR;
+            Rodrigues(Matx31d(-delta(0), -delta(1), -delta(2)), dR);
+            Matx33d candidate_R = dR * R;
+            Matx31d candidate_t(t(0) - delta(3), t(1) - delta(4), t(2) - delta(5));
+            double candidate_cost = pose_cost(K, candidate_R, candidate_t, obs);
+            if (candidate_cost >= 0 && candidate_cost < cost) {
+                R = candidate_R;
+                t = candidate_t;
+                cost = candidate_cost;
+                lambda /= 10;
+                break;
+            }
+            lambda *= 10;
+        }
+    }
+}
+
+// camera from 6 or more 2D-3D matches (x on the z = 1 plane): linear P
+// on centered, scaled points, then the closest rotation
+static bool dlt_pose(const vector<Point3d>& X, const vector<Point2d>& x,
+                     const vector<size_t>& sample, Matx33d& R, Matx31d& t) {
+    Point3d c(0, 0, 0);
+    for (size_t k = 0; k < sample.size(); k++) {
+        c += X[sample[k]];
+    }
+    c *= 1.0 / sample.size();
+    double s = 0;
+    for (size_t k = 0; k < sample.size(); k++) {
+        s += norm(X[sample[k]] - c);
+    }
+    s /= sample.size();
+    if (s <= 0) {
+        return false;
+    }
+
+    Matx1212d AtA;
+    for (size_t k = 0; k < sample.size(); k++) {
+        Point3d p = (X[sample[k]] - c) * (1 / s);
+        double h[4] = { p.x, p.y, p.z, 1 };
+        double rows[2][12] = {};
+        for (int j = 0; j < 4; j++) {
+            rows[0][j] = -h[j];
+            rows[0][8 + j] = x[sample[k]].x * h[j];
+            rows[1][4 + j] = -h[j];
+            rows[1][8 + j] = x[sample[k]].y * h[j];
+        }
+        for (int r = 0; r < 2; r++) {
+            for (int i = 0; i < 12; i++) {
+                for (int j = 0; j < 12; j++) {
+                    AtA(i, j) += rows[r][i] * rows[r][j];
+                }
+            }
+        }
+    }
+
+    Mat w, u, vt;
+    SVD::compute(AtA, w, u, vt);
+
+    // back to the original points: M = M' / s, p4 = p4' - M c
+    Matx33d M;
+    Matx31d p4;
+    for (int r = 0; r < 3; r++) {
+        for (int j = 0; j < 3; j++) {
+            M(r, j) = vt.at<double>(11, 4 * r + j) / s;
+        }
+        p4(r) = vt.at<double>(11, 4 * r + 3) -
+            (M(r, 0) * c.x + M(r, 1) * c.y + M(r, 2) * c.z);
+    }
+
+    // P is known up to its sign, in front of the camera is det(M) > 0
+    if (determinant(M) < 0) {
+        M = -M;
+        p4 = -p4;
+    }
+
+    Matx31d sv;
+    Matx33d U, Vt;
+    SVD::compute(M, sv, U, Vt);
+    double scale = (sv(0) + sv(1) + sv(2)) / 3;
+    if (scale <= 1e-12) {
+        return false;
+    }
+    R = U * Vt;
+    t = p4 * (1 / scale);
+    return determinant(R) > 0;
+}
+
+// samples of k needed to draw an all inliers one with confidence
+static int ransac_iterations(double inlier_ratio, int k, double confidence,
+                             int max_iterations) {
+    double p = pow(inlier_ratio, k);
+    if (p >= 1) {
+        return 0;
+    }
+
+    double num = log(1 - confidence), den = log(1 - p);
+    if (den >= 0 || num <= max_iterations * den) {
+        return max_iterations;
+    }
+    return (int) ceil(num / den);
+}
+
+// widest angle between the rays of a point, degrees
+static double widest_angle(const vector<Matx31d>& centers, const Point3d& X) {
+    vector<Matx31d> rays(centers.size());
+    for (size_t k = 0; k < centers.size(); k++) {
+        Matx31d ray(X.x - centers[k](0), X.y - centers[k](1), X.z - centers[k](2));
+        rays[k] = ray * (1 / norm(ray));
+    }
+
+    double smallest_cos = 1;
+    for (size_t i = 0; i < rays.size(); i++) {
+        for (size_t j = i + 1; j < rays.size(); j++) {
+            smallest_cos = std::min(smallest_cos, rays[i].dot(rays[j]));
+        }
+    }
+    return acos(std::max(-1.0, std::min(1.0, smallest_cos))) * 180 / M_PI;
+}
+
+// linear triangulation from cameras on the z = 1 plane, false at infinity
+static bool dlt_point(const vector<Matx33d>& R, const vector<Matx31d>& t,
+                      const vector<Point2d>& x, Point3d& X) {
+    Matx44d AtA;
+    for (size_t k = 0; k < x.size(); k++) {
+        double rows[2][4];
+        for (int j = 0; j < 3; j++) {
+            rows[0][j] = x[k].x * R[k](2, j) - R[k](0, j);
+            rows[1][j] = x[k].y * R[k](2, j) - R[k](1, j);
+        }
+        rows[0][3] = x[k].x * t[k](2) - t[k](0);
+        rows[1][3] = x[k].y * t[k](2) - t[k](1);
+        for (int r = 0; r < 2; r++) {
+            for (int i = 0; i < 4; i++) {
+                for (int j = 0; j < 4; j++) {
+                    AtA(i, j) += rows[r][i] * rows[r][j];
+                }
+            }
+        }
+    }
+
+    Matx41d w;
+    Matx44d u, vt;
+    SVD::compute(AtA, w, u, vt);
+    double h = vt(3, 3);
+    if (fabs(h) < 1e-12) {
+        return false;
+    }
+    X = Point3d(vt(3, 0) / h, vt(3, 1) / h, vt(3, 2) / h);
+    return true;
+}
+
+// observation of an image in a track, NULL if it doesn't see it
+static TrackObservation *find_observation(vector<TrackObservation>& track, size_t image) {
+    for (size_t k = 0; k < track.size(); k++) {
+        if (track[k].image == image) {
+            return &track[k];
+        }
+    }
+    return NULL;
+}
+
+/////////////////////
+/// model         ///
+/////////////////////
+
+size_t IncrementalReconstruction::add_image(const Matx33d& camera) {
+    K.push_back(camera);
+    image_tracks.push_back(vector<uint32_t>());
+    registered.push_back(0);
+    rotations.push_back(Matx33d::eye());
+    translations.push_back(Matx31d());
+    visible.push_back(0);
+    retry_at.push_back(0);
+    return K.size() - 1;
+}
+
+void IncrementalReconstruction::add_track(const std::map<size_t, Point2f>& observations) {
+    if (observations.size() < 2) {
+        return;
+    }
+
+    uint32_t id = tracks.size();
+    vector<TrackObservation> track;
+    for (auto it = observations.begin(); it != observations.end(); ++it) {
+        if (it->first >= K.size()) {
+            continue;
+        }
+        TrackObservation observation;
+        observation.image = it->first;
+        observation.point = it->second;
+        observation.used = 0;
+        track.push_back(observation);
+        image_tracks[it->first].push_back(id);
+    }
+
+    tracks.push_back(track);
+    points.push_back(Point3d());
+    has_point.push_back(0);
+    track_stamp.push_back(0);
+}
+
+bool IncrementalReconstruction::get_pose(size_t image, Matx33d& R, Matx31d& t) const {
+    if (image >= registered.size() || !registered[image]) {
+        return false;
+    }
+    R = rotations[image];
+    t = translations[image];
+    return true;
+}
+
+bool IncrementalReconstruction::get_point(size_t track, Point3d& point) const {
+    if (track >= has_point.size() || !has_point[track]) {
+        return false;
+    }
+    point = points[track];
+    return true;
+}
+
+void IncrementalReconstruction::get_points(std::vector<Point3f>& out) const {
+    out.clear();
+    out.reserve(point_count);
+    for (size_t i = 0; i < points.size(); i++) {
+        if (has_point[i]) {
+            out.push_back(Point3f(points[i].x, points[i].y, points[i].z));
+        }
+    }
+}
+
+void IncrementalReconstruction::add_visible(size_t track, int delta) {
+    for (const TrackObservation& observation : tracks[track]) {
+        size_t image = observation.image;
+        if (registered[image]) {
+            continue;
+        }
+        visible[image] += delta;
+        next_views.push(std::make_pair(visible[image], image));
+    }
+}
+
+void IncrementalReconstruction::set_point(size_t track, const Point3d& point) {
+    points[track] = point;
+    if (!has_point[track]) {
+        has_point[track] = 1;
+        point_count++;
+        add_visible(track, 1);
+    }
+}
+
+void IncrementalReconstruction::drop_point(size_t track) {
+    if (!has_point[track]) {
+        return;
+    }
+    has_point[track] = 0;
+    point_count--;
+    for (TrackObservation& observation : tracks[track]) {
+        observation.used = 0;
+    }
+    add_visible(track, -1);
+}
+
+void IncrementalReconstruction::set_registered(size_t image, const Matx33d& R,
+                                               const Matx31d& t) {
+    rotations[image] = R;
+    translations[image] = t;
+    registered[image] = 1;
+    order.push_back(image);
+    registered_count++;
+}
+
+bool IncrementalReconstruction::triangulate_track(size_t track) {
+    vector<TrackObservation>& observations = tracks[track];
+    vector<Matx33d> R;
+    vector<Matx31d> t;
+    vector<Point2d> x;
+    for (const TrackObservation& observation : observations) {
+        size_t c = observation.image;
+        if (registered[c]) {
+            R.push_back(rotations[c]);
+            t.push_back(translations[c]);
+            x.push_back(normalize(K[c], observation.point));
+        }
+    }
+
+    Point3d X;
+    if (x.size() < 2 || !dlt_point(R, t, x, X)) {
+        return false;
+    }
+
+    // refine on the consistent observations, then check them again
+    double threshold2 = options.reprojection_error * options.reprojection_error;
+    for (int pass = 0; pass < 2; pass++) {
+        PointObservations consistent;
+        for (TrackObservation& observation : observations) {
+            size_t c = observation.image;
+            if (!registered[c]) {
+                continue;
+            }
+            double e2 = reprojection_error2(K[c], rotations[c], translations[c],
+                                            X, observation.point);
+            observation.used = e2 >= 0 && e2 <= threshold2;
+            if (observation.used) {
+                consistent.push_back(std::make_pair(c, observation.point));
+            }
+        }
+        if (consistent.size() < 2) {
+            break;
+        }
+        if (pass == 0) {
+            refine_point(K, rotations, translations, consistent, X);
+            continue;
+        }
+
+        vector<Matx31d> centers;
+        for (size_t k = 0; k < consistent.size(); k++) {
+            size_t c = consistent[k].first;
+            centers.push_back(camera_center(rotations[c], translations[c]));
+        }
+        if (widest_angle(centers, X) < options.min_angle) {
+            break;
+        }
+
+        set_point(track, X);
+        return true;
+    }
+
+    for (TrackObservation& observation : observations) {
+        observation.used = 0;
+    }
+    return false;
+}
+
+bool IncrementalReconstruction::initialize() {
+    // tracks shared by each pair of images
+    std::unordered_map<uint64_t, size_t> shared;
+    uint64_t n = K.size();
+    for (const vector<TrackObservation>& track : tracks) {
+        for (size_t i = 0; i < track.size(); i++) {
+            for (size_t j = i + 1; j < track.size(); j++) {
+                uint64_t a = std::min(track[i].image, track[j].image);
+                uint64_t b = std::max(track[i].image, track[j].image);
+                shared[a * n + b]++;
+            }
+        }
+    }
+
+    vector<std::pair<size_t, uint64_t> > candidates;
+    for (auto it = shared.begin(); it != shared.end(); ++it) {
+        if (it->second >= options.min_inliers) {
+            candidates.push_back(std::make_pair(it->second, it->first));
+        }
+    }
+    std::sort(candidates.rbegin(), candidates.rend());
+    if (candidates.size() > options.seed_candidates) {
+        candidates.resize(options.seed_candidates);
+    }
+
+    double threshold2 = options.reprojection_error * options.reprojection_error;
+    for (size_t s = 0; s < candidates.size(); s++) {
+        size_t a = candidates[s].second / n, b = candidates[s].second % n;
+
+        vector<Point2f> pts1, pts2;
+        for (uint32_t track : image_tracks[a]) {
+            TrackObservation *first = find_observation(tracks[track], a);
+            TrackObservation *second = find_observation(tracks[track], b);
+            if (second) {
+                pts1.push_back(first->point);
+                pts2.push_back(second->point);
+            }
+        }
+
+        if (pts1.size() < 8) {
+            continue;
+        }
+
+        vector<uchar> status;
+        Mat F = findFundamentalMat(pts1, pts2, FM_RANSAC, 1, 0.99, status);
+        if (F.rows != 3 || F.cols != 3) {
+            continue;
+        }
+        F.convertTo(F, CV_64F);
+        Matx33d E = K[b].t() * Matx33d(F.ptr<double>()) * K[a];
+
+        // the decomposition with the most points in front of both
+        // cameras and within the reprojection error
+        Matx31d w;
+        Matx33d U, Vt;
+        SVD::compute(E, w, U, Vt);
+        if (determinant(U) < 0) {
+            U = -U;
+        }
+        if (determinant(Vt) < 0) {
+            Vt = -Vt;
+        }
+        Matx33d W(0, -1, 0, 1, 0, 0, 0, 0, 1);
+        Matx33d rotations_E[2] = { U * W * Vt, U * W.t() * Vt };
+
+        vector<Matx33d> R(2, Matx33d::eye());
+        vector<Matx31d> t(2);
+        vector<double> best_angles;
+        for (int r = 0; r < 2; r++) {
+            for (int sign = -1; sign <= 1; sign += 2) {
+                R[1] = rotations_E[r];
+                t[1] = Matx31d(U(0, 2), U(1, 2), U(2, 2)) * sign;
+                vector<Matx31d> centers(2);
+                centers[1] = camera_center(R[1], t[1]);
+
+                vector<double> angles;
+                for (size_t i = 0; i < pts1.size(); i++) {
+                    if (!status[i]) {
+                        continue;
+                    }
+                    vector<Point2d> x(2);
+                    x[0] = normalize(K[a], pts1[i]);
+                    x[1] = normalize(K[b], pts2[i]);
+                    Point3d X;
+                    if (!dlt_point(R, t, x, X)) {
+                        continue;
+                    }
+                    double e1 = reprojection_error2(K[a], R[0], t[0], X, pts1[i]);
+                    double e2 = reprojection_error2(K[b], R[1], t[1], X, pts2[i]);
+                    if (e1 >= 0 && e1 <= threshold2 && e2 >= 0 && e2 <= threshold2) {
+                        angles.push_back(widest_angle(centers, X));
+                    }
+                }
+                if (angles.size() > best_angles.size()) {
+                    best_angles.swap(angles);
+                    rotations[b] = R[1];
+                    translations[b] = t[1];
+                }
+            }
+        }
+
+        // enough points, and a baseline: not a rotation or a plane
+        if (best_angles.size() < options.min_inliers) {
+            continue;
+        }
+        std::nth_element(best_angles.begin(), best_angles.begin() + best_angles.size() / 2,
+                         best_angles.end());
+        double median_angle = best_angles[best_angles.size() / 2];
+        LOG(DEBUG) << "Seed " << a << ", " << b << ": " << best_angles.size()
+                   << " points, median angle " << median_angle;
+        if (median_angle < options.min_angle) {
+            continue;
+        }
+
+        set_registered(a, Matx33d::eye(), Matx31d());
+        set_registered(b, rotations[b], translations[b]);
+        for (uint32_t track : image_tracks[a]) {
+            triangulate_track(track);
+        }
+        refine(order);
+        last_global = registered_count;
+
+        LOG(INFO) << "Seed pair " << a << ", " << b << ": " << point_count << " points";
+        return true;
+    }
+
+    LOG(ERROR) << "No seed pair with enough baseline";
+    return false;
+}
+
+bool IncrementalReconstruction::register_image(size_t image) {
+    // the 2D-3D matches
+    vector<Point3d> X;
+    vector<Point2d> x;
+    PoseObservations matches;
+    vector<TrackObservation*> observations;
+    for (uint32_t track : image_tracks[image]) {
+        if (!has_point[track]) {
+            continue;
+        }
+        TrackObservation *observation = find_observation(tracks[track], image);
+        X.push_back(points[track]);
+        x.push_back(normalize(K[image], observation->point));
+        matches.push_back(std::make_pair(points[track], observation->point));
+        observations.push_back(observation);
+    }
+
+    size_t n = X.size();
+    if (n < std::max(options.min_inliers, (size_t) 6)) {
+        return false;
+    }
+
+    double threshold2 = options.reprojection_error * options.reprojection_error;
+    auto count_inliers = [&](const Matx33d& R, const Matx31d& t, vector<char> *inliers) {
+        size_t count = 0;
+        for (size_t i = 0; i < n; i++) {
+            double e2 = reprojection_error2(K[image], R, t, X[i], matches[i].second);
+            bool inlier = e2 >= 0 && e2 <= threshold2;
+            count += inlier;
+            if (inliers) {
+                (*inliers)[i] = inlier;
+            }
+        }
+        return count;
+    };
+
+    RNG rng((uint64) n * 7919 + image);
+    Matx33d R;
+    Matx31d t;
+    size_t best_count = 0;
+    int iterations = options.max_iterations;
+    vector<size_t> sample(6);
+
+    for (int it = 0; it < iterations; it++) {
+        for (size_t k = 0; k < sample.size(); k++) {
+            size_t i;
+            do {
+                i = rng.uniform(0, (int) n);
+            } while (std::find(sample.begin(), sample.begin() + k, i) != sample.begin() + k);
+            sample[k] = i;
+        }
+
+        Matx33d R_hypothesis;
+        Matx31d t_hypothesis;
+        if (!dlt_pose(X, x, sample, R_hypothesis, t_hypothesis)) {
+            continue;
+        }
+
+        size_t count = count_inliers(R_hypothesis, t_hypothesis, NULL);
+        if (count <= best_count) {
+            continue;
+        }
+
+        // 6 noisy points make a rough camera: refine it on its inliers
+        // before deciding how many more samples to draw
+        vector<char> sample_inliers(n);
+        count_inliers(R_hypothesis, t_hypothesis, &sample_inliers);
+        PoseObservations inlier_matches;
+        for (size_t i = 0; i < n; i++) {
+            if (sample_inliers[i]) {
+                inlier_matches.push_back(matches[i]);
+            }
+        }
+        Matx33d R_refined = R_hypothesis;
+        Matx31d t_refined = t_hypothesis;
+        refine_pose(K[image], inlier_matches, R_refined, t_refined);
+        size_t refined_count = count_inliers(R_refined, t_refined, NULL);
+        if (refined_count > count) {
+            count = refined_count;
+            R_hypothesis = R_refined;
+            t_hypothesis = t_refined;
+        }
+
+        best_count = count;
+        R = R_hypothesis;
+        t = t_hypothesis;
+        iterations = std::min(iterations,
+                              ransac_iterations((double) count / n, 6, options.confidence,
+                                                options.max_iterations));
+    }
+
+    if (best_count < 6) {
+        return false;
+    }
+
+    // refinement on all the inliers, while it keeps as many
+    vector<char> inliers(n);
+    count_inliers(R, t, &inliers);
+    for (int k = 0; k < 2; k++) {
+        PoseObservations inlier_matches;
+        for (size_t i = 0; i < n; i++) {
+            if (inliers[i]) {
+                inlier_matches.push_back(matches[i]);
+            }
+        }
+
+        Matx33d R_refined = R;
+        Matx31d t_refined = t;
+        refine_pose(K[image], inlier_matches, R_refined, t_refined);
+
+        vector<char> refined_inliers(n);
+        size_t count = count_inliers(R_refined, t_refined, &refined_inliers);
+        if (count < best_count) {
+            break;
+        }
+        best_count = count;
+        R = R_refined;
+        t = t_refined;
+        inliers.swap(refined_inliers);
+    }
+
+    LOG(DEBUG) << "Image " << image << ": " << best_count << " / " << n << " inliers";
+    if (best_count < options.min_inliers) {
+        return false;
+    }
+
+    set_registered(image, R, t);
+    for (size_t i = 0; i < n; i++) {
+        observations[i]->used = inliers[i];
+    }
+
+    // the tracks this image completes
+    for (uint32_t track : image_tracks[image]) {
+        if (!has_point[track]) {
+            triangulate_track(track);
+        }
+    }
+    return true;
+}
+
+void IncrementalReconstruction::refine(const std::vector<size_t>& cameras) {
+    // points seen by the cameras
+    stamp++;
+    vector<uint32_t> window_tracks;
+    for (size_t c : cameras) {
+        for (uint32_t track : image_tracks[c]) {
+            if (has_point[track] && track_stamp[track] != stamp) {
+                track_stamp[track] = stamp;
+                window_tracks.push_back(track);
+            }
+        }
+    }
+
+    // the first camera holds the frame
+    vector<size_t> free_cameras;
+    for (size_t c : cameras) {
+        if (c != order[0]) {
+            free_cameras.push_back(c);
+        }
+    }
+
+    for (int iteration = 0; iteration < options.refine_iterations; iteration++) {
+        parallel_for_index(free_cameras.size(), [&](size_t i, int) {
+                size_t c = free_cameras[i];
+                PoseObservations matches;
+                for (uint32_t track : image_tracks[c]) {
+                    TrackObservation *observation = find_observation(tracks[track], c);
+                    if (has_point[track] && observation->used) {
+                        matches.push_back(std::make_pair(points[track], observation->point));
+                    }
+                }
+                if (matches.size() >= 6) {
+                    refine_pose(K[c], matches, rotations[c], translations[c]);
+                }
+            }, options.threads);
+
+        parallel_for_index(window_tracks.size(), [&](size_t i, int) {
+                uint32_t track = window_tracks[i];
+                PointObservations observations;
+                for (const TrackObservation& observation : tracks[track]) {
+                    if (observation.used) {
+                        observations.push_back(std::make_pair((size_t) observation.image,
+                                                              observation.point));
+                    }
+                }
+                if (observations.size() >= 2) {
+                    refine_point(K, rotations, translations, observations, points[track]);
+                }
+            }, options.threads);
+    }
+
+    // observations of registered images within the error are used, the
+    // points left with too few or too narrow rays are dropped
+    double threshold2 = options.reprojection_error * options.reprojection_error;
+    size_t dropped = 0;
+    for (uint32_t track : window_tracks) {
+        vector<Matx31d> centers;
+        for (TrackObservation& observation : tracks[track]) {
+            size_t c = observation.image;
+            if (!registered[c]) {
+                continue;
+            }
+            double e2 = reprojection_error2(K[c], rotations[c], translations[c],
+                                            points[track], observation.point);
+            observation.used = e2 >= 0 && e2 <= threshold2;
+            if (observation.used) {
+                centers.push_back(camera_center(rotations[c], translations[c]));
+            }
+        }
+
+        if (centers.size() < 2 || widest_angle(centers, points[track]) < options.min_angle) {
+            drop_point(track);
+            dropped++;
+        }
+    }
+
+    Metrics::instance().add("sfm.refined_points", window_tracks.size());
+    Metrics::instance().add("sfm.dropped_points", dropped);
+}
+
+void IncrementalReconstruction::refine_after_registration() {
+    if (registered_count >= last_global * options.global_growth) {
+        LOG(DEBUG) << "Global refinement, " << registered_count << " cameras";
+        refine(order);
+        last_global = registered_count;
+        Metrics::instance().add("sfm.global_passes");
+        return;
+    }
+
+    size_t window = std::min(options.window, order.size());
+    vector<size_t> cameras(order.end() - window, order.end());
+    refine(cameras);
+}
+
+bool IncrementalReconstruction::step() {
+    while (!next_views.empty()) {
+        size_t count = next_views.top().first, image = next_views.top().second;
+        next_views.pop();
+
+        // stale, or failed and not seeing enough more points since
+        if (registered[image] || count != visible[image] || count < retry_at[image]) {
+            continue;
+        }
+
+        // the best image left can't be registered
+        if (count < options.min_inliers) {
+            return false;
+        }
+
+        if (!register_image(image)) {
+            retry_at[image] = count + count / 4 + 1;
+            Metrics::instance().add("sfm.failed_registrations");
+            continue;
+        }
+
+        Metrics::instance().add("sfm.registered");
+        refine_after_registration();
+        return true;
+    }
+    return false;
+}
+
+size_t IncrementalReconstruction::run() {
+    if (!initialize()) {
+        return 0;
+    }
+
+    while (step()) {
+        LOG(DEBUG) << "Registered " << registered_count << " / " << K.size()
+                   << " images, " << point_count << " points";
+    }
+
+    if (last_global < registered_count) {
+        refine(order);
+        last_global = registered_count;
+    }
+
+    LOG(INFO) << "Reconstruction: " << registered_count << " / " << K.size()
+              << " images, " << point_count << " points";
+    Metrics::instance().add("sfm.points", point_count);
+    return registered_count;
+}
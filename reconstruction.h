@@ -0,0 +1,199 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Incremental structure from motion over the tracks.
+//
+// Starts from the pair of images sharing the most tracks with enough
+// baseline, then registers one image at a time and triangulates the
+// tracks it completes. Picking the next view by rescanning every image
+// and track gets slower as the model grows, instead the state is
+// updated as it changes:
+//  - each unregistered image keeps the count of its tracks that have a
+//    3D point, bumped when one of them is triangulated and lowered when
+//    refinement drops it. Counts go in a max heap with lazy deletion (an
+//    entry is stale once its count isn't the image's anymore), the next
+//    view is a pop: O(log n),
+//  - registration (6 point DLT RANSAC on the 2D-3D matches, each new
+//    best camera refined on its inliers) and triangulation only touch
+//    the tracks of the new image,
+//  - refinement alternates pose and point Gauss-Newton steps over the
+//    last window cameras and the points they see, the other cameras
+//    held fixed. A global pass over every camera runs each time the
+//    model has grown by global_growth since the last one: their cost
+//    adds up to a constant per image, amortized.
+//
+// The work per added image depends on its tracks and the window, not on
+// the size of the model.
+//
+// Poses map world points to the camera frame: x = K (R X + t). The seed
+// pair sets the frame and a unit baseline.
+//
+// Usage :
+//  IncrementalReconstruction sfm;
+//  sfm.add_image(K);                    // per image
+//  sfm.add_track(observations);         // per track, image -> pixel
+//  sfm.run();
+//  if (sfm.get_pose(i, R, t)) ...
+
+#ifndef RECONSTRUCTION_H
+#define RECONSTRUCTION_H
+
+#include <stdint.h>
+
+#include <map>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "photogram.h"
+
+struct ReconstructionOptions {
+    ReconstructionOptions()
+        : min_inliers(30), seed_candidates(20), reprojection_error(4.0),
+          min_angle(2.0), confidence(0.99), max_iterations(1000),
+          window(8), global_growth(1.5), refine_iterations(3), threads(0)
+    {};
+
+    // 2D-3D inliers to register an image, shared tracks of the seed
+    size_t      min_inliers;
+
+    // pairs sharing the most tracks tried as seeds
+    size_t      seed_candidates;
+
+    // pixels
+    double      reprojection_error;
+
+    // degrees, widest angle between the rays of a new point
+    double      min_angle;
+
+    // registration RANSAC
+    double      confidence;
+    int         max_iterations;
+
+    // cameras refined after each registration
+    size_t      window;
+
+    // registered cameras since the last global pass, as a ratio
+    double      global_growth;
+
+    // pose then points passes per refinement
+    int         refine_iterations;
+
+    int         threads;
+};
+
+// an image seeing a track, at a pixel
+struct TrackObservation {
+    uint32_t    image;
+    Point2f     point;
+
+    // registered and consistent with the point
+    char        used;
+};
+
+class IncrementalReconstruction {
+ public:
+    IncrementalReconstruction(const ReconstructionOptions& options = ReconstructionOptions())
+        : options(options), registered_count(0), last_global(0), point_count(0),
+          stamp(0)
+    {};
+
+    // a camera, its index is the one the tracks refer to
+    size_t add_image(const Matx33d& K);
+
+    // a track, image index -> pixel. tracks seeing less than 2 images
+    // are ignored
+    void add_track(const std::map<size_t, Point2f>& observations);
+
+    // register the seed pair, false if no pair has enough baseline
+    bool initialize();
+
+    // register the next best image, false when none of those left can be
+    bool step();
+
+    // initialize, then step while it can, and a last global pass.
+    // number of registered images
+    size_t run();
+
+    inline size_t image_count() const {
+        return K.size();
+    }
+
+    inline size_t track_count() const {
+        return tracks.size();
+    }
+
+    inline size_t get_registered_count() const {
+        return registered_count;
+    }
+
+    inline size_t get_point_count() const {
+        return point_count;
+    }
+
+    // images in registration order
+    inline const std::vector<size_t>& get_order() const {
+        return order;
+    }
+
+    // false for an image not registered
+    bool get_pose(size_t image, Matx33d& R, Matx31d& t) const;
+
+    // false for a track without a point
+    bool get_point(size_t track, Point3d& point) const;
+
+    // the points of the model
+    void get_points(std::vector<Point3f>& points) const;
+
+ private:
+    // multi-view DLT then refinement from the registered images of the
+    // track, keeps it if consistent
+    bool triangulate_track(size_t track);
+    void set_point(size_t track, const Point3d& point);
+    void drop_point(size_t track);
+
+    // unregistered images seeing a track with a point, and their count
+    void add_visible(size_t track, int delta);
+
+    bool register_image(size_t image);
+    void set_registered(size_t image, const Matx33d& R, const Matx31d& t);
+
+    // pose and point passes over cameras and the points they see
+    void refine(const std::vector<size_t>& cameras);
+
+    // local window or global pass, after a registration
+    void refine_after_registration();
+
+    ReconstructionOptions   options;
+
+    std::vector<Matx33d>    K;
+
+    // per image
+    std::vector<std::vector<uint32_t> > image_tracks;
+    std::vector<char>       registered;
+    std::vector<Matx33d>    rotations;
+    std::vector<Matx31d>    translations;
+
+    // unregistered images: tracks with a point, the count a failed
+    // registration is retried at
+    std::vector<size_t>     visible;
+    std::vector<size_t>     retry_at;
+
+    // (visible, image), stale entries skipped on pop
+    std::priority_queue<std::pair<size_t, size_t> > next_views;
+
+    // per track
+    std::vector<std::vector<TrackObservation> > tracks;
+    std::vector<Point3d>    points;
+    std::vector<char>       has_point;
+
+    std::vector<size_t>     order;
+    size_t                  registered_count;
+    size_t                  last_global;
+    size_t                  point_count;
+
+    // tracks already collected by the current refinement
+    std::vector<size_t>     track_stamp;
+    size_t                  stamp;
+};
+
+#endif // !RECONSTRUCTION_H
@@ -0,0 +1,206 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <math.h>
+
+#include <algorithm>
+
+#include "rotation_ransac.h"
+
+// unit rays of the pixels through an upper triangular K, 3 per point
+static void get_bearings(const vector<Point2f>& pts, const Matx33d& K, vector<double>& b) {
+    b.resize(3 * pts.size());
+    for (size_t i = 0; i < pts.size(); i++) {
+        double y = (pts[i].y - K(1, 2)) / K(1, 1);
+        double x = (pts[i].x - K(0, 2) - K(0, 1) * y) / K(0, 0);
+        double norm = sqrt(x * x + y * y + 1);
+        b[3 * i] = x / norm;
+        b[3 * i + 1] = y / norm;
+        b[3 * i + 2] = 1 / norm;
+    }
+}
+
+static inline double dot(const double *a, const double *b) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static inline void cross(const double *a, const double *b, double *c) {
+    c[0] = a[1] * b[2] - a[2] * b[1];
+    c[1] = a[2] * b[0] - a[0] * b[2];
+    c[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+static double det3(const Matx33d& M) {
+    return M(0, 0) * (M(1, 1) * M(2, 2) - M(1, 2) * M(2, 1)) -
+        M(0, 1) * (M(1, 0) * M(2, 2) - M(1, 2) * M(2, 0)) +
+        M(0, 2) * (M(1, 0) * M(2, 1) - M(1, 1) * M(2, 0));
+}
+
+// orthonormal frame of two unit rays as rows: a, a x b, a x (a x b).
+// false when they're almost parallel
+static bool triad(const double *a, const double *b, Matx33d& T) {
+    double e2[3], e3[3];
+    cross(a, b, e2);
+    double norm = sqrt(dot(e2, e2));
+    if (norm < 1e-6) {
+        return false;
+    }
+    for (int k = 0; k < 3; k++) {
+        e2[k] /= norm;
+    }
+    cross(a, e2, e3);
+
+    for (int k = 0; k < 3; k++) {
+        T(0, k) = a[k];
+        T(1, k) = e2[k];
+        T(2, k) = e3[k];
+    }
+    return true;
+}
+
+// R with R a1 = b1 and R a2 along b2, the frames of both pairs aligned
+static bool rotation_2pt(const double *a1, const double *a2,
+                         const double *b1, const double *b2, Matx33d& R) {
+    Matx33d Ta, Tb;
+    if (!triad(a1, a2, Ta) || !triad(b1, b2, Tb)) {
+        return false;
+    }
+    R = Tb.t() * Ta;
+    return true;
+}
+
+// R closest to sum b2 b1^T of the inliers (Kabsch)
+static void refit_rotation(const vector<double>& b1, const vector<double>& b2,
+                           const vector<char>& inliers, Matx33d& R) {
+    Matx33d M;
+    for (size_t i = 0; i < inliers.size(); i++) {
+        if (!inliers[i]) {
+            continue;
+        }
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 3; c++) {
+                M(r, c) += b2[3 * i + r] * b1[3 * i + c];
+            }
+        }
+    }
+
+    Matx31d w;
+    Matx33d u, vt;
+    SVD::compute(M, w, u, vt);
+
+    // a reflection flips the smallest axis
+    Matx33d D = Matx33d::eye();
+    if (det3(u * vt) < 0) {
+        D(2, 2) = -1;
+    }
+    R = u * D * vt;
+}
+
+// matches within threshold of K2 R b1 in the second image
+static size_t count_inliers(const vector<double>& b1, const vector<Point2f>& pts2,
+                            const Matx33d& K2, const Matx33d& R, double threshold,
+                            vector<char> *inliers) {
+    Matx33d H = K2 * R;
+    double t2 = threshold * threshold;
+    size_t count = 0;
+
+    for (size_t i = 0; i < pts2.size(); i++) {
+        const double *b = &b1[3 * i];
+        double z = H(2, 0) * b[0] + H(2, 1) * b[1] + H(2, 2) * b[2];
+        bool inlier = false;
+        if (z > 0) {
+            double dx = (H(0, 0) * b[0] + H(0, 1) * b[1] + H(0, 2) * b[2]) / z - pts2[i].x;
+            double dy = (H(1, 0) * b[0] + H(1, 1) * b[1] + H(1, 2) * b[2]) / z - pts2[i].y;
+            inlier = dx * dx + dy * dy <= t2;
+        }
+        count += inlier;
+        if (inliers) {
+            (*inliers)[i] = inlier;
+        }
+    }
+    return count;
+}
+
+// samples of 2 needed to draw an all inliers one with confidence
+static int ransac_iterations(double inlier_ratio, double confidence, int max_iterations) {
+    double p = inlier_ratio * inlier_ratio;
+    if (p >= 1) {
+        return 0;
+    }
+
+    double num = log(1 - confidence), den = log(1 - p);
+    if (den >= 0 || num <= max_iterations * den) {
+        return max_iterations;
+    }
+    return (int) ceil(num / den);
+}
+
+bool find_rotation(const vector<Point2f>& pts1, const vector<Point2f>& pts2,
+                   const Matx33d& K1, const Matx33d& K2,
+                   const RotationRansacOptions& options,
+                   Matx33d& R, vector<char>& inliers) {
+    size_t n = std::min(pts1.size(), pts2.size());
+    R = Matx33d::eye();
+    inliers.assign(n, 0);
+    if (n < 2) {
+        return false;
+    }
+
+    vector<double> b1, b2;
+    get_bearings(pts1, K1, b1);
+    get_bearings(pts2, K2, b2);
+
+    // a rotation keeps the angle between two rays, up to the noise
+    double angle_tolerance = 2 * options.threshold / std::min(K2(0, 0), K2(1, 1));
+
+    RNG rng((uint64) n * 7919 + 1);
+    size_t best_count = 0;
+    int iterations = options.max_iterations;
+
+    for (int it = 0; it < iterations; it++) {
+        int i = rng.uniform(0, (int) n);
+        int j = rng.uniform(0, (int) n - 1);
+        j += j >= i;
+
+        const double *a1 = &b1[3 * i], *a2 = &b1[3 * j];
+        const double *c1 = &b2[3 * i], *c2 = &b2[3 * j];
+        if (fabs(dot(a1, a2) - dot(c1, c2)) > angle_tolerance) {
+            continue;
+        }
+
+        Matx33d hypothesis;
+        if (!rotation_2pt(a1, a2, c1, c2, hypothesis)) {
+            continue;
+        }
+
+        size_t count = count_inliers(b1, pts2, K2, hypothesis, options.threshold, NULL);
+        if (count > best_count) {
+            best_count = count;
+            R = hypothesis;
+            iterations = std::min(iterations,
+                                  ransac_iterations((double) count / n, options.confidence,
+                                                    options.max_iterations));
+        }
+    }
+
+    if (best_count < 2) {
+        return false;
+    }
+
+    // least squares on the inliers, while it keeps as many
+    count_inliers(b1, pts2, K2, R, options.threshold, &inliers);
+    for (int k = 0; k < 2; k++) {
+        Matx33d refit;
+        refit_rotation(b1, b2, inliers, refit);
+
+        vector<char> refit_inliers(n);
+        size_t count = count_inliers(b1, pts2, K2, refit, options.threshold, &refit_inliers);
+        if (count < best_count) {
+            break;
+        }
+        best_count = count;
+        R = refit;
+        inliers.swap(refit_inliers);
+    }
+
+    return true;
+}
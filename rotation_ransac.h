@@ -0,0 +1,58 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Rotation only two view model, for panoramas shot from a tripod or a
+// gimbal.
+//
+// When the camera turns around its center the matches follow
+// x2 ~ K2 R K1^-1 x1 whatever the depth of the scene, and the epipolar
+// geometry is degenerate: findFundamentalMat() needs many iterations
+// for a model that doesn't mean much. Here with known K the matches are
+// bearing vectors, two of them give R in closed form (TRIAD: the
+// orthonormal frames built on both pairs of bearings), and RANSAC stops
+// after log(1 - confidence) / log(1 - w^2) samples, a few dozens at 50%
+// inliers instead of hundreds for 7 or 8 points.
+//
+// Samples whose two bearings don't make the same angle in both images
+// can't come from a rotation and are skipped before scoring. The best R
+// is refit on its inliers (Kabsch, SVD of sum b2 b1^T).
+//
+// Inliers are within threshold pixels of K2 R K1^-1 x1 in the second
+// image. ImagePair::compute_motion() picks between this model and the
+// fundamental matrix.
+//
+// Usage :
+//  Matx33d R;
+//  vector<char> inliers;
+//  find_rotation(pts1, pts2, K1, K2, RotationRansacOptions(), R, inliers);
+
+#ifndef ROTATION_RANSAC_H
+#define ROTATION_RANSAC_H
+
+#include "photogram.h"
+
+struct RotationRansacOptions {
+    RotationRansacOptions()
+        : threshold(2.0), confidence(0.99), max_iterations(1000),
+          min_ratio(0.5), margin(0.1)
+    {};
+
+    // pixels in the second image
+    double      threshold;
+    double      confidence;
+    int         max_iterations;
+
+    // model selection (ImagePair::compute_motion()): a rotation keeping
+    // min_ratio of the matches is taken without trying F, else it's
+    // taken when F doesn't keep margin more inliers
+    double      min_ratio;
+    double      margin;
+};
+
+// rotation of the second camera from the first (b2 = R b1) and the
+// inliers of the matches, false with less than 2 points
+bool find_rotation(const vector<Point2f>& pts1, const vector<Point2f>& pts2,
+                   const Matx33d& K1, const Matx33d& K2,
+                   const RotationRansacOptions& options,
+                   Matx33d& R, vector<char>& inliers);
+
+#endif // !ROTATION_RANSAC_H
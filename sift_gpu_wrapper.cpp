@@ -98,7 +98,7 @@ SiftGPUWrapper* SiftGPUWrapper::getInstance() {
     return instance;
 }
 
-void SiftGPUWrapper::detect(const cv::Mat& image, cv::vector<cv::KeyPoint>& keypoints,
+void SiftGPUWrapper::detect(const cv::Mat& image, KeypointSet& keypoints,
                             std::vector<float>& descriptors, const Mat& mask) const {
     // TODO (mtourne): timer is a good idea
     //ScopedTimer s(__FUNCTION__);
@@ -107,6 +107,9 @@ void SiftGPUWrapper::detect(const cv::Mat& image, cv::vector<cv::KeyPoint>& keyp
         LOG(FATAL) << "SiftGPU cannot be used. Detection of keypoints failed";
     }
 
+    // the image buffer is shared too
+    boost::mutex::scoped_lock lock(gpu_mutex);
+
     //get image
     if(image.rows != imageHeight || image.cols != imageWidth){
       imageHeight = image.rows;
@@ -119,7 +122,6 @@ void SiftGPUWrapper::detect(const cv::Mat& image, cv::vector<cv::KeyPoint>& keyp
     int num_features = 0;
     SiftGPU::SiftKeypoint* keys = 0;
 
-    boost::mutex::scoped_lock lock(gpu_mutex);
     LOG(DEBUG) << "SIFTGPU: cols: " << image.cols << ", rows: " << image.rows;
     if (siftgpu->RunSIFT(image.cols, image.rows, data, GL_LUMINANCE, GL_UNSIGNED_BYTE)) {
         num_features = siftgpu->GetFeatureNum();
@@ -132,12 +134,13 @@ void SiftGPUWrapper::detect(const cv::Mat& image, cv::vector<cv::KeyPoint>& keyp
         LOG(WARNING) << "SIFTGPU->RunSIFT() failed!";
     }
 
-    //copy to opencv structure
+    //copy to the keypoint arrays
     keypoints.clear();
+    keypoints.reserve(num_features);
     for (int i = 0; i < num_features; ++i) {
-        KeyPoint key(keys[i].x, keys[i].y, 6.0 * keys[i].s, keys[i].o); // 6 x scale is the conversion to pixels, according to changchang wu (the author of siftgpu)
-        keypoints.push_back(key);
+        keypoints.push_back(keys[i].x, keys[i].y, 6.0 * keys[i].s, keys[i].o); // 6 x scale is the conversion to pixels, according to changchang wu (the author of siftgpu)
     }
+    delete[] keys;
 }
 
 int SiftGPUWrapper::match(
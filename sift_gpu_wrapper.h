@@ -25,6 +25,7 @@
 #include <boost/thread/mutex.hpp>
 
 #include "SiftGPU.h"
+#include "keypoints.h"
 
 
 
@@ -50,7 +51,7 @@ public:
 	 * \param  mask         a mask (see OpenCV)
 	 * \return a pointer to the descriptor values
 	 */
-	void detect(const cv::Mat& image, cv::vector<cv::KeyPoint>& keypoints, std::vector<float>& descriptors, const cv::Mat& mask = cv::Mat()) const;
+	void detect(const cv::Mat& image, KeypointSet& keypoints, std::vector<float>& descriptors, const cv::Mat& mask = cv::Mat()) const;
 
 	/*!
 	 * Is used for matching two descriptors
@@ -0,0 +1,299 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "photogram.h"
+#include "simd_kernels.h"
+#include "metrics.h"
+
+// scalar reference implementations, always available and used
+// to check the vectorized ones (see test_simd_kernels.cc)
+
+static float l2_sqr_f32_scalar(const float *a, const float *b, size_t n) {
+    float sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+static uint32_t l2_sqr_u8_scalar(const uint8_t *a, const uint8_t *b, size_t n) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        int d = (int) a[i] - (int) b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+static float l2_sqr_f16_scalar(const Half *a, const Half *b, size_t n) {
+    float sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        float d = half_to_float(a[i]) - half_to_float(b[i]);
+        sum += d * d;
+    }
+    return sum;
+}
+
+static void f32_to_f16_scalar(const float *src, Half *dst, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = half_from_float(src[i]);
+    }
+}
+
+static void f16_to_f32_scalar(const Half *src, float *dst, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = half_to_float(src[i]);
+    }
+}
+
+static void sampson_error_scalar(const double *F,
+                                 const float *pts1, const float *pts2,
+                                 size_t n, float *err) {
+    for (size_t i = 0; i < n; i++) {
+        double x1 = pts1[2 * i], y1 = pts1[2 * i + 1];
+        double x2 = pts2[2 * i], y2 = pts2[2 * i + 1];
+
+        // F x1 and F' x2
+        double fx0 = F[0] * x1 + F[1] * y1 + F[2];
+        double fx1 = F[3] * x1 + F[4] * y1 + F[5];
+        double fx2 = F[6] * x1 + F[7] * y1 + F[8];
+        double ftx0 = F[0] * x2 + F[3] * y2 + F[6];
+        double ftx1 = F[1] * x2 + F[4] * y2 + F[7];
+
+        // x2' F x1
+        double e = x2 * fx0 + y2 * fx1 + fx2;
+
+        err[i] = e * e / (fx0 * fx0 + fx1 * fx1 + ftx0 * ftx0 + ftx1 * ftx1);
+    }
+}
+
+static void sampson_count_lanes_scalar(const float *F, const float *points, size_t n,
+                                       const float *threshold, uint32_t *inliers) {
+    for (int l = 0; l < SAMPSON_LANES; l++) {
+        float f[9];
+        for (int c = 0; c < 9; c++) {
+            f[c] = F[c * SAMPSON_LANES + l];
+        }
+
+        uint32_t count = 0;
+        for (size_t i = 0; i < n; i++) {
+            const float *p = points + 4 * i * SAMPSON_LANES + l;
+            float x1 = p[0], y1 = p[SAMPSON_LANES];
+            float x2 = p[2 * SAMPSON_LANES], y2 = p[3 * SAMPSON_LANES];
+
+            float fx0 = f[0] * x1 + f[1] * y1 + f[2];
+            float fx1 = f[3] * x1 + f[4] * y1 + f[5];
+            float fx2 = f[6] * x1 + f[7] * y1 + f[8];
+            float ftx0 = f[0] * x2 + f[3] * y2 + f[6];
+            float ftx1 = f[1] * x2 + f[4] * y2 + f[7];
+            float e = x2 * fx0 + y2 * fx1 + fx2;
+
+            // false for the NaN padding
+            count += e * e <= threshold[l] *
+                (fx0 * fx0 + fx1 * fx1 + ftx0 * ftx0 + ftx1 * ftx1);
+        }
+        inliers[l] = count;
+    }
+}
+
+static void haversine_batch_scalar(const double *q, const GeoTable *table,
+                                   size_t n, double *a) {
+    for (size_t i = 0; i < n; i++) {
+        double cos_dlat = q[1] * table->cos_lat[i] + q[0] * table->sin_lat[i];
+        double cos_dlon = q[3] * table->cos_lon[i] + q[2] * table->sin_lon[i];
+
+        // sin^2(d/2) = (1 - cos d) / 2
+        a[i] = 0.5 * ((1 - cos_dlat) + q[1] * table->cos_lat[i] * (1 - cos_dlon));
+    }
+}
+
+static inline double fetch_u8(const uint8_t *src, int cols, int rows,
+                              size_t step, int x, int y) {
+    if (x < 0 || y < 0 || x >= cols || y >= rows) {
+        return 0;
+    }
+    return src[y * step + x];
+}
+
+static void warp_row_bilinear_u8_scalar(const uint8_t *src, int src_cols,
+                                        int src_rows, size_t src_step,
+                                        const double *H, int y,
+                                        uint8_t *dst, int dst_cols) {
+    for (int x = 0; x < dst_cols; x++) {
+        double w = H[6] * x + H[7] * y + H[8];
+        w = w ? 1. / w : 0;
+        double fx = (H[0] * x + H[1] * y + H[2]) * w;
+        double fy = (H[3] * x + H[4] * y + H[5]) * w;
+        double x0 = floor(fx);
+        double y0 = floor(fy);
+        double ax = fx - x0;
+        double ay = fy - y0;
+        int ix = (int) x0;
+        int iy = (int) y0;
+
+        double v00 = fetch_u8(src, src_cols, src_rows, src_step, ix, iy);
+        double v01 = fetch_u8(src, src_cols, src_rows, src_step, ix + 1, iy);
+        double v10 = fetch_u8(src, src_cols, src_rows, src_step, ix, iy + 1);
+        double v11 = fetch_u8(src, src_cols, src_rows, src_step, ix + 1, iy + 1);
+
+        double top = v00 + ax * (v01 - v00);
+        double bot = v10 + ax * (v11 - v10);
+        dst[x] = (uint8_t) (top + ay * (bot - top) + 0.5);
+    }
+}
+
+static void bgr_to_gray_u8_scalar(const uint8_t *bgr, uint8_t *gray, size_t n) {
+    // COLOR_BGR2GRAY fixed point coefficients (14 bits)
+    for (size_t i = 0; i < n; i++) {
+        const uint8_t *p = bgr + 3 * i;
+        gray[i] = (uint8_t) ((p[0] * 1868 + p[1] * 9617 + p[2] * 4899
+                              + (1 << 13)) >> 14);
+    }
+}
+
+static void pq4_scan_scalar(const uint8_t *codes, size_t blocks, size_t m,
+                            const uint8_t *lut, uint16_t *dist) {
+    const size_t rows = m / 2;
+
+    for (size_t b = 0; b < blocks; b++) {
+        const uint8_t *block = codes + b * rows * 16;
+        for (int lane = 0; lane < 16; lane++) {
+            uint16_t sum = 0;
+            for (size_t k = 0; k < rows; k++) {
+                uint8_t c = block[k * 16 + lane];
+                sum += lut[(2 * k) * 16 + (c & 0x0f)] + lut[(2 * k + 1) * 16 + (c >> 4)];
+            }
+            dist[b * 16 + lane] = sum;
+        }
+    }
+}
+
+static inline uint16_t adds_u16(uint16_t a, uint16_t b) {
+    uint32_t s = (uint32_t) a + b;
+    return s > 0xffff ? 0xffff : s;
+}
+
+static uint16_t sgm_step_scalar(const uint8_t *cost, const uint16_t *prev,
+                                uint16_t prev_min, uint16_t p1, uint16_t p2,
+                                size_t n, uint16_t *cur, uint16_t *sum) {
+    uint16_t jump = adds_u16(prev_min, p2);
+    uint16_t min_cur = 0xffff;
+
+    for (size_t d = 0; d < n; d++) {
+        uint16_t m = std::min(prev[d], std::min(adds_u16(prev[d - 1], p1),
+                                                adds_u16(prev[d + 1], p1)));
+        m = std::min(m, jump);
+        cur[d] = cost[d] + (m - prev_min);
+        sum[d] = adds_u16(sum[d], cur[d]);
+        min_cur = std::min(min_cur, cur[d]);
+    }
+
+    return min_cur;
+}
+
+static const SimdKernels scalar_kernels = {
+    SIMD_SCALAR, "scalar",
+    l2_sqr_f32_scalar,
+    l2_sqr_u8_scalar,
+    l2_sqr_f16_scalar,
+    f32_to_f16_scalar,
+    f16_to_f32_scalar,
+    sampson_error_scalar,
+    sampson_count_lanes_scalar,
+    haversine_batch_scalar,
+    warp_row_bilinear_u8_scalar,
+    bgr_to_gray_u8_scalar,
+    pq4_scan_scalar,
+    sgm_step_scalar
+};
+
+static const char* simd_level_names[SIMD_LEVEL_COUNT] = {
+    "scalar", "sse42", "avx2", "avx512"
+};
+
+const char* simd_level_name(SimdLevel level) {
+    if (level < 0 || level >= SIMD_LEVEL_COUNT) {
+        return "unknown";
+    }
+    return simd_level_names[level];
+}
+
+SimdLevel simd_cpu_level() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+
+    // __builtin_cpu_supports also checks the OS saves the wide registers
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("f16c")) {
+        return SIMD_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+        __builtin_cpu_supports("f16c")) {
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return SIMD_SSE42;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+const SimdKernels* simd_kernels_for(SimdLevel level) {
+    if (level > simd_cpu_level()) {
+        return NULL;
+    }
+
+    switch (level) {
+        case SIMD_SCALAR:
+            return &scalar_kernels;
+        case SIMD_SSE42:
+            return simd_kernels_sse42();
+        case SIMD_AVX2:
+            return simd_kernels_avx2();
+        case SIMD_AVX512:
+            return simd_kernels_avx512();
+        default:
+            return NULL;
+    }
+}
+
+static const SimdKernels* select_kernels() {
+    SimdLevel cpu_level = simd_cpu_level();
+    SimdLevel max_level = cpu_level;
+
+    const char *env = getenv("PHOTOGRAM_SIMD");
+    if (env) {
+        for (int i = 0; i < SIMD_LEVEL_COUNT; i++) {
+            if (strcmp(env, simd_level_names[i]) == 0 && i < max_level) {
+                max_level = (SimdLevel) i;
+            }
+        }
+    }
+
+    // highest level both supported and compiled in
+    const SimdKernels *kernels = &scalar_kernels;
+    for (int i = max_level; i > SIMD_SCALAR; i--) {
+        const SimdKernels *k = simd_kernels_for((SimdLevel) i);
+        if (k) {
+            kernels = k;
+            break;
+        }
+    }
+
+    LOG(INFO) << "SIMD kernels: " << kernels->name
+              << " (cpu: " << simd_level_name(cpu_level) << ")";
+
+    Metrics::instance().set("simd.isa", kernels->name);
+    Metrics::instance().set("simd.cpu", simd_level_name(cpu_level));
+
+    return kernels;
+}
+
+const SimdKernels& simd_kernels() {
+    // picked once, thread safe static initialization
+    static const SimdKernels *kernels = select_kernels();
+    return *kernels;
+}
@@ -0,0 +1,234 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#ifndef SIMD_KERNELS_H
+#define SIMD_KERNELS_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Hot kernels compiled for several instruction sets, the best one
+// supported by the cpu is picked once at startup.
+//
+// Only plain C types are allowed in this header: the per instruction set
+// translation units (simd_kernels_*.cc) are built with -m flags and must
+// not instantiate inline or template code shared with the rest of the
+// program, or the linker could keep an AVX copy for everybody.
+
+// ordered, a level implies all the ones below it
+enum SimdLevel {
+    SIMD_SCALAR = 0,
+    SIMD_SSE42,
+    SIMD_AVX2,
+    SIMD_AVX512,
+    SIMD_LEVEL_COUNT
+};
+
+// earth's mean radius in km, same as haversine_dist.h
+#define HAVERSINE_EARTH_RADIUS 6371.0
+
+// gps coordinates prepared for haversine_batch(), structure of arrays
+// of the sin / cos of each latitude and longitude so the trigonometry
+// is paid once per point instead of once per distance.
+struct GeoTable {
+    const double *sin_lat;
+    const double *cos_lat;
+    const double *sin_lon;
+    const double *cos_lon;
+};
+
+// pairs scored at once by sampson_count_lanes(), one per lane, a
+// multiple of every register width
+#define SAMPSON_LANES 16
+
+// IEEE 754 half precision float, storage only
+struct Half {
+    uint16_t bits;
+};
+
+struct SimdKernels {
+    SimdLevel   level;
+    const char *name;
+
+    // squared L2 distance between two float descriptors
+    float (*l2_sqr_f32)(const float *a, const float *b, size_t n);
+
+    // squared L2 distance between two uint8 descriptors
+    uint32_t (*l2_sqr_u8)(const uint8_t *a, const uint8_t *b, size_t n);
+
+    // squared L2 distance of two half precision descriptors, converted
+    // on the fly (F16C) and accumulated in float
+    float (*l2_sqr_f16)(const Half *a, const Half *b, size_t n);
+
+    // conversions, round to nearest even
+    void (*f32_to_f16)(const float *src, Half *dst, size_t n);
+    void (*f16_to_f32)(const Half *src, float *dst, size_t n);
+
+    // squared Sampson distance of n correspondences to F (3x3 row major),
+    // with x2' F x1 = 0. Points are interleaved x, y, same layout as
+    // vector<Point2f>.
+    void (*sampson_error)(const double *F,
+                          const float *pts1, const float *pts2,
+                          size_t n, float *err);
+
+    // inliers of SAMPSON_LANES fundamental matrices, each one over the
+    // points of its own pair (see batch_ransac.h). Coefficient c of the
+    // 3x3 row major matrix of lane l is F[c * SAMPSON_LANES + l], point
+    // i of lane l is x1, y1, x2, y2 at points[(4 * i + k) * SAMPSON_LANES
+    // + l] for k in 0..3. Points past the end of a pair are NaN and never
+    // count. A point is an inlier when its squared Sampson distance is
+    // <= the threshold of its lane.
+    void (*sampson_count_lanes)(const float *F, const float *points, size_t n,
+                                const float *threshold, uint32_t *inliers);
+
+    // haversine term a = sin^2(dlat/2) + cos(lat1) cos(lat2) sin^2(dlon/2)
+    // between point q (sin lat, cos lat, sin lon, cos lon) and the n
+    // points of table. a grows with the distance, see haversine_km().
+    void (*haversine_batch)(const double *q, const GeoTable *table,
+                            size_t n, double *a);
+
+    // bilinear perspective warp of row y of a single channel 8 bit
+    // image. Hinv (3x3 row major) maps destination to source pixels,
+    // samples falling outside of src are 0 (BORDER_CONSTANT).
+    void (*warp_row_bilinear_u8)(const uint8_t *src, int src_cols,
+                                 int src_rows, size_t src_step,
+                                 const double *Hinv, int y,
+                                 uint8_t *dst, int dst_cols);
+
+    // BGR to gray conversion of n pixels, same fixed point
+    // coefficients as COLOR_BGR2GRAY
+    void (*bgr_to_gray_u8)(const uint8_t *bgr, uint8_t *gray, size_t n);
+
+    // product quantizer fast scan over 4 bit codes (see pq.h), in
+    // blocks of 16 codes: m / 2 rows of 16 bytes, the low nibble of row
+    // k is sub quantizer 2k, the high one 2k + 1. lut holds m rows of
+    // 16 quantized distances, dist gets 16 sums per block.
+    void (*pq4_scan)(const uint8_t *codes, size_t blocks, size_t m,
+                     const uint8_t *lut, uint16_t *dist);
+
+    // one step of a semi-global matching path (see stereo.h), over the
+    // n disparities of a pixel:
+    //  cur[d] = cost[d] + min(prev[d], prev[d - 1] + p1, prev[d + 1] + p1,
+    //                         prev_min + p2) - prev_min
+    //  sum[d] += cur[d] (saturated)
+    // prev[-1] and prev[n] must be readable and 0xffff, additions
+    // saturate. Returns the min of cur, prev_min of the next step.
+    uint16_t (*sgm_step)(const uint8_t *cost, const uint16_t *prev,
+                         uint16_t prev_min, uint16_t p1, uint16_t p2,
+                         size_t n, uint16_t *cur, uint16_t *sum);
+};
+
+// kernels for the best level supported by this cpu, the
+// PHOTOGRAM_SIMD environment variable (scalar, sse42, avx2, avx512)
+// can lower the selection.
+const SimdKernels& simd_kernels();
+
+// kernels of a given level, NULL if not compiled in or not
+// supported by this cpu. Used to check implementations against the
+// scalar reference.
+const SimdKernels* simd_kernels_for(SimdLevel level);
+
+const char* simd_level_name(SimdLevel level);
+
+// highest level supported by the cpu
+SimdLevel simd_cpu_level();
+
+// prepare a point for haversine_batch()
+static inline void haversine_prepare(double lat, double lon, double *q) {
+    double lat_rad = lat * M_PI / 180;
+    double lon_rad = lon * M_PI / 180;
+
+    q[0] = sin(lat_rad);
+    q[1] = cos(lat_rad);
+    q[2] = sin(lon_rad);
+    q[3] = cos(lon_rad);
+}
+
+// haversine term to distance in km
+static inline double haversine_km(double a) {
+    if (a > 1) {
+        a = 1;
+    }
+    return 2 * HAVERSINE_EARTH_RADIUS * asin(sqrt(a));
+}
+
+// software conversions, for the levels without F16C
+static inline Half half_from_float(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t mant = x & 0x7fffff;
+    int exp = (int) ((x >> 23) & 0xff) - 127 + 15;
+    Half h;
+
+    if (exp == 128 + 15) {
+        // inf, nan
+        h.bits = sign | 0x7c00 | (mant ? 0x200 : 0);
+        return h;
+    }
+    if (exp >= 31) {
+        h.bits = sign | 0x7c00;
+        return h;
+    }
+
+    uint32_t shift = 13;
+    uint32_t bits = ((uint32_t) exp << 10) | (mant >> 13);
+    if (exp <= 0) {
+        // subnormal, or zero
+        if (exp < -10) {
+            h.bits = sign;
+            return h;
+        }
+        mant |= 0x800000;
+        shift = 14 - exp;
+        bits = mant >> shift;
+    }
+
+    // round to nearest even, a carry can bump the exponent
+    uint32_t rem = mant & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (rem > halfway || (rem == halfway && (bits & 1))) {
+        bits++;
+    }
+
+    h.bits = sign | bits;
+    return h;
+}
+
+static inline float half_to_float(Half h) {
+    uint32_t sign = (uint32_t) (h.bits & 0x8000) << 16;
+    uint32_t exp = (h.bits >> 10) & 0x1f;
+    uint32_t mant = h.bits & 0x3ff;
+    uint32_t x;
+
+    if (exp == 0x1f) {
+        x = sign | 0x7f800000 | (mant << 13);
+    } else if (exp == 0) {
+        if (mant == 0) {
+            x = sign;
+        } else {
+            // subnormal, normalized in float
+            exp = 127 - 15 + 1;
+            while (!(mant & 0x400)) {
+                mant <<= 1;
+                exp--;
+            }
+            x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+        }
+    } else {
+        x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+    }
+
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// per level entry points, defined in simd_kernels_*.cc
+const SimdKernels* simd_kernels_sse42();
+const SimdKernels* simd_kernels_avx2();
+const SimdKernels* simd_kernels_avx512();
+
+#endif // !SIMD_KERNELS_H
@@ -0,0 +1,23 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// avx2 kernels, built with the matching -m flags (see CMakeLists.txt)
+
+#include "simd_kernels.h"
+
+#if defined(__AVX2__)
+
+#include "simd_kernels_impl.hpp"
+
+static const SimdKernels kernels = SIMD_KERNELS_TABLE(SIMD_AVX2, "avx2");
+
+const SimdKernels* simd_kernels_avx2() {
+    return &kernels;
+}
+
+#else
+
+const SimdKernels* simd_kernels_avx2() {
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,23 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// avx512 kernels, built with the matching -m flags (see CMakeLists.txt)
+
+#include "simd_kernels.h"
+
+#if defined(__AVX512BW__)
+
+#include "simd_kernels_impl.hpp"
+
+static const SimdKernels kernels = SIMD_KERNELS_TABLE(SIMD_AVX512, "avx512");
+
+const SimdKernels* simd_kernels_avx512() {
+    return &kernels;
+}
+
+#else
+
+const SimdKernels* simd_kernels_avx512() {
+    return NULL;
+}
+
+#endif
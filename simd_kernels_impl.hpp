@@ -0,0 +1,796 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Vectorized kernels, written once on top of a thin wrapper of the
+// widest registers enabled by the compiler flags of the including
+// translation unit (-msse4.2, -mavx2 -mfma or -mavx512f -mavx512bw).
+//
+// Included by simd_kernels_{sse42,avx2,avx512}.cc only, everything lives
+// in an anonymous namespace, see simd_kernels.h for the rationale.
+
+#ifndef SIMD_KERNELS_IMPL_HPP
+#define SIMD_KERNELS_IMPL_HPP
+
+#include <immintrin.h>
+
+#include "simd_kernels.h"
+
+namespace {
+
+//////////////////////
+/// vector wrapper ///
+//////////////////////
+
+#if defined(__AVX512F__)
+
+#define VF_WIDTH 16
+#define VD_WIDTH 8
+typedef __m512  vf;
+typedef __m512d vd;
+
+static inline vf vf_set1(float x) { return _mm512_set1_ps(x); }
+static inline vf vf_loadu(const float *p) { return _mm512_loadu_ps(p); }
+static inline void vf_storeu(float *p, vf a) { _mm512_storeu_ps(p, a); }
+static inline vf vf_add(vf a, vf b) { return _mm512_add_ps(a, b); }
+static inline vf vf_sub(vf a, vf b) { return _mm512_sub_ps(a, b); }
+static inline vf vf_mul(vf a, vf b) { return _mm512_mul_ps(a, b); }
+static inline vf vf_div(vf a, vf b) { return _mm512_div_ps(a, b); }
+static inline vf vf_fmadd(vf a, vf b, vf c) { return _mm512_fmadd_ps(a, b, c); }
+static inline float vf_hsum(vf a) { return _mm512_reduce_add_ps(a); }
+// 1 where a <= b, else 0 (NaNs compare false)
+static inline vf vf_le_one(vf a, vf b) {
+    return _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(a, b, _CMP_LE_OQ), _mm512_set1_ps(1));
+}
+
+static inline vd vd_set1(double x) { return _mm512_set1_pd(x); }
+static inline vd vd_loadu(const double *p) { return _mm512_loadu_pd(p); }
+static inline void vd_storeu(double *p, vd a) { _mm512_storeu_pd(p, a); }
+static inline vd vd_add(vd a, vd b) { return _mm512_add_pd(a, b); }
+static inline vd vd_sub(vd a, vd b) { return _mm512_sub_pd(a, b); }
+static inline vd vd_mul(vd a, vd b) { return _mm512_mul_pd(a, b); }
+static inline vd vd_div(vd a, vd b) { return _mm512_div_pd(a, b); }
+static inline vd vd_fmadd(vd a, vd b, vd c) { return _mm512_fmadd_pd(a, b, c); }
+static inline vd vd_floor(vd a) {
+    return _mm512_roundscale_pd(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+}
+// a where mask is set, else 0
+static inline vd vd_nonzero_or_zero(vd test, vd a) {
+    __mmask8 m = _mm512_cmp_pd_mask(test, _mm512_setzero_pd(), _CMP_NEQ_OQ);
+    return _mm512_maskz_mov_pd(m, a);
+}
+
+#elif defined(__AVX2__)
+
+#define VF_WIDTH 8
+#define VD_WIDTH 4
+typedef __m256  vf;
+typedef __m256d vd;
+
+static inline vf vf_set1(float x) { return _mm256_set1_ps(x); }
+static inline vf vf_loadu(const float *p) { return _mm256_loadu_ps(p); }
+static inline void vf_storeu(float *p, vf a) { _mm256_storeu_ps(p, a); }
+static inline vf vf_add(vf a, vf b) { return _mm256_add_ps(a, b); }
+static inline vf vf_sub(vf a, vf b) { return _mm256_sub_ps(a, b); }
+static inline vf vf_mul(vf a, vf b) { return _mm256_mul_ps(a, b); }
+static inline vf vf_div(vf a, vf b) { return _mm256_div_ps(a, b); }
+static inline vf vf_fmadd(vf a, vf b, vf c) { return _mm256_fmadd_ps(a, b, c); }
+static inline float vf_hsum(vf a) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(a),
+                          _mm256_extractf128_ps(a, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+static inline vf vf_le_one(vf a, vf b) {
+    return _mm256_and_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ), _mm256_set1_ps(1));
+}
+
+static inline vd vd_set1(double x) { return _mm256_set1_pd(x); }
+static inline vd vd_loadu(const double *p) { return _mm256_loadu_pd(p); }
+static inline void vd_storeu(double *p, vd a) { _mm256_storeu_pd(p, a); }
+static inline vd vd_add(vd a, vd b) { return _mm256_add_pd(a, b); }
+static inline vd vd_sub(vd a, vd b) { return _mm256_sub_pd(a, b); }
+static inline vd vd_mul(vd a, vd b) { return _mm256_mul_pd(a, b); }
+static inline vd vd_div(vd a, vd b) { return _mm256_div_pd(a, b); }
+static inline vd vd_fmadd(vd a, vd b, vd c) { return _mm256_fmadd_pd(a, b, c); }
+static inline vd vd_floor(vd a) { return _mm256_floor_pd(a); }
+static inline vd vd_nonzero_or_zero(vd test, vd a) {
+    vd m = _mm256_cmp_pd(test, _mm256_setzero_pd(), _CMP_NEQ_OQ);
+    return _mm256_and_pd(m, a);
+}
+
+#elif defined(__SSE4_2__)
+
+#define VF_WIDTH 4
+#define VD_WIDTH 2
+typedef __m128  vf;
+typedef __m128d vd;
+
+static inline vf vf_set1(float x) { return _mm_set1_ps(x); }
+static inline vf vf_loadu(const float *p) { return _mm_loadu_ps(p); }
+static inline void vf_storeu(float *p, vf a) { _mm_storeu_ps(p, a); }
+static inline vf vf_add(vf a, vf b) { return _mm_add_ps(a, b); }
+static inline vf vf_sub(vf a, vf b) { return _mm_sub_ps(a, b); }
+static inline vf vf_mul(vf a, vf b) { return _mm_mul_ps(a, b); }
+static inline vf vf_div(vf a, vf b) { return _mm_div_ps(a, b); }
+static inline vf vf_fmadd(vf a, vf b, vf c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+static inline float vf_hsum(vf s) {
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+static inline vf vf_le_one(vf a, vf b) {
+    return _mm_and_ps(_mm_cmple_ps(a, b), _mm_set1_ps(1));
+}
+
+static inline vd vd_set1(double x) { return _mm_set1_pd(x); }
+static inline vd vd_loadu(const double *p) { return _mm_loadu_pd(p); }
+static inline void vd_storeu(double *p, vd a) { _mm_storeu_pd(p, a); }
+static inline vd vd_add(vd a, vd b) { return _mm_add_pd(a, b); }
+static inline vd vd_sub(vd a, vd b) { return _mm_sub_pd(a, b); }
+static inline vd vd_mul(vd a, vd b) { return _mm_mul_pd(a, b); }
+static inline vd vd_div(vd a, vd b) { return _mm_div_pd(a, b); }
+static inline vd vd_fmadd(vd a, vd b, vd c) { return _mm_add_pd(_mm_mul_pd(a, b), c); }
+static inline vd vd_floor(vd a) { return _mm_floor_pd(a); }
+static inline vd vd_nonzero_or_zero(vd test, vd a) {
+    vd m = _mm_cmpneq_pd(test, _mm_setzero_pd());
+    return _mm_and_pd(m, a);
+}
+
+#else
+#error "simd_kernels_impl.hpp needs at least -msse4.2"
+#endif
+
+// half precision loads and stores, F16C comes with the AVX2 and
+// AVX512 flags, the SSE4.2 level falls back to software conversions
+#if defined(__AVX512F__)
+static inline vf vf_load_half(const Half *p) {
+    return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*) p));
+}
+static inline void vf_store_half(Half *p, vf a) {
+    _mm256_storeu_si256((__m256i*) p,
+                        _mm512_cvtps_ph(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+}
+#elif defined(__AVX2__) && defined(__F16C__)
+static inline vf vf_load_half(const Half *p) {
+    return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*) p));
+}
+static inline void vf_store_half(Half *p, vf a) {
+    _mm_storeu_si128((__m128i*) p, _mm256_cvtps_ph(a, _MM_FROUND_TO_NEAREST_INT));
+}
+#elif defined(__F16C__)
+static inline vf vf_load_half(const Half *p) {
+    return _mm_cvtph_ps(_mm_loadl_epi64((const __m128i*) p));
+}
+static inline void vf_store_half(Half *p, vf a) {
+    _mm_storel_epi64((__m128i*) p, _mm_cvtps_ph(a, _MM_FROUND_TO_NEAREST_INT));
+}
+#else
+static inline vf vf_load_half(const Half *p) {
+    float f[VF_WIDTH];
+    for (int i = 0; i < VF_WIDTH; i++) {
+        f[i] = half_to_float(p[i]);
+    }
+    return vf_loadu(f);
+}
+static inline void vf_store_half(Half *p, vf a) {
+    float f[VF_WIDTH];
+    vf_storeu(f, a);
+    for (int i = 0; i < VF_WIDTH; i++) {
+        p[i] = half_from_float(f[i]);
+    }
+}
+#endif
+
+///////////////
+/// kernels ///
+///////////////
+
+static float l2_sqr_f32(const float *a, const float *b, size_t n) {
+    vf acc0 = vf_set1(0);
+    vf acc1 = vf_set1(0);
+    size_t i = 0;
+
+    // two accumulators to hide the fma latency, 128 floats of a SIFT
+    // descriptor is a multiple of every width
+    for (; i + 2 * VF_WIDTH <= n; i += 2 * VF_WIDTH) {
+        vf d0 = vf_sub(vf_loadu(a + i), vf_loadu(b + i));
+        vf d1 = vf_sub(vf_loadu(a + i + VF_WIDTH), vf_loadu(b + i + VF_WIDTH));
+        acc0 = vf_fmadd(d0, d0, acc0);
+        acc1 = vf_fmadd(d1, d1, acc1);
+    }
+
+    float sum = vf_hsum(vf_add(acc0, acc1));
+
+    for (; i < n; i++) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+
+    return sum;
+}
+
+static float l2_sqr_f16(const Half *a, const Half *b, size_t n) {
+    vf acc0 = vf_set1(0);
+    vf acc1 = vf_set1(0);
+    size_t i = 0;
+
+    // half the bytes of l2_sqr_f32 to load, same float arithmetic
+    for (; i + 2 * VF_WIDTH <= n; i += 2 * VF_WIDTH) {
+        vf d0 = vf_sub(vf_load_half(a + i), vf_load_half(b + i));
+        vf d1 = vf_sub(vf_load_half(a + i + VF_WIDTH), vf_load_half(b + i + VF_WIDTH));
+        acc0 = vf_fmadd(d0, d0, acc0);
+        acc1 = vf_fmadd(d1, d1, acc1);
+    }
+
+    float sum = vf_hsum(vf_add(acc0, acc1));
+
+    for (; i < n; i++) {
+        float d = half_to_float(a[i]) - half_to_float(b[i]);
+        sum += d * d;
+    }
+
+    return sum;
+}
+
+static void f32_to_f16(const float *src, Half *dst, size_t n) {
+    size_t i = 0;
+
+    for (; i + VF_WIDTH <= n; i += VF_WIDTH) {
+        vf_store_half(dst + i, vf_loadu(src + i));
+    }
+    for (; i < n; i++) {
+        dst[i] = half_from_float(src[i]);
+    }
+}
+
+static void f16_to_f32(const Half *src, float *dst, size_t n) {
+    size_t i = 0;
+
+    for (; i + VF_WIDTH <= n; i += VF_WIDTH) {
+        vf_storeu(dst + i, vf_load_half(src + i));
+    }
+    for (; i < n; i++) {
+        dst[i] = half_to_float(src[i]);
+    }
+}
+
+static uint32_t l2_sqr_u8(const uint8_t *a, const uint8_t *b, size_t n) {
+    size_t i = 0;
+    uint32_t sum = 0;
+
+    // widen to 16 bits, square and pair-wise add to 32 bits with madd
+#if defined(__AVX512BW__)
+    __m512i acc = _mm512_setzero_si512();
+    for (; i + 32 <= n; i += 32) {
+        __m512i va = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*) (a + i)));
+        __m512i vb = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*) (b + i)));
+        __m512i d = _mm512_sub_epi16(va, vb);
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(d, d));
+    }
+    sum = (uint32_t) _mm512_reduce_add_epi32(acc);
+#elif defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 16 <= n; i += 16) {
+        __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (a + i)));
+        __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (b + i)));
+        __m256i d = _mm256_sub_epi16(va, vb);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d, d));
+    }
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                              _mm256_extracti128_si256(acc, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    sum = (uint32_t) _mm_cvtsi128_si32(s);
+#else
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8) {
+        __m128i va = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*) (a + i)));
+        __m128i vb = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*) (b + i)));
+        __m128i d = _mm_sub_epi16(va, vb);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(d, d));
+    }
+    __m128i s = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    sum = (uint32_t) _mm_cvtsi128_si32(s);
+#endif
+
+    for (; i < n; i++) {
+        int d = (int) a[i] - (int) b[i];
+        sum += d * d;
+    }
+
+    return sum;
+}
+
+static void sampson_error(const double *F,
+                          const float *pts1, const float *pts2,
+                          size_t n, float *err) {
+    const vf f0 = vf_set1(F[0]), f1 = vf_set1(F[1]), f2 = vf_set1(F[2]);
+    const vf f3 = vf_set1(F[3]), f4 = vf_set1(F[4]), f5 = vf_set1(F[5]);
+    const vf f6 = vf_set1(F[6]), f7 = vf_set1(F[7]), f8 = vf_set1(F[8]);
+
+    float x1[VF_WIDTH], y1[VF_WIDTH], x2[VF_WIDTH], y2[VF_WIDTH];
+    size_t i = 0;
+
+    for (; i + VF_WIDTH <= n; i += VF_WIDTH) {
+        // deinterleave x, y
+        for (int k = 0; k < VF_WIDTH; k++) {
+            x1[k] = pts1[2 * (i + k)];
+            y1[k] = pts1[2 * (i + k) + 1];
+            x2[k] = pts2[2 * (i + k)];
+            y2[k] = pts2[2 * (i + k) + 1];
+        }
+        vf vx1 = vf_loadu(x1), vy1 = vf_loadu(y1);
+        vf vx2 = vf_loadu(x2), vy2 = vf_loadu(y2);
+
+        // F x1
+        vf fx0 = vf_fmadd(f0, vx1, vf_fmadd(f1, vy1, f2));
+        vf fx1 = vf_fmadd(f3, vx1, vf_fmadd(f4, vy1, f5));
+        vf fx2 = vf_fmadd(f6, vx1, vf_fmadd(f7, vy1, f8));
+
+        // F' x2
+        vf ftx0 = vf_fmadd(f0, vx2, vf_fmadd(f3, vy2, f6));
+        vf ftx1 = vf_fmadd(f1, vx2, vf_fmadd(f4, vy2, f7));
+
+        // x2' F x1
+        vf e = vf_fmadd(vx2, fx0, vf_fmadd(vy2, fx1, fx2));
+
+        vf den = vf_fmadd(fx0, fx0, vf_mul(fx1, fx1));
+        den = vf_fmadd(ftx0, ftx0, den);
+        den = vf_fmadd(ftx1, ftx1, den);
+
+        vf_storeu(err + i, vf_div(vf_mul(e, e), den));
+    }
+
+    for (; i < n; i++) {
+        float px1 = pts1[2 * i], py1 = pts1[2 * i + 1];
+        float px2 = pts2[2 * i], py2 = pts2[2 * i + 1];
+
+        float fx0 = F[0] * px1 + F[1] * py1 + F[2];
+        float fx1 = F[3] * px1 + F[4] * py1 + F[5];
+        float fx2 = F[6] * px1 + F[7] * py1 + F[8];
+        float ftx0 = F[0] * px2 + F[3] * py2 + F[6];
+        float ftx1 = F[1] * px2 + F[4] * py2 + F[7];
+        float e = px2 * fx0 + py2 * fx1 + fx2;
+
+        err[i] = e * e / (fx0 * fx0 + fx1 * fx1 + ftx0 * ftx0 + ftx1 * ftx1);
+    }
+}
+
+static void sampson_count_lanes(const float *F, const float *points, size_t n,
+                                const float *threshold, uint32_t *inliers) {
+    // one register of lanes at a time, e^2 <= threshold * den saves the
+    // division of sampson_error()
+    for (int l = 0; l < SAMPSON_LANES; l += VF_WIDTH) {
+        const vf thr = vf_loadu(threshold + l);
+        const vf f0 = vf_loadu(F + 0 * SAMPSON_LANES + l);
+        const vf f1 = vf_loadu(F + 1 * SAMPSON_LANES + l);
+        const vf f2 = vf_loadu(F + 2 * SAMPSON_LANES + l);
+        const vf f3 = vf_loadu(F + 3 * SAMPSON_LANES + l);
+        const vf f4 = vf_loadu(F + 4 * SAMPSON_LANES + l);
+        const vf f5 = vf_loadu(F + 5 * SAMPSON_LANES + l);
+        const vf f6 = vf_loadu(F + 6 * SAMPSON_LANES + l);
+        const vf f7 = vf_loadu(F + 7 * SAMPSON_LANES + l);
+        const vf f8 = vf_loadu(F + 8 * SAMPSON_LANES + l);
+        vf count = vf_set1(0);
+
+        for (size_t i = 0; i < n; i++) {
+            const float *p = points + 4 * i * SAMPSON_LANES + l;
+            vf vx1 = vf_loadu(p);
+            vf vy1 = vf_loadu(p + SAMPSON_LANES);
+            vf vx2 = vf_loadu(p + 2 * SAMPSON_LANES);
+            vf vy2 = vf_loadu(p + 3 * SAMPSON_LANES);
+
+            vf fx0 = vf_fmadd(f0, vx1, vf_fmadd(f1, vy1, f2));
+            vf fx1 = vf_fmadd(f3, vx1, vf_fmadd(f4, vy1, f5));
+            vf fx2 = vf_fmadd(f6, vx1, vf_fmadd(f7, vy1, f8));
+            vf ftx0 = vf_fmadd(f0, vx2, vf_fmadd(f3, vy2, f6));
+            vf ftx1 = vf_fmadd(f1, vx2, vf_fmadd(f4, vy2, f7));
+            vf e = vf_fmadd(vx2, fx0, vf_fmadd(vy2, fx1, fx2));
+
+            vf den = vf_fmadd(fx0, fx0, vf_mul(fx1, fx1));
+            den = vf_fmadd(ftx0, ftx0, den);
+            den = vf_fmadd(ftx1, ftx1, den);
+
+            count = vf_add(count, vf_le_one(vf_mul(e, e), vf_mul(thr, den)));
+        }
+
+        float c[VF_WIDTH];
+        vf_storeu(c, count);
+        for (int k = 0; k < VF_WIDTH; k++) {
+            inliers[l + k] = (uint32_t) c[k];
+        }
+    }
+}
+
+static void haversine_batch(const double *q, const GeoTable *table,
+                            size_t n, double *a) {
+    const vd sl = vd_set1(q[0]), cl = vd_set1(q[1]);
+    const vd so = vd_set1(q[2]), co = vd_set1(q[3]);
+    const vd one = vd_set1(1), half = vd_set1(0.5);
+    size_t i = 0;
+
+    // sin^2(d/2) = (1 - cos d) / 2 with
+    //   cos(dlat) = cl1 cl2 + sl1 sl2, cos(dlon) = co1 co2 + so1 so2
+    for (; i + VD_WIDTH <= n; i += VD_WIDTH) {
+        vd cl2 = vd_loadu(table->cos_lat + i);
+        vd cos_dlat = vd_fmadd(cl, cl2, vd_mul(sl, vd_loadu(table->sin_lat + i)));
+        vd cos_dlon = vd_fmadd(co, vd_loadu(table->cos_lon + i),
+                               vd_mul(so, vd_loadu(table->sin_lon + i)));
+
+        vd r = vd_fmadd(vd_mul(cl, cl2), vd_sub(one, cos_dlon),
+                        vd_sub(one, cos_dlat));
+        vd_storeu(a + i, vd_mul(half, r));
+    }
+
+    for (; i < n; i++) {
+        double cos_dlat = q[1] * table->cos_lat[i] + q[0] * table->sin_lat[i];
+        double cos_dlon = q[3] * table->cos_lon[i] + q[2] * table->sin_lon[i];
+        a[i] = 0.5 * ((1 - cos_dlat) + q[1] * table->cos_lat[i] * (1 - cos_dlon));
+    }
+}
+
+static inline double fetch_u8(const uint8_t *src, int cols, int rows,
+                              size_t step, int x, int y) {
+    if (x < 0 || y < 0 || x >= cols || y >= rows) {
+        return 0;
+    }
+    return src[y * step + x];
+}
+
+static void warp_row_bilinear_u8(const uint8_t *src, int src_cols,
+                                 int src_rows, size_t src_step,
+                                 const double *H, int y,
+                                 uint8_t *dst, int dst_cols) {
+    double lane[VD_WIDTH];
+    double sx[VD_WIDTH], sy[VD_WIDTH];
+    double p00[VD_WIDTH], p01[VD_WIDTH], p10[VD_WIDTH], p11[VD_WIDTH];
+    double out[VD_WIDTH];
+
+    for (int k = 0; k < VD_WIDTH; k++) {
+        lane[k] = k;
+    }
+
+    // row constant part of H [x y 1]'
+    const vd bx = vd_set1(H[1] * y + H[2]);
+    const vd by = vd_set1(H[4] * y + H[5]);
+    const vd bw = vd_set1(H[7] * y + H[8]);
+    const vd h0 = vd_set1(H[0]), h3 = vd_set1(H[3]), h6 = vd_set1(H[6]);
+    const vd one = vd_set1(1);
+    const vd vlane = vd_loadu(lane);
+
+    int x = 0;
+    for (; x + VD_WIDTH <= dst_cols; x += VD_WIDTH) {
+        vd vx = vd_add(vd_set1(x), vlane);
+        vd w = vd_fmadd(h6, vx, bw);
+        w = vd_nonzero_or_zero(w, vd_div(one, w));
+        vd fx = vd_mul(vd_fmadd(h0, vx, bx), w);
+        vd fy = vd_mul(vd_fmadd(h3, vx, by), w);
+
+        vd x0 = vd_floor(fx);
+        vd y0 = vd_floor(fy);
+        vd ax = vd_sub(fx, x0);
+        vd ay = vd_sub(fy, y0);
+        vd_storeu(sx, x0);
+        vd_storeu(sy, y0);
+
+        // no gather worth it on 8 bit pixels, neighbours are fetched
+        // per lane and blended in vector registers
+        for (int k = 0; k < VD_WIDTH; k++) {
+            int ix = (int) sx[k];
+            int iy = (int) sy[k];
+            p00[k] = fetch_u8(src, src_cols, src_rows, src_step, ix, iy);
+            p01[k] = fetch_u8(src, src_cols, src_rows, src_step, ix + 1, iy);
+            p10[k] = fetch_u8(src, src_cols, src_rows, src_step, ix, iy + 1);
+            p11[k] = fetch_u8(src, src_cols, src_rows, src_step, ix + 1, iy + 1);
+        }
+
+        vd top = vd_fmadd(ax, vd_sub(vd_loadu(p01), vd_loadu(p00)), vd_loadu(p00));
+        vd bot = vd_fmadd(ax, vd_sub(vd_loadu(p11), vd_loadu(p10)), vd_loadu(p10));
+        vd_storeu(out, vd_fmadd(ay, vd_sub(bot, top), top));
+
+        for (int k = 0; k < VD_WIDTH; k++) {
+            dst[x + k] = (uint8_t) (out[k] + 0.5);
+        }
+    }
+
+    for (; x < dst_cols; x++) {
+        double w = H[6] * x + H[7] * y + H[8];
+        w = w ? 1. / w : 0;
+        double fx = (H[0] * x + H[1] * y + H[2]) * w;
+        double fy = (H[3] * x + H[4] * y + H[5]) * w;
+        double x0 = floor(fx);
+        double y0 = floor(fy);
+        double ax = fx - x0;
+        double ay = fy - y0;
+        int ix = (int) x0;
+        int iy = (int) y0;
+
+        double v00 = fetch_u8(src, src_cols, src_rows, src_step, ix, iy);
+        double v01 = fetch_u8(src, src_cols, src_rows, src_step, ix + 1, iy);
+        double v10 = fetch_u8(src, src_cols, src_rows, src_step, ix, iy + 1);
+        double v11 = fetch_u8(src, src_cols, src_rows, src_step, ix + 1, iy + 1);
+
+        double top = v00 + ax * (v01 - v00);
+        double bot = v10 + ax * (v11 - v10);
+        dst[x] = (uint8_t) (top + ay * (bot - top) + 0.5);
+    }
+}
+
+// COLOR_BGR2GRAY fixed point coefficients (14 bits)
+#define GRAY_SHIFT  14
+#define GRAY_B      1868
+#define GRAY_G      9617
+#define GRAY_R      4899
+
+static void bgr_to_gray_u8(const uint8_t *bgr, uint8_t *gray, size_t n) {
+    size_t i = 0;
+
+    // 16 pixels at a time on all levels: the 3 channel deinterleave is
+    // a 128 bit pshufb, wider registers would need cross lane shuffles
+    const __m128i b0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+    const __m128i b2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+    const __m128i g0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i g1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+    const __m128i g2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+    const __m128i r0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i r1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+    const __m128i r2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+
+    const __m128i w_bg = _mm_setr_epi16(GRAY_B, GRAY_G, GRAY_B, GRAY_G,
+                                        GRAY_B, GRAY_G, GRAY_B, GRAY_G);
+    const __m128i w_r1 = _mm_setr_epi16(GRAY_R, 1, GRAY_R, 1,
+                                        GRAY_R, 1, GRAY_R, 1);
+    const __m128i round = _mm_set1_epi16(1 << (GRAY_SHIFT - 1));
+
+    for (; i + 16 <= n; i += 16) {
+        const uint8_t *p = bgr + 3 * i;
+        __m128i a0 = _mm_loadu_si128((const __m128i*) p);
+        __m128i a1 = _mm_loadu_si128((const __m128i*) (p + 16));
+        __m128i a2 = _mm_loadu_si128((const __m128i*) (p + 32));
+
+        __m128i b = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, b0),
+                                              _mm_shuffle_epi8(a1, b1)),
+                                 _mm_shuffle_epi8(a2, b2));
+        __m128i g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, g0),
+                                              _mm_shuffle_epi8(a1, g1)),
+                                 _mm_shuffle_epi8(a2, g2));
+        __m128i r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, r0),
+                                              _mm_shuffle_epi8(a1, r1)),
+                                 _mm_shuffle_epi8(a2, r2));
+
+        __m128i res[2];
+        for (int half = 0; half < 2; half++) {
+            __m128i b16 = _mm_cvtepu8_epi16(half ? _mm_srli_si128(b, 8) : b);
+            __m128i g16 = _mm_cvtepu8_epi16(half ? _mm_srli_si128(g, 8) : g);
+            __m128i r16 = _mm_cvtepu8_epi16(half ? _mm_srli_si128(r, 8) : r);
+
+            // (b, g) . (wb, wg) + (r, round) . (wr, 1)
+            __m128i lo = _mm_add_epi32(
+                _mm_madd_epi16(_mm_unpacklo_epi16(b16, g16), w_bg),
+                _mm_madd_epi16(_mm_unpacklo_epi16(r16, round), w_r1));
+            __m128i hi = _mm_add_epi32(
+                _mm_madd_epi16(_mm_unpackhi_epi16(b16, g16), w_bg),
+                _mm_madd_epi16(_mm_unpackhi_epi16(r16, round), w_r1));
+
+            res[half] = _mm_packs_epi32(_mm_srli_epi32(lo, GRAY_SHIFT),
+                                        _mm_srli_epi32(hi, GRAY_SHIFT));
+        }
+
+        _mm_storeu_si128((__m128i*) (gray + i), _mm_packus_epi16(res[0], res[1]));
+    }
+
+    for (; i < n; i++) {
+        const uint8_t *p = bgr + 3 * i;
+        gray[i] = (uint8_t) ((p[0] * GRAY_B + p[1] * GRAY_G + p[2] * GRAY_R
+                              + (1 << (GRAY_SHIFT - 1))) >> GRAY_SHIFT);
+    }
+}
+
+// lookups of one row of 16 codes, widened and added to the 16 bit
+// sums of codes 0-7 (a) and 8-15 (b)
+static inline void pq4_row_128(const uint8_t *row, const uint8_t *lut,
+                               __m128i &a, __m128i &b) {
+    const __m128i low4 = _mm_set1_epi8(0x0f);
+    const __m128i zero = _mm_setzero_si128();
+
+    __m128i c = _mm_loadu_si128((const __m128i*) row);
+    __m128i lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) lut),
+                                  _mm_and_si128(c, low4));
+    __m128i hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (lut + 16)),
+                                  _mm_and_si128(_mm_srli_epi16(c, 4), low4));
+
+    a = _mm_add_epi16(a, _mm_add_epi16(_mm_unpacklo_epi8(lo, zero),
+                                       _mm_unpacklo_epi8(hi, zero)));
+    b = _mm_add_epi16(b, _mm_add_epi16(_mm_unpackhi_epi8(lo, zero),
+                                       _mm_unpackhi_epi8(hi, zero)));
+}
+
+static void pq4_scan(const uint8_t *codes, size_t blocks, size_t m,
+                     const uint8_t *lut, uint16_t *dist) {
+    const size_t rows = m / 2;
+
+    for (size_t blk = 0; blk < blocks; blk++) {
+        const uint8_t *block = codes + blk * rows * 16;
+        __m128i a = _mm_setzero_si128();
+        __m128i b = _mm_setzero_si128();
+        size_t k = 0;
+
+        // the lookup tables live in registers, pshufb does 16 (32, 64)
+        // lookups at once. Wider registers handle several rows, one per
+        // 128 bit lane, folded at the end.
+#if defined(__AVX512BW__)
+        const __m512i low4 = _mm512_set1_epi8(0x0f);
+        const __m512i zero = _mm512_setzero_si512();
+        const __m512i idx_lo = _mm512_setr_epi64(0, 1, 4, 5, 8, 9, 12, 13);
+        const __m512i idx_hi = _mm512_setr_epi64(2, 3, 6, 7, 10, 11, 14, 15);
+        __m512i wa = zero, wb = zero;
+
+        for (; k + 4 <= rows; k += 4) {
+            __m512i c = _mm512_loadu_si512(block + k * 16);
+            __m512i l0 = _mm512_loadu_si512(lut + 2 * k * 16);
+            __m512i l1 = _mm512_loadu_si512(lut + 2 * k * 16 + 64);
+            __m512i lo = _mm512_shuffle_epi8(_mm512_permutex2var_epi64(l0, idx_lo, l1),
+                                             _mm512_and_si512(c, low4));
+            __m512i hi = _mm512_shuffle_epi8(_mm512_permutex2var_epi64(l0, idx_hi, l1),
+                                             _mm512_and_si512(_mm512_srli_epi16(c, 4), low4));
+
+            wa = _mm512_add_epi16(wa, _mm512_add_epi16(_mm512_unpacklo_epi8(lo, zero),
+                                                       _mm512_unpacklo_epi8(hi, zero)));
+            wb = _mm512_add_epi16(wb, _mm512_add_epi16(_mm512_unpackhi_epi8(lo, zero),
+                                                       _mm512_unpackhi_epi8(hi, zero)));
+        }
+
+        __m256i ha = _mm256_add_epi16(_mm512_castsi512_si256(wa), _mm512_extracti64x4_epi64(wa, 1));
+        __m256i hb = _mm256_add_epi16(_mm512_castsi512_si256(wb), _mm512_extracti64x4_epi64(wb, 1));
+        a = _mm_add_epi16(_mm256_castsi256_si128(ha), _mm256_extracti128_si256(ha, 1));
+        b = _mm_add_epi16(_mm256_castsi256_si128(hb), _mm256_extracti128_si256(hb, 1));
+#elif defined(__AVX2__)
+        const __m256i low4 = _mm256_set1_epi8(0x0f);
+        const __m256i zero = _mm256_setzero_si256();
+        __m256i wa = zero, wb = zero;
+
+        for (; k + 2 <= rows; k += 2) {
+            __m256i c = _mm256_loadu_si256((const __m256i*) (block + k * 16));
+            __m256i l0 = _mm256_loadu_si256((const __m256i*) (lut + 2 * k * 16));
+            __m256i l1 = _mm256_loadu_si256((const __m256i*) (lut + 2 * k * 16 + 32));
+            __m256i lo = _mm256_shuffle_epi8(_mm256_permute2x128_si256(l0, l1, 0x20),
+                                             _mm256_and_si256(c, low4));
+            __m256i hi = _mm256_shuffle_epi8(_mm256_permute2x128_si256(l0, l1, 0x31),
+                                             _mm256_and_si256(_mm256_srli_epi16(c, 4), low4));
+
+            wa = _mm256_add_epi16(wa, _mm256_add_epi16(_mm256_unpacklo_epi8(lo, zero),
+                                                       _mm256_unpacklo_epi8(hi, zero)));
+            wb = _mm256_add_epi16(wb, _mm256_add_epi16(_mm256_unpackhi_epi8(lo, zero),
+                                                       _mm256_unpackhi_epi8(hi, zero)));
+        }
+
+        a = _mm_add_epi16(_mm256_castsi256_si128(wa), _mm256_extracti128_si256(wa, 1));
+        b = _mm_add_epi16(_mm256_castsi256_si128(wb), _mm256_extracti128_si256(wb, 1));
+#endif
+
+        for (; k < rows; k++) {
+            pq4_row_128(block + k * 16, lut + 2 * k * 16, a, b);
+        }
+
+        _mm_storeu_si128((__m128i*) (dist + blk * 16), a);
+        _mm_storeu_si128((__m128i*) (dist + blk * 16 + 8), b);
+    }
+}
+
+// unsigned 16 bit lanes
+#if defined(__AVX512BW__)
+typedef __m512i vu16;
+#define VU16_LANES 32
+static inline vu16 vu16_set1(uint16_t x) { return _mm512_set1_epi16(x); }
+static inline vu16 vu16_loadu(const uint16_t *p) { return _mm512_loadu_si512(p); }
+static inline void vu16_storeu(uint16_t *p, vu16 a) { _mm512_storeu_si512(p, a); }
+static inline vu16 vu16_load_u8(const uint8_t *p) {
+    return _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*) p));
+}
+static inline vu16 vu16_add(vu16 a, vu16 b) { return _mm512_add_epi16(a, b); }
+static inline vu16 vu16_sub(vu16 a, vu16 b) { return _mm512_sub_epi16(a, b); }
+static inline vu16 vu16_adds(vu16 a, vu16 b) { return _mm512_adds_epu16(a, b); }
+static inline vu16 vu16_min(vu16 a, vu16 b) { return _mm512_min_epu16(a, b); }
+static inline uint16_t vu16_hmin(vu16 a) {
+    __m256i h = _mm256_min_epu16(_mm512_castsi512_si256(a), _mm512_extracti64x4_epi64(a, 1));
+    __m128i q = _mm_min_epu16(_mm256_castsi256_si128(h), _mm256_extracti128_si256(h, 1));
+    return (uint16_t) _mm_cvtsi128_si32(_mm_minpos_epu16(q));
+}
+#elif defined(__AVX2__)
+typedef __m256i vu16;
+#define VU16_LANES 16
+static inline vu16 vu16_set1(uint16_t x) { return _mm256_set1_epi16(x); }
+static inline vu16 vu16_loadu(const uint16_t *p) { return _mm256_loadu_si256((const __m256i*) p); }
+static inline void vu16_storeu(uint16_t *p, vu16 a) { _mm256_storeu_si256((__m256i*) p, a); }
+static inline vu16 vu16_load_u8(const uint8_t *p) {
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) p));
+}
+static inline vu16 vu16_add(vu16 a, vu16 b) { return _mm256_add_epi16(a, b); }
+static inline vu16 vu16_sub(vu16 a, vu16 b) { return _mm256_sub_epi16(a, b); }
+static inline vu16 vu16_adds(vu16 a, vu16 b) { return _mm256_adds_epu16(a, b); }
+static inline vu16 vu16_min(vu16 a, vu16 b) { return _mm256_min_epu16(a, b); }
+static inline uint16_t vu16_hmin(vu16 a) {
+    __m128i q = _mm_min_epu16(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1));
+    return (uint16_t) _mm_cvtsi128_si32(_mm_minpos_epu16(q));
+}
+#else
+typedef __m128i vu16;
+#define VU16_LANES 8
+static inline vu16 vu16_set1(uint16_t x) { return _mm_set1_epi16(x); }
+static inline vu16 vu16_loadu(const uint16_t *p) { return _mm_loadu_si128((const __m128i*) p); }
+static inline void vu16_storeu(uint16_t *p, vu16 a) { _mm_storeu_si128((__m128i*) p, a); }
+static inline vu16 vu16_load_u8(const uint8_t *p) {
+    return _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*) p));
+}
+static inline vu16 vu16_add(vu16 a, vu16 b) { return _mm_add_epi16(a, b); }
+static inline vu16 vu16_sub(vu16 a, vu16 b) { return _mm_sub_epi16(a, b); }
+static inline vu16 vu16_adds(vu16 a, vu16 b) { return _mm_adds_epu16(a, b); }
+static inline vu16 vu16_min(vu16 a, vu16 b) { return _mm_min_epu16(a, b); }
+static inline uint16_t vu16_hmin(vu16 a) {
+    return (uint16_t) _mm_cvtsi128_si32(_mm_minpos_epu16(a));
+}
+#endif
+
+static uint16_t sgm_step(const uint8_t *cost, const uint16_t *prev,
+                         uint16_t prev_min, uint16_t p1, uint16_t p2,
+                         size_t n, uint16_t *cur, uint16_t *sum) {
+    uint16_t jump = prev_min + p2 > 0xffff ? 0xffff : prev_min + p2;
+    size_t d = 0;
+
+    // neighbor disparities are unaligned loads shifted by one lane
+    const vu16 vp1 = vu16_set1(p1);
+    const vu16 vjump = vu16_set1(jump);
+    const vu16 vprev_min = vu16_set1(prev_min);
+    vu16 vmin = vu16_set1(0xffff);
+
+    for (; d + VU16_LANES <= n; d += VU16_LANES) {
+        vu16 m = vu16_min(vu16_loadu(prev + d),
+                          vu16_min(vu16_adds(vu16_loadu(prev + d - 1), vp1),
+                                   vu16_adds(vu16_loadu(prev + d + 1), vp1)));
+        m = vu16_min(m, vjump);
+
+        vu16 c = vu16_add(vu16_load_u8(cost + d), vu16_sub(m, vprev_min));
+        vu16_storeu(cur + d, c);
+        vu16_storeu(sum + d, vu16_adds(vu16_loadu(sum + d), c));
+        vmin = vu16_min(vmin, c);
+    }
+
+    uint16_t min_cur = vu16_hmin(vmin);
+
+    for (; d < n; d++) {
+        uint32_t m = prev[d];
+        uint32_t l = (uint32_t) prev[d - 1] + p1;
+        uint32_t r = (uint32_t) prev[d + 1] + p1;
+        m = l < m ? l : m;
+        m = r < m ? r : m;
+        m = jump < m ? jump : m;
+        cur[d] = cost[d] + (m - prev_min);
+        uint32_t s = (uint32_t) sum[d] + cur[d];
+        sum[d] = s > 0xffff ? 0xffff : s;
+        min_cur = cur[d] < min_cur ? cur[d] : min_cur;
+    }
+
+    return min_cur;
+}
+
+} // namespace
+
+#define SIMD_KERNELS_TABLE(level, name) {       \
+        level, name,                            \
+        l2_sqr_f32,                             \
+        l2_sqr_u8,                              \
+        l2_sqr_f16,                             \
+        f32_to_f16,                             \
+        f16_to_f32,                             \
+        sampson_error,                          \
+        sampson_count_lanes,                    \
+        haversine_batch,                        \
+        warp_row_bilinear_u8,                   \
+        bgr_to_gray_u8,                         \
+        pq4_scan,                               \
+        sgm_step                                \
+    }
+
+#endif // !SIMD_KERNELS_IMPL_HPP
@@ -0,0 +1,23 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// sse42 kernels, built with the matching -m flags (see CMakeLists.txt)
+
+#include "simd_kernels.h"
+
+#if defined(__SSE4_2__)
+
+#include "simd_kernels_impl.hpp"
+
+static const SimdKernels kernels = SIMD_KERNELS_TABLE(SIMD_SSE42, "sse42");
+
+const SimdKernels* simd_kernels_sse42() {
+    return &kernels;
+}
+
+#else
+
+const SimdKernels* simd_kernels_sse42() {
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,435 @@
+/* Copyright 2014 Matthieu Tourne */
+
+#include <fstream>
+
+#include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "stereo.h"
+#include "image.h"
+#include "metrics.h"
+#include "simd_kernels.h"
+#include "util.h"
+
+// census of a 5x5 window, center excluded
+#define SGM_MAX_COST 24
+
+static void census_5x5(const Mat& img, Mat& census) {
+    census = Mat::zeros(img.size(), CV_32S);
+
+    for (int y = 2; y < img.rows - 2; y++) {
+        uint32_t *out = census.ptr<uint32_t>(y);
+        for (int x = 2; x < img.cols - 2; x++) {
+            uint8_t center = img.at<uint8_t>(y, x);
+            uint32_t bits = 0;
+            for (int dy = -2; dy <= 2; dy++) {
+                const uint8_t *row = img.ptr<uint8_t>(y + dy);
+                for (int dx = -2; dx <= 2; dx++) {
+                    if (dx || dy) {
+                        bits = (bits << 1) | (row[x + dx] < center);
+                    }
+                }
+            }
+            out[x] = bits;
+        }
+    }
+}
+
+// matching cost of every pixel of a row and disparity
+static void cost_row(const uint32_t *left, const uint32_t *right,
+                     int cols, int disparities, uint8_t *cost) {
+    for (int x = 0; x < cols; x++) {
+        uint8_t *c = cost + x * disparities;
+        int valid = std::min(x + 1, disparities);
+        for (int d = 0; d < valid; d++) {
+            c[d] = __builtin_popcount(left[x] ^ right[x - d]);
+        }
+        for (int d = valid; d < disparities; d++) {
+            c[d] = SGM_MAX_COST;
+        }
+    }
+}
+
+// costs of one path, for the previous and current step. Each pixel has
+// disparities + 2 entries, the guards around its costs stay at 0xffff.
+struct SgmPath {
+    void init(size_t pixels, size_t stride) {
+        prev.assign(pixels * stride, 0xffff);
+        cur = prev;
+        prev_min.assign(pixels, 0);
+        cur_min = prev_min;
+    }
+
+    void swap() {
+        prev.swap(cur);
+        prev_min.swap(cur_min);
+    }
+
+    vector<uint16_t>    prev;
+    vector<uint16_t>    cur;
+    vector<uint16_t>    prev_min;
+    vector<uint16_t>    cur_min;
+};
+
+// the 4 paths coming from above (dir 1) or below (dir -1), summed into
+// the costs of rows [y0, y1)
+static void aggregate_pass(const Mat& census_l, const Mat& census_r,
+                           int y0, int y1, int dir, int disparities,
+                           const StereoOptions& options, vector<uint16_t>& sum) {
+    const SimdKernels& kernels = simd_kernels();
+    const int cols = census_l.cols;
+    const size_t stride = disparities + 2;
+    const uint16_t p1 = options.p1;
+    const uint16_t p2 = options.p2;
+
+    vector<uint8_t> cost(cols * disparities);
+
+    // paths start from 0 costs
+    vector<uint16_t> start(stride, 0);
+    start[0] = start[stride - 1] = 0xffff;
+
+    // along the row, and from the 3 neighbors of the previous row
+    SgmPath along;
+    along.init(1, stride);
+    SgmPath paths[3];
+    for (int k = 0; k < 3; k++) {
+        paths[k].init(cols, stride);
+    }
+
+    const int first = dir > 0 ? y0 : y1 - 1;
+    const int last = dir > 0 ? y1 : y0 - 1;
+    for (int y = first; y != last; y += dir) {
+        cost_row(census_l.ptr<uint32_t>(y), census_r.ptr<uint32_t>(y),
+                 cols, disparities, &cost[0]);
+        uint16_t *sum_row = &sum[(size_t) (y - y0) * cols * disparities];
+
+        const int x0 = dir > 0 ? 0 : cols - 1;
+        const int x1 = dir > 0 ? cols : -1;
+        for (int x = x0; x != x1; x += dir) {
+            const uint8_t *c = &cost[x * disparities];
+            uint16_t *s = sum_row + x * disparities;
+
+            bool none = x == x0;
+            along.cur_min[0] = kernels.sgm_step(c, none ? &start[1] : &along.prev[1],
+                                                none ? 0 : along.prev_min[0], p1, p2,
+                                                disparities, &along.cur[1], s);
+            along.swap();
+
+            for (int k = 0; k < 3; k++) {
+                SgmPath& path = paths[k];
+                int px = x + k - 1;
+                none = y == first || px < 0 || px >= cols;
+                path.cur_min[x] = kernels.sgm_step(
+                    c, none ? &start[1] : &path.prev[px * stride + 1],
+                    none ? 0 : path.prev_min[px], p1, p2,
+                    disparities, &path.cur[x * stride + 1], s);
+            }
+        }
+
+        for (int k = 0; k < 3; k++) {
+            paths[k].swap();
+        }
+    }
+}
+
+// disparities of rows [core0, core1), aggregated over the tile grown by
+// the overlap
+static void sgm_tile(const Mat& census_l, const Mat& census_r,
+                     int core0, int core1, int disparities,
+                     const StereoOptions& options, Mat& disparity) {
+    const int cols = census_l.cols;
+    const int y0 = std::max(0, core0 - options.tile_overlap);
+    const int y1 = std::min(census_l.rows, core1 + options.tile_overlap);
+
+    vector<uint16_t> sum((size_t) (y1 - y0) * cols * disparities, 0);
+    aggregate_pass(census_l, census_r, y0, y1, 1, disparities, options, sum);
+    aggregate_pass(census_l, census_r, y0, y1, -1, disparities, options, sum);
+
+    vector<int> right(cols);
+    for (int y = core0; y < core1; y++) {
+        const uint16_t *sum_row = &sum[(size_t) (y - y0) * cols * disparities];
+
+        // disparities of the right image, from the same costs
+        for (int xr = 0; xr < cols; xr++) {
+            uint16_t best = 0xffff;
+            right[xr] = -1;
+            for (int d = 0; d < disparities && xr + d < cols; d++) {
+                uint16_t v = sum_row[(xr + d) * disparities + d];
+                if (v < best) {
+                    best = v;
+                    right[xr] = d;
+                }
+            }
+        }
+
+        float *out = disparity.ptr<float>(y);
+        for (int x = 0; x < cols; x++) {
+            const uint16_t *s = sum_row + x * disparities;
+            int valid = std::min(x + 1, disparities);
+            out[x] = -1;
+
+            int d = 0;
+            for (int i = 1; i < valid; i++) {
+                if (s[i] < s[d]) {
+                    d = i;
+                }
+            }
+
+            // unique, away from its neighbors
+            bool unique = true;
+            for (int i = 0; i < valid && unique; i++) {
+                if (abs(i - d) > 1 &&
+                    s[d] * 100 > s[i] * (100 - options.uniqueness)) {
+                    unique = false;
+                }
+            }
+            if (!unique || abs(right[x - d] - d) > 1) {
+                continue;
+            }
+
+            float subpixel = d;
+            if (d > 0 && d < valid - 1) {
+                int denom = s[d - 1] + s[d + 1] - 2 * s[d];
+                if (denom > 0) {
+                    subpixel += (s[d - 1] - s[d + 1]) / (2.0f * denom);
+                }
+            }
+            out[x] = subpixel;
+        }
+    }
+}
+
+void sgm_disparity(const Mat& left, const Mat& right,
+                   const StereoOptions& options, Mat& disparity) {
+    assert(left.type() == CV_8U && right.type() == CV_8U &&
+           left.size() == right.size());
+
+    int disparities = (std::max(options.disparities, 16) + 15) / 16 * 16;
+    int tile_rows = std::max(1, options.tile_rows);
+
+    Mat census_l, census_r;
+    census_5x5(left, census_l);
+    census_5x5(right, census_r);
+
+    disparity.create(left.size(), CV_32F);
+
+    size_t tiles = (left.rows + tile_rows - 1) / tile_rows;
+    parallel_for_index(tiles, [&](size_t t, int) {
+            int core0 = t * tile_rows;
+            int core1 = std::min(left.rows, core0 + tile_rows);
+            sgm_tile(census_l, census_r, core0, core1, disparities, options, disparity);
+        }, options.threads);
+}
+
+// relative pose of the second camera (x2 = R x1 + t) among the 4
+// decompositions of E, the one with most points in front of both cameras
+static bool recover_pose(const Mat& E, const Mat& K1, const Mat& K2,
+                         const vector<Point2f>& pts1, const vector<Point2f>& pts2,
+                         Mat& R, Mat& t) {
+    SVD svd(E);
+    Mat U = svd.u, Vt = svd.vt;
+    // E is known up to its sign, keep proper rotations
+    if (determinant(U) < 0) {
+        U = -U;
+    }
+    if (determinant(Vt) < 0) {
+        Vt = -Vt;
+    }
+
+    Mat W = (Mat_<double>(3, 3) << 0, -1, 0, 1, 0, 0, 0, 0, 1);
+    Mat rotations[2] = { U * W * Vt, U * W.t() * Vt };
+
+    size_t n = pts1.size();
+    Mat x1(2, n, CV_64F), x2(2, n, CV_64F);
+    for (size_t i = 0; i < n; i++) {
+        x1.at<double>(0, i) = pts1[i].x;
+        x1.at<double>(1, i) = pts1[i].y;
+        x2.at<double>(0, i) = pts2[i].x;
+        x2.at<double>(1, i) = pts2[i].y;
+    }
+
+    Mat P1 = K1 * Mat::eye(3, 4, CV_64F);
+    size_t best = 0;
+    for (int r = 0; r < 2; r++) {
+        for (int sign = -1; sign <= 1; sign += 2) {
+            Mat tr = sign * U.col(2);
+            Mat Rt;
+            hconcat(rotations[r], tr, Rt);
+            Mat P2 = K2 * Rt;
+
+            Mat X;
+            triangulatePoints(P1, P2, x1, x2, X);
+            X.convertTo(X, CV_64F);
+
+            size_t front = 0;
+            for (size_t i = 0; i < n; i++) {
+                double w = X.at<double>(3, i);
+                if (w == 0) {
+                    continue;
+                }
+                Mat p = X(Rect(i, 0, 1, 3)) / w;
+                Mat p2 = rotations[r] * p + tr;
+                front += p.at<double>(2) > 0 && p2.at<double>(2) > 0;
+            }
+
+            if (front > best) {
+                best = front;
+                R = rotations[r];
+                t = tr;
+            }
+        }
+    }
+
+    LOG(DEBUG) << "Pose: " << best << " / " << n << " points in front";
+    return best > n / 2;
+}
+
+bool dense_pair(ImagePair& pair, const StereoOptions& options,
+                DensePoints& dense) {
+    dense.points.clear();
+    dense.gray.clear();
+
+    Image::ptr image1 = pair.first();
+    Image::ptr image2 = pair.second();
+    ImageFeaturesPtr features1 = image1->get_image_features();
+    ImageFeaturesPtr features2 = image2->get_image_features();
+
+    Mat F = pair.get_F();
+    Mat K1, K2;
+    image1->get_camera_matrix().convertTo(K1, CV_64F);
+    image2->get_camera_matrix().convertTo(K2, CV_64F);
+    if (F.empty() || K1.empty() || K2.empty() || !features1 || !features2) {
+        LOG(ERROR) << "Dense stereo needs F, the camera matrices and the features";
+        return false;
+    }
+
+    Matches inliers;
+    vector<Point2f> pts1, pts2;
+    if (!get_putative_matches(pair.get_matches(), pair.get_inliers(), inliers)) {
+        return false;
+    }
+    matches2points(inliers, *features1, *features2, pts1, pts2);
+
+    Mat E = K2.t() * F * K1;
+    Mat R, t;
+    if (!recover_pose(E, K1, K2, pts1, pts2, R, t)) {
+        LOG(ERROR) << "Can't recover the pose of the pair";
+        return false;
+    }
+
+    // rectify at the reduced size
+    Mat gray1 = image1->get_image_gray();
+    Mat gray2 = image2->get_image_gray();
+    double scale = std::min(1.0, options.max_size /
+                            (double) std::max(gray1.cols, gray1.rows));
+    Mat small1, small2;
+    resize(gray1, small1, Size(), scale, scale, INTER_AREA);
+    resize(gray2, small2, Size(), scale, scale, INTER_AREA);
+
+    Mat S = Mat::eye(3, 3, CV_64F);
+    S.at<double>(0, 0) = scale;
+    S.at<double>(1, 1) = scale;
+    K1 = S * K1;
+    K2 = S * K2;
+
+    Size size = small1.size();
+    Mat R1, R2, P1, P2, Q;
+    stereoRectify(K1, Mat(), K2, Mat(), size, R, t, R1, R2, P1, P2, Q,
+                  CALIB_ZERO_DISPARITY, 0);
+
+    Mat map_x, map_y, rect1, rect2;
+    initUndistortRectifyMap(K1, Mat(), R1, P1, size, CV_32FC1, map_x, map_y);
+    remap(small1, rect1, map_x, map_y, INTER_LINEAR);
+    initUndistortRectifyMap(K2, Mat(), R2, P2, size, CV_32FC1, map_x, map_y);
+    remap(small2, rect2, map_x, map_y, INTER_LINEAR);
+
+    // epipolar lines along the rows, matches of the second image at x - d
+    bool vertical = fabs(P2.at<double>(1, 3)) > fabs(P2.at<double>(0, 3));
+    bool flipped = (vertical ? P2.at<double>(1, 3) : P2.at<double>(0, 3)) > 0;
+
+    Mat left = vertical ? Mat(rect1.t()) : rect1.clone();
+    Mat right = vertical ? Mat(rect2.t()) : rect2.clone();
+    if (flipped) {
+        flip(left, left, 1);
+        flip(right, right, 1);
+    }
+
+    Mat disparity;
+    sgm_disparity(left, right, options, disparity);
+
+    if (flipped) {
+        flip(disparity, disparity, 1);
+    }
+    if (vertical) {
+        disparity = disparity.t();
+    }
+
+    // back to the frame of the first camera
+    Mat R1t = R1.t();
+    const double *q = Q.ptr<double>();
+    const double *r = R1t.ptr<double>();
+    for (int y = 0; y < disparity.rows; y++) {
+        const float *row = disparity.ptr<float>(y);
+        for (int x = 0; x < disparity.cols; x++) {
+            if (row[x] <= 0) {
+                continue;
+            }
+
+            double v[4] = { (double) x, (double) y, flipped ? -row[x] : row[x], 1 };
+            double X[4];
+            for (int i = 0; i < 4; i++) {
+                X[i] = q[4 * i] * v[0] + q[4 * i + 1] * v[1] +
+                    q[4 * i + 2] * v[2] + q[4 * i + 3] * v[3];
+            }
+            if (X[3] == 0) {
+                continue;
+            }
+
+            double p[3];
+            for (int i = 0; i < 3; i++) {
+                p[i] = (r[3 * i] * X[0] + r[3 * i + 1] * X[1] + r[3 * i + 2] * X[2]) / X[3];
+            }
+            if (p[2] <= 0) {
+                continue;
+            }
+
+            dense.points.push_back(Point3f(p[0], p[1], p[2]));
+            dense.gray.push_back(rect1.at<uint8_t>(y, x));
+        }
+    }
+
+    LOG(INFO) << "Dense pair: " << dense.points.size() << " points, "
+              << disparity.cols << "x" << disparity.rows << " disparities";
+    Metrics::instance().add("stereo.pairs");
+    Metrics::instance().add("stereo.points", dense.points.size());
+
+    return true;
+}
+
+bool write_ply(const string& filename, const DensePoints& dense) {
+    std::ofstream out(filename.c_str());
+    if (!out) {
+        LOG(ERROR) << "Can't write " << filename;
+        return false;
+    }
+
+    out << "ply" << endl
+        << "format ascii 1.0" << endl
+        << "element vertex " << dense.points.size() << endl
+        << "property float x" << endl
+        << "property float y" << endl
+        << "property float z" << endl
+        << "property uchar red" << endl
+        << "property uchar green" << endl
+        << "property uchar blue" << endl
+        << "end_header" << endl;
+
+    for (size_t i = 0; i < dense.points.size(); i++) {
+        const Point3f& p = dense.points[i];
+        int g = dense.gray[i];
+        out << p.x << " " << p.y << " " << p.z << " "
+            << g << " " << g << " " << g << "\n";
+    }
+
+    return out.good();
+}
@@ -0,0 +1,82 @@
+/* Copyright 2014 Matthieu Tourne */
+
+// Dense stereo of verified image pairs, on the CPU.
+//
+//  [1] H. Hirschmuller, "Stereo processing by semiglobal matching and
+//    mutual information", TPAMI 2008.
+//
+// The relative pose of a pair comes from its F matrix and the camera
+// matrices (E = K2' F K1, the decomposition in front of both cameras for
+// most inliers), both images are rectified at a reduced size, then:
+//  - matching cost: Hamming distance of 5x5 census transforms,
+//  - 8 path semi-global aggregation, one sgm_step kernel call per pixel
+//    and path (SIMD over the disparities, see simd_kernels.h),
+//  - winner takes all with a uniqueness ratio, sub pixel parabola fit
+//    and a left-right consistency check.
+//
+// The aggregated cost volume is never held whole: rows are processed in
+// tiles of tile_rows, grown by tile_overlap rows on each side so the
+// vertical paths settle, and tiles run in parallel. Memory is about
+// threads x (tile_rows + 2 x tile_overlap) x width x disparities x 2
+// bytes.
+//
+// Points are in the frame of the first camera, the baseline of the pair
+// being the unit length.
+
+#ifndef STEREO_H
+#define STEREO_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "photogram.h"
+#include "image_pairs.h"
+
+struct StereoOptions {
+    StereoOptions()
+        : disparities(128), p1(8), p2(96), uniqueness(10),
+          max_size(1024), tile_rows(32), tile_overlap(16), threads(0)
+    {};
+
+    // disparity range searched, rounded up to a multiple of 16
+    int     disparities;
+
+    // penalties of disparity changes of 1, and more
+    int     p1;
+    int     p2;
+
+    // percent the best cost must beat the second best by
+    int     uniqueness;
+
+    // larger side of the rectified images
+    int     max_size;
+
+    // aggregation tiles
+    int     tile_rows;
+    int     tile_overlap;
+
+    int     threads;
+};
+
+// dense points of a pair and the gray level they were seen with
+struct DensePoints {
+    vector<Point3f>     points;
+    vector<uint8_t>     gray;
+};
+
+// disparity of each pixel of left in right (x - d), rectified 8 bit
+// gray images of the same size. CV_32F, -1 where unknown.
+void sgm_disparity(const Mat& left, const Mat& right,
+                   const StereoOptions& options, Mat& disparity);
+
+// rectify, match and triangulate a verified pair, false if its pose
+// can't be recovered
+bool dense_pair(ImagePair& pair, const StereoOptions& options,
+                DensePoints& dense);
+
+// ascii PLY, gray as the color of the vertices
+bool write_ply(const string& filename, const DensePoints& dense);
+
+#endif // !STEREO_H
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+
+#include "photogram.h"
+#include "async_io.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// every backend and fsync policy writes whole files and coalesced
+// appends back as they were given, a file that can't be opened fails
+// the next flush only
+
+static string read_file(const string& path) {
+    std::ifstream is(path.c_str(), std::ios::binary);
+    std::stringstream ss;
+    ss << is.rdbuf();
+    return ss.str();
+}
+
+int main() {
+    int errors = 0;
+
+    char tmpl[] = "/tmp/test_async_io.XXXXXX";
+    string dir = mkdtemp(tmpl);
+
+    AsyncIoBackend backends[] = { ASYNC_IO_AUTO, ASYNC_IO_URING, ASYNC_IO_THREADS,
+                                  ASYNC_IO_SYNC };
+    FsyncPolicy policies[] = { FSYNC_NONE, FSYNC_FILE, FSYNC_FLUSH };
+
+    for (AsyncIoBackend backend : backends) {
+        for (FsyncPolicy policy : policies) {
+            AsyncIoOptions options;
+            options.backend = backend;
+            options.fsync = policy;
+            options.queue_depth = 8;
+            options.coalesce_bytes = 1000;
+
+            string name = std::to_string(backend) + "_" + std::to_string(policy);
+            string expected_log;
+            vector<string> contents;
+            {
+                AsyncWriter writer(options);
+
+                // more files than the queue depth, some large
+                for (int i = 0; i < 50; i++) {
+                    string data(i % 10 == 0 ? 3 << 20 : 100 + i, 'a' + i % 26);
+                    contents.push_back(data);
+                    writer.write_file(dir + "/" + name + "_" + std::to_string(i), data);
+                }
+
+                for (int i = 0; i < 500; i++) {
+                    string record = std::to_string(i) + ",";
+                    expected_log += record;
+                    writer.append(dir + "/" + name + "_log", record.data(), record.size());
+                }
+
+                if (!writer.flush()) {
+                    LOG(ERROR) << name << ": flush failed";
+                    errors++;
+                }
+
+                // appends go on after a flush
+                writer.append(dir + "/" + name + "_log", "end", 3);
+                expected_log += "end";
+
+                writer.write_file(dir + "/missing/file", "x");
+                if (writer.flush()) {
+                    LOG(ERROR) << name << ": unopened file not reported";
+                    errors++;
+                }
+                if (!writer.flush()) {
+                    LOG(ERROR) << name << ": error reported twice";
+                    errors++;
+                }
+            }
+
+            for (size_t i = 0; i < contents.size(); i++) {
+                if (read_file(dir + "/" + name + "_" + std::to_string(i)) != contents[i]) {
+                    LOG(ERROR) << name << ": file " << i << " differs";
+                    errors++;
+                }
+            }
+            if (read_file(dir + "/" + name + "_log") != expected_log) {
+                LOG(ERROR) << name << ": appended file differs";
+                errors++;
+            }
+        }
+    }
+
+    string cleanup = "rm -rf " + dir;
+    if (system(cleanup.c_str()) != 0) {
+        LOG(ERROR) << "can't remove " << dir;
+    }
+
+    if (errors) {
+        printf("%d errors\n", errors);
+        return 1;
+    }
+
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <random>
+#include <sstream>
+
+#include "photogram.h"
+#include "autotune.h"
+#include "features2d.h"
+#include "simd_kernels.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// autotune picks a configuration, keeps the settings out of its grid,
+// and the second run reads the same choice from the cache
+
+int main() {
+    const size_t images = 3, count = 1000;
+    int errors = 0;
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(0, 1);
+
+    vector<ImageFeaturesPtr> features;
+    for (size_t i = 0; i < images; i++) {
+        vector<float> desc(count * SIFT_DIM);
+        for (size_t j = 0; j < desc.size(); j++) {
+            desc[j] = uniform(rng) * 100;
+        }
+
+        ImageFeaturesPtr f(new ImageFeatures());
+        f->keypoints.resize(count);
+        f->descriptors_f16.resize(desc.size());
+        simd_kernels().f32_to_f16(&desc[0], &f->descriptors_f16[0], desc.size());
+        features.push_back(f);
+    }
+
+    std::ostringstream dir;
+    dir << "/tmp/test_autotune." << getpid() << "/cache";
+
+    AutotuneOptions autotune;
+    autotune.target_recall = 0.8;
+    autotune.pairs = 2;
+    autotune.queries = 500;
+    autotune.cache_dir = dir.str();
+
+    MatcherOptions options;
+    options.descriptors_f16 = true;
+    options.threads = 2;
+
+    if (!autotune_matcher(features, autotune, options)) {
+        LOG(ERROR) << "autotune failed";
+        return 1;
+    }
+    string tuned = describe_matcher(options);
+    LOG(INFO) << "Tuned: " << tuned;
+
+    if (!options.descriptors_f16 || options.threads != 2) {
+        LOG(ERROR) << "settings out of the grid changed";
+        errors++;
+    }
+
+    MatcherOptions cached;
+    cached.descriptors_f16 = true;
+    cached.threads = 2;
+    if (!autotune_matcher(features, autotune, cached) ||
+        describe_matcher(cached) != tuned) {
+        LOG(ERROR) << "cached choice differs: " << describe_matcher(cached);
+        errors++;
+    }
+
+    // a single image has no pair to sample
+    vector<ImageFeaturesPtr> one(1, features[0]);
+    autotune.cache_dir = "";
+    if (autotune_matcher(one, autotune, options)) {
+        LOG(ERROR) << "autotune of a single image";
+        errors++;
+    }
+
+    string cleanup = "rm -rf /tmp/test_autotune." + std::to_string(getpid());
+    if (system(cleanup.c_str()) != 0) {
+        LOG(ERROR) << "can't remove " << dir.str();
+    }
+
+    return errors ? 1 : 0;
+}
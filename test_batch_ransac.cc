@@ -0,0 +1,96 @@
+#include <random>
+
+#include "photogram.h"
+#include "batch_ransac.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// batched RANSAC finds the true inliers of small synthetic pairs with 30%
+// outliers, gives the same result on any number of threads, and leaves
+// the pairs too small for 8 points without F
+
+// a random scene seen from two cameras, truth[i] unset for mismatches
+static void synthetic_pair(std::mt19937& rng, int n, vector<Point2f>& pts1,
+                           vector<Point2f>& pts2, vector<char>& truth) {
+    std::uniform_real_distribution<double> u(-1, 1);
+    std::normal_distribution<double> noise(0, 0.3);
+    const double f = 1000, cx = 960, cy = 540;
+
+    double yaw = 0.05 * u(rng);
+    double tx = 0.5 + 0.2 * u(rng), ty = 0.1 * u(rng), tz = 0.1 * u(rng);
+
+    for (int i = 0; i < n; i++) {
+        double X = 3 * u(rng), Y = 2 * u(rng), Z = 5 + 2 * u(rng);
+        double Xr = cos(yaw) * X + sin(yaw) * Z - tx;
+        double Yr = Y - ty;
+        double Zr = -sin(yaw) * X + cos(yaw) * Z - tz;
+
+        double x2 = f * Xr / Zr + cx, y2 = f * Yr / Zr + cy;
+        bool inlier = rng() % 100 >= 30;
+        if (!inlier) {
+            x2 = cx + 900 * u(rng);
+            y2 = cy + 500 * u(rng);
+        }
+
+        pts1.push_back(Point2f(f * X / Z + cx + noise(rng), f * Y / Z + cy + noise(rng)));
+        pts2.push_back(Point2f(x2 + noise(rng), y2 + noise(rng)));
+        truth.push_back(inlier);
+    }
+}
+
+int main() {
+    const int count = 300;
+    int errors = 0;
+
+    std::mt19937 rng(3);
+    vector<vector<Point2f> > pts1(count), pts2(count);
+    vector<vector<char> > truth(count);
+    for (int i = 0; i < count; i++) {
+        // a few pairs below 8 points
+        int n = i % 50 == 0 ? 6 : 50 + rng() % 251;
+        synthetic_pair(rng, n, pts1[i], pts2[i], truth[i]);
+    }
+
+    BatchRansacOptions options;
+    vector<Mat> F;
+    vector<vector<char> > inliers;
+    batch_fundamental(pts1, pts2, options, F, inliers);
+
+    size_t tp = 0, fp = 0, fn = 0;
+    for (int i = 0; i < count; i++) {
+        if (pts1[i].size() < 8) {
+            errors += !F[i].empty();
+            continue;
+        }
+        if (F[i].empty()) {
+            LOG(ERROR) << "no F for pair " << i;
+            errors++;
+            continue;
+        }
+        for (size_t j = 0; j < truth[i].size(); j++) {
+            tp += inliers[i][j] && truth[i][j];
+            fp += inliers[i][j] && !truth[i][j];
+            fn += !inliers[i][j] && truth[i][j];
+        }
+    }
+
+    double recall = tp / (double) (tp + fn);
+    double precision = tp / (double) (tp + fp);
+    LOG(INFO) << "recall " << recall << ", precision " << precision;
+    if (recall < 0.95 || precision < 0.99) {
+        LOG(ERROR) << "inliers not found";
+        errors++;
+    }
+
+    // hypotheses are seeded per pair
+    options.threads = 1;
+    vector<Mat> F1;
+    vector<vector<char> > inliers1;
+    batch_fundamental(pts1, pts2, options, F1, inliers1);
+    if (inliers1 != inliers) {
+        LOG(ERROR) << "results depend on the thread count";
+        errors++;
+    }
+
+    return errors ? 1 : 0;
+}
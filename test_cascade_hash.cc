@@ -0,0 +1,53 @@
+#include <random>
+
+#include "photogram.h"
+#include "cascade_hash.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// cascade hashing finds the train descriptor a noisy query comes from
+
+int main() {
+    const size_t n = 3000, dim = 128;
+    int errors = 0;
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    std::normal_distribution<float> noise(0, 8);
+
+    vector<float> train(n * dim), query(n * dim);
+    for (size_t i = 0; i < train.size(); i++) {
+        train[i] = uniform(rng) * 100;
+        query[i] = train[i] + noise(rng);
+    }
+
+    CascadeHasher hasher(dim);
+    hasher.init(&train[0], n);
+    CascadeHashes::ptr train_hashes = hasher.hash(&train[0], n);
+    CascadeHashes::ptr query_hashes = hasher.hash(&query[0], n);
+
+    // the same descriptors always hash the same
+    CascadeHashes::ptr again = hasher.hash(&train[0], n);
+    if (again->codes != train_hashes->codes ||
+        again->bucket_ids != train_hashes->bucket_ids) {
+        LOG(ERROR) << "hashing is not deterministic";
+        errors++;
+    }
+
+    vector<DMatch> matches;
+    hasher.match(*query_hashes, &query[0], *train_hashes, &train[0], 10, matches);
+
+    size_t correct = 0;
+    for (size_t i = 0; i < matches.size(); i++) {
+        correct += matches[i].queryIdx == matches[i].trainIdx;
+    }
+
+    double recall = correct / (double) n;
+    LOG(INFO) << "Cascade hashing recall@1: " << recall;
+    if (recall < 0.95) {
+        LOG(ERROR) << "recall too low";
+        errors++;
+    }
+
+    return errors ? 1 : 0;
+}
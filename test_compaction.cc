@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <random>
+
+#include "photogram.h"
+#include "compaction.h"
+#include "external_tracks.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// three images of 200 keypoints, pairs 0 - 1 (with outliers) and 1 - 2
+// (no inliers vector): only the matched keypoints are left, their
+// descriptors with them, the matches and a track table point at the same
+// keypoints as before, and a reserve keeps the strongest unmatched ones
+
+#define KEYPOINTS 200
+
+// an image with features already in memory
+class FeatureImage : public Image {
+ public:
+    FeatureImage(const string& filename, ImageFeaturesPtr image_features)
+        : Image(filename) {
+        features = image_features;
+    }
+};
+
+static DMatch match(int query, int train) {
+    DMatch m;
+    m.queryIdx = query;
+    m.trainIdx = train;
+    return m;
+}
+
+static float* descriptor_row(ImageFeatures& features, size_t i) {
+#ifdef USE_SIFT_GPU
+    return &features.descriptors[i * SIFT_DIM];
+#else
+    return features.descriptors.ptr<float>(i);
+#endif
+}
+
+// keypoint i of image is at (image * 1000 + i, i), its descriptor starts
+// with its x
+static ImageFeaturesPtr make_features(int image, std::mt19937& rng) {
+    std::uniform_real_distribution<float> response(0.01, 0.1);
+    ImageFeaturesPtr features(new ImageFeatures());
+    for (int i = 0; i < KEYPOINTS; i++) {
+        features->keypoints.push_back(image * 1000 + i, i, 2, 0);
+        features->keypoints.response.push_back(response(rng));
+    }
+
+#ifdef USE_SIFT_GPU
+    features->descriptors.assign(KEYPOINTS * SIFT_DIM, 0);
+#else
+    features->descriptors = Mat::zeros(KEYPOINTS, SIFT_DIM, CV_32F);
+#endif
+    for (int i = 0; i < KEYPOINTS; i++) {
+        descriptor_row(*features, i)[0] = image * 1000 + i;
+    }
+    return features;
+}
+
+static void make_bundle(Bundle& bundle, vector<ImageFeaturesPtr>& features) {
+    std::mt19937 rng(5);
+    vector<Image::ptr> images;
+    for (int i = 0; i < 3; i++) {
+        features.push_back(make_features(i, rng));
+        images.push_back(Image::ptr(new FeatureImage("image" + std::to_string(i) + ".jpg",
+                                                     features.back())));
+        bundle.add_image(images.back());
+    }
+
+    // 0:2i - 1:i+100, every 5th an outlier
+    Matches matches;
+    vector<char> inliers;
+    for (int i = 0; i < 50; i++) {
+        matches.push_back(match(2 * i, i + 100));
+        inliers.push_back(i % 5 != 0);
+    }
+    ImagePair pair01(images[0], images[1]);
+    pair01.set_matches(matches);
+    pair01.set_rotation(Matx33d::eye(), inliers);
+    bundle.add_pair(pair01);
+
+    // 1:i+100 - 2:199-i
+    matches.clear();
+    for (int i = 0; i < 40; i++) {
+        matches.push_back(match(i + 100, 199 - i));
+    }
+    ImagePair pair12(images[1], images[2]);
+    pair12.set_matches(matches);
+    bundle.add_pair(pair12);
+}
+
+// matches still join the same keypoints: x of the first image is
+// 1000 * image1 + query
+static int check_pair(const ImagePair& pair, int image1, int image2, size_t expected) {
+    Matches matches = pair.get_matches();
+    vector<char> inliers = pair.get_inliers();
+    if (matches.size() != expected || (!inliers.empty() && inliers.size() != expected)) {
+        LOG(ERROR) << "pair " << image1 << " - " << image2 << ": " << matches.size()
+                   << " matches";
+        return 1;
+    }
+
+    ImageFeaturesPtr features1 = pair.first()->get_image_features();
+    ImageFeaturesPtr features2 = pair.second()->get_image_features();
+    for (const DMatch& m : matches) {
+        int x1 = features1->keypoints.x[m.queryIdx] - 1000 * image1;
+        int x2 = features2->keypoints.x[m.trainIdx] - 1000 * image2;
+        bool same = image1 == 0 ? x2 == x1 / 2 + 100 : x2 == 299 - x1;
+        float descriptor = descriptor_row(*features1, m.queryIdx)[0];
+        if (!same || descriptor != features1->keypoints.x[m.queryIdx]) {
+            LOG(ERROR) << "pair " << image1 << " - " << image2 << ": match "
+                       << x1 << " - " << x2;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main() {
+    int errors = 0;
+
+    Bundle bundle;
+    vector<ImageFeaturesPtr> features;
+    make_bundle(bundle, features);
+
+    // the track table of the matches, before the compaction
+    char path[] = "/tmp/test_compaction.XXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+    ExternalTracks tracks;
+    for (size_t p = 0; p < bundle.pair_count(); p++) {
+        ImagePair pair = bundle.get_image_pair(p);
+        tracks.add_pair(p, p + 1, pair.get_matches(), pair.get_inliers());
+    }
+    size_t count = 0;
+    tracks.build(path, &count);
+
+    vector<vector<int> > remap;
+    size_t kept = compact_bundle(bundle, CompactionOptions(), &remap);
+
+    // 40 inliers in image 0, 100-139 and 8 more inliers in image 1
+    if (kept != 40 + 48 + 40 || features[0]->keypoints.size() != 40 ||
+        features[1]->keypoints.size() != 48 || features[2]->keypoints.size() != 40) {
+        LOG(ERROR) << "kept " << kept << " keypoints";
+        errors++;
+    }
+
+    errors += check_pair(bundle.get_image_pair(0), 0, 1, 40);
+    errors += check_pair(bundle.get_image_pair(1), 1, 2, 40);
+
+    if (bundle.get_image_pair(0).get_inliers_count() != 40) {
+        LOG(ERROR) << "inliers count changed";
+        errors++;
+    }
+
+    // keypoints stay in order
+    for (size_t i = 1; i < features[1]->keypoints.size(); i++) {
+        if (features[1]->keypoints.x[i] <= features[1]->keypoints.x[i - 1]) {
+            LOG(ERROR) << "keypoints out of order";
+            errors++;
+            break;
+        }
+    }
+
+    // same tracks, on the same keypoints
+    size_t remapped = 0;
+    if (!remap_track_table(path, remap, 2, &remapped) || remapped != count || count != 48) {
+        LOG(ERROR) << "remapped " << remapped << " / " << count << " tracks";
+        errors++;
+    }
+    TrackTableReader reader;
+    std::map<size_t, int> track;
+    reader.open(path);
+    while (reader.next(track)) {
+        int origin = -1;
+        for (auto it = track.begin(); it != track.end(); ++it) {
+            int x = features[it->first]->keypoints.x[it->second] - 1000 * it->first;
+            int i = it->first == 0 ? x / 2 : it->first == 1 ? x - 100 : 199 - x;
+            if (origin >= 0 && i != origin) {
+                LOG(ERROR) << "track through " << origin << " and " << i;
+                errors++;
+                break;
+            }
+            origin = i;
+        }
+    }
+
+    // image 2 gone: the tracks of 1 - 2 alone go too
+    remap[2].assign(remap[2].size(), -1);
+    if (!remap_track_table(path, remap, 2, &remapped) || remapped != 40) {
+        LOG(ERROR) << remapped << " tracks without image 2";
+        errors++;
+    }
+    unlink(path);
+
+    // a reserve of the 10 strongest unmatched keypoints
+    Bundle reserved;
+    vector<ImageFeaturesPtr> original, compacted;
+    make_bundle(reserved, compacted);
+    std::mt19937 rng(5);
+    for (int i = 0; i < 3; i++) {
+        original.push_back(make_features(i, rng));
+    }
+
+    CompactionOptions options;
+    options.reserve = 10;
+    compact_bundle(reserved, options, &remap);
+    if (compacted[0]->keypoints.size() != 50) {
+        LOG(ERROR) << "reserve: " << compacted[0]->keypoints.size() << " keypoints";
+        errors++;
+    }
+
+    // no unmatched keypoint left out is stronger than one kept
+    float weakest = 1, strongest_dropped = 0;
+    const KeypointSet& keypoints = original[0]->keypoints;
+    for (int i = 0; i < KEYPOINTS; i++) {
+        bool matched = i % 2 == 0 && i < 100 && (i / 2) % 5 != 0;
+        if (matched) {
+            continue;
+        }
+        if (remap[0][i] >= 0) {
+            weakest = std::min(weakest, keypoints.response[i]);
+        } else {
+            strongest_dropped = std::max(strongest_dropped, keypoints.response[i]);
+        }
+    }
+    if (strongest_dropped > weakest) {
+        LOG(ERROR) << "reserve kept " << weakest << ", dropped " << strongest_dropped;
+        errors++;
+    }
+
+    if (errors) {
+        printf("%d errors\n", errors);
+        return 1;
+    }
+
+    printf("ok\n");
+    return 0;
+}
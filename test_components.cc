@@ -0,0 +1,81 @@
+#include <stdio.h>
+
+#include "photogram.h"
+#include "components.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// two groups of images without a pair between them, an isolated image:
+// two sub-bundles, largest first, the isolated image dropped, and the
+// tracks of each component indexed in its own bundle
+
+static DMatch match(int query, int train) {
+    DMatch m;
+    m.queryIdx = query;
+    m.trainIdx = train;
+    return m;
+}
+
+int main() {
+    int errors = 0;
+
+    Bundle bundle;
+    vector<Image::ptr> images;
+    for (int i = 0; i < 6; i++) {
+        images.push_back(Image::ptr(new Image("image" + std::to_string(i) + ".jpg")));
+        bundle.add_image(images.back());
+    }
+
+    // 1 - 3, 3 - 5 and 0 - 4, image 2 alone
+    int edges[3][2] = { { 1, 3 }, { 3, 5 }, { 0, 4 } };
+    for (auto& edge : edges) {
+        ImagePair pair(images[edge[0]], images[edge[1]]);
+        pair.set_matches({ match(0, 0), match(1, 1) });
+        bundle.add_pair(pair);
+    }
+
+    vector<Bundle> components;
+    size_t dropped = split_components(bundle, components);
+    if (dropped != 1 || components.size() != 2) {
+        LOG(ERROR) << components.size() << " components, " << dropped << " dropped";
+        return 1;
+    }
+
+    if (components[0].image_count() != 3 || components[0].pair_count() != 2 ||
+        components[0].get_image(0) != images[1] || components[0].get_image(2) != images[5]) {
+        LOG(ERROR) << "wrong first component";
+        errors++;
+    }
+    if (components[1].image_count() != 2 || components[1].pair_count() != 1 ||
+        components[1].get_image(1) != images[4]) {
+        LOG(ERROR) << "wrong second component";
+        errors++;
+    }
+
+    // 0:0 - 1:0 - 2:0 and 0:1 - 1:1 - 2:1 in the first component
+    IncrementalTracks tracks;
+    add_bundle_pairs(components[0], tracks);
+    std::map<size_t, std::map<size_t, int> > result;
+    tracks.get_tracks(result, 3);
+    if (result.size() != 2 || result.begin()->second.count(2) != 1) {
+        LOG(ERROR) << result.size() << " tracks of length 3";
+        errors++;
+    }
+
+    // larger components only
+    ComponentOptions options;
+    options.min_images = 3;
+    split_components(bundle, components, options);
+    if (components.size() != 1 || components[0].image_count() != 3) {
+        LOG(ERROR) << components.size() << " components of 3 images";
+        errors++;
+    }
+
+    if (errors) {
+        printf("%d errors\n", errors);
+        return 1;
+    }
+
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <set>
+
+#include "photogram.h"
+#include "external_tracks.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// tracks built out of core, with chunks small enough to spill and merge
+// several runs, are the ones IncrementalTracks keeps in memory
+
+static DMatch match(int query, int train) {
+    DMatch m;
+    m.queryIdx = query;
+    m.trainIdx = train;
+    return m;
+}
+
+typedef std::set<std::map<size_t, int> > TrackSet;
+
+static bool read_table(const string& path, TrackSet& tracks) {
+    TrackTableReader reader;
+    if (!reader.open(path)) {
+        return false;
+    }
+
+    std::map<size_t, int> track;
+    while (reader.next(track)) {
+        tracks.insert(track);
+    }
+    return tracks.size() == reader.track_count();
+}
+
+int main() {
+    int errors = 0;
+
+    char tmpl[] = "/tmp/test_external_tracks.XXXXXX";
+    string dir = mkdtemp(tmpl);
+    string table = dir + "/tracks.bin";
+
+    ExternalTracksOptions options;
+    options.directory = dir;
+    options.chunk_edges = 5;
+
+    // same example as test_ingest: 0:1 - 2:0 makes a conflict
+    {
+        ExternalTracks tracks(options);
+        Matches matches01 = { match(0, 0), match(1, 1), match(3, 2) };
+        Matches matches12 = { match(0, 0), match(1, 6) };
+        tracks.add_pair(0, 1, matches01, vector<char>(3, 1));
+        tracks.add_pair(1, 2, matches12, { 1, 0 });
+        tracks.add_pair(0, 2, { match(1, 0) }, vector<char>());
+
+        size_t count = 0;
+        TrackSet result;
+        if (!tracks.build(table, &count) || !read_table(table, result) ||
+            count != 1 || result.size() != 1 ||
+            *result.begin() != std::map<size_t, int>({ { 0, 3 }, { 1, 2 } })) {
+            LOG(ERROR) << "conflicting track kept, " << count << " tracks";
+            errors++;
+        }
+    }
+
+    // random matches between 12 images, some outliers
+    struct Pair {
+        size_t          image1, image2;
+        Matches         matches;
+        vector<char>    inliers;
+    };
+
+    RNG rng(7);
+    vector<Pair> pairs;
+    for (size_t image1 = 0; image1 < 12; image1++) {
+        for (size_t image2 = image1 + 1; image2 < 12 && image2 < image1 + 4; image2++) {
+            Pair pair;
+            pair.image1 = image1;
+            pair.image2 = image2;
+            for (int i = 0; i < 20; i++) {
+                pair.matches.push_back(match(rng.uniform(0, 60), rng.uniform(0, 60)));
+                pair.inliers.push_back(rng.uniform(0, 4) != 0);
+            }
+            pairs.push_back(pair);
+        }
+    }
+
+    for (size_t min_length = 2; min_length <= 3; min_length++) {
+        IncrementalTracks reference;
+        options.min_length = min_length;
+        ExternalTracks tracks(options);
+        for (const Pair& pair : pairs) {
+            reference.add_pair(pair.image1, pair.image2, pair.matches, pair.inliers);
+            tracks.add_pair(pair.image1, pair.image2, pair.matches, pair.inliers);
+        }
+
+        std::map<size_t, std::map<size_t, int> > reference_tracks;
+        reference.get_tracks(reference_tracks, min_length);
+        TrackSet expected;
+        for (auto& track : reference_tracks) {
+            expected.insert(track.second);
+        }
+
+        TrackSet result;
+        if (!tracks.build(table) || !read_table(table, result)) {
+            LOG(ERROR) << "can't build the tracks";
+            errors++;
+        } else if (result != expected) {
+            LOG(ERROR) << "min length " << min_length << ": " << result.size()
+                       << " tracks, expected " << expected.size();
+            errors++;
+        }
+    }
+
+    string cleanup = "rm -rf " + dir;
+    if (system(cleanup.c_str()) != 0) {
+        LOG(ERROR) << "can't remove " << dir;
+    }
+
+    if (errors) {
+        printf("%d errors\n", errors);
+        return 1;
+    }
+
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <random>
+
+#include "photogram.h"
+#include "feature_codec.h"
+#include "image.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// feature files decode to the same bits, whole or block by block, for
+// uint8, float and half descriptors. SIFT like features are 2x smaller
+// than their raw arrays, and truncated files are refused. An image with
+// a feature file in MatcherOptions::features_dir reads it instead of
+// extracting.
+
+static float* descriptor_row(ImageFeatures& features, size_t i) {
+#ifdef USE_SIFT_GPU
+    return &features.descriptors[i * SIFT_DIM];
+#else
+    return features.descriptors.ptr<float>(i);
+#endif
+}
+
+// n keypoints on a 4000x3000 image, descriptors with OpenCV's SIFT
+// statistics: integers, mostly small
+static void make_features(size_t n, bool integral, bool response, ImageFeatures& features) {
+    std::mt19937 rng(n);
+    std::uniform_real_distribution<float> px(0, 4000), py(0, 3000), angle(0, 360);
+    std::lognormal_distribution<float> scale(1.0, 0.6);
+    std::geometric_distribution<int> value(0.08);
+
+    features = ImageFeatures();
+    for (size_t i = 0; i < n; i++) {
+        features.keypoints.push_back(px(rng), py(rng), scale(rng), angle(rng));
+    }
+    if (response) {
+        std::uniform_real_distribution<float> r(0.01, 0.1);
+        for (size_t i = 0; i < n; i++) {
+            features.keypoints.response.push_back(r(rng));
+        }
+    }
+
+#ifdef USE_SIFT_GPU
+    features.descriptors.resize(n * SIFT_DIM);
+#else
+    features.descriptors.create(n, SIFT_DIM, CV_32F);
+#endif
+    for (size_t i = 0; i < n; i++) {
+        float *row = descriptor_row(features, i);
+        for (int k = 0; k < SIFT_DIM; k++) {
+            row[k] = std::min(value(rng), 255);
+            if (!integral) {
+                row[k] /= 512;
+            }
+        }
+    }
+}
+
+static bool same_floats(const vector<float>& a, const float *b, size_t first, size_t n) {
+    return n == 0 || memcmp(&a[first], b, n * sizeof(float)) == 0;
+}
+
+// keypoints [first, first + n) of expected are the ones of features
+static bool same_features(const ImageFeatures& expected, ImageFeatures& features,
+                          size_t first) {
+    const KeypointSet& a = expected.keypoints;
+    const KeypointSet& b = features.keypoints;
+    size_t n = b.size();
+    if (first + n > a.size() || a.has_response() != b.has_response()) {
+        return false;
+    }
+
+    if (!same_floats(a.x, b.x.data(), first, n) || !same_floats(a.y, b.y.data(), first, n) ||
+        !same_floats(a.scale, b.scale.data(), first, n) ||
+        !same_floats(a.orientation, b.orientation.data(), first, n) ||
+        (a.has_response() && !same_floats(a.response, b.response.data(), first, n))) {
+        return false;
+    }
+
+    if (!expected.descriptors_f16.empty()) {
+        return features.descriptors_f16.size() == n * SIFT_DIM &&
+            (n == 0 || memcmp(&expected.descriptors_f16[first * SIFT_DIM],
+                              &features.descriptors_f16[0], n * SIFT_DIM * sizeof(Half)) == 0);
+    }
+
+    ImageFeatures& e = const_cast<ImageFeatures&>(expected);
+    for (size_t i = 0; i < n; i++) {
+        if (memcmp(descriptor_row(e, first + i), descriptor_row(features, i),
+                   SIFT_DIM * sizeof(float))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main() {
+    int errors = 0;
+
+    FeatureCodecOptions options;
+    options.block_size = 256;
+
+    for (size_t n : { 0, 1, 255, 256, 3000 }) {
+        for (int c = 0; c < 3; c++) {
+            bool integral = c != 1;
+            bool response = n % 2 == 1;
+            ImageFeatures features;
+            make_features(n, integral, response, features);
+            if (c == 2) {
+                // half bits, as compact_descriptors_f16() leaves them
+                std::mt19937 rng(n);
+                features.descriptors_f16.resize(n * SIFT_DIM);
+                for (Half& h : features.descriptors_f16) {
+                    h.bits = 0x2000 + rng() % 0x1800;
+                }
+            }
+            sort_features_spatially(features);
+
+            string file;
+            if (!encode_features(features, options, file)) {
+                LOG(ERROR) << n << "/" << c << ": encoding failed";
+                errors++;
+                continue;
+            }
+
+            FeatureFileReader reader;
+            ImageFeatures decoded;
+            if (!reader.open((const unsigned char*) file.data(), file.size()) ||
+                !reader.decode(decoded) || !same_features(features, decoded, 0) ||
+                decoded.keypoints.size() != n) {
+                LOG(ERROR) << n << "/" << c << ": round trip differs";
+                errors++;
+                continue;
+            }
+
+            // blocks alone, last one first
+            for (size_t b = reader.block_count(); b-- > 0; ) {
+                size_t first;
+                ImageFeatures block;
+                if (!reader.decode_block(b, first, block) || first != b * options.block_size ||
+                    !same_features(features, block, first)) {
+                    LOG(ERROR) << n << "/" << c << ": block " << b << " differs";
+                    errors++;
+                }
+            }
+
+            // every cut of the file is refused
+            for (size_t length = 0; length < file.size(); length += 1 + file.size() / 50) {
+                FeatureFileReader truncated;
+                ImageFeatures partial;
+                if (truncated.open((const unsigned char*) file.data(), length) &&
+                    truncated.decode(partial)) {
+                    LOG(ERROR) << n << "/" << c << ": truncated at " << length << " accepted";
+                    errors++;
+                    break;
+                }
+            }
+
+            size_t raw = n * (response ? 20 : 16) + n * SIFT_DIM * (c == 2 ? 2 : 4);
+            if (n == 3000 && c == 0 && file.size() * 2 > raw) {
+                LOG(ERROR) << "SIFT features only " << (double) raw / file.size()
+                           << "x smaller";
+                errors++;
+            }
+        }
+    }
+
+    // keypoints end up sorted by bands of rows, descriptors follow
+    ImageFeatures features;
+    make_features(1000, true, false, features);
+    float first_x = features.keypoints.x[0];
+    float first_y = features.keypoints.y[0];
+    float first_value = descriptor_row(features, 0)[0];
+    sort_features_spatially(features);
+    const KeypointSet& keypoints = features.keypoints;
+    for (size_t i = 1; i < keypoints.size(); i++) {
+        int band = keypoints.y[i - 1] / FEATURE_SORT_BAND;
+        int next = keypoints.y[i] / FEATURE_SORT_BAND;
+        if (next < band || (next == band && keypoints.x[i] < keypoints.x[i - 1])) {
+            LOG(ERROR) << "keypoint " << i << " out of order";
+            errors++;
+            break;
+        }
+        if (keypoints.x[i] == first_x && keypoints.y[i] == first_y &&
+            descriptor_row(features, i)[0] != first_value) {
+            LOG(ERROR) << "descriptors didn't follow their keypoints";
+            errors++;
+        }
+    }
+
+    // through a file
+    char path[] = "/tmp/test_feature_codec.XXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+    ImageFeatures read;
+    if (!write_features_file(path, features) || !read_features_file(path, read) ||
+        !same_features(features, read, 0)) {
+        LOG(ERROR) << "file round trip differs";
+        errors++;
+    }
+    unlink(path);
+
+    // an image that can't be decoded, its features from the directory
+    char directory[] = "/tmp/test_feature_codec_dir.XXXXXX";
+    if (mkdtemp(directory)) {
+        string feat = string(directory) + "/frame.feat";
+        MatcherOptions options;
+        options.features_dir = directory;
+        set_matcher_options(options);
+
+        Image image(string(directory) + "/frame.jpg");
+        ImageFeaturesPtr loaded;
+        if (write_features_file(feat, features)) {
+            loaded = image.get_image_features();
+        }
+        if (!loaded || !same_features(features, *loaded, 0)) {
+            LOG(ERROR) << "features not read from " << feat;
+            errors++;
+        }
+        set_matcher_options(MatcherOptions());
+        unlink(feat.c_str());
+        rmdir(directory);
+    }
+
+    if (errors) {
+        printf("%d errors\n", errors);
+        return 1;
+    }
+
+    printf("ok\n");
+    return 0;
+}
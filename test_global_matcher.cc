@@ -0,0 +1,90 @@
+#include <random>
+
+#include "photogram.h"
+#include "features2d.h"
+#include "global_matcher.h"
+#include "simd_kernels.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// images 0 - 1 and 2 - 3 see the same points, 4 sees nothing in common:
+// the global index votes for the two overlapping pairs only, with their
+// shared points as matches
+
+int main() {
+    const size_t images = 5, count = 400, shared = 200;
+    int errors = 0;
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    std::normal_distribution<float> noise(0, 4);
+
+    vector<vector<float> > desc(images, vector<float>(count * SIFT_DIM));
+    for (size_t i = 0; i < images; i++) {
+        for (size_t j = 0; j < desc[i].size(); j++) {
+            desc[i][j] = uniform(rng) * 100;
+        }
+    }
+    // keypoint k < shared of image 2i + 1 is keypoint k of image 2i
+    for (size_t i = 1; i < 4; i += 2) {
+        for (size_t j = 0; j < shared * SIFT_DIM; j++) {
+            desc[i][j] = desc[i - 1][j] + noise(rng);
+        }
+    }
+
+    vector<ImageFeaturesPtr> features;
+    for (size_t i = 0; i < images; i++) {
+        ImageFeaturesPtr f(new ImageFeatures());
+        f->keypoints.resize(count);
+        f->descriptors_f16.resize(count * SIFT_DIM);
+        simd_kernels().f32_to_f16(&desc[i][0], &f->descriptors_f16[0],
+                                  f->descriptors_f16.size());
+        features.push_back(f);
+    }
+    // an image without features
+    features.push_back(ImageFeaturesPtr());
+
+    GlobalMatcherOptions options;
+    options.shard_size = 2 * count;
+
+    GlobalMatcher matcher(options);
+    if (!matcher.build(features)) {
+        LOG(ERROR) << "build failed";
+        return 1;
+    }
+    if (matcher.size() != images * count || matcher.shard_count() != 3) {
+        LOG(ERROR) << "index of " << matcher.size() << " descriptors in "
+                   << matcher.shard_count() << " shards";
+        errors++;
+    }
+
+    vector<GlobalPair> pairs;
+    matcher.match(pairs);
+
+    if (pairs.size() != 2) {
+        LOG(ERROR) << "expected 2 candidate pairs, got " << pairs.size();
+        errors++;
+    }
+
+    for (size_t i = 0; i < pairs.size(); i++) {
+        const GlobalPair& pair = pairs[i];
+        if (pair.image1 % 2 || pair.image2 != pair.image1 + 1) {
+            LOG(ERROR) << "unexpected pair " << pair.image1 << " - " << pair.image2;
+            errors++;
+            continue;
+        }
+
+        size_t correct = 0;
+        for (const DMatch& m : pair.matches) {
+            correct += m.queryIdx == m.trainIdx && m.queryIdx < (int) shared;
+        }
+        LOG(INFO) << "pair " << pair.image1 << " - " << pair.image2 << ": "
+                  << pair.votes << " votes, " << correct << " correct";
+        if (correct < 0.9 * shared || correct < 0.9 * pair.votes) {
+            LOG(ERROR) << "too few correct matches";
+            errors++;
+        }
+    }
+
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,218 @@
+#include <math.h>
+
+#include <random>
+
+#include "photogram.h"
+#include "attitude.h"
+#include "gravity_ransac.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// gimbal angles are read from XMP attributes or elements inside a JPEG,
+// footprints land where the camera looks, and the 3 point RANSAC finds
+// the inliers of synthetic drone pairs with 30% outliers and noisy
+// gimbal angles
+
+static Matx33d rot_x(double a) {
+    return Matx33d(1, 0, 0, 0, cos(a), -sin(a), 0, sin(a), cos(a));
+}
+
+static Matx33d rot_y(double a) {
+    return Matx33d(cos(a), 0, sin(a), 0, 1, 0, -sin(a), 0, cos(a));
+}
+
+static Matx33d rot_z(double a) {
+    return Matx33d(cos(a), -sin(a), 0, sin(a), cos(a), 0, 0, 0, 1);
+}
+
+static double radians(double degrees) {
+    return degrees * M_PI / 180;
+}
+
+// world to camera, world y is down
+static Matx33d camera_rotation(const Attitude& attitude) {
+    return rot_z(-radians(attitude.roll)) * rot_x(radians(-attitude.pitch)) *
+        rot_y(radians(attitude.yaw));
+}
+
+// a JPEG with only an XMP segment
+static string jpeg_with_xmp(const string& xmp) {
+    string payload = string("http://ns.adobe.com/xap/1.0/") + '\0' + xmp;
+    size_t length = payload.size() + 2;
+    string jpeg = "\xFF\xD8";
+    jpeg += "\xFF\xE0";
+    jpeg += string("\x00\x04\x00\x00", 4);
+    jpeg += "\xFF\xE1";
+    jpeg += (char) (length >> 8);
+    jpeg += (char) (length & 0xFF);
+    jpeg += payload;
+    jpeg += "\xFF\xDA";
+    return jpeg;
+}
+
+// ground points at about height below camera 1, seen by both cameras
+static void synthetic_pair(std::mt19937& rng, int n, const Matx33d& K, double height,
+                           const Matx33d& R1, const Matx33d& R2, const Matx31d& C2,
+                           vector<Point2f>& pts1, vector<Point2f>& pts2,
+                           vector<char>& truth) {
+    std::uniform_real_distribution<double> u(-1, 1);
+    std::normal_distribution<double> noise(0, 0.5);
+
+    while ((int) pts1.size() < n) {
+        Matx31d X;
+        X(0) = 150 * u(rng);
+        X(1) = height + 0.1 * height * u(rng);
+        X(2) = 150 * u(rng);
+
+        Matx31d x1 = K * (R1 * X);
+        Matx31d x2 = K * (R2 * Matx31d(X(0) - C2(0), X(1) - C2(1), X(2) - C2(2)));
+        if (x1(2) <= 0 || x2(2) <= 0) {
+            continue;
+        }
+        Point2f p1(x1(0) / x1(2), x1(1) / x1(2)), p2(x2(0) / x2(2), x2(1) / x2(2));
+        if (p1.x < 0 || p1.y < 0 || p1.x > 1920 || p1.y > 1080 ||
+            p2.x < 0 || p2.y < 0 || p2.x > 1920 || p2.y > 1080) {
+            continue;
+        }
+
+        bool inlier = rng() % 100 >= 30;
+        if (!inlier) {
+            p2 = Point2f(960 + 960 * u(rng), 540 + 540 * u(rng));
+        }
+        pts1.push_back(Point2f(p1.x + noise(rng), p1.y + noise(rng)));
+        pts2.push_back(Point2f(p2.x + noise(rng), p2.y + noise(rng)));
+        truth.push_back(inlier);
+    }
+}
+
+int main() {
+    int errors = 0;
+
+    // attributes, and elements with another prefix
+    Attitude attitude;
+    string attributes = "<rdf:Description drone-dji:AbsoluteAltitude=\"+120.5\" "
+        "drone-dji:RelativeAltitude=\"+80.20\" drone-dji:GimbalRollDegree=\"+0.50\" "
+        "drone-dji:GimbalYawDegree=\"-37.40\" drone-dji:GimbalPitchDegree=\"-89.90\"/>";
+    string jpeg = jpeg_with_xmp(attributes);
+    if (!parse_xmp_attitude((const unsigned char*) jpeg.data(), jpeg.size(), attitude) ||
+        attitude.pitch != -89.9 || attitude.roll != 0.5 || attitude.yaw != -37.4 ||
+        !attitude.has_height || attitude.height != 80.2) {
+        LOG(ERROR) << "XMP attributes";
+        errors++;
+    }
+
+    string elements = "<x:GimbalPitchDegree>-45</x:GimbalPitchDegree>"
+        "<x:FlightYawDegree>12</x:FlightYawDegree>";
+    if (!parse_xmp_packet(elements, attitude) || attitude.pitch != -45 ||
+        attitude.yaw != 12 || attitude.has_height) {
+        LOG(ERROR) << "XMP elements";
+        errors++;
+    }
+
+    jpeg = jpeg_with_xmp("<rdf:Description tiff:Make=\"DJI\"/>");
+    if (parse_xmp_attitude((const unsigned char*) jpeg.data(), jpeg.size(), attitude) ||
+        parse_xmp_attitude((const unsigned char*) jpeg.data(), 3, attitude)) {
+        LOG(ERROR) << "XMP without gimbal angles";
+        errors++;
+    }
+
+    // gravity is the y axis of the world in the camera
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<double> u(-1, 1);
+    for (int i = 0; i < 20; i++) {
+        Attitude random;
+        random.pitch = -90 * (u(rng) + 1) / 2;
+        random.roll = 10 * u(rng);
+        random.yaw = 180 * u(rng);
+        Matx31d g = gravity_in_camera(random);
+        Matx31d expected = camera_rotation(random) * Matx31d(0, 1, 0);
+        if (fabs(g(0) - expected(0)) + fabs(g(1) - expected(1)) +
+            fabs(g(2) - expected(2)) > 1e-9) {
+            LOG(ERROR) << "gravity of pitch " << random.pitch << " roll " << random.roll;
+            errors++;
+        }
+    }
+
+    // footprints: below a nadir camera, ahead of a tilted one
+    Matx33d K(1000, 0, 960, 0, 1000, 540, 0, 0, 1);
+    Attitude nadir;
+    nadir.pitch = -90;
+    nadir.has_height = true;
+    nadir.height = 100;
+    Footprint footprint;
+    if (!camera_footprint(37.7, -122.4, nadir, K, footprint) ||
+        fabs(footprint.lat - 37.7) > 1e-9 || fabs(footprint.lon + 122.4) > 1e-9 ||
+        fabs(footprint.radius_km - 0.1 * hypot(0.96, 0.54)) > 1e-6) {
+        LOG(ERROR) << "nadir footprint";
+        errors++;
+    }
+    Attitude east = nadir;
+    east.pitch = -45;
+    east.yaw = 90;
+    if (!camera_footprint(37.7, -122.4, east, K, footprint) ||
+        fabs(footprint.lat - 37.7) > 1e-6 || footprint.lon <= -122.4 ||
+        fabs((footprint.lon + 122.4) * M_PI / 180 * 6371 * cos(37.7 * M_PI / 180) - 0.1) > 1e-4) {
+        LOG(ERROR) << "tilted footprint";
+        errors++;
+    }
+    east.pitch = -5;
+    if (camera_footprint(37.7, -122.4, east, K, footprint)) {
+        LOG(ERROR) << "footprint to the horizon";
+        errors++;
+    }
+
+    // drone pairs, gimbal angles off by 0.2 degrees
+    std::normal_distribution<double> imu(0, 0.2);
+    GravityRansacOptions options;
+    size_t tp = 0, fp = 0, fn = 0;
+    for (int p = 0; p < 50; p++) {
+        Attitude a1, a2;
+        a1.pitch = -90 + 20 * (u(rng) + 1) / 2;
+        a1.roll = 3 * u(rng);
+        a1.yaw = 180 * u(rng);
+        a2.pitch = -90 + 20 * (u(rng) + 1) / 2;
+        a2.roll = 3 * u(rng);
+        a2.yaw = a1.yaw + 30 * u(rng);
+        Matx31d C2(20 * u(rng), 3 * u(rng), 20 * u(rng));
+
+        vector<Point2f> pts1, pts2;
+        vector<char> truth;
+        synthetic_pair(rng, 100 + rng() % 300, K, 80, camera_rotation(a1),
+                       camera_rotation(a2), C2, pts1, pts2, truth);
+
+        Attitude m1 = a1, m2 = a2;
+        m1.pitch += imu(rng);
+        m1.roll += imu(rng);
+        m2.pitch += imu(rng);
+        m2.roll += imu(rng);
+
+        Mat F;
+        vector<char> inliers;
+        if (!find_F_gravity(pts1, pts2, K, K, gravity_in_camera(m1), gravity_in_camera(m2),
+                            options, F, inliers)) {
+            LOG(ERROR) << "pair " << p << ": no F";
+            errors++;
+            continue;
+        }
+
+        for (size_t i = 0; i < truth.size(); i++) {
+            tp += inliers[i] && truth[i];
+            fp += inliers[i] && !truth[i];
+            fn += !inliers[i] && truth[i];
+        }
+    }
+
+    double recall = tp / (double) (tp + fn), precision = tp / (double) (tp + fp);
+    if (recall < 0.85 || precision < 0.97) {
+        LOG(ERROR) << "recall " << recall << " precision " << precision;
+        errors++;
+    }
+
+    if (errors) {
+        printf("%d errors\n", errors);
+        return 1;
+    }
+
+    printf("ok\n");
+    return 0;
+}
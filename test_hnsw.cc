@@ -0,0 +1,103 @@
+#include <sstream>
+
+#include "photogram.h"
+#include "hnsw.hpp"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// HNSW recall against brute force, and serialization round trip
+
+int main() {
+    const size_t n = 5000, dim = 128, queries = 200;
+    const SimdKernels& kernels = simd_kernels();
+    int errors = 0;
+
+    // clustered data, closer to descriptors than uniform noise
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    vector<float> centers(20 * dim);
+    for (auto &v : centers) {
+        v = uniform(rng) * 100;
+    }
+
+    vector<float> data(n * dim), query(queries * dim);
+    for (size_t i = 0; i < n + queries; i++) {
+        float *v = i < n ? &data[i * dim] : &query[(i - n) * dim];
+        size_t c = rng() % 20;
+        for (size_t d = 0; d < dim; d++) {
+            v[d] = centers[c * dim + d] + uniform(rng) * 20;
+        }
+    }
+
+    HnswIndex<float> index(dim, 16, 200);
+    index.build(&data[0], n);
+
+    size_t correct = 0;
+    vector<HnswIndex<float>::Neighbor> neighbors;
+    for (size_t q = 0; q < queries; q++) {
+        index.search(&query[q * dim], 1, 64, neighbors);
+
+        float best = 1e30;
+        uint32_t best_id = 0;
+        for (size_t i = 0; i < n; i++) {
+            float d = kernels.l2_sqr_f32(&query[q * dim], &data[i * dim], dim);
+            if (d < best) {
+                best = d;
+                best_id = i;
+            }
+        }
+        correct += !neighbors.empty() && neighbors[0].second == best_id;
+    }
+
+    double recall = correct / (double) queries;
+    LOG(INFO) << "HNSW recall@1, ef 64: " << recall;
+    if (recall < 0.95) {
+        LOG(ERROR) << "recall too low";
+        errors++;
+    }
+
+    std::stringstream ss;
+    HnswIndex<float> loaded;
+    if (!index.save(ss) || !loaded.load(ss)) {
+        LOG(ERROR) << "serialization failed";
+        errors++;
+    }
+    for (size_t q = 0; q < queries; q++) {
+        vector<HnswIndex<float>::Neighbor> a, b;
+        index.search(&query[q * dim], 5, 64, a);
+        loaded.search(&query[q * dim], 5, 64, b);
+        if (a != b) {
+            LOG(ERROR) << "loaded index differs";
+            errors++;
+            break;
+        }
+    }
+
+    // truncated or corrupt files are refused
+    string saved = ss.str();
+    std::stringstream truncated(saved.substr(0, saved.size() / 2));
+    string bad_link = saved;
+    uint32_t bad_id = n + 1;
+    memcpy(&bad_link[bad_link.size() - sizeof(bad_id)], &bad_id, sizeof(bad_id));
+    std::stringstream corrupt(bad_link);
+    if (loaded.load(truncated) || loaded.size() != 0 || loaded.load(corrupt)) {
+        LOG(ERROR) << "corrupt index loaded";
+        errors++;
+    }
+
+    // uint8 descriptors find themselves
+    vector<uint8_t> data_u8(n * dim);
+    for (size_t i = 0; i < data_u8.size(); i++) {
+        data_u8[i] = std::min(255.f, data[i] * 2);
+    }
+    HnswIndex<uint8_t> index_u8(dim, 16, 100);
+    index_u8.build(&data_u8[0], n);
+    vector<HnswIndex<uint8_t>::Neighbor> found;
+    index_u8.search(&data_u8[42 * dim], 1, 32, found);
+    if (found.empty() || found[0].first != 0) {
+        LOG(ERROR) << "uint8 index doesn't find its own vectors";
+        errors++;
+    }
+
+    return errors ? 1 : 0;
+}
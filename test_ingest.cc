@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <thread>
+
+#include "photogram.h"
+#include "image.h"
+#include "ingest.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// the watcher sees files written and moved into a directory, tracks grow
+// one pair at a time and drop conflicts, new images are matched with the
+// previous ones and their gps or footprint neighbors, and a jpeg still
+// being written when the directory is listed is ingested once complete
+
+static DMatch match(int query, int train) {
+    DMatch m;
+    m.queryIdx = query;
+    m.trainIdx = train;
+    return m;
+}
+
+static Mat position(double lat, double lon) {
+    Mat coords = Mat::zeros(1, 2, CV_64F);
+    coords.at<double>(0, 0) = lat;
+    coords.at<double>(0, 1) = lon;
+    return coords;
+}
+
+int main() {
+    int errors = 0;
+
+    // watcher
+    char tmpl[] = "/tmp/test_ingest.XXXXXX";
+    string dir = mkdtemp(tmpl);
+
+    DirectoryWatcher watcher;
+    if (!watcher.open(dir)) {
+        LOG(ERROR) << "can't watch " << dir;
+        return 1;
+    }
+
+    vector<string> paths;
+    if (watcher.wait(paths, 10)) {
+        LOG(ERROR) << "events in an empty directory";
+        errors++;
+    }
+
+    std::ofstream(dir + "/a.jpg") << "a";
+    std::ofstream(dir + "/b.part") << "b";
+    rename((dir + "/b.part").c_str(), (dir + "/b.jpg").c_str());
+
+    if (!watcher.wait(paths, 1000) ||
+        std::count(paths.begin(), paths.end(), dir + "/a.jpg") != 1 ||
+        std::count(paths.begin(), paths.end(), dir + "/b.jpg") != 1) {
+        LOG(ERROR) << "new files not seen, " << paths.size() << " events";
+        errors++;
+    }
+
+    string cleanup = "rm -rf " + dir;
+    if (system(cleanup.c_str()) != 0) {
+        LOG(ERROR) << "can't remove " << dir;
+    }
+
+    // ingestor: the first bytes of a jpeg when it starts, the rest later
+    char ingest_tmpl[] = "/tmp/test_ingest.XXXXXX";
+    string ingest_dir = mkdtemp(ingest_tmpl);
+
+    Mat frame(240, 320, CV_8UC1);
+    randu(frame, Scalar(0), Scalar(255));
+    vector<uchar> jpeg;
+    imencode(".jpg", frame, jpeg);
+    string image_path = ingest_dir + "/frame.jpg";
+    std::ofstream(image_path, std::ios::binary).write((const char*) &jpeg[0], 64);
+
+    std::thread uploader([&]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(300));
+            std::ofstream(image_path, std::ios::binary).write((const char*) &jpeg[0],
+                                                              jpeg.size());
+            std::this_thread::sleep_for(std::chrono::milliseconds(300));
+            std::ofstream(ingest_dir + "/.done") << "done";
+        });
+
+    IngestOptions ingest_options;
+    ingest_options.directory = ingest_dir;
+    ingest_options.idle_timeout = 5;
+    Bundle bundle;
+    Ingestor ingestor(ingest_options, bundle,
+                      [](const ImageSource& source) {
+                          return Image::ptr(new Image(source));
+                      },
+                      [](ImagePair&, bool) {});
+    if (!ingestor.run() || bundle.image_count() != 1) {
+        LOG(ERROR) << "partial jpeg: " << bundle.image_count() << " images ingested";
+        errors++;
+    }
+    uploader.join();
+
+    cleanup = "rm -rf " + ingest_dir;
+    if (system(cleanup.c_str()) != 0) {
+        LOG(ERROR) << "can't remove " << ingest_dir;
+    }
+
+    // tracks: 0:0 - 1:0 - 2:0, 0:1 - 1:1, 0:3 - 1:2, the outlier 1:1 - 2:6
+    // is dropped
+    IncrementalTracks tracks;
+    Matches matches01 = { match(0, 0), match(1, 1), match(3, 2) };
+    Matches matches12 = { match(0, 0), match(1, 6) };
+    tracks.add_pair(0, 1, matches01, vector<char>(3, 1));
+    tracks.add_pair(1, 2, matches12, { 1, 0 });
+
+    std::map<size_t, std::map<size_t, int> > result;
+    tracks.get_tracks(result);
+    size_t long_tracks = 0;
+    for (auto& track : result) {
+        long_tracks += track.second.size() == 3;
+    }
+    if (result.size() != 3 || long_tracks != 1) {
+        LOG(ERROR) << result.size() << " tracks, " << long_tracks << " of length 3";
+        errors++;
+    }
+
+    // 0:1 - 2:0 joins two features of image 0 in a track
+    tracks.add_pair(0, 2, { match(1, 0) }, vector<char>());
+    tracks.get_tracks(result);
+    if (result.size() != 1) {
+        LOG(ERROR) << "conflicting track kept";
+        errors++;
+    }
+
+    // neighbors: 2 previous images, and the nearest image in range
+    IngestOptions options;
+    options.temporal = 2;
+    options.spatial = 1;
+    options.radius_km = 0.5;
+
+    vector<Mat> coords;
+    coords.push_back(position(37.7700, -122.4500));
+    coords.push_back(position(37.7720, -122.4500));
+    coords.push_back(Mat());
+    coords.push_back(position(37.8000, -122.4500));
+    coords.push_back(position(37.8010, -122.4500));
+    coords.push_back(position(37.7701, -122.4500));
+
+    vector<size_t> neighbors = select_neighbors(coords, 5, options);
+    std::sort(neighbors.begin(), neighbors.end());
+    if (neighbors != vector<size_t>({ 0, 3, 4 })) {
+        LOG(ERROR) << "unexpected neighbors";
+        errors++;
+    }
+
+    // an overlapping footprint comes before a nearer position
+    vector<Footprint> footprints(coords.size());
+    footprints[1].lat = 37.8004;
+    footprints[1].lon = -122.4500;
+    footprints[1].radius_km = 0.2;
+    footprints[5].lat = 37.8005;
+    footprints[5].lon = -122.4500;
+    footprints[5].radius_km = 0.2;
+    neighbors = select_neighbors(coords, 5, options, &footprints);
+    std::sort(neighbors.begin(), neighbors.end());
+    if (neighbors != vector<size_t>({ 1, 3, 4 })) {
+        LOG(ERROR) << "unexpected footprint neighbors";
+        errors++;
+    }
+
+    // without a position, temporal only
+    coords[5] = Mat();
+    if (select_neighbors(coords, 5, options).size() != 2) {
+        LOG(ERROR) << "spatial neighbors without a position";
+        errors++;
+    }
+
+    return errors ? 1 : 0;
+}
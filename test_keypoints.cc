@@ -0,0 +1,69 @@
+#include "photogram.h"
+#include "keypoints.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// KeypointSet round trips through OpenCV keypoints and serialization,
+// and reads the vector<KeyPoint> of older feature files
+
+static bool same(const KeypointSet& a, const KeypointSet& b) {
+    return a.x == b.x && a.y == b.y && a.scale == b.scale &&
+        a.orientation == b.orientation && a.response == b.response;
+}
+
+int main() {
+    int errors = 0;
+
+    Keypoints keypoints;
+    for (int i = 0; i < 100; i++) {
+        keypoints.push_back(KeyPoint(i * 1.5f, 1000 - i * 0.25f, 2 + i % 7, i * 3.6f,
+                                     0.01f * i, i % 4));
+    }
+
+    KeypointSet set;
+    set.assign(keypoints);
+    KeypointSet with_response;
+    with_response.assign(keypoints, true);
+
+    if (set.size() != keypoints.size() || set.has_response() ||
+        !with_response.has_response()) {
+        LOG(ERROR) << "assign";
+        errors++;
+    }
+
+    Keypoints back;
+    with_response.to_keypoints(back);
+    for (size_t i = 0; i < keypoints.size(); i++) {
+        if (back[i].pt != keypoints[i].pt || back[i].size != keypoints[i].size ||
+            back[i].angle != keypoints[i].angle ||
+            back[i].response != keypoints[i].response ||
+            set.pt(i) != keypoints[i].pt) {
+            LOG(ERROR) << "keypoint " << i << " differs";
+            errors++;
+            break;
+        }
+    }
+
+    FileStorage out(".yml", FileStorage::WRITE + FileStorage::MEMORY);
+    set.write(out, "keypoints");
+    with_response.write(out, "with_response");
+    cv::write(out, "older", keypoints);
+    string yml = out.releaseAndGetString();
+
+    FileStorage in(yml, FileStorage::READ + FileStorage::MEMORY);
+    KeypointSet read, read_response, older;
+    read.read(in["keypoints"]);
+    read_response.read(in["with_response"]);
+    older.read(in["older"]);
+
+    if (!same(read, set) || !same(read_response, with_response)) {
+        LOG(ERROR) << "serialization round trip";
+        errors++;
+    }
+    if (!same(older, with_response)) {
+        LOG(ERROR) << "vector<KeyPoint> deserialization";
+        errors++;
+    }
+
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,92 @@
+#include <random>
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "photogram.h"
+#include "phase_correlation.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// a frame seen rotated, scaled and slightly tilted over a synthetic
+// orthophoto registers without features, an unrelated frame doesn't
+
+// textured background, buildings and roads
+static Mat make_scene(std::mt19937& rng, Size size) {
+    std::uniform_int_distribution<int> x(0, size.width), y(0, size.height);
+    std::uniform_int_distribution<int> side(10, 80), level(100, 255);
+
+    Mat noise(size, CV_32F);
+    randu(noise, 0, 1);
+    GaussianBlur(noise, noise, Size(), 3);
+
+    Mat scene;
+    normalize(noise, scene, 0, 80, NORM_MINMAX, CV_8U);
+    for (int i = 0; i < 300; i++) {
+        Point p(x(rng), y(rng));
+        rectangle(scene, p, p + Point(side(rng), side(rng)), Scalar(level(rng)), -1);
+    }
+    for (int i = 0; i < 20; i++) {
+        line(scene, Point(x(rng), y(rng)), Point(x(rng), y(rng)), Scalar(200), 6);
+    }
+    return scene;
+}
+
+// largest distance between the two mappings over the image
+static double max_error(const Mat& H, const Mat& expected, Size size) {
+    vector<Point2f> pts, a, b;
+    for (int y = 0; y <= size.height; y += 100) {
+        for (int x = 0; x <= size.width; x += 100) {
+            pts.push_back(Point2f(x, y));
+        }
+    }
+    perspectiveTransform(pts, a, H);
+    perspectiveTransform(pts, b, expected);
+
+    double error = 0;
+    for (size_t i = 0; i < pts.size(); i++) {
+        error = max(error, norm(a[i] - b[i]));
+    }
+    return error;
+}
+
+int main() {
+    int errors = 0;
+    std::mt19937 rng(1);
+    theRNG().state = 1;
+
+    Mat truth = make_scene(rng, Size(1600, 1200));
+
+    // img to truth: 20 degrees, 0.9 scale about the centers, some tilt
+    Size img_size(1400, 1000);
+    double theta = 20 * CV_PI / 180, scale = 1 / 0.9;
+    double c = cos(theta) * scale, s = sin(theta) * scale;
+    Mat expected = (Mat_<double>(3, 3) <<
+                    c, -s, 800 - (c * 700 - s * 500),
+                    s, c, 600 - (s * 700 + c * 500),
+                    1e-5, -7e-6, 1);
+
+    Mat img;
+    warpPerspective(truth, img, expected.inv(), img_size);
+
+    PhaseCorrelationOptions options;
+    Mat H;
+    if (!phase_correlation_homography(img, truth, options, H)) {
+        LOG(ERROR) << "registration failed";
+        errors++;
+    } else {
+        double error = max_error(H, expected, img_size);
+        LOG(INFO) << "Max error: " << error << " pixels";
+        if (error > 2) {
+            LOG(ERROR) << "homography off by " << error << " pixels";
+            errors++;
+        }
+    }
+
+    Mat unrelated = make_scene(rng, img_size);
+    if (phase_correlation_homography(unrelated, truth, options, H)) {
+        LOG(ERROR) << "unrelated image registered";
+        errors++;
+    }
+
+    return errors ? 1 : 0;
+}
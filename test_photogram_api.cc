@@ -0,0 +1,126 @@
+#include <random>
+#include <thread>
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "photogram.h"
+#include "photogram_api.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// a synthetic frame and its warp, one decoded and one png encoded in
+// memory, match with the warp as homography. Undecodable bytes only
+// lose their image, and concurrent calls give the same result.
+
+static Mat make_scene(std::mt19937& rng, Size size) {
+    std::uniform_int_distribution<int> x(0, size.width), y(0, size.height);
+    std::uniform_int_distribution<int> side(10, 60), level(100, 255);
+
+    Mat noise(size, CV_32F);
+    randu(noise, 0, 1);
+    GaussianBlur(noise, noise, Size(), 3);
+
+    Mat scene;
+    normalize(noise, scene, 0, 80, NORM_MINMAX, CV_8U);
+    for (int i = 0; i < 200; i++) {
+        Point p(x(rng), y(rng));
+        rectangle(scene, p, p + Point(side(rng), side(rng)), Scalar(level(rng)), -1);
+    }
+    return scene;
+}
+
+static double max_error(const Mat& H, const Mat& expected, Size size) {
+    vector<Point2f> pts, a, b;
+    for (int y = 0; y <= size.height; y += 100) {
+        for (int x = 0; x <= size.width; x += 100) {
+            pts.push_back(Point2f(x, y));
+        }
+    }
+    perspectiveTransform(pts, a, H);
+    perspectiveTransform(pts, b, expected);
+
+    double error = 0;
+    for (size_t i = 0; i < pts.size(); i++) {
+        error = max(error, norm(a[i] - b[i]));
+    }
+    return error;
+}
+
+int main() {
+    int errors = 0;
+    std::mt19937 rng(1);
+    theRNG().state = 1;
+
+    Size size(800, 600);
+    Mat scene = make_scene(rng, size);
+
+    Mat expected = getRotationMatrix2D(Point2f(400, 300), 10.0, 0.95);
+    expected.push_back(Mat((Mat_<double>(1, 3) << 0, 0, 1)));
+    Mat warped;
+    warpPerspective(scene, warped, expected, size);
+
+    vector<unsigned char> png;
+    imencode(".png", warped, png);
+    unsigned char garbage[] = { 1, 2, 3, 4 };
+
+    vector<ImageInput> inputs(3);
+    inputs[0].image = scene;
+    inputs[0].name = "scene";
+    inputs[1].data = &png[0];
+    inputs[1].size = png.size();
+    inputs[1].name = "warped";
+    inputs[2].data = garbage;
+    inputs[2].size = sizeof(garbage);
+    inputs[2].name = "garbage";
+
+    MatchResult result;
+    if (match_images(inputs, vector<IndexPair>(), ApiOptions(), result)) {
+        LOG(ERROR) << "undecodable input not reported";
+        errors++;
+    }
+    if (!result.features[0] || !result.features[1] || result.features[2]) {
+        LOG(ERROR) << "wrong features per input";
+        errors++;
+    }
+
+    if (result.pairs.size() != 1 || result.pairs[0].image1 != 0 ||
+        result.pairs[0].image2 != 1 || result.pairs[0].H.empty()) {
+        LOG(ERROR) << result.pairs.size() << " verified pairs";
+        return 1;
+    }
+
+    double error = max_error(result.pairs[0].H, expected, size);
+    if (error > 2.0) {
+        LOG(ERROR) << "homography off by " << error << " pixels";
+        errors++;
+    }
+
+    // from several threads at once
+    vector<MatchResult> results(4);
+    vector<std::thread> threads;
+    for (size_t t = 0; t < results.size(); t++) {
+        threads.push_back(std::thread([&inputs, &results, t]() {
+                    vector<ImageInput> pair(inputs.begin(), inputs.begin() + 2);
+                    match_images(pair, vector<IndexPair>(), ApiOptions(), results[t]);
+                }));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (const MatchResult& other : results) {
+        if (other.pairs.size() != 1 ||
+            other.features[0]->keypoints.size() != result.features[0]->keypoints.size() ||
+            max_error(other.pairs[0].H, expected, size) > 2.0) {
+            LOG(ERROR) << "concurrent call differs";
+            errors++;
+        }
+    }
+
+    if (errors) {
+        printf("%d errors\n", errors);
+        return 1;
+    }
+
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "photogram.h"
+#include "metrics.h"
+#include "pipeline.hpp"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// the lock free queue loses and duplicates nothing under concurrency,
+// a pipeline drains all its items, a slow sink shows up as
+// backpressure on the stages before it, and a budget bounds the
+// workers computing at once
+
+int main() {
+    int errors = 0;
+
+    // 4 producers, 4 consumers on a small queue
+    {
+        const int producers = 4, consumers = 4, count = 20000;
+        BoundedQueue<int> queue(16);
+        std::atomic<long long> sum(0);
+        std::atomic<int> popped(0), done(0);
+
+        std::vector<std::thread> threads;
+        for (int p = 0; p < producers; p++) {
+            threads.push_back(std::thread([&, p]() {
+                        for (int i = 0; i < count; i++) {
+                            int value = p * count + i;
+                            while (!queue.try_push(value)) {
+                                std::this_thread::yield();
+                            }
+                        }
+                        done++;
+                    }));
+        }
+        for (int c = 0; c < consumers; c++) {
+            threads.push_back(std::thread([&]() {
+                        int value;
+                        while (true) {
+                            if (queue.try_pop(value)) {
+                                sum += value;
+                                popped++;
+                            } else if (done == producers) {
+                                if (!queue.try_pop(value)) {
+                                    break;
+                                }
+                                sum += value;
+                                popped++;
+                            } else {
+                                std::this_thread::yield();
+                            }
+                        }
+                    }));
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        long long n = (long long) producers * count;
+        if (popped != n || sum != n * (n - 1) / 2) {
+            LOG(ERROR) << "queue: " << popped << " items popped";
+            errors++;
+        }
+    }
+
+    // generate -> square (4 workers) -> slow sink
+    {
+        const int count = 2000;
+        Pipeline pipeline("test");
+        PipelineQueue<int> *numbers = pipeline.queue<int>("numbers", 8);
+        PipelineQueue<long long> *squares = pipeline.queue<long long>("squares", 8);
+
+        pipeline.source<int>("generate", numbers, [&](const PipelineEmit<int>& emit) {
+                for (int i = 0; i < count; i++) {
+                    emit(i);
+                }
+            });
+        pipeline.stage<int, long long>("square", 4, numbers, squares,
+            [](int& i, const PipelineEmit<long long>& emit) {
+                emit((long long) i * i);
+            });
+
+        long long sum = 0;
+        int items = 0;
+        pipeline.sink<long long>("sum", 1, squares, [&](long long& value) {
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+                sum += value;
+                items++;
+            });
+        pipeline.run();
+
+        long long expected = (long long) (count - 1) * count * (2 * count - 1) / 6;
+        if (items != count || sum != expected) {
+            LOG(ERROR) << "pipeline: " << items << " items";
+            errors++;
+        }
+
+        Metrics& metrics = Metrics::instance();
+        if (metrics.get("pipeline.test.square.items") != count ||
+            metrics.get("pipeline.test.square.blocked_s") <= 0 ||
+            metrics.get("pipeline.test.sum.occupancy") < 0.5 ||
+            metrics.get("pipeline.test.squares.mean_depth") < 4) {
+            LOG(ERROR) << "the slow sink doesn't show: square blocked "
+                       << metrics.get("pipeline.test.square.blocked_s") << "s, sum occupancy "
+                       << metrics.get("pipeline.test.sum.occupancy");
+            errors++;
+        }
+    }
+
+    // 8 workers over two stages, a budget of 2 computing at once
+    {
+        const int count = 400;
+        const int budget = 2;
+        Pipeline pipeline("budget", budget);
+        PipelineQueue<int> *numbers = pipeline.queue<int>("numbers", 4);
+
+        std::atomic<int> computing(0), most(0);
+        auto compute = [&]() {
+            int now = ++computing;
+            int seen = most.load();
+            while (now > seen && !most.compare_exchange_weak(seen, now)) {
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+            computing--;
+        };
+
+        pipeline.source<int>("generate", numbers, [&](const PipelineEmit<int>& emit) {
+                for (int i = 0; i < count; i++) {
+                    compute();
+                    emit(i);
+                }
+            });
+        std::atomic<int> items(0);
+        pipeline.sink<int>("consume", 7, numbers, [&](int&) {
+                compute();
+                items++;
+            });
+        pipeline.run();
+
+        if (items != count || most > budget) {
+            LOG(ERROR) << "budget: " << items << " items, " << most << " computing at once";
+            errors++;
+        }
+    }
+
+    return errors ? 1 : 0;
+}
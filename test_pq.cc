@@ -0,0 +1,119 @@
+#include <string.h>
+
+#include <random>
+#include <sstream>
+
+#include "photogram.h"
+#include "pq.h"
+#include "simd_kernels.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// PQ store recall with re-ranking against brute force, serialization
+// round trip, and corrupt stores refused
+
+int main() {
+    const size_t n = 20000, dim = 128, queries = 200;
+    const SimdKernels& kernels = simd_kernels();
+    int errors = 0;
+
+    // clustered data, closer to descriptors than uniform noise
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    vector<float> centers(50 * dim);
+    for (auto &v : centers) {
+        v = uniform(rng) * 100;
+    }
+
+    vector<float> data(n * dim), query(queries * dim);
+    for (size_t i = 0; i < n + queries; i++) {
+        float *v = i < n ? &data[i * dim] : &query[(i - n) * dim];
+        size_t c = rng() % 50;
+        for (size_t d = 0; d < dim; d++) {
+            v[d] = centers[c * dim + d] + uniform(rng) * 20;
+        }
+    }
+
+    ProductQuantizer::ptr pq(new ProductQuantizer(dim, 32));
+    if (!pq->train(Mat(5000, dim, CV_32F, &data[0]))) {
+        LOG(ERROR) << "training failed";
+        return 1;
+    }
+
+    // two images, the second starts inside a block of codes
+    const size_t split = 7001;
+    PqStore store(pq);
+    store.add(&data[0], split);
+    store.add(&data[split * dim], n - split);
+    LOG(INFO) << "PQ store: " << store.memory_size() << " bytes for "
+              << store.size() << " descriptors";
+
+    ExactDescriptorFn exact = [&](uint32_t image, uint32_t keypoint) {
+        return &data[((image ? split : 0) + keypoint) * dim];
+    };
+
+    size_t correct = 0;
+    vector<PqMatch> matches;
+    for (size_t q = 0; q < queries; q++) {
+        store.search(&query[q * dim], 1, 64, matches, exact);
+
+        float best = 1e30;
+        size_t best_id = 0;
+        for (size_t i = 0; i < n; i++) {
+            float d = kernels.l2_sqr_f32(&query[q * dim], &data[i * dim], dim);
+            if (d < best) {
+                best = d;
+                best_id = i;
+            }
+        }
+        correct += !matches.empty() &&
+            (matches[0].image ? split : 0) + matches[0].keypoint == best_id;
+    }
+
+    double recall = correct / (double) queries;
+    LOG(INFO) << "PQ recall@1, 16 bytes, re-ranking 64: " << recall;
+    if (recall < 0.9) {
+        LOG(ERROR) << "recall too low";
+        errors++;
+    }
+
+    std::stringstream ss;
+    PqStore loaded;
+    if (!store.save(ss) || !loaded.load(ss)) {
+        LOG(ERROR) << "serialization failed";
+        errors++;
+    }
+    for (size_t q = 0; q < queries; q++) {
+        vector<PqMatch> a, b;
+        store.search(&query[q * dim], 5, 4, a);
+        loaded.search(&query[q * dim], 5, 4, b);
+        bool same = a.size() == b.size();
+        for (size_t i = 0; same && i < a.size(); i++) {
+            same = a[i].image == b[i].image && a[i].keypoint == b[i].keypoint;
+        }
+        if (!same) {
+            LOG(ERROR) << "loaded store differs";
+            errors++;
+            break;
+        }
+    }
+
+    // truncated, an odd m, more descriptors than the file holds
+    string saved = ss.str();
+    vector<string> corrupt(3, saved);
+    corrupt[0].resize(saved.size() - 10);
+    uint32_t odd = 31;
+    memcpy(&corrupt[1][3 * sizeof(uint64_t) + 2 * sizeof(uint32_t)], &odd, sizeof(odd));
+    uint64_t huge = (uint64_t) 1 << 40;
+    memcpy(&corrupt[2][sizeof(uint64_t)], &huge, sizeof(huge));
+    for (size_t c = 0; c < corrupt.size(); c++) {
+        std::stringstream is(corrupt[c]);
+        PqStore rejected;
+        if (rejected.load(is)) {
+            LOG(ERROR) << "corrupt store " << c << " loaded";
+            errors++;
+        }
+    }
+
+    return errors ? 1 : 0;
+}
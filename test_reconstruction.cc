@@ -0,0 +1,161 @@
+#include <math.h>
+
+#include <map>
+#include <random>
+
+#include "photogram.h"
+#include "reconstruction.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// an orbit of cameras around a cloud of points, seen from one side each
+// with noise and 5% of mismatched observations: every camera is
+// registered, the centers match the orbit up to a similarity, and an
+// image without tracks is left out
+
+#define CAMERAS 36
+#define POINTS 3000
+#define ORBIT 10.0
+
+// camera at center looking at the origin, y down
+static void look_at(const Matx31d& center, Matx33d& R, Matx31d& t) {
+    Matx31d z = -center * (1 / norm(center));
+    Matx31d up(0, 0, 1);
+    Matx31d x(z(1) * up(2) - z(2) * up(1), z(2) * up(0) - z(0) * up(2),
+              z(0) * up(1) - z(1) * up(0));
+    x = x * (1 / norm(x));
+    Matx31d y(z(1) * x(2) - z(2) * x(1), z(2) * x(0) - z(0) * x(2),
+              z(0) * x(1) - z(1) * x(0));
+
+    for (int j = 0; j < 3; j++) {
+        R(0, j) = x(j);
+        R(1, j) = y(j);
+        R(2, j) = z(j);
+    }
+    t = -(R * center);
+}
+
+// largest distance between the centers once aligned with a similarity
+// (Umeyama), relative to the orbit
+static double center_error(const vector<Matx31d>& estimated, const vector<Matx31d>& truth) {
+    size_t n = estimated.size();
+    Matx31d mean_e, mean_t;
+    for (size_t i = 0; i < n; i++) {
+        mean_e += estimated[i] * (1.0 / n);
+        mean_t += truth[i] * (1.0 / n);
+    }
+
+    Matx33d H;
+    double variance = 0;
+    for (size_t i = 0; i < n; i++) {
+        Matx31d e = estimated[i] - mean_e, g = truth[i] - mean_t;
+        H += g * e.t();
+        variance += e.dot(e);
+    }
+
+    Matx31d w;
+    Matx33d U, Vt;
+    SVD::compute(H, w, U, Vt);
+    Matx33d D = Matx33d::eye();
+    if (determinant(U * Vt) < 0) {
+        D(2, 2) = -1;
+    }
+    Matx33d R = U * D * Vt;
+    double scale = (w(0) + w(1) + D(2, 2) * w(2)) / variance;
+
+    double worst = 0;
+    for (size_t i = 0; i < n; i++) {
+        Matx31d aligned = R * (estimated[i] - mean_e) * scale + mean_t;
+        worst = std::max(worst, norm(aligned - truth[i]));
+    }
+    return worst / ORBIT;
+}
+
+int main() {
+    int errors = 0;
+
+    std::mt19937 rng(11);
+    std::uniform_real_distribution<double> u(-1, 1);
+    std::normal_distribution<double> noise(0, 0.5);
+    Matx33d K(1000, 0, 960, 0, 1000, 540, 0, 0, 1);
+
+    vector<Matx33d> R(CAMERAS);
+    vector<Matx31d> t(CAMERAS), centers(CAMERAS);
+    for (int c = 0; c < CAMERAS; c++) {
+        double angle = 2 * M_PI * c / CAMERAS;
+        centers[c] = Matx31d(ORBIT * cos(angle), ORBIT * sin(angle), 2 + u(rng));
+        look_at(centers[c], R[c], t[c]);
+    }
+
+    IncrementalReconstruction sfm;
+    for (int c = 0; c < CAMERAS + 1; c++) {
+        sfm.add_image(K);
+    }
+
+    // points on a noisy sphere, seen from the cameras they face
+    size_t tracks = 0;
+    for (int p = 0; p < POINTS; p++) {
+        Matx31d X(u(rng), u(rng), u(rng));
+        X = X * (3 * (0.8 + 0.2 * (u(rng) + 1) / 2) / norm(X));
+
+        std::map<size_t, Point2f> observations;
+        for (int c = 0; c < CAMERAS; c++) {
+            Matx31d ray = centers[c] - X;
+            if (ray.dot(X) < 0.3 * norm(ray) * norm(X)) {
+                continue;
+            }
+            Matx31d x = K * (R[c] * X + t[c]);
+            Point2f pixel(x(0) / x(2) + noise(rng), x(1) / x(2) + noise(rng));
+            if (rng() % 100 < 5) {
+                pixel = Point2f(960 + 960 * u(rng), 540 + 540 * u(rng));
+            }
+            observations[c] = pixel;
+        }
+
+        if (observations.size() >= 2) {
+            sfm.add_track(observations);
+            tracks++;
+        }
+    }
+
+    size_t registered = sfm.run();
+    if (registered != CAMERAS) {
+        LOG(ERROR) << "registered " << registered << " / " << CAMERAS;
+        errors++;
+    }
+
+    Matx33d R_unused;
+    Matx31d t_unused;
+    if (sfm.get_pose(CAMERAS, R_unused, t_unused)) {
+        LOG(ERROR) << "image without tracks registered";
+        errors++;
+    }
+
+    if (sfm.get_point_count() < 0.8 * tracks) {
+        LOG(ERROR) << "points " << sfm.get_point_count() << " / " << tracks;
+        errors++;
+    }
+
+    vector<Matx31d> estimated, truth;
+    for (int c = 0; c < CAMERAS; c++) {
+        Matx33d Rc;
+        Matx31d tc;
+        if (sfm.get_pose(c, Rc, tc)) {
+            estimated.push_back(-(Rc.t() * tc));
+            truth.push_back(centers[c]);
+        }
+    }
+    double error = estimated.size() >= 3 ? center_error(estimated, truth) : 1;
+    if (error > 0.01) {
+        LOG(ERROR) << "camera centers off by " << error << " of the orbit";
+        errors++;
+    }
+
+    if (errors) {
+        printf("%d errors\n", errors);
+        return 1;
+    }
+
+    printf("ok\n");
+    return 0;
+}
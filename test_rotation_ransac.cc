@@ -0,0 +1,136 @@
+#include <math.h>
+
+#include <algorithm>
+#include <random>
+
+#include "photogram.h"
+#include "rotation_ransac.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// the 2 point rotation RANSAC finds the true rotation and inliers of
+// synthetic panoramas with 40% outliers and different cameras, and keeps
+// few matches of a translating camera close to the scene
+
+// rotation about a unit axis (Rodrigues)
+static Matx33d axis_angle(double ax, double ay, double az, double angle) {
+    double c = cos(angle), s = sin(angle), t = 1 - c;
+    return Matx33d(t * ax * ax + c, t * ax * ay - s * az, t * ax * az + s * ay,
+                   t * ax * ay + s * az, t * ay * ay + c, t * ay * az - s * ax,
+                   t * ax * az - s * ay, t * ay * az + s * ax, t * az * az + c);
+}
+
+static Matx33d camera(double f, double cx, double cy) {
+    return Matx33d(f, 0, cx, 0, f, cy, 0, 0, 1);
+}
+
+// n points seen by K1 at the origin and by K2 turned by R and moved by
+// t, truth[i] unset for mismatches
+static void synthetic_pair(std::mt19937& rng, int n, const Matx33d& K1, const Matx33d& K2,
+                           const Matx33d& R, double tx, double outliers,
+                           vector<Point2f>& pts1, vector<Point2f>& pts2,
+                           vector<char>& truth) {
+    std::uniform_real_distribution<double> u(-1, 1);
+    std::normal_distribution<double> noise(0, 0.5);
+
+    while ((int) pts1.size() < n) {
+        double X = 4 * u(rng), Y = 3 * u(rng), Z = 6 + 2 * u(rng);
+        double x1 = K1(0, 0) * X / Z + K1(0, 2), y1 = K1(1, 1) * Y / Z + K1(1, 2);
+
+        double Xr = R(0, 0) * X + R(0, 1) * Y + R(0, 2) * Z + tx;
+        double Yr = R(1, 0) * X + R(1, 1) * Y + R(1, 2) * Z;
+        double Zr = R(2, 0) * X + R(2, 1) * Y + R(2, 2) * Z;
+        double x2 = K2(0, 0) * Xr / Zr + K2(0, 2), y2 = K2(1, 1) * Yr / Zr + K2(1, 2);
+        if (Zr <= 0 || x1 < 0 || y1 < 0 || x2 < 0 || y2 < 0 ||
+            x1 > 2 * K1(0, 2) || y1 > 2 * K1(1, 2) || x2 > 2 * K2(0, 2) || y2 > 2 * K2(1, 2)) {
+            continue;
+        }
+
+        bool inlier = (u(rng) + 1) / 2 >= outliers;
+        if (!inlier) {
+            x2 = K2(0, 2) * (1 + u(rng));
+            y2 = K2(1, 2) * (1 + u(rng));
+        }
+
+        pts1.push_back(Point2f(x1 + noise(rng), y1 + noise(rng)));
+        pts2.push_back(Point2f(x2 + noise(rng), y2 + noise(rng)));
+        truth.push_back(inlier);
+    }
+}
+
+int main() {
+    int errors = 0;
+    std::mt19937 rng(5);
+    std::uniform_real_distribution<double> u(-1, 1);
+
+    RotationRansacOptions options;
+    Matx33d K1 = camera(1000, 960, 540), K2 = camera(1200, 960, 540);
+
+    size_t tp = 0, fp = 0, fn = 0;
+    for (int p = 0; p < 100; p++) {
+        double ax = u(rng), ay = u(rng), az = 0.2 * u(rng);
+        double norm = sqrt(ax * ax + ay * ay + az * az);
+        Matx33d truth_R = axis_angle(ax / norm, ay / norm, az / norm, 0.3 * u(rng));
+
+        vector<Point2f> pts1, pts2;
+        vector<char> truth;
+        synthetic_pair(rng, 60 + rng() % 200, K1, p % 2 ? K2 : K1, truth_R, 0, 0.4,
+                       pts1, pts2, truth);
+
+        Matx33d R;
+        vector<char> inliers;
+        if (!find_rotation(pts1, pts2, K1, p % 2 ? K2 : K1, options, R, inliers)) {
+            LOG(ERROR) << "pair " << p << ": no rotation";
+            errors++;
+            continue;
+        }
+
+        // angle of R truth_R^T
+        Matx33d D = R * truth_R.t();
+        double angle = acos(std::min(1.0, (D(0, 0) + D(1, 1) + D(2, 2) - 1) / 2));
+        if (angle > 1e-3) {
+            LOG(ERROR) << "pair " << p << ": rotation off by " << angle << " rad";
+            errors++;
+        }
+
+        for (size_t i = 0; i < truth.size(); i++) {
+            tp += inliers[i] && truth[i];
+            fp += inliers[i] && !truth[i];
+            fn += !inliers[i] && truth[i];
+        }
+    }
+
+    double recall = tp / (double) (tp + fn), precision = tp / (double) (tp + fp);
+    if (recall < 0.95 || precision < 0.98) {
+        LOG(ERROR) << "recall " << recall << " precision " << precision;
+        errors++;
+    }
+
+    // a camera moving sideways close to the scene isn't a rotation
+    vector<Point2f> pts1, pts2;
+    vector<char> truth, inliers;
+    synthetic_pair(rng, 300, K1, K1, axis_angle(0, 1, 0, 0.05), -1.5, 0, pts1, pts2, truth);
+    Matx33d R;
+    find_rotation(pts1, pts2, K1, K1, options, R, inliers);
+    size_t kept = std::count(inliers.begin(), inliers.end(), 1);
+    if (kept >= options.min_ratio * pts1.size()) {
+        LOG(ERROR) << "translation kept " << kept << " / " << pts1.size();
+        errors++;
+    }
+
+    // too few points
+    pts1.resize(1);
+    pts2.resize(1);
+    if (find_rotation(pts1, pts2, K1, K1, options, R, inliers)) {
+        LOG(ERROR) << "rotation from one point";
+        errors++;
+    }
+
+    if (errors) {
+        printf("%d errors\n", errors);
+        return 1;
+    }
+
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,242 @@
+#include <stdlib.h>
+
+#include "photogram.h"
+#include "simd_kernels.h"
+#include "haversine_dist.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// check every SIMD level supported by this cpu against the scalar reference
+
+static float frand(float min, float max) {
+    return min + (max - min) * (rand() / (float) RAND_MAX);
+}
+
+static int check(bool ok, const char *level, const char *kernel) {
+    if (!ok) {
+        LOG(ERROR) << level << ": " << kernel << " differs from scalar";
+        return 1;
+    }
+    return 0;
+}
+
+int main() {
+    const SimdKernels *ref = simd_kernels_for(SIMD_SCALAR);
+    int errors = 0;
+
+    // descriptors, odd size to exercise the tails
+    const size_t dim = 131;
+    vector<float> fa(dim), fb(dim);
+    vector<uint8_t> ua(dim), ub(dim);
+    for (size_t i = 0; i < dim; i++) {
+        fa[i] = frand(0, 1);
+        fb[i] = frand(0, 1);
+        ua[i] = rand() % 256;
+        ub[i] = rand() % 256;
+    }
+
+    // correspondences and a F matrix
+    const size_t n = 1003;
+    vector<Point2f> pts1(n), pts2(n);
+    for (size_t i = 0; i < n; i++) {
+        pts1[i] = Point2f(frand(0, 4000), frand(0, 3000));
+        pts2[i] = Point2f(frand(0, 4000), frand(0, 3000));
+    }
+    double F[9] = { 1e-8, -3e-7, 2e-4,
+                    4e-7, 2e-8, -6e-3,
+                    -3e-4, 5e-3, 1 };
+
+    // gps points around San Francisco
+    vector<double> sin_lat(n), cos_lat(n), sin_lon(n), cos_lon(n);
+    vector<double> lats(n), lons(n);
+    for (size_t i = 0; i < n; i++) {
+        double p[4];
+        lats[i] = frand(37.70, 37.72);
+        lons[i] = frand(-122.51, -122.50);
+        haversine_prepare(lats[i], lons[i], p);
+        sin_lat[i] = p[0];
+        cos_lat[i] = p[1];
+        sin_lon[i] = p[2];
+        cos_lon[i] = p[3];
+    }
+    GeoTable table = { &sin_lat[0], &cos_lat[0], &sin_lon[0], &cos_lon[0] };
+    double q[4];
+    haversine_prepare(37.71, -122.505, q);
+
+    // images
+    Mat bgr(67, 101, CV_8UC3);
+    randu(bgr, Scalar::all(0), Scalar::all(255));
+    Mat gray(bgr.rows, bgr.cols, CV_8UC1);
+    double H[9] = { 1.1, 0.05, -3.5,
+                    -0.04, 0.95, 2.25,
+                    1e-4, -2e-4, 1 };
+
+    // 4 bit product quantizer codes, 7 blocks of 16 codes with
+    // m = 38 to exercise the tail rows of the wide registers
+    const size_t pq_m = 38, pq_blocks = 7;
+    vector<uint8_t> pq_codes(pq_blocks * pq_m / 2 * 16), pq_lut(pq_m * 16);
+    for (size_t i = 0; i < pq_codes.size(); i++) {
+        pq_codes[i] = rand() % 256;
+    }
+    for (size_t i = 0; i < pq_lut.size(); i++) {
+        pq_lut[i] = rand() % 256;
+    }
+
+    // semi-global matching path step, 70 disparities for the tails,
+    // sums near saturation
+    const size_t sgm_n = 70;
+    vector<uint8_t> sgm_cost(sgm_n);
+    vector<uint16_t> sgm_prev(sgm_n + 2, 0xffff), sgm_sum(sgm_n);
+    uint16_t sgm_prev_min = 0xffff;
+    for (size_t d = 0; d < sgm_n; d++) {
+        sgm_cost[d] = rand() % 25;
+        sgm_prev[d + 1] = 200 + rand() % 300;
+        sgm_prev_min = std::min(sgm_prev_min, sgm_prev[d + 1]);
+        sgm_sum[d] = 65000 + rand() % 536;
+    }
+
+    // scalar results
+    vector<float> ref_err(n);
+    ref->sampson_error(F, (const float*) &pts1[0], (const float*) &pts2[0], n, &ref_err[0]);
+    vector<double> ref_a(n);
+    ref->haversine_batch(q, &table, n, &ref_a[0]);
+
+    // one F per lane over normalized points, lane l has 100 + l points
+    const size_t lane_n = 100 + SAMPSON_LANES;
+    vector<float> lane_F(9 * SAMPSON_LANES), lane_thr(SAMPSON_LANES);
+    vector<float> lane_pts(4 * lane_n * SAMPSON_LANES, NAN);
+    for (int l = 0; l < SAMPSON_LANES; l++) {
+        for (int c = 0; c < 9; c++) {
+            lane_F[c * SAMPSON_LANES + l] = frand(-1, 1);
+        }
+        lane_thr[l] = frand(1e-4, 1e-2);
+        for (size_t i = 0; i < 100 + (size_t) l; i++) {
+            for (int k = 0; k < 4; k++) {
+                lane_pts[(4 * i + k) * SAMPSON_LANES + l] = frand(-1.5, 1.5);
+            }
+        }
+    }
+    uint32_t ref_inliers[SAMPSON_LANES];
+    ref->sampson_count_lanes(&lane_F[0], &lane_pts[0], lane_n, &lane_thr[0], ref_inliers);
+
+    for (size_t i = 0; i < n; i++) {
+        double km = haversine<double>(37.71, -122.505, lats[i], lons[i]);
+        errors += check(fabs(haversine_km(ref_a[i]) - km) < 1e-5, "scalar", "haversine_km");
+    }
+
+    // every half but the NaNs survives a round trip through float
+    bool round_trip = true;
+    for (uint32_t bits = 0; bits < 0x10000; bits++) {
+        Half h = { (uint16_t) bits };
+        float f = half_to_float(h);
+        round_trip &= f != f || half_from_float(f).bits == bits;
+    }
+    errors += check(round_trip, "scalar", "half_from_float");
+
+    Mat ref_gray(bgr.rows, bgr.cols, CV_8UC1);
+    Mat ref_warp(bgr.rows, bgr.cols, CV_8UC1);
+    for (int y = 0; y < bgr.rows; y++) {
+        ref->bgr_to_gray_u8(bgr.ptr<uint8_t>(y), ref_gray.ptr<uint8_t>(y), bgr.cols);
+    }
+    for (int y = 0; y < bgr.rows; y++) {
+        ref->warp_row_bilinear_u8(ref_gray.ptr<uint8_t>(), ref_gray.cols, ref_gray.rows,
+                                  ref_gray.step, H, y, ref_warp.ptr<uint8_t>(y), ref_warp.cols);
+    }
+
+    vector<uint16_t> ref_pq(pq_blocks * 16);
+    ref->pq4_scan(&pq_codes[0], pq_blocks, pq_m, &pq_lut[0], &ref_pq[0]);
+
+    vector<uint16_t> ref_sgm_cur(sgm_n), ref_sgm_sum = sgm_sum;
+    uint16_t ref_sgm_min = ref->sgm_step(&sgm_cost[0], &sgm_prev[1], sgm_prev_min, 8, 96,
+                                         sgm_n, &ref_sgm_cur[0], &ref_sgm_sum[0]);
+
+    Mat cv_gray;
+    cvtColor(bgr, cv_gray, COLOR_BGR2GRAY);
+    errors += check(norm(cv_gray, ref_gray, NORM_INF) <= 1, "scalar", "bgr_to_gray_u8");
+
+    for (int level = SIMD_SSE42; level < SIMD_LEVEL_COUNT; level++) {
+        const SimdKernels *k = simd_kernels_for((SimdLevel) level);
+        if (!k) {
+            LOG(INFO) << simd_level_name((SimdLevel) level) << ": not available, skipped";
+            continue;
+        }
+        LOG(INFO) << "Checking " << k->name;
+
+        float fd = k->l2_sqr_f32(&fa[0], &fb[0], dim);
+        float ref_fd = ref->l2_sqr_f32(&fa[0], &fb[0], dim);
+        errors += check(fabs(fd - ref_fd) <= 1e-4 * ref_fd, k->name, "l2_sqr_f32");
+
+        errors += check(k->l2_sqr_u8(&ua[0], &ub[0], dim) ==
+                        ref->l2_sqr_u8(&ua[0], &ub[0], dim), k->name, "l2_sqr_u8");
+
+        vector<Half> ref_ha(dim), ha(dim), hb(dim);
+        ref->f32_to_f16(&fa[0], &ref_ha[0], dim);
+        k->f32_to_f16(&fa[0], &ha[0], dim);
+        k->f32_to_f16(&fb[0], &hb[0], dim);
+        bool same = true;
+        for (size_t i = 0; i < dim; i++) {
+            same &= ha[i].bits == ref_ha[i].bits;
+        }
+        errors += check(same, k->name, "f32_to_f16");
+
+        vector<float> back(dim), ref_back(dim);
+        k->f16_to_f32(&ha[0], &back[0], dim);
+        ref->f16_to_f32(&ha[0], &ref_back[0], dim);
+        errors += check(back == ref_back, k->name, "f16_to_f32");
+
+        float hd = k->l2_sqr_f16(&ha[0], &hb[0], dim);
+        float ref_hd = ref->l2_sqr_f16(&ha[0], &hb[0], dim);
+        errors += check(fabs(hd - ref_hd) <= 1e-4 * ref_hd, k->name, "l2_sqr_f16");
+
+        vector<float> err(n);
+        k->sampson_error(F, (const float*) &pts1[0], (const float*) &pts2[0], n, &err[0]);
+        bool ok = true;
+        for (size_t i = 0; i < n; i++) {
+            ok &= fabs(err[i] - ref_err[i]) <= 1e-3 * ref_err[i] + 1e-6;
+        }
+        errors += check(ok, k->name, "sampson_error");
+
+        // fma rounding can move a point sitting on the threshold
+        uint32_t inliers[SAMPSON_LANES];
+        k->sampson_count_lanes(&lane_F[0], &lane_pts[0], lane_n, &lane_thr[0], inliers);
+        ok = true;
+        for (int l = 0; l < SAMPSON_LANES; l++) {
+            ok &= abs((int) inliers[l] - (int) ref_inliers[l]) <= 1;
+        }
+        errors += check(ok, k->name, "sampson_count_lanes");
+
+        vector<double> a(n);
+        k->haversine_batch(q, &table, n, &a[0]);
+        ok = true;
+        for (size_t i = 0; i < n; i++) {
+            ok &= fabs(haversine_km(a[i]) - haversine_km(ref_a[i])) < 1e-6;
+        }
+        errors += check(ok, k->name, "haversine_batch");
+
+        for (int y = 0; y < bgr.rows; y++) {
+            k->bgr_to_gray_u8(bgr.ptr<uint8_t>(y), gray.ptr<uint8_t>(y), bgr.cols);
+        }
+        errors += check(norm(gray, ref_gray, NORM_INF) == 0, k->name, "bgr_to_gray_u8");
+
+        Mat warp(bgr.rows, bgr.cols, CV_8UC1);
+        for (int y = 0; y < bgr.rows; y++) {
+            k->warp_row_bilinear_u8(ref_gray.ptr<uint8_t>(), ref_gray.cols, ref_gray.rows,
+                                    ref_gray.step, H, y, warp.ptr<uint8_t>(y), warp.cols);
+        }
+        errors += check(norm(warp, ref_warp, NORM_INF) <= 1, k->name, "warp_row_bilinear_u8");
+
+        vector<uint16_t> pq(pq_blocks * 16);
+        k->pq4_scan(&pq_codes[0], pq_blocks, pq_m, &pq_lut[0], &pq[0]);
+        errors += check(pq == ref_pq, k->name, "pq4_scan");
+
+        vector<uint16_t> sgm_cur(sgm_n), sgm_out = sgm_sum;
+        uint16_t sgm_min = k->sgm_step(&sgm_cost[0], &sgm_prev[1], sgm_prev_min, 8, 96,
+                                       sgm_n, &sgm_cur[0], &sgm_out[0]);
+        errors += check(sgm_min == ref_sgm_min && sgm_cur == ref_sgm_cur &&
+                        sgm_out == ref_sgm_sum, k->name, "sgm_step");
+    }
+
+    LOG(INFO) << "Selected kernels: " << simd_kernels().name;
+
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,78 @@
+#include <random>
+
+#include "photogram.h"
+#include "stereo.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// semi-global matching recovers the disparities of a synthetic pair:
+// random texture, the right image is the left one shifted by 12 pixels
+// on its left half and 20 on its right half
+
+int main() {
+    const int width = 320, height = 200;
+    int errors = 0;
+
+    std::mt19937 rng(1);
+    Mat left(height, width, CV_8U), right(height, width, CV_8U);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            left.at<uint8_t>(y, x) = rng() % 256;
+        }
+    }
+    // left pixel x is right pixel x - d
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int d = x < width / 2 ? 12 : 20;
+            right.at<uint8_t>(y, x) = x + d < width ? left.at<uint8_t>(y, x + d) : rng() % 256;
+        }
+    }
+
+    StereoOptions options;
+    options.disparities = 64;
+    options.tile_rows = 24;
+
+    Mat disparity;
+    sgm_disparity(left, right, options, disparity);
+
+    size_t total = 0, valid = 0, correct = 0;
+    for (int y = 0; y < height; y++) {
+        // the first columns have no match in the right image
+        for (int x = 30; x < width; x++) {
+            float d = disparity.at<float>(y, x);
+            total++;
+            if (d < 0) {
+                continue;
+            }
+            valid++;
+
+            float expected = x - 12 < width / 2 ? 12 : 20;
+            correct += fabs(d - expected) < 1;
+        }
+    }
+
+    LOG(INFO) << "SGM: " << valid / (double) total << " valid, "
+              << correct / (double) valid << " correct";
+    if (valid < 0.9 * total || correct < 0.98 * valid) {
+        LOG(ERROR) << "disparities are off";
+        errors++;
+    }
+
+    // the same disparities, whatever the tiling
+    options.tile_rows = height;
+    Mat untiled;
+    sgm_disparity(left, right, options, untiled);
+    size_t differ = 0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            float a = disparity.at<float>(y, x), b = untiled.at<float>(y, x);
+            differ += (a < 0) != (b < 0) || fabs(a - b) > 0.5;
+        }
+    }
+    if (differ > 0.01 * width * height) {
+        LOG(ERROR) << "tiling changes " << differ << " disparities";
+        errors++;
+    }
+
+    return errors ? 1 : 0;
+}
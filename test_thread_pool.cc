@@ -0,0 +1,58 @@
+#include <atomic>
+
+#include "photogram.h"
+#include "util.h"
+
+_INITIALIZE_EASYLOGGINGPP
+
+// nested loops on the shared pool cover every index once, with worker
+// indexes in range, at any pool size; OpenCV loops run on it too
+
+int main() {
+    int errors = 0;
+
+    for (int threads : { 1, 3, 8, 32 }) {
+        set_thread_count(threads);
+        if (default_thread_count() != threads) {
+            LOG(ERROR) << "pool of " << default_thread_count() << " for " << threads;
+            errors++;
+        }
+
+        const size_t outer = 64, inner = 50;
+        std::atomic<long> sum(0);
+        std::atomic<int> bad_workers(0);
+        parallel_for_index(outer, [&](size_t i, int worker) {
+                bad_workers += worker < 0 || worker >= threads;
+
+                parallel_for_index(inner, [&](size_t j, int nested) {
+                        bad_workers += nested < 0 || nested >= threads;
+                        sum += i * inner + j;
+                    });
+            });
+
+        long expected = (long) (outer * inner) * (outer * inner - 1) / 2;
+        if (sum != expected || bad_workers) {
+            LOG(ERROR) << threads << " threads: sum " << sum << " expected " << expected
+                       << ", " << bad_workers << " workers out of range";
+            errors++;
+        }
+
+        // OpenCV inside our loop, same result as serial
+        Mat img(256, 256, CV_8U), reference;
+        randu(img, 0, 256);
+        GaussianBlur(img, reference, Size(7, 7), 1.5);
+
+        std::atomic<int> mismatches(0);
+        parallel_for_index(16, [&](size_t, int) {
+                Mat blurred;
+                GaussianBlur(img, blurred, Size(7, 7), 1.5);
+                mismatches += countNonZero(blurred != reference) != 0;
+            });
+        if (mismatches) {
+            LOG(ERROR) << threads << " threads: " << mismatches << " blurs differ";
+            errors++;
+        }
+    }
+
+    return errors ? 1 : 0;
+}
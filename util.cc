@@ -1,3 +1,10 @@
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
 #include "util.h"
 
 std::string basename(const std::string& pathname) {
@@ -6,6 +13,14 @@ std::string basename(const std::string& pathname) {
             pathname.end()};
 }
 
+std::string dirname(const std::string& pathname) {
+    size_t pos = pathname.find_last_of('/');
+    if (pos == string::npos) {
+        return "";
+    }
+    return pathname.substr(0, pos);
+}
+
 std::string remove_extension(const std::string& pathname) {
     string s = pathname;
     s.erase(s.find_last_of("."), string::npos);
@@ -22,3 +37,191 @@ unsigned long upper_power_of_two(unsigned long v) {
     v++;
     return v;
 }
+
+// extensions imread knows about
+bool is_image_filename(const std::string& pathname) {
+    size_t pos = pathname.find_last_of('.');
+    if (pos == string::npos) {
+        return false;
+    }
+
+    string ext = pathname.substr(pos + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+    return ext == "jpg" || ext == "jpeg" || ext == "png" ||
+        ext == "tif" || ext == "tiff" || ext == "bmp" ||
+        ext == "pgm" || ext == "ppm";
+}
+
+/////////////////
+/// task pool ///
+/////////////////
+
+// one parallel_for_index call, shared with the helpers it asked for
+struct PoolJob {
+    PoolJob(size_t n, const std::function<void(size_t, int)>& fn)
+        : n(n), fn(fn), next(0), joined(0), active(0), closed(false)
+    {};
+
+    size_t                                      n;
+    const std::function<void(size_t, int)>&     fn;
+    std::atomic<size_t>                         next;
+
+    // helpers that started, still running, and whether new ones can
+    // join (fn is gone once the caller returns)
+    int                                         joined;
+    int                                         active;
+    bool                                        closed;
+    std::mutex                                  mutex;
+    std::condition_variable                     done;
+};
+
+class TaskPool {
+ public:
+    static TaskPool& instance() {
+        static TaskPool pool;
+        return pool;
+    }
+
+    ~TaskPool() {
+        stop();
+    }
+
+    int size() const {
+        return threads;
+    }
+
+    // threads - 1 pool threads, the calling thread is the last one
+    void resize(int count) {
+        stop();
+
+        threads = count;
+        stopping = false;
+        for (int t = 1; t < threads; t++) {
+            workers.push_back(std::thread(&TaskPool::worker_loop, this));
+        }
+    }
+
+    void run(size_t n, const std::function<void(size_t, int)>& fn, int count) {
+        if (count <= 0 || count > threads) {
+            count = threads;
+        }
+        if ((size_t) count > n) {
+            count = n;
+        }
+
+        std::shared_ptr<PoolJob> job = std::make_shared<PoolJob>(n, fn);
+
+        {
+            // only the idle threads, the busy ones already use their core
+            std::lock_guard<std::mutex> lock(mutex);
+            int available = idle - (int) pending.size();
+            for (int h = 1; h < count && h <= available; h++) {
+                pending.push_back(job);
+            }
+        }
+        wake.notify_all();
+
+        work(*job, 0);
+
+        // helpers queued but not started yet won't join
+        std::unique_lock<std::mutex> lock(job->mutex);
+        job->closed = true;
+        job->done.wait(lock, [&job]() { return job->active == 0; });
+    }
+
+ private:
+    TaskPool()
+        : threads(0), idle(0), stopping(false) {
+        resize(std::max<int>(std::thread::hardware_concurrency(), 1));
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+
+        for (auto &t : workers) {
+            t.join();
+        }
+        workers.clear();
+    }
+
+    static void work(PoolJob& job, int worker) {
+        for (size_t i = job.next++; i < job.n; i = job.next++) {
+            job.fn(i, worker);
+        }
+    }
+
+    static void help(PoolJob& job) {
+        int worker;
+        {
+            std::lock_guard<std::mutex> lock(job.mutex);
+            if (job.closed) {
+                return;
+            }
+            worker = ++job.joined;
+            job.active++;
+        }
+
+        work(job, worker);
+
+        std::lock_guard<std::mutex> lock(job.mutex);
+        job.active--;
+        job.done.notify_all();
+    }
+
+    void worker_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            idle++;
+            wake.wait(lock, [this]() { return stopping || !pending.empty(); });
+            idle--;
+
+            if (pending.empty()) {
+                return;
+            }
+
+            std::shared_ptr<PoolJob> job = pending.front();
+            pending.pop_front();
+
+            lock.unlock();
+            help(*job);
+            lock.lock();
+        }
+    }
+
+    int                                         threads;
+    std::vector<std::thread>                    workers;
+
+    std::mutex                                  mutex;
+    std::condition_variable                     wake;
+    std::deque<std::shared_ptr<PoolJob> >       pending;
+    int                                         idle;
+    bool                                        stopping;
+};
+
+void set_thread_count(int threads) {
+    if (threads <= 0) {
+        threads = std::max<int>(std::thread::hardware_concurrency(), 1);
+    }
+
+    TaskPool::instance().resize(threads);
+
+    // OpenCV 2.4 can't share the pool: its loops stay serial, on the
+    // cores of the callers
+    cv::setNumThreads(1);
+
+    LOG(DEBUG) << "Thread pool: " << threads << " threads";
+}
+
+int default_thread_count() {
+    return TaskPool::instance().size();
+}
+
+void parallel_for_index(size_t n, const std::function<void(size_t, int)>& fn,
+                        int threads) {
+    TaskPool::instance().run(n, fn, threads);
+}
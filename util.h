@@ -3,10 +3,34 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <functional>
+
 #include "photogram.h"
 
 string basename(const std::string& pathname);
+string dirname(const std::string& pathname);
 string remove_extension(const std::string& pathname);
 unsigned long upper_power_of_two(unsigned long v);
+bool is_image_filename(const std::string& pathname);
+
+// the one setting for the cores used by the process (<= 0 for all the
+// hardware threads): sizes the shared pool, the default of every
+// threads option. OpenCV's own loops are made serial so they don't add
+// threads of their own. call it before any parallel work.
+void set_thread_count(int threads);
+
+// threads from set_thread_count, all the hardware threads by default,
+// at least 1
+int default_thread_count();
+
+// run fn(i, worker) for i in [0, n) on up to threads workers (<= 0 for
+// all cores), indexes are handed out dynamically. worker is in
+// [0, threads) so callers can keep per worker scratch state.
+//
+// workers come from the shared pool and the calling thread is one of
+// them: a nested call only borrows the idle pool threads, and runs
+// inline when there are none.
+void parallel_for_index(size_t n, const std::function<void(size_t, int)>& fn,
+                        int threads = 0);
 
 #endif // !UTIL_H